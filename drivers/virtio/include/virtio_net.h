@@ -36,6 +36,7 @@ const uint32_t feature_table[] = {
 	VIRTIO_NET_F_MAC,
 	VIRTIO_NET_F_MRG_RXBUF, 
 	VIRTIO_NET_F_CTRL_VQ,
+	VIRTIO_NET_F_MQ,
 };
 
 typedef struct {
@@ -59,6 +60,8 @@ typedef struct {
 	uint8_t mac[6];
 	/* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
 	uint16_t status;
+	/* Maximum number of each of receive and transmit queues (if VIRTIO_NET_F_MQ) */
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed)) VirtIONetConfig;
 
 /* Packet Structure that PacketNgin uses */
@@ -77,8 +80,8 @@ typedef struct {
 typedef struct {
 	uint8_t class;
 	uint8_t cmd;
-	uint8_t cmd_specific_data;
 	uint8_t ack;
+	uint8_t cmd_specific_data[2];
 } __attribute__((packed)) VirtIONetCtrlPacket;
 
 typedef uint8_t virtio_net_ctrl_ack;
@@ -140,4 +143,21 @@ typedef struct {
 #define VIRTIO_NET_CTRL_VLAN_ADD        0
 #define VIRTIO_NET_CTRL_VLAN_DEL        1
 
+/*
+ * Control Receive Flow Steering
+ *
+ * The command VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET enables Receive Flow Steering,
+ * specifying the number of the transmit and receive queues that will be used.
+ * After the command is consumed and acked by the device, the device will not
+ * steer new packets on receive virtqueues other than specified nor read from
+ * transmit virtqueues other than specified. Accordingly, driver should not
+ * transmit new packets on virtqueues other than specified. The data is a 2
+ * byte number of queue pairs. Packets of a flow are received on the queue
+ * paired with the transmit queue the flow was last sent on.
+ */
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN		1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX		0x8000
+
 #endif /* _VIRTIO_NET_H_ */
@@ -134,6 +134,8 @@ typedef struct {
 typedef struct {
 	/* Queue index */
 	uint16_t index;
+	/* Receive, transmit or control (VIRTIO_*_QUEUE_IDX) */
+	uint16_t type;
 
 	/* Actual memory layout for this queue */
 	Vring vring;
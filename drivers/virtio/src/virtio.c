@@ -19,6 +19,7 @@
 #define MAX_DEVICE_COUNT	8
 #define PAGE_SIZE		4096
 #define MAX_BUF_SIZE		1526 // MTU + VNET_HDR_LEN
+#define RX_HEADROOM_MIN		(sizeof(PacketMeta) + VNET_HDR_LEN)	// Zero-copy needs the metadata and the vnet header before the frame
 
 #define BUDGET_SIZE		64
 
@@ -37,11 +38,37 @@ typedef struct {
 	VirtIONetConfig config;
 } VirtIODevice;
 
+typedef struct _VirtNetPriv VirtNetPriv;
+
+/* Receive and transmit queue pair. Each pair is polled by its own event */
 typedef struct {
+	VirtQueue *rvq, *svq;
+	VirtNetPriv* priv;
+
+	/* Receive buffers. A descriptor points either to its own driver buffer
+	 * (copy path) or to a packet of a VNIC (zero-copy), which is posted from
+	 * the pool of the VNIC the last unicast frame of the queue went to */
+	void** rx_bufs;
+	VNIC** rx_owners;
+	VNIC* rx_owner;
+
+	/* Packets are handed over by xmit on core 0 and sent by the poll of the
+	 * pair, so the send queue is touched by one core only */
+	Packet** tx_ring;
+	volatile uint32_t tx_head;	///< Next slot written by xmit
+	volatile uint32_t tx_tail;	///< Next slot sent by the poll
+
+	NICQueueStatus status;
+} VirtNetQueue;
+
+struct _VirtNetPriv {
 	VirtIODevice vdev;
-	VirtQueue *rvq, *svq, *cvq;
+	VirtQueue *cvq;
 	NICDevice* priv;
-} VirtNetPriv;
+
+	uint16_t queue_count;
+	VirtNetQueue queues[NIC_MAX_QUEUE_COUNT];
+};
 
 /* Pseudo header used by add_buf for transmit */
 // TODO: Partial checksum, GSO needs to be implemented. At that time, real virtio header replaces it
@@ -72,7 +99,7 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 	uint32_t head = vq->free_head;
 	Vring* vr = &vq->vring;
 
-	switch(vq->index) {
+	switch(vq->type) {
 		case VIRTIO_RX_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 1) % vr->num;
 
@@ -99,18 +126,19 @@ static int add_buf(VirtQueue* vq, void* buffer, uint32_t len) {
 		case VIRTIO_CTRL_QUEUE_IDX : 
 			vq->free_head = (vq->free_head + 3) % vr->num;
 
+			// Class and command, len bytes of command data, then ack
+			VirtIONetCtrlPacket* ctrl = (VirtIONetCtrlPacket*)buffer;
+
 			vr->desc[head].flags = VRING_DESC_F_NEXT;
-			vr->desc[head].addr = (uint64_t)buffer;
+			vr->desc[head].addr = (uint64_t)ctrl;
 			vr->desc[head].len = 2;
 
-			uint8_t* ptr = (uint8_t*)buffer;
-
 			vr->desc[head + 1].flags = VRING_DESC_F_NEXT;
-			vr->desc[head + 1].addr = (uint64_t)&ptr[2];
-			vr->desc[head + 1].len = 1;
+			vr->desc[head + 1].addr = (uint64_t)ctrl->cmd_specific_data;
+			vr->desc[head + 1].len = len;
 
 			vr->desc[head + 2].flags = VRING_DESC_F_WRITE;
-			vr->desc[head + 2].addr = (uint64_t)&ptr[3];
+			vr->desc[head + 2].addr = (uint64_t)&ctrl->ack;
 			vr->desc[head + 2].len = 1;
 
 			break;
@@ -220,18 +248,21 @@ static int prepare_send_buf(VirtQueue* vq, uint32_t num) {
 }
 
 /* Prepare in the empty receive buffers */
-static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
-	void* buffer[num]; 
+static int prepare_recv_buf(VirtNetQueue* queue, uint32_t num) {
+	VirtQueue* vq = queue->rvq;
 	//int size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN)); // check
 	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
 
+	queue->rx_bufs = gmalloc(sizeof(void*) * num);
+	queue->rx_owners = gmalloc(sizeof(VNIC*) * num);
+	if(!queue->rx_bufs || !queue->rx_owners)
+		return -1;
+	memset(queue->rx_owners, 0, sizeof(VNIC*) * num);
+
 	for(uint32_t i = 0; i < num; i++) {
-		buffer[i] = (void*)((uint64_t)vq->vring.desc + size + PAGE_SIZE * i);
-		if(!buffer[i]) {
-			return -1;
-		}
+		queue->rx_bufs[i] = (void*)((uint64_t)vq->vring.desc + size + PAGE_SIZE * i);
 
-		if(add_buf(vq, buffer[i], MAX_BUF_SIZE))
+		if(add_buf(vq, queue->rx_bufs[i], MAX_BUF_SIZE))
 			return -2;
 
 	}
@@ -243,7 +274,7 @@ static int prepare_recv_buf(VirtQueue* vq, uint32_t num) {
 }
 
 /* Initializing function for virtqueues */
-static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
+static int init_vq(VirtIODevice* vdev, uint32_t index, uint16_t type, VirtQueue** vq) {
 	// Select the queue we're interested in
 	port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, index);
 
@@ -256,13 +287,14 @@ static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
 	int size = (vring_size(num, VIRTIO_PCI_VRING_ALIGN) + PAGE_SIZE) & ~PAGE_SIZE;
 
 	// Alloc and initialize virtqueue 
-	vqs[index] = gmalloc(sizeof(VirtQueue) + sizeof(void*) * num /* For token data */);
-	memset(vqs[index], 0, sizeof(VirtQueue) + sizeof(void*) * num); 
-	vqs[index]->size = num;
-	vqs[index]->last_used_idx = 0;
-	vqs[index]->num_added = 0;
-	vqs[index]->index = index;
-	vqs[index]->ioaddr = vdev->ioaddr;
+	*vq = gmalloc(sizeof(VirtQueue) + sizeof(void*) * num /* For token data */);
+	memset(*vq, 0, sizeof(VirtQueue) + sizeof(void*) * num); 
+	(*vq)->size = num;
+	(*vq)->last_used_idx = 0;
+	(*vq)->num_added = 0;
+	(*vq)->index = index;
+	(*vq)->type = type;
+	(*vq)->ioaddr = vdev->ioaddr;
 
 	// Assign vring memory space. It must be aligned by page size (4096)
 	if(size > 0x200000 /* 2MB */) {
@@ -281,17 +313,17 @@ static int init_vq(VirtIODevice* vdev, uint32_t index, VirtQueue* vqs[]) {
 	port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
 
 	// Create the vring 
-	vring_init(&vqs[index]->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
+	vring_init(&(*vq)->vring, num, queue, VIRTIO_PCI_VRING_ALIGN);
 
 	// We don't have interrupt handler. Tell otherside not to interrupt us
-	vqs[index]->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+	(*vq)->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 
 	// Put everything in free lists 
-	vqs[index]->num_free = num;
-	vqs[index]->free_head = 0;
+	(*vq)->num_free = num;
+	(*vq)->free_head = 0;
 
 	for(int i = 0; i < num; i++) {
-		vqs[index]->vring.desc[i].next = i + 1;
+		(*vq)->vring.desc[i].next = i + 1;
 	}
 
 	return 0;
@@ -323,8 +355,6 @@ static int virtio_pci_probe(VirtIODevice* vdev) {
 /* Probing function for VirtI/O network device */
 static int virtnet_probe(VirtNetPriv* priv) {
 	VirtIODevice* vdev = &priv->vdev;
-	// VirtI/O network device has three queues (receive, transmit, control)
-	VirtQueue* vqs[3];
 
 	// Confiuration may specify what MAC to use. Otherwise set designated MAC
 	get_config(vdev->ioaddr, 0, vdev->config.mac, ETH_ALEN);
@@ -334,31 +364,57 @@ static int virtnet_probe(VirtNetPriv* priv) {
 
 	// Get link status 
 	get_config(vdev->ioaddr, 6, &vdev->config.status, 2);
-	
-	// Check whether we supports control queue 
-	int nvqs = device_has_feature(&priv->vdev, VIRTIO_NET_F_CTRL_VQ) ? 3 : 2;
 
-	// Set for queues
-	for(int i = 0; i < nvqs; i++) 
-		if(init_vq(vdev, i, vqs))
+	// Queue pairs are enabled by a control command, so multiqueue needs the control queue
+	vdev->config.max_virtqueue_pairs = 1;
+	if(device_has_feature(vdev, VIRTIO_NET_F_MQ) && device_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ))
+		get_config(vdev->ioaddr, 8, &vdev->config.max_virtqueue_pairs, 2);
+
+	priv->queue_count = vdev->config.max_virtqueue_pairs;
+	if(priv->queue_count < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || priv->queue_count > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX)
+		priv->queue_count = 1;
+	if(priv->queue_count > NIC_MAX_QUEUE_COUNT)
+		priv->queue_count = NIC_MAX_QUEUE_COUNT;
+
+	// Queue pair n is virtqueue 2n (receive) and 2n + 1 (transmit). Unused pairs are left inactive
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+		queue->priv = priv;
+
+		if(init_vq(vdev, 2 * i, VIRTIO_RX_QUEUE_IDX, &queue->rvq))
 			return -1;
 
-	priv->rvq = vqs[0];
-	priv->svq = vqs[1];
-	if(nvqs == 3)
-		priv->cvq = vqs[2];
+		if(init_vq(vdev, 2 * i + 1, VIRTIO_TX_QUEUE_IDX, &queue->svq))
+			return -1;
+	}
+
+	// Control queue comes after every queue pair the device has
+	if(device_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ)) {
+		if(init_vq(vdev, 2 * vdev->config.max_virtqueue_pairs, VIRTIO_CTRL_QUEUE_IDX, &priv->cvq))
+			return -1;
+	}
 
 	// Make pseudo header for transmit
-	pseudo_vnet_hdr = gmalloc(sizeof(VirtIONetHDR));
-	bzero(pseudo_vnet_hdr, sizeof(VirtIONetHDR));
+	if(!pseudo_vnet_hdr) {
+		pseudo_vnet_hdr = gmalloc(sizeof(VirtIONetHDR));
+		bzero(pseudo_vnet_hdr, sizeof(VirtIONetHDR));
+	}
 
-	// Prepare receive buffers in advance  
-	if(prepare_recv_buf(priv->rvq, priv->rvq->size))
-		return -2;
-	
-	// Prepare pseudo header in send buffers in advance  
-	if(prepare_send_buf(priv->svq, priv->rvq->size))
-		return -3;
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+
+		// Prepare receive buffers in advance  
+		if(prepare_recv_buf(queue, queue->rvq->size))
+			return -2;
+
+		// Prepare pseudo header in send buffers in advance  
+		if(prepare_send_buf(queue->svq, queue->rvq->size))
+			return -3;
+
+		queue->tx_ring = gmalloc(sizeof(Packet*) * queue->svq->size);
+		if(!queue->tx_ring)
+			return -3;
+	}
 
 	// Device is alive at this point
 	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
@@ -367,24 +423,33 @@ static int virtnet_probe(VirtNetPriv* priv) {
 }
 
 /* Send control command to VirtI/O network device */
-static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd, void* data) {
-	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
-	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
+static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd, void* data, uint32_t len) {
+	if(!priv->cvq)
+		return false;
 
-	// Controlling RX mode is only available now 
-	if(class != VIRTIO_NET_CTRL_RX) {
+	// Controlling RX mode and the number of queue pairs are only available now 
+	if(class != VIRTIO_NET_CTRL_RX && class != VIRTIO_NET_CTRL_MQ) {
 		printf("[%02d] Class command not supported\n", class);
 		return false;
 	}
+
+	if(len > sizeof(((VirtIONetCtrlPacket*)0)->cmd_specific_data))
+		return false;
+
+	VirtIONetCtrlPacket* ctrl = gmalloc(sizeof(VirtIONetCtrlPacket));
+	memset(ctrl, 0, sizeof(VirtIONetCtrlPacket));
+
 	ctrl->class = class;
 	ctrl->cmd = cmd;
 	ctrl->ack = ~0;
 
 	// TODO: Other classes need to be implemented. e.g VLAN, MAC Filtering...
-	ctrl->cmd_specific_data = *(uint8_t*)data;
+	memcpy(ctrl->cmd_specific_data, data, len);
 
-	if(add_buf(priv->cvq, ctrl, 4))
+	if(add_buf(priv->cvq, ctrl, len)) {
+		gfree(ctrl);
 		return false;
+	}
 
 	// Notify otherside of new buffer
 	kick(priv->cvq);
@@ -412,23 +477,17 @@ static bool virtnet_send_command(VirtNetPriv* priv, uint8_t class, uint8_t cmd,
 
 /* Function for packet receive */
 static int virtnet_receive(VirtNetPriv* priv, void* buf, uint32_t len) {
-	// Instead of calling add_buf, we just notify that buffer index is updated 
-	VirtQueue* vq = priv->rvq;
-	vq->num_added++; 
 	VirtIONetPacket* vp = (VirtIONetPacket*)buf;
 	NICDevice* nicdev = priv->priv;
 
 	Ether* ether = (Ether*)vp->data;
 	if(ether->type == endian16(ETHER_TYPE_8021Q)) {
 		VLAN* vlan = (VLAN*)ether->payload;
-		for(nicdev = nicdev->next; nicdev; nicdev = nicdev->next) {
-			if(nicdev->vlan_tci != vlan->tci & 0xff0f)
-				continue;
-
+		nicdev = nicdev_get_vlan(nicdev, endian16(vlan->tci) & 0xfff);
+		if(nicdev) {
 			memmove((uint8_t*)ether + 4 , ether, ETHER_LEN - 2);
 			ether = (uint8_t*)ether + 4;
 			len -= 4;
-			break;
 		}
 	}
 
@@ -438,43 +497,305 @@ static int virtnet_receive(VirtNetPriv* priv, void* buf, uint32_t len) {
 	return 0;
 }
 
-/* Function for packet send */
+/* Frame of a VNIC packet posted as a receive buffer, start was set when it was posted */
+static inline VirtIONetPacket* virtnet_packet_data(Packet* packet) {
+	return (VirtIONetPacket*)(packet->buffer + packet->start - VNET_HDR_LEN);
+}
+
+/* VNIC a frame can be received into in place: the one of its unicast destination */
+static VNIC* virtnet_rx_owner(VirtNetPriv* priv, VirtIONetPacket* vp) {
+	Ether* ether = (Ether*)vp->data;
+	if(ether->type == endian16(ETHER_TYPE_8021Q))
+		return NULL;
+
+	return nicdev_rx_owner(priv->priv, endian48(ether->dmac));
+}
+
+/* Function for packet receive into the VNIC packet the frame landed in */
+static void virtnet_receive_packet(Packet* packet, uint32_t len) {
+	VirtIONetPacket* vp = virtnet_packet_data(packet);
+
+	PacketMeta meta;
+	packet_meta_parse(&meta, vp->data, len - VNET_HDR_LEN);
+
+	packet->end = packet->start - VNET_HDR_LEN + len;
+	packet_meta_set(packet, &meta);
+}
+
+/* Post receive buffers again, from the owner's pool if possible */
+static void refill_recv_buf(VirtNetQueue* queue, uint32_t first, uint32_t count, VNIC* owner) {
+	VirtQueue* vq = queue->rvq;
+	Vring* vr = &vq->vring;
+
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t slot = (first + i) % vr->num;
+
+		// The frame starts at the headroom of the VNIC as on the copy path
+		Packet* packet = owner && owner->padding_head >= RX_HEADROOM_MIN ?
+			vnic_alloc(owner, MAX_BUF_SIZE - VNET_HDR_LEN) : NULL;
+		if(packet && packet->size < owner->padding_head + MAX_BUF_SIZE - VNET_HDR_LEN) {
+			vnic_free(owner, packet);
+			packet = NULL;
+		}
+
+		if(packet) {
+			packet->start = owner->padding_head;
+			vr->desc[slot].addr = (uint64_t)packet->buffer + packet->start - VNET_HDR_LEN;
+			vq->data[slot] = packet;
+			queue->rx_owners[slot] = owner;
+		} else {
+			vr->desc[slot].addr = (uint64_t)queue->rx_bufs[slot];
+			vq->data[slot] = queue->rx_bufs[slot];
+			queue->rx_owners[slot] = NULL;
+		}
+		vr->desc[slot].len = MAX_BUF_SIZE;
+
+		// Instead of calling add_buf, we just notify that buffer index is updated
+		vq->num_added++;
+	}
+}
+
+/* Transmit queue of the packet's flow. The device steers the replies of a flow to the paired receive queue */
+static VirtNetQueue* virtnet_tx_queue(VirtNetPriv* priv, Packet* packet) {
+	if(priv->queue_count == 1)
+		return &priv->queues[0];
+
+	PacketMeta* meta = packet_meta(packet);
+	uint32_t hash = meta ? meta->hash : 0;
+	if(!hash) {
+		PacketMeta parsed;
+		packet_meta_parse(&parsed, packet->buffer + packet->start, packet->end - packet->start);
+		hash = parsed.hash;
+	}
+
+	return &priv->queues[hash % priv->queue_count];
+}
+
+/* Function for packet send. The poll of the queue pair sends it */
 static int virtnet_send(VirtNetPriv* priv, Packet* packet) {
-	// Check whether free descriptor exists to prevent buffer overflow 
-	VirtQueue* vq = priv->svq;
-	if(vq->num_free == 0) {
+	VirtNetQueue* queue = virtnet_tx_queue(priv, packet);
+
+	uint32_t head = queue->tx_head;
+	if(head - queue->tx_tail >= queue->svq->size) {
+		queue->status.tx_drops++;
 		nic_free(packet);
 
 		return -1;
 	}
 
-	// Add new buffer and try to send 
-	int len = packet->end - packet->start;
-	add_buf(vq, packet, len);
+	queue->tx_ring[head % queue->svq->size] = packet;
+
+	// Packet needs to be set before the poll sees it
+	asm volatile("sfence" ::: "memory");
+	queue->tx_head = head + 1;
 
 	return 0;
 }
 
+/* Free the sent buffers of the pair and send the packets xmit handed over */
+static void virtnet_xmit(VirtNetQueue* queue) {
+	VirtQueue* vq = queue->svq;
+	void* buf;
+	while((buf = get_buf(vq, NULL)))
+		nic_free(buf);
+
+	uint32_t tail = queue->tx_tail;
+	uint32_t head = queue->tx_head;
+	asm volatile("lfence" ::: "memory");
+
+	// Check whether free descriptor exists to prevent buffer overflow 
+	while(tail != head && vq->num_free) {
+		Packet* packet = queue->tx_ring[tail++ % vq->size];
+		int len = packet->end - packet->start;
+
+		add_buf(vq, packet, len);
+		queue->status.tx_packets++;
+		queue->status.tx_bytes += len;
+	}
+	queue->tx_tail = tail;
+
+	if(vq->num_added)
+		kick(vq);
+}
+
+/* Poll a queue pair. Queue pairs share nothing but the NIC device, so each is polled on its own core */
 static bool poll(void* context) {
 	uint32_t len;
 	int received = 0;
 	void* buf;
 
- 	VirtNetPriv* priv = context;
-	VirtQueue* vq = priv->rvq;
-	while((BUDGET_SIZE > received) && (buf = get_buf(vq, &len))) {
-		virtnet_receive(priv, buf, len);
+	VirtNetQueue* queue = context;
+	VirtNetPriv* priv = queue->priv;
+	VirtQueue* vq = queue->rvq;
+	Packet* packets[BUDGET_SIZE];
+	uint32_t count = 0;
+	VNIC* burst_owner = NULL;
+
+	// The owners and the classifier are not freed until the section ends
+	nicdev_rx_begin(priv->priv);
+
+	uint32_t first = vq->last_used_idx % vq->vring.num;
+	while(BUDGET_SIZE > received) {
+		VNIC* buf_owner = queue->rx_owners[vq->last_used_idx % vq->vring.num];
+		if(!(buf = get_buf(vq, &len)))
+			break;
+
+		queue->status.rx_packets++;
+		queue->status.rx_bytes += len - VNET_HDR_LEN;
+
+		VirtIONetPacket* vp = buf_owner ? virtnet_packet_data(buf) : buf;
+		VNIC* owner = virtnet_rx_owner(priv, vp);
+		if(owner)
+			queue->rx_owner = owner;
+
+		if(buf_owner && buf_owner == owner) {
+			virtnet_receive_packet(buf, len);
+
+			if(burst_owner != owner) {
+				if(count)
+					vnic_rx_burst(burst_owner, packets, count);
+
+				burst_owner = owner;
+				count = 0;
+			}
+			packets[count++] = buf;
+		} else {
+			// Frames of the burst go first to keep the order of a flow
+			if(count)
+				vnic_rx_burst(burst_owner, packets, count);
+			count = 0;
+
+			virtnet_receive(priv, vp, len);
+
+			// A VNIC is not unregistered before its buffers are taken back (see virtnet_detach)
+			if(buf_owner)
+				vnic_free(buf_owner, buf);
+		}
+
 		received++;
 	}
+
+	if(count)
+		vnic_rx_burst(burst_owner, packets, count);
+
+	refill_recv_buf(queue, first, received, queue->rx_owner);
  
 	if(vq->num_free > vq->size / 2) {
 		kick(vq);
 		vq->num_free = 0;
 	}
- 
+
+	nicdev_rx_end(priv->priv);
+
+	virtnet_xmit(queue);
+
 	return true;
 }
 
+/* Set a virtqueue up again on its own memory */
+static void reset_vq(VirtIODevice* vdev, VirtQueue* vq) {
+	void* queue = vq->vring.desc;
+	memset(queue, 0, vring_size(vq->size, VIRTIO_PCI_VRING_ALIGN));
+	memset(vq->data, 0, sizeof(void*) * vq->size);
+
+	port_out16(vdev->ioaddr + VIRTIO_PCI_QUEUE_SEL, vq->index);
+	port_out32(vdev->ioaddr + VIRTIO_PCI_QUEUE_PFN, (uint32_t)(uint64_t)queue >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+	vring_init(&vq->vring, vq->size, queue, VIRTIO_PCI_VRING_ALIGN);
+	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+
+	vq->num_free = vq->size;
+	vq->free_head = 0;
+	vq->num_added = 0;
+	vq->last_used_idx = 0;
+	for(uint32_t i = 0; i < vq->size; i++)
+		vq->vring.desc[i].next = i + 1;
+}
+
+/*
+ * The device gives back the buffers it holds only when it is reset. Every
+ * VNIC buffer, received or transmitted, is freed and the receive queues get
+ * the driver's own buffers until the next poll refills them.
+ */
+static void virtnet_reset(VirtNetPriv* priv) {
+	VirtIODevice* vdev = &priv->vdev;
+
+	vdev->status = 0;
+	add_status(vdev, 0);
+
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+		VirtQueue* vq = queue->rvq;
+		for(uint32_t j = 0; j < vq->size; j++) {
+			if(queue->rx_owners[j])
+				vnic_free(queue->rx_owners[j], vq->data[j]);
+			queue->rx_owners[j] = NULL;
+		}
+
+		void* buf;
+		vq = queue->svq;
+		while((buf = get_buf(vq, NULL)))
+			nic_free(buf);
+
+		uint16_t avail = vq->vring.avail->idx + vq->num_added;
+		for(uint16_t idx = vq->last_used_idx; idx != avail; idx++)
+			nic_free(vq->data[idx % vq->vring.num]);
+
+		// xmit runs on core 0 as the reset does, so nothing is handed over meanwhile
+		for(; queue->tx_tail != queue->tx_head; queue->tx_tail++)
+			nic_free(queue->tx_ring[queue->tx_tail % vq->size]);
+	}
+
+	add_status(vdev, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+	add_status(vdev, VIRTIO_CONFIG_S_DRIVER);
+	port_out32(vdev->ioaddr + VIRTIO_PCI_GUEST_FEATURES, vdev->features);
+
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+		reset_vq(vdev, queue->rvq);
+		reset_vq(vdev, queue->svq);
+
+		for(uint32_t j = 0; j < queue->rvq->size; j++)
+			add_buf(queue->rvq, queue->rx_bufs[j], MAX_BUF_SIZE);
+		kick(queue->rvq);
+
+		prepare_send_buf(queue->svq, queue->rvq->size);
+	}
+
+	if(priv->cvq)
+		reset_vq(vdev, priv->cvq);
+
+	add_status(vdev, VIRTIO_CONFIG_S_DRIVER_OK);
+
+	uint8_t promisc = 1;
+	virtnet_send_command(priv, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc, sizeof(promisc));
+
+	if(priv->queue_count > 1) {
+		uint16_t pairs = priv->queue_count;
+		virtnet_send_command(priv, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+	}
+}
+
+/* Reset the device if it holds receive buffers of the VNIC */
+static void virtnet_detach(NICDevice* nicdev, VNIC* vnic) {
+	VirtNetPriv* priv = nicdev->priv;
+
+	for(int i = 0; i < priv->queue_count; i++) {
+		if(priv->queues[i].rx_owner == vnic)
+			priv->queues[i].rx_owner = NULL;
+	}
+
+	for(int i = 0; i < priv->queue_count; i++) {
+		VirtNetQueue* queue = &priv->queues[i];
+		for(uint32_t j = 0; j < queue->rvq->size; j++) {
+			if(queue->rx_owners[j] == vnic) {
+				virtnet_reset(priv);
+				return;
+			}
+		}
+	}
+}
+
 int init(void* device, void* data) {
 	int err;
 
@@ -507,11 +828,20 @@ int init(void* device, void* data) {
 
 	// Set promiscuos mode
 	uint8_t promisc = 1; // 1 means ON for the command
-	if(virtnet_send_command(priv, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc))
+	if(virtnet_send_command(priv, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &promisc, sizeof(promisc)))
 		printf("Promiscuos mode ON\n");
 	else
 		printf("Promiscous mode OFF\n");
 
+	// Let the device steer flows across the queue pairs
+	if(priv->queue_count > 1) {
+		uint16_t pairs = priv->queue_count;
+		if(virtnet_send_command(priv, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs)))
+			printf("Multiqueue ON: %d queue pairs\n", pairs);
+		else
+			priv->queue_count = 1;
+	}
+
 	//Register NICDevice
 	NICDevice* nicdev = gmalloc(sizeof(NICDevice));
 	if(!nicdev)
@@ -535,7 +865,11 @@ int init(void* device, void* data) {
 	//TODO check return value
 	nicdev_register(nicdev);
 
-	event_busy_add(poll, priv);
+	// Queue pairs are spread over the cores
+	for(int i = 0; i < priv->queue_count; i++) {
+		if(!nicdev_poll_add(nicdev, i, poll, &priv->queues[i]))
+			printf("Queue %d is not polled\n", i);
+	}
 
 	return 0;
 error: 
@@ -582,32 +916,22 @@ static bool process(Packet* packet, void* context) {
 	return virtnet_send(nicdev->priv, packet) == 0 ? true : false;
 }
 
+/* Schedule the VNICs. The polls of the queue pairs free, send and kick */
 int virtio_tx(NICDevice* nicdev) {
- 	VirtNetPriv* priv = nicdev->priv;
-	VirtQueue* vq;
- 
- 	// Free used buffer
- 	void* buf;
- 	while((buf = get_buf(priv->svq, NULL))) {
- 		nic_free(buf);
- 	}
- 
- 	// TX
  	int nicdev_tx(NICDevice* dev,
  			bool (*process)(Packet* packet, void* context), void* context);
- 	int count = nicdev_tx(nicdev, process, nicdev);
-	if(count) {
-		vq = priv->svq;
-		kick(vq);
-	}
-
-	return count;
+ 	return nicdev_tx(nicdev, process, nicdev);
 }
 
-void get_status(int id, NICStatus* status) {
+void get_status(NICDevice* nicdev, NICStatus* status) {
+	VirtNetPriv* priv = nicdev->priv;
+
+	status->queue_count = priv->queue_count;
+	for(int i = 0; i < priv->queue_count; i++)
+		status->queues[i] = priv->queues[i].status;
 }
 
-bool set_status(int id, NICStatus* status) {
+bool set_status(NICDevice* nicdev, NICStatus* status) {
 	return false;
 }
 
@@ -662,5 +986,6 @@ NICDriver device_driver = {
 	.get_info = get_info,
 
 	.add_vid = virtnet_vlan_rx_add_vid,
-	.remove_vid = virtnet_vlan_rx_kill_vid
+	.remove_vid = virtnet_vlan_rx_kill_vid,
+	.detach = virtnet_detach
 };
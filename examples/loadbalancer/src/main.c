@@ -13,6 +13,7 @@
 #include <net/tcp.h>
 #include <util/list.h>
 #include <util/map.h>
+#include <util/objpool.h>
 #include <util/event.h>
 #include <util/cmd.h>
 
@@ -34,6 +35,7 @@ typedef struct {
 	uint64_t	fin;
 } Session;
 
+static ObjectPool* session_pool;
 static Map* sessions;
 static Map* ports;
 static int mode;
@@ -398,6 +400,7 @@ int ginit(int argc, char** argv) {
 }
 
 void init(int argc, char** argv) {
+	session_pool = object_pool_create(sizeof(Session), 4096, 0, NULL);
 	sessions = map_create(4096, NULL, NULL, NULL);
 }
 
@@ -458,10 +461,10 @@ static void process_config(Packet** packet) {
 static Session* session_alloc(uint32_t saddr, uint16_t sport) {
 	uint64_t key = (uint64_t)saddr << 32 | (uint64_t)sport;
 	
-	Session* session = malloc(sizeof(Session));
+	Session* session = object_pool_get(session_pool);
 	session->source.addr = saddr;
 	session->source.port = sport;
-	session->port = tcp_port_alloc(ni_intra);
+	session->port = tcp_port_alloc(ni_intra, 0);
 	Endpoint* rip = rip_alloc(ni_intra);
 	session->destination.addr = rip->addr;
 	session->destination.port = rip->port;
@@ -493,7 +496,33 @@ static void session_free(Session* session) {
 	map_remove(sessions, (void*)key);
 	map_remove(ports, (void*)(uint64_t)session->port);
 	tcp_port_free(ni_intra, session->port);
-	free(session);
+	object_pool_put(session_pool, session);
+}
+
+// Rewrites the addresses and ports (network byte order) and adjusts the checksums
+static void tcp_rewrite(IP* ip, TCP* tcp, uint32_t source, uint16_t sport, uint32_t destination, uint16_t dport) {
+	uint16_t ip_checksum = ip->checksum;
+	uint16_t tcp_checksum = tcp->checksum;
+
+	// Addresses are part of the TCP pseudo header
+	ip_checksum = checksum_adjust32(ip_checksum, ip->source, source);
+	tcp_checksum = checksum_adjust32(tcp_checksum, ip->source, source);
+	ip_checksum = checksum_adjust32(ip_checksum, ip->destination, destination);
+	tcp_checksum = checksum_adjust32(tcp_checksum, ip->destination, destination);
+	tcp_checksum = checksum_adjust16(tcp_checksum, tcp->source, sport);
+	tcp_checksum = checksum_adjust16(tcp_checksum, tcp->destination, dport);
+
+	// TTL shares a 16-bit word with the protocol
+	uint16_t ttl = endian16((uint16_t)ip->ttl << 8 | ip->protocol);
+	ip_checksum = checksum_adjust16(ip_checksum, ttl, endian16(IPDEFTTL << 8 | ip->protocol));
+
+	ip->source = source;
+	ip->destination = destination;
+	ip->ttl = IPDEFTTL;
+	ip->checksum = ip_checksum;
+	tcp->source = sport;
+	tcp->destination = dport;
+	tcp->checksum = tcp_checksum;
 }
 
 void process_inter() {
@@ -532,28 +561,25 @@ void process_inter() {
 				
 				switch(mode) {
 					case NAT:
-					ip->source = endian32(raddr);
-					tcp->source = endian16(session->port);
-				
-					ip->destination = endian32(session->destination.addr);
-					tcp->destination = endian16(session->destination.port);
+					tcp_rewrite(ip, tcp, endian32(raddr), endian16(session->port),
+						endian32(session->destination.addr), endian16(session->destination.port));
 					ether->smac = endian48(ni_intra->mac);
 					ether->dmac = endian48(arp_get_mac(ni_intra, session->destination.addr));
 					break;
 
 					case DNAT:
-					ip->destination = endian32(session->destination.addr);
-					tcp->destination = endian16(session->destination.port);
+					tcp_rewrite(ip, tcp, ip->source, tcp->source,
+						endian32(session->destination.addr), endian16(session->destination.port));
 					ether->smac = endian48(ni_intra->mac);
 					ether->dmac = endian48(arp_get_mac(ni_intra, session->destination.addr));
 					break;
 
 					case DR:
+					tcp_rewrite(ip, tcp, ip->source, tcp->source, ip->destination, tcp->destination);
 					ether->smac = endian48(ni_intra->mac);
 					ether->dmac = endian48(arp_get_mac(ni_intra, session->destination.addr));
 					break;
 				}
-				tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 				
 				printf("Incoming: %lx %lx %d.%d.%d.%d:%d %d %d.%d.%d.%d:%d\n", 
 					endian48(ether->dmac), 
@@ -636,17 +662,14 @@ void process_intra() {
 				
 				switch(mode) {
 					case NAT:
-					tcp->source = endian16(port);
-					ip->source = endian32(addr);
-					tcp->destination = endian16(session->source.port);
-					ip->destination = endian32(session->source.addr);
+					tcp_rewrite(ip, tcp, endian32(addr), endian16(port),
+						endian32(session->source.addr), endian16(session->source.port));
 					ether->smac = endian48(ni_inter->mac);
 					ether->dmac = endian48(arp_get_mac(ni_inter, endian32(ip->destination)));
 					break;
 
 					case DNAT:
-					tcp->source = endian16(port);
-					ip->source = endian32(addr);
+					tcp_rewrite(ip, tcp, endian32(addr), endian16(port), ip->destination, tcp->destination);
 					ether->smac = endian48(ni_inter->mac);
 					ether->dmac = endian48(arp_get_mac(ni_inter, endian32(ip->destination)));
 					break;
@@ -655,7 +678,6 @@ void process_intra() {
 					//Do nothing
 					break;
 				}
-				tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 				
 				printf("Outgoing: %lx %lx %d.%d.%d.%d:%d %d %d.%d.%d.%d:%d\n", 
 					endian48(ether->dmac), 
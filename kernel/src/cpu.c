@@ -50,6 +50,7 @@ bool cpu_has_feature(int feature) {
 
 	#define INFO(cmd) asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"((cmd)))
 	#define EXT(cmd) asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x80000000 + (cmd)))
+	#define LEAF(cmd, sub) asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"((cmd)), "c"((sub)))
 
 	switch(feature) {
 		case CPU_FEATURE_SSE_4_1:
@@ -70,6 +71,31 @@ bool cpu_has_feature(int feature) {
 		case CPU_FEATURE_INVARIANT_TSC:
 			EXT(0x07);
 			return !!(d & 0x100);
+		case CPU_FEATURE_SSE_2:
+			INFO(0x01);
+			return !!(d & 0x4000000);
+		case CPU_FEATURE_AVX_2:
+			INFO(0x00);
+			if(a < 0x07)	// Leaf 7 reads as the highest leaf on the CPUs which do not have it
+				return false;
+
+			INFO(0x01);
+			if(!(c & 0x8000000))	// OSXSAVE
+				return false;
+
+			asm volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+			if((a & 0x6) != 0x6)	// SSE and AVX states
+				return false;
+
+			LEAF(0x07, 0);
+			return !!(b & 0x20);
+		case CPU_FEATURE_ERMS:
+			INFO(0x00);
+			if(a < 0x07)
+				return false;
+
+			LEAF(0x07, 0);
+			return !!(b & 0x200);
 		default:
 			return false;
 	}
@@ -10,8 +10,14 @@
 #define CPU_FEATURE_MWAIT_INTERRUPT	4
 #define CPU_FEATURE_TURBO_BOOST		5
 #define CPU_FEATURE_INVARIANT_TSC	6
+#define CPU_FEATURE_SSE_2		7
+#define CPU_FEATURE_AVX_2		8	// Only when XCR0 enables the YMM registers
+#define CPU_FEATURE_ERMS		9	// Enhanced rep movsb and stosb
 
 void cpu_init();
 bool cpu_has_feature(int feature);
 
+// Picks memcpy, memset, memmove and memcmp of string.c for the CPU features, on every core as the kernel data is per core
+void string_init();
+
 #endif /* __CPU_H__ */
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <util/event.h>
+#include <timer.h>
+#include <lock.h>
 
 #include "gmalloc.h"
+#include "../icc.h"
 #include "nicdev.h"
 
 #define ETHER_TYPE_IPv4		0x0800		///< Ether type of IPv4
@@ -21,6 +24,12 @@
 #define ETHER_MULTICAST		((uint64_t)1 << 40)	///< MAC address is multicast
 #define ID_BUFFER_SIZE		(MAX_NIC_DEVICE_COUNT * 8)
 
+#define NICDEV_TX_BUDGET	256				///< Maximum packets transmitted by a nicdev_tx call
+#define CLASS_MIN_SIZE		16				///< Minimum number of classifier entries
+#define CLASS_KEY(mac, vid)	((mac) | (uint64_t)(vid) << 48)	///< Classifier key of a MAC address on a VLAN
+#define NICDEV_POLL_TIMEOUT	1000				///< Core 0 takes a queue over when its core has not polled it for a while (us)
+#define MULTICAST_GROUP_COUNT	16				///< Groups sharing a multicast frame, the VNICs of more groups get their own copies
+
 typedef struct _Ether {
 	uint64_t dmac: 48;			///< Destination address (endian48)
 	uint64_t smac: 48;			///< Destination address (endian48)
@@ -30,6 +39,121 @@ typedef struct _Ether {
 
 static NICDevice* nic_devices[MAX_NIC_DEVICE_COUNT]; //key string
 
+static inline NICDevice* nicdev_root(NICDevice* nicdev) {
+	return nicdev->root ? : nicdev;
+}
+
+static inline uint16_t nicdev_vid(NICDevice* nicdev) {
+	return endian16(nicdev->vlan_tci) & 0xfff;
+}
+
+static inline uint32_t class_hash(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15UL) >> 32;
+}
+
+static NICClass* class_get(NICDevice* nicdev, uint64_t key) {
+	NICClassifier* classifier = __atomic_load_n(&nicdev_root(nicdev)->classifier, __ATOMIC_ACQUIRE);
+	if(!classifier)
+		return NULL;
+
+	for(uint32_t i = class_hash(key) & classifier->mask; ; i = (i + 1) & classifier->mask) {
+		NICClass* class = &classifier->classes[i];
+		if(!class->nicdev)
+			return NULL;
+		if(class->key == key)
+			return class;
+	}
+}
+
+static void class_put(NICClassifier* classifier, uint64_t key, NICDevice* nicdev, VNIC* vnic) {
+	uint32_t i = class_hash(key) & classifier->mask;
+	while(classifier->classes[i].nicdev)
+		i = (i + 1) & classifier->mask;
+
+	classifier->classes[i].key = key;
+	classifier->classes[i].nicdev = nicdev;
+	classifier->classes[i].vnic = vnic;
+}
+
+/*
+ * Wait until every other core has left the receive section it is in. A core
+ * which enters one afterwards cannot see what was unpublished before. The
+ * caller must not be in a receive section itself.
+ */
+static void nicdev_synchronize(NICDevice* nicdev) {
+	NICDevice* root = nicdev_root(nicdev);
+	uint64_t seqs[MP_MAX_CORE_COUNT];
+
+	// Unpublishing stores are ordered before the counters are read
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(int i = 0; i < MP_MAX_CORE_COUNT; i++)
+		seqs[i] = root->rx_sections[i].seq;
+
+	for(int i = 0; i < MP_MAX_CORE_COUNT; i++) {
+		if(i == mp_processor_id() || !(seqs[i] & 1))
+			continue;
+
+		while(root->rx_sections[i].seq == seqs[i])
+			asm volatile("pause");
+	}
+}
+
+void nicdev_rx_begin(NICDevice* nicdev) {
+	// Ordered before the NIC device is looked up
+	__atomic_fetch_add(&nicdev_root(nicdev)->rx_sections[mp_processor_id()].seq, 1, __ATOMIC_SEQ_CST);
+}
+
+void nicdev_rx_end(NICDevice* nicdev) {
+	__atomic_fetch_add(&nicdev_root(nicdev)->rx_sections[mp_processor_id()].seq, 1, __ATOMIC_RELEASE);
+}
+
+// Publish the classifier and free the previous one once no core can be looking it up
+static void nicdev_publish(NICDevice* root, NICClassifier* classifier) {
+	NICClassifier* old = root->classifier;
+	__atomic_store_n(&root->classifier, classifier, __ATOMIC_RELEASE);
+
+	nicdev_synchronize(root);
+	if(old)
+		gfree(old);
+}
+
+/*
+ * Rebuild the classifier of the physical NIC device from its VLANs and VNICs.
+ * The new table is published with a single store, the previous one is freed
+ * after the receivers which may still be looking it up are done.
+ */
+static bool nicdev_classify(NICDevice* nicdev) {
+	NICDevice* root = nicdev_root(nicdev);
+
+	uint32_t count = 0;
+	for(NICDevice* dev = root; dev; dev = dev->next) {
+		count++;
+		for(int i = 0; i < MAX_VNIC_COUNT && dev->vnics[i]; i++)
+			count++;
+	}
+
+	// At most half full
+	uint32_t size = CLASS_MIN_SIZE;
+	while(size < count * 2)
+		size <<= 1;
+
+	NICClassifier* classifier = gmalloc(sizeof(NICClassifier) + sizeof(NICClass) * size);
+	if(!classifier)
+		return false;
+
+	classifier->mask = size - 1;
+	memset(classifier->classes, 0, sizeof(NICClass) * size);
+	for(NICDevice* dev = root; dev; dev = dev->next) {
+		class_put(classifier, CLASS_KEY(0, nicdev_vid(dev)), dev, NULL);
+		for(int i = 0; i < MAX_VNIC_COUNT && dev->vnics[i]; i++)
+			class_put(classifier, CLASS_KEY(dev->vnics[i]->mac, nicdev_vid(dev)), dev, dev->vnics[i]);
+	}
+
+	nicdev_publish(root, classifier);
+
+	return true;
+}
+
 static int nicdev_get_count0(NICDevice* nicdev) {
 	int sum = 0;
 	while(nicdev) {
@@ -83,6 +207,85 @@ static bool nicdev_schedule(void* context) {
 	return true;
 }
 
+/**
+ * Queue poll shared by the core of the queue and core 0
+ */
+typedef struct {
+	bool			(*func)(void* context);
+	void*			context;
+	volatile uint8_t	lock;	///< Held while the queue is polled
+	volatile uint64_t	time;	///< Last time the core of the queue polled it (us)
+} NICPoll;
+
+static bool nicdev_poll_core(void* context) {
+	NICPoll* poll = context;
+	if(!lock_trylock(&poll->lock))
+		return true;
+
+	poll->time = timer_us();
+	bool result = poll->func(poll->context);
+	lock_unlock(&poll->lock);
+
+	return result;
+}
+
+// The core of the queue does not run the event loop while it runs a VM
+static bool nicdev_poll_fallback(void* context) {
+	NICPoll* poll = context;
+	if(timer_us() - poll->time < NICDEV_POLL_TIMEOUT || !lock_trylock(&poll->lock))
+		return true;
+
+	bool result = poll->func(poll->context);
+	lock_unlock(&poll->lock);
+
+	return result;
+}
+
+bool nicdev_poll_add(NICDevice* nicdev, uint16_t queue, bool (*func)(void* context), void* context) {
+	uint8_t processor_id = queue % mp_processor_count();
+	uint8_t* core_map = mp_processor_map();
+	uint8_t apic_id = 0;
+	for(int i = 0; i < MP_MAX_CORE_COUNT; i++) {
+		if(core_map[i] == processor_id) {
+			apic_id = i;
+			break;
+		}
+	}
+
+	if(apic_id == mp_apic_id())
+		return event_busy_add(func, context) != 0;
+
+	if(queue >= NIC_MAX_QUEUE_COUNT)
+		return false;
+
+	NICPoll* poll = gmalloc(sizeof(NICPoll));
+	if(!poll)
+		return false;
+
+	poll->func = func;
+	poll->context = context;
+	poll->lock = 0;
+	poll->time = 0;
+
+	if(!event_busy_add(nicdev_poll_fallback, poll)) {
+		gfree(poll);
+		return false;
+	}
+
+	nicdev_root(nicdev)->polls[queue] = poll;
+
+	// The queue is still polled by the fallback
+	ICC_Message* msg = icc_alloc(ICC_TYPE_BUSY);
+	if(!msg)
+		return true;
+
+	msg->data.busy.func = nicdev_poll_core;
+	msg->data.busy.context = poll;
+	icc_send(msg, apic_id);
+
+	return true;
+}
+
 int nicdev_register(NICDevice* nicdev) {
 	if(nicdev_get(nicdev->name))
 		return -1;
@@ -153,6 +356,12 @@ NICDevice* nicdev_get_by_idx(int _index) {
 	return NULL;
 }
 
+void nicdev_bandwidth_set(NICDevice* nicdev, uint64_t rx_bandwidth, uint64_t tx_bandwidth) {
+	// Burst sizes are the traffic of 10ms for rx and 1ms for tx, as of a VNIC
+	shaper_set(&nicdev->rx_shaper, TIMER_FREQUENCY_PER_SEC, timer_frequency(), rx_bandwidth, rx_bandwidth / 8 / 100, 0, 0);
+	shaper_set(&nicdev->tx_shaper, TIMER_FREQUENCY_PER_SEC, timer_frequency(), tx_bandwidth, tx_bandwidth / 8 / 1000, 0, 0);
+}
+
 int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic) {
 	int i;
 	for(i = 0; i < MAX_VNIC_COUNT; i++) {
@@ -161,6 +370,11 @@ int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic) {
 			vnic->vlan_proto = nicdev->vlan_proto;
 			vnic->vlan_tci = nicdev->vlan_tci;
 
+			if(!nicdev_classify(nicdev)) {
+				nicdev->vnics[i] = NULL;
+				return -3;
+			}
+
 			return vnic->id;
 		}
 
@@ -171,12 +385,37 @@ int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic) {
 	return -2;
 }
 
+/*
+ * Let the driver take back the buffers of a VNIC. The polls of the other
+ * cores are held off meanwhile, the ones of this core do not run anyway.
+ */
+static void nicdev_detach(NICDevice* nicdev, VNIC* vnic) {
+	NICDevice* root = nicdev_root(nicdev);
+	NICDriver* driver = root->driver;
+	if(!driver || !driver->detach)
+		return;
+
+	for(int i = 0; i < NIC_MAX_QUEUE_COUNT; i++) {
+		NICPoll* poll = root->polls[i];
+		if(poll)
+			lock_lock(&poll->lock);
+	}
+
+	driver->detach(root, vnic);
+
+	for(int i = 0; i < NIC_MAX_QUEUE_COUNT; i++) {
+		NICPoll* poll = root->polls[i];
+		if(poll)
+			lock_unlock(&poll->lock);
+	}
+}
+
 VNIC* nicdev_unregister_vnic(NICDevice* nicdev, uint32_t id) {
 	VNIC* vnic;
 	int i, j;
 
 	for(i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(!nic_devices[i])
+		if(!nicdev->vnics[i])
 			return NULL;
 
 		if(nicdev->vnics[i]->id == id) {
@@ -190,6 +429,17 @@ VNIC* nicdev_unregister_vnic(NICDevice* nicdev, uint32_t id) {
 				}
 			}
 
+			// On failure the old classifier still has the VNIC, keep it unreachable
+			if(!nicdev_classify(nicdev)) {
+				NICClass* class = class_get(nicdev, CLASS_KEY(vnic->mac, nicdev_vid(nicdev)));
+				if(class && class->vnic == vnic)
+					class->vnic = NULL;
+
+				nicdev_synchronize(nicdev);
+			}
+
+			nicdev_detach(nicdev, vnic);
+
 			return vnic;
 		}
 	}
@@ -201,7 +451,7 @@ VNIC* nicdev_get_vnic(NICDevice* nicdev, uint32_t id) {
 	if(!nicdev)
 		return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
+	for(int i = 0; i < MAX_VNIC_COUNT && nicdev->vnics[i]; i++) {
 		if(nicdev->vnics[i]->id == id)
 			return nicdev->vnics[i];
 	}
@@ -213,12 +463,20 @@ VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac) {
 	if(!nicdev)
 		return NULL;
 
-	for(int i = 0; i < MAX_VNIC_COUNT; i++) {
-		if(nicdev->vnics[i]->mac == mac)
-			return nicdev->vnics[i];
-	}
+	NICClass* class = class_get(nicdev, CLASS_KEY(mac, nicdev_vid(nicdev)));
+	return class ? class->vnic : NULL;
+}
 
-	return NULL;
+NICDevice* nicdev_get_vlan(NICDevice* nicdev, uint16_t vid) {
+	if(!nicdev)
+		return NULL;
+
+	NICClass* class = class_get(nicdev, CLASS_KEY(0, vid & 0xfff));
+	if(class)
+		return class->nicdev;
+
+	// Not classified yet (no VNIC nor VLAN)
+	return vid ? NULL : nicdev_root(nicdev);
 }
 
 VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic) {
@@ -233,15 +491,27 @@ VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic) {
 		dst_vnic->mac = src_vnic->mac;
 	}
 
-	//TODO fix bandwidth
-	dst_vnic->rx_bandwidth = dst_vnic->nic->rx_bandwidth = src_vnic->rx_bandwidth;
-	dst_vnic->tx_bandwidth = dst_vnic->nic->tx_bandwidth = src_vnic->tx_bandwidth;
-	dst_vnic->padding_head = dst_vnic->nic->padding_head = src_vnic->padding_head;
-	dst_vnic->padding_tail = dst_vnic->nic->padding_tail = src_vnic->padding_tail;
+	uint64_t attrs[] = {
+		VNIC_RX_BANDWIDTH, src_vnic->rx_bandwidth,
+		VNIC_TX_BANDWIDTH, src_vnic->tx_bandwidth,
+		VNIC_PADDING_HEAD, src_vnic->padding_head,
+		VNIC_PADDING_TAIL, src_vnic->padding_tail,
+		VNIC_NONE
+	};
+
+	if(vnic_update(dst_vnic, attrs) != VNIC_ERROR_NOERROR)
+		return NULL;
 
 	return dst_vnic;
 }
 
+VNIC* nicdev_rx_owner(NICDevice* nicdev, uint64_t dmac) {
+	if(dmac & ETHER_MULTICAST)
+		return NULL;
+
+	return nicdev_get_vnic_mac(nicdev, dmac);
+}
+
 static uint8_t packet_debug_switch;
 void nidev_debug_switch_set(uint8_t opt) {
 	packet_debug_switch = opt;
@@ -309,6 +579,80 @@ inline static void packet_dump(void* _data, size_t size) {
 	}
 }
 
+typedef struct {
+	uint32_t	group;		///< Group of the VNICs, 0 is empty
+	VNIC*		owner;		///< VNIC which the packet is allocated from
+	Packet*		packet;		///< Packet shared by the group
+} MulticastGroup;
+
+/*
+ * Multicast and broadcast are copied once per group of VNICs which are
+ * mapped to the same VM. The other VNICs of the group receive the same
+ * packet read-only. A reference is held until every VNIC has it queued.
+ * Groups are found in a small hash table, so a frame takes one pass over
+ * the VNICs.
+ */
+static void nicdev_rx_multicast(NICDevice* dev, uint8_t* data, size_t size,
+		void* data_optional, size_t size_optional, PacketMeta* meta) {
+	MulticastGroup groups[MULTICAST_GROUP_COUNT];
+	memset(groups, 0, sizeof(groups));
+
+	for(int i = 0; i < MAX_VNIC_COUNT && dev->vnics[i]; i++) {
+		VNIC* vnic = dev->vnics[i];
+
+		MulticastGroup* slot = NULL;
+		if(vnic->group) {
+			// Fibonacci hashing, the top bits index the table
+			uint32_t hash = vnic->group * 2654435761U >> (32 - __builtin_ctz(MULTICAST_GROUP_COUNT));
+			for(int j = 0; j < MULTICAST_GROUP_COUNT; j++) {
+				MulticastGroup* group = &groups[(hash + j) % MULTICAST_GROUP_COUNT];
+				if(!group->group || group->group == vnic->group) {
+					slot = group;
+					break;
+				}
+			}
+		}
+
+		// A VNIC which cannot share the packet of its group gets its own copy
+		if(slot && slot->group) {
+			if(vnic_rx_ref(vnic, slot->owner, slot->packet) != VNIC_ERROR_UNSUPPORTED)
+				continue;
+
+			slot = NULL;
+		}
+
+		Packet* packet = slot ? vnic_alloc(vnic, size + size_optional) : NULL;
+		if(!packet || !nic_pool_class_ref(vnic->nic, &vnic->pool, packet)) {
+			if(packet)
+				vnic_free(vnic, packet);
+
+			vnic_rx_meta(vnic, data, size, data_optional, size_optional, meta);
+			continue;
+		}
+
+		if(vnic->padding_head >= sizeof(PacketMeta))
+			packet->start = vnic->padding_head;
+
+		memcpy(packet->buffer + packet->start, data, size);
+		if(size_optional)
+			memcpy(packet->buffer + packet->start + size, data_optional, size_optional);
+		packet->end = packet->start + size + size_optional;
+
+		if(packet->start)
+			packet_meta_set(packet, meta);
+
+		slot->group = vnic->group;
+		slot->owner = vnic;
+		slot->packet = packet;
+		vnic_rx_burst(vnic, &packet, 1);
+	}
+
+	for(int j = 0; j < MULTICAST_GROUP_COUNT; j++) {
+		if(groups[j].group)
+			vnic_free(groups[j].owner, groups[j].packet);
+	}
+}
+
 int nicdev_rx(NICDevice* dev, void* data, size_t size) {
 	return nicdev_rx0(dev, data, size, NULL, 0);
 }
@@ -316,7 +660,6 @@ int nicdev_rx(NICDevice* dev, void* data, size_t size) {
 int nicdev_rx0(NICDevice* dev, void* data, size_t size,
 		void* data_optional, size_t size_optional) {
 	Ether* eth = data;
-	int i;
 	VNIC* vnic;
 
 	if(size + size_optional < sizeof(Ether))
@@ -325,18 +668,18 @@ int nicdev_rx0(NICDevice* dev, void* data, size_t size,
 
 	//TODO lock
 	packet_dump(data, size);
-	if(dmac & ETHER_MULTICAST) {
-		for(i = 0; i < MAX_VNIC_COUNT; i++) {
-			if(!dev->vnics[i])
-				break;
 
-			vnic_rx(dev->vnics[i], (uint8_t*)eth, size, data_optional, size_optional);
-		}
+	// Headers are parsed once for every VNIC receiving the frame
+	PacketMeta meta;
+	packet_meta_parse(&meta, data, size);
+
+	if(dmac & ETHER_MULTICAST) {
+		nicdev_rx_multicast(dev, (uint8_t*)eth, size, data_optional, size_optional, &meta);
 		return NICDEV_PROCESS_PASS;
 	} else {
 		vnic = nicdev_get_vnic_mac(dev, dmac);
 		if(vnic) {
-			vnic_rx(vnic, (uint8_t*)eth, size, data_optional, size_optional);
+			vnic_rx_meta(vnic, (uint8_t*)eth, size, data_optional, size_optional, &meta);
 			return NICDEV_PROCESS_COMPLETE;
 		}
 	}
@@ -369,40 +712,13 @@ static bool transmitter(Packet* packet, void* context) {
  *
  * @return number of packets proccessed
  */
-//FIXME: Need VNIC Scheduling.
-//If device buffer is full, last vnic in array can't send packet.
-//Task = budget
 int nicdev_tx(NICDevice* nicdev,
 		bool (*process)(Packet* packet, void* context), void* context) {
-	VNIC* vnic;
-	int budget;
-	int count = 0;
-
 	TransmitContext transmitter_context = {
 		.process = process,
 		.context = context};
 
-	for(; nicdev->round < MAX_VNIC_COUNT; nicdev->round++) {
-		vnic = nicdev->vnics[nicdev->round];
-		if(!vnic) {
-			nicdev->round = 0;
-			break;
-		}
-
-		budget = vnic->budget;
-		while(budget--) {
-			VNICError ret = vnic_tx(vnic, transmitter, &transmitter_context);
-
-			if(ret == VNIC_ERROR_OPERATION_FAILED) // Transmiitter Error
-				return count;
-			else if(ret == VNIC_ERROR_RESOURCE_NOT_AVAILABLE) // There no Packet, Check next vnic
-				break;
-
-			count++;
-		}
-	}
-
-	return count;
+	return scheduler_tx(&nicdev->scheduler, nicdev->vnics, transmitter, &transmitter_context, NICDEV_TX_BUDGET);
 }
 
 void nicdev_free(Packet* packet) {
@@ -429,6 +745,7 @@ NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id) {
 	vlan_nicdev->vlan_tci = endian16(id);
 	vlan_nicdev->driver = nicdev->driver;
 	vlan_nicdev->priv = nicdev->priv;
+	vlan_nicdev->root = nicdev_root(nicdev);
 
 	NICDevice* next = nicdev;
 	while(1) {
@@ -453,6 +770,15 @@ NICDevice* nicdev_add_vlan(NICDevice* nicdev, uint16_t id) {
 		}
 	}
 
+	if(!nicdev_classify(vlan_nicdev)) {
+		vlan_nicdev->prev->next = vlan_nicdev->next;
+		if(vlan_nicdev->next)
+			vlan_nicdev->next->prev = vlan_nicdev->prev;
+
+		gfree(vlan_nicdev);
+		return NULL;
+	}
+
 	event_busy_add(nicdev_schedule, vlan_nicdev);
 	return vlan_nicdev;
 }
@@ -474,6 +800,15 @@ bool nicdev_remove_vlan(NICDevice* nicdev) {
 		((NICDriver*)nicdev->driver)->remove_vid(nicdev, endian16(nicdev->vlan_tci) & 0xfff);
 	}
 
+	nicdev->prev->next = nicdev->next;
+	if(nicdev->next)
+		nicdev->next->prev = nicdev->prev;
+
+	// A VLAN entry left behind points at freed memory, drop the whole table then
+	NICDevice* root = nicdev_root(nicdev);
+	if(!nicdev_classify(root))
+		nicdev_publish(root, NULL);
+
 	gfree(nicdev);
 	//FIXME remove event nicdev
 	return false;
@@ -2,9 +2,43 @@
 #define __NICDEV_H__
 
 #include <vnic.h>
+#include <scheduler.h>
+#include "../mp.h"
 
 #define MAX_NIC_DEVICE_COUNT	128
 #define MAX_NIC_NAME_LEN	16
+#define NIC_MAX_QUEUE_COUNT	8	///< Maximum number of receive/transmit queue pairs of a NIC device
+
+struct _NICDevice;
+
+/**
+ * Classifier entry, the VNIC of a MAC address on a VLAN.
+ * The entry of MAC 0 is the NIC device of the VLAN.
+ */
+typedef struct _NICClass {
+	uint64_t	key;		///< MAC address | VLAN id << 48
+	struct _NICDevice* nicdev;	///< NIC device of the VLAN, NULL if the entry is empty
+	VNIC*		vnic;		///< VNIC, NULL for the entry of the NIC device
+} NICClass;
+
+/**
+ * Open addressing hash table of the VNICs and VLANs of a physical NIC device.
+ * It is rebuilt whenever a VNIC or a VLAN is added or removed, receiving
+ * only looks it up.
+ */
+typedef struct _NICClassifier {
+	uint32_t	mask;		///< Number of entries - 1 (power of 2)
+	NICClass	classes[0];
+} NICClassifier;
+
+/**
+ * Receive section counter of a core, odd while the core receives from the NIC
+ * device. Padded so that the cores do not write to the same cache line.
+ */
+typedef struct {
+	volatile uint64_t	seq;
+	uint8_t			padding[56];
+} NICRxSection;
 
 typedef struct _NICDevice{
 	char		name[MAX_NIC_NAME_LEN];
@@ -16,11 +50,18 @@ typedef struct _NICDevice{
 	void*		priv;
 
 	VNIC*		vnics[MAX_VNIC_COUNT];
+	Shaper		rx_shaper;	///< Parent token buckets of VNICs' rx (unlimited when zeroed)
+	Shaper		tx_shaper;	///< Parent token buckets of VNICs' tx (unlimited when zeroed)
 
-	uint16_t	round; //FIXME: current nicdev only support round robin schedule
+	Scheduler	scheduler;	///< Egress scheduler of the VNICs (deficit round robin when zeroed)
 
 	struct _NICDevice* next;
 	struct _NICDevice* prev;
+	struct _NICDevice* root;	///< Physical NIC device of a VLAN, NULL for the physical NIC device itself
+
+	NICClassifier*	classifier;	///< Classifier of the physical NIC device
+	NICRxSection	rx_sections[MP_MAX_CORE_COUNT];	///< Receive sections of the cores, by processor id (physical NIC device)
+	void*		polls[NIC_MAX_QUEUE_COUNT];	///< Queue polls handed over to the other cores
 } NICDevice;
 
 typedef struct {
@@ -28,8 +69,21 @@ typedef struct {
 	uint64_t	mac;
 } NICInfo;
 
+/**
+ * Counters of a receive/transmit queue pair
+ */
+typedef struct {
+	uint64_t	rx_packets;
+	uint64_t	rx_bytes;
+	uint64_t	tx_packets;
+	uint64_t	tx_bytes;
+	uint64_t	tx_drops;	///< Packets dropped as the queue was full
+} NICQueueStatus;
+
 typedef struct {
 	int		mtu;
+	uint16_t	queue_count;	///< Number of queue pairs in use
+	NICQueueStatus	queues[NIC_MAX_QUEUE_COUNT];
 } NICStatus;
 
 typedef struct {
@@ -43,6 +97,12 @@ typedef struct {
 
 	bool 		(*add_vid)(NICDevice* nicdev, uint16_t vid);
 	bool 		(*remove_vid)(NICDevice* nicdev, uint16_t vid);
+
+	/**
+	 * Take back the receive buffers of a VNIC which the device still holds.
+	 * Called with the queues not polled, after no core receives to the VNIC.
+	 */
+	void		(*detach)(NICDevice* nicdev, VNIC* vnic);
 } NICDriver;
 
 int nicdev_get_count();
@@ -73,14 +133,87 @@ void nicdev_free(Packet* packet);
  * @param nicdev NIC Device
  * @param vnic Virtual NIC
  *
- * @param vnic id
+ * @return vnic id, -1 if the MAC address is in use, -2 if the NIC device is
+ * full, -3 if the classifier cannot be rebuilt
  */
 int nicdev_register_vnic(NICDevice* nicdev, VNIC* vnic);
+
+/**
+ * Set the bandwidth shared by the VNICs of the NIC device. The rates can be
+ * changed while packets are flowing.
+ *
+ * @param nicdev NIC device
+ * @param rx_bandwidth rx rate (bps), 0 is unlimited
+ * @param tx_bandwidth tx rate (bps), 0 is unlimited
+ */
+void nicdev_bandwidth_set(NICDevice* nicdev, uint64_t rx_bandwidth, uint64_t tx_bandwidth);
+
+/**
+ * Unregister VNIC from NICDevice. No core receives to the VNIC anymore and
+ * the device holds none of its buffers when it returns, so its memory can be
+ * freed.
+ *
+ * @param nicdev NIC Device
+ * @param id vnic id
+ *
+ * @return the VNIC, NULL if it is not registered
+ */
 VNIC* nicdev_unregister_vnic(NICDevice* nicdev, uint32_t id);
 VNIC* nicdev_get_vnic(NICDevice* nicdev, uint32_t id);
 VNIC* nicdev_get_vnic_mac(NICDevice* nicdev, uint64_t mac);
 VNIC* nicdev_update_vnic(NICDevice* nicdev, VNIC* src_vnic);
 
+/**
+ * Find the NIC device of a VLAN in constant time
+ *
+ * @param nicdev NIC Device or any of its VLANs
+ * @param vid VLAN id, 0 for the physical NIC device
+ *
+ * @return NIC Device of the VLAN, NULL if there is none
+ */
+NICDevice* nicdev_get_vlan(NICDevice* nicdev, uint16_t vid);
+
+/**
+ * Enter a receive section of the core. Drivers look up the NIC device, e.g.
+ * call nicdev_rx() or nicdev_rx_owner(), only inside a receive section, so
+ * that a classifier or a VNIC which is removed is not freed under them.
+ * Sections do not nest.
+ *
+ * @param nicdev NIC Device
+ */
+void nicdev_rx_begin(NICDevice* nicdev);
+
+/**
+ * Leave the receive section of the core.
+ *
+ * @param nicdev NIC Device
+ */
+void nicdev_rx_end(NICDevice* nicdev);
+
+/**
+ * Get the VNIC which receives the unicast packets to the MAC address, so that
+ * a driver can receive directly into its packet pool (zero-copy).
+ *
+ * @param nicdev NIC Device
+ * @param dmac destination MAC address
+ *
+ * @return the VNIC of the MAC address, NULL if there is none or it is multicast
+ */
+VNIC* nicdev_rx_owner(NICDevice* nicdev, uint64_t dmac);
+
+/**
+ * Poll a queue of the NIC device on core (queue % core count). Core 0 polls
+ * the queue instead while that core runs a VM, the two never poll it at once.
+ *
+ * @param nicdev NIC Device
+ * @param queue queue index
+ * @param func poll function
+ * @param context context to be passed to the poll function
+ *
+ * @return true if the poll is registered
+ */
+bool nicdev_poll_add(NICDevice* nicdev, uint16_t queue, bool (*func)(void* context), void* context);
+
 enum NICDEV_PROCESS_RESULT {
 	NICDEV_PROCESS_COMPLETE,
 	NICDEV_PROCESS_PASS,
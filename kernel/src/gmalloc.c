@@ -11,16 +11,31 @@
 #include "e820.h"
 #include "pnkc.h"
 
-uint32_t bmalloc_count;
+#define BMALLOC_BLOCK_SIZE	0x200000
+#define BMALLOC_ORDER_COUNT	10		// Runs up to 2^9 blocks (1GB)
+#define BMALLOC_NONE		UINT32_MAX
 
-typedef struct _BmallocPool {
-	bool		used;
-	bool		head;
-	int		count;
-	uint64_t	pool;
-} BmallocPool;
+uint32_t bmalloc_count;
+static uint32_t bmalloc_used_count;
+
+/**
+ * Buddy allocator of 2MB blocks. A free run of 2^order blocks starts at a
+ * block index aligned to 2^order, so a run of 512 blocks is 1GB aligned.
+ */
+typedef struct _BmallocBlock {
+	uint32_t	next;	///< Next free run of the same order
+	uint32_t	prev;	///< Previous free run of the same order
+	uint32_t	count;	///< Blocks allocated from here, 0 if none
+	int8_t		order;	///< Order of the free run starting here, -1 if none
+} BmallocBlock;
+
+static BmallocBlock* bmalloc_blocks;
+static uintptr_t bmalloc_base;		// Address of bmalloc_blocks[0], 1GB aligned
+static uint32_t bmalloc_size;		// Number of bmalloc_blocks including holes
+static uint32_t bmalloc_free[BMALLOC_ORDER_COUNT];
+
+static void bmalloc_free_run(uint32_t index, uint32_t count);
 
-BmallocPool* bmalloc_pool;
 void* gmalloc_pool;
 
 void gmalloc_init() {
@@ -179,18 +194,36 @@ void gmalloc_init() {
 			return NULL;
 	}
 
-	bmalloc_pool = malloc(sizeof(BmallocPool) * bmalloc_count);
-	uint32_t bmalloc_index = 0;
+	uintptr_t first = UINTPTR_MAX;
+	uintptr_t last = 0;
+	list_iterator_init(&iter, blocks);
+	while(list_iterator_has_next(&iter)) {
+		Block* b = list_iterator_next(&iter);
+		if(b->start < first)
+			first = b->start;
+		if(b->end > last)
+			last = b->end;
+	}
+
+	uintptr_t align = (uintptr_t)BMALLOC_BLOCK_SIZE << (BMALLOC_ORDER_COUNT - 1);
+	bmalloc_base = first == UINTPTR_MAX ? 0 : first & ~(align - 1);
+	bmalloc_size = last > bmalloc_base ? (last - bmalloc_base) / BMALLOC_BLOCK_SIZE : 0;
+	bmalloc_blocks = malloc(sizeof(BmallocBlock) * bmalloc_size);
+	for(uint32_t i = 0; i < bmalloc_size; i++) {
+		bmalloc_blocks[i].count = 0;
+		bmalloc_blocks[i].order = -1;
+	}
+
+	for(int i = 0; i < BMALLOC_ORDER_COUNT; i++)
+		bmalloc_free[i] = BMALLOC_NONE;
+
 	Block* block = pop();
 	while(block) {
 		uintptr_t start = block->start;
 		uintptr_t end = block->end;
 		printf("\t\t0x%016lx - 0x%016lx\n", start, end);
 
-		while(start < end) {
-			bmalloc_pool[bmalloc_index++].pool = start;
-			start += 0x200000;
-		}
+		bmalloc_free_run((start - bmalloc_base) / BMALLOC_BLOCK_SIZE, (end - start) / BMALLOC_BLOCK_SIZE);
 
 		free(block);
 
@@ -250,69 +283,117 @@ inline void* gcalloc(uint32_t nmemb, size_t size) {
 	return calloc_ex(nmemb, size, gmalloc_pool);
 }
 
-static inline bool is_linear(BmallocPool* bmalloc_pool, int count) {
-	for(int i = 0; i < count; i++)
-		if(bmalloc_pool[i].used)
-			return false;
+static void bmalloc_link(uint32_t index, int order) {
+	BmallocBlock* block = &bmalloc_blocks[index];
+	block->order = order;
+	block->prev = BMALLOC_NONE;
+	block->next = bmalloc_free[order];
+	if(block->next != BMALLOC_NONE)
+		bmalloc_blocks[block->next].prev = index;
 
-	return true;
+	bmalloc_free[order] = index;
 }
 
-static inline void set_used(BmallocPool* bmalloc_pool, int count) {
-	bmalloc_pool[0].head = true;
-	bmalloc_pool[0].count = count;
+static void bmalloc_unlink(uint32_t index) {
+	BmallocBlock* block = &bmalloc_blocks[index];
+	if(block->prev != BMALLOC_NONE)
+		bmalloc_blocks[block->prev].next = block->next;
+	else
+		bmalloc_free[block->order] = block->next;
+
+	if(block->next != BMALLOC_NONE)
+		bmalloc_blocks[block->next].prev = block->prev;
 
-	for(int i = 0; i < count; i++)
-		bmalloc_pool[i].used = true;
+	block->order = -1;
 }
 
-static inline void clear_used(BmallocPool* bmalloc_pool) {
-	for(int i = 0; i < bmalloc_pool[0].count; i++)
-		bmalloc_pool[i].used = false;
+// Merges the run with its free buddies
+static void bmalloc_release(uint32_t index, int order) {
+	while(order < BMALLOC_ORDER_COUNT - 1) {
+		uint32_t buddy = index ^ (1 << order);
+		if(buddy >= bmalloc_size || bmalloc_blocks[buddy].order != order)
+			break;
+
+		bmalloc_unlink(buddy);
+		if(buddy < index)
+			index = buddy;
+
+		order++;
+	}
 
-	bmalloc_pool[0].head = false;
-	bmalloc_pool[0].count = 0;
+	bmalloc_link(index, order);
 }
 
-void* bmalloc(int count) {
-	for(size_t i = 0; i < bmalloc_count; i++) {
-		if(!bmalloc_pool[i].used) {
-			if(is_linear(&bmalloc_pool[i], count)) {
-				set_used(&bmalloc_pool[i], count);
-				return (void*)bmalloc_pool[i].pool;
-			}
+// Releases blocks in the largest aligned runs they are made of
+static void bmalloc_free_run(uint32_t index, uint32_t count) {
+	uint32_t end = index + count;
+	while(index < end) {
+		int order = 0;
+		while(order < BMALLOC_ORDER_COUNT - 1 && !(index & (1 << order)) &&
+				index + (2 << order) <= end)
+			order++;
+
+		bmalloc_release(index, order);
+		index += 1 << order;
+	}
+}
 
-			i += count;
-		}
+void* bmalloc_align(int count, int align) {
+	int order = 0;
+	while(order < BMALLOC_ORDER_COUNT && ((1 << order) < count || (1 << order) < align))
+		order++;
+
+	if(count <= 0 || order >= BMALLOC_ORDER_COUNT)
+		return NULL;
+
+	int o = order;
+	while(o < BMALLOC_ORDER_COUNT && bmalloc_free[o] == BMALLOC_NONE)
+		o++;
+
+	if(o >= BMALLOC_ORDER_COUNT)
+		return NULL;
+
+	uint32_t index = bmalloc_free[o];
+	bmalloc_unlink(index);
+
+	// Split down to the order, upper halves are free buddies
+	while(o > order) {
+		o--;
+		bmalloc_link(index + (1 << o), o);
 	}
 
-	printf("Not enough block memory!!!");
-	while(1);
+	// Blocks over the count are given back
+	bmalloc_free_run(index + count, (1 << order) - count);
+
+	bmalloc_blocks[index].count = count;
+	bmalloc_used_count += count;
 
-	return NULL;
+	return (void*)(bmalloc_base + (uintptr_t)index * BMALLOC_BLOCK_SIZE);
+}
+
+void* bmalloc(int count) {
+	return bmalloc_align(count, 1);
 }
 
 void bfree(void* ptr) {
-	for(size_t i = 0; i < bmalloc_count; i++) {
-		if((void*)bmalloc_pool[i].pool == ptr) {
-			if(bmalloc_pool[i].head)
-				clear_used(&bmalloc_pool[i]);
-			break;
-		}
-	}
+	if((uintptr_t)ptr < bmalloc_base || ((uintptr_t)ptr - bmalloc_base) % BMALLOC_BLOCK_SIZE)
+		return;
+
+	uint32_t index = ((uintptr_t)ptr - bmalloc_base) / BMALLOC_BLOCK_SIZE;
+	if(index >= bmalloc_size || !bmalloc_blocks[index].count)
+		return;
+
+	uint32_t count = bmalloc_blocks[index].count;
+	bmalloc_blocks[index].count = 0;
+	bmalloc_used_count -= count;
+
+	bmalloc_free_run(index, count);
 }
 
 size_t bmalloc_total() {
-	return bmalloc_count * 0x200000;
+	return (size_t)bmalloc_count * BMALLOC_BLOCK_SIZE;
 }
 
 size_t bmalloc_used() {
-	size_t size = 0;
-	for(size_t i = 0; i < bmalloc_count; i++) {
-		if(bmalloc_pool[i].used) {
-			size += 0x200000;
-		}
-	}
-
-	return size;
+	return (size_t)bmalloc_used_count * BMALLOC_BLOCK_SIZE;
 }
@@ -14,7 +14,20 @@ void gfree(void* ptr);
 void* grealloc(void* ptr, size_t size);
 void* gcalloc(uint32_t nmemb, size_t size);
 
+/**
+ * Allocate count contiguous 2MB blocks.
+ *
+ * @return address of the first block, NULL if no run is free
+ */
 void* bmalloc(int count);
+
+/**
+ * Allocate count contiguous 2MB blocks starting at a multiple of align blocks
+ * (a power of two up to 512, that is 1GB).
+ *
+ * @return address of the first block, NULL if no run is free
+ */
+void* bmalloc_align(int count, int align);
 void bfree(void* ptr);
 size_t bmalloc_total();
 size_t bmalloc_used();
@@ -1,8 +1,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <util/event.h>
-#include <util/fifo.h>
-#include <lock.h>
 #include <_malloc.h>
 #include <timer.h>
 #include "asm.h"
@@ -19,90 +17,132 @@
 static uint32_t icc_id;
 
 #define ICC_EVENTS_COUNT	64
+#define ICC_POOL_SIZE		(MP_MAX_CORE_COUNT * 2)	// Messages per core
+#define ICC_BUDGET		32			// Messages handled per event loop
+
 typedef void (*ICC_Handler)(ICC_Message*);
 static ICC_Handler icc_events[ICC_EVENTS_COUNT];
 
-static bool icc_event(void* context) {
-	uint8_t apic_id = mp_apic_id();
+static inline ICC* icc_queue(uint8_t apic_id) {
 	Shared* shared = (Shared*)VIRTUAL_TO_PHYSICAL(SHARED_ADDR);
-	FIFO* icc_queue = shared->icc_queues[apic_id].icc_queue;
 
-	if(fifo_empty(icc_queue))
-		return true;
+	return &shared->icc_queues[apic_id];
+}
+
+// Any core may push at the same time
+static void icc_push(ICC_Message* volatile* stack, ICC_Message* msg) {
+	ICC_Message* top;
+	do {
+		top = *stack;
+		msg->next = top;
+	} while(!__sync_bool_compare_and_swap(stack, top, msg));
+}
 
-	lock_lock(&shared->icc_queues[apic_id].icc_queue_lock);
-	ICC_Message* icc_msg = fifo_pop(icc_queue);
-	lock_unlock(&shared->icc_queues[apic_id].icc_queue_lock);
+// Only the owner takes, all of the messages at once, so no ABA problem
+static inline ICC_Message* icc_take(ICC_Message* volatile* stack) {
+	if(!*stack)
+		return NULL;
 
-	if(!icc_msg)
-		return true;
+	return __sync_lock_test_and_set(stack, NULL);
+}
 
-	if(icc_msg->type >= ICC_EVENTS_COUNT) {
-		icc_free(icc_msg);
-		return true;
+static ICC_Message* icc_receive(ICC* icc) {
+	if(!icc->received) {
+		// Reverse the inbox to handle the messages in the order they were sent
+		ICC_Message* msg = icc_take(&icc->inbox);
+		while(msg) {
+			ICC_Message* next = msg->next;
+			msg->next = icc->received;
+			icc->received = msg;
+			msg = next;
+		}
 	}
 
-	if(!icc_events[icc_msg->type]) {
-		icc_free(icc_msg);
-		return true;
+	ICC_Message* msg = icc->received;
+	if(msg)
+		icc->received = msg->next;
+
+	return msg;
+}
+
+static void icc_dispatch(ICC_Message* msg) {
+	if(msg->type >= ICC_EVENTS_COUNT || !icc_events[msg->type]) {
+		icc_free(msg);
+		return;
 	}
 
-	icc_events[icc_msg->type](icc_msg); //event call
+	icc_events[msg->type](msg); //event call
+}
+
+static void icc_ipi(uint8_t apic_id, uint64_t shorthand, uint8_t vector) {
+	apic_write64(APIC_REG_ICR, ((uint64_t)(apic_id) << 56) |
+			shorthand |
+			APIC_TM_EDGE |
+			APIC_LV_DEASSERT |
+			APIC_DM_PHYSICAL |
+			APIC_DMODE_FIXED |
+			vector);
+}
+
+static bool icc_event(void* context) {
+	ICC* icc = icc_queue(mp_apic_id());
+
+	// Cleared before taking the inbox, so a message pushed after that rings again
+	if(icc->doorbell)
+		__sync_lock_test_and_set(&icc->doorbell, 0);
+
+	for(int i = 0; i < ICC_BUDGET; i++) {
+		ICC_Message* msg = icc_receive(icc);
+		if(!msg)
+			break;
+
+		// VM is not running on the core
+		if(msg->type == ICC_TYPE_STOP)
+			msg->result = -1000;
+
+		icc_dispatch(msg);
+	}
 
 	return true;
 }
 
 static void icc(uint64_t vector, uint64_t err) {
-	uint8_t apic_id = mp_apic_id();
-	Shared* shared = (Shared*)VIRTUAL_TO_PHYSICAL(SHARED_ADDR);
-	FIFO* icc_queue = shared->icc_queues[apic_id].icc_queue;
-	ICC_Message* icc_msg = fifo_peek(icc_queue, 0);
-
 	apic_eoi();
 
-	if(icc_msg == NULL)
+	// The event loop handles the messages
+	if(task_id() == 0)
 		return;
 
-	icc_msg->result = 0;
-	if(task_id() != 0) {
-		if(icc_msg->type == ICC_TYPE_RESUME) {
-			icc_msg->result = -1000;
-			icc_event(NULL);
-		} else {
-			icc_event(NULL);
-		}
-	} else {
-		if(icc_msg->type == ICC_TYPE_STOP) {
-			icc_msg->result = -1000;
-			icc_event(NULL);
-		}
+	ICC* icc = icc_queue(mp_apic_id());
+	__sync_lock_test_and_set(&icc->doorbell, 0);
+
+	ICC_Message* icc_msg;
+	while((icc_msg = icc_receive(icc))) {
+		// VM is running already
+		icc_msg->result = icc_msg->type == ICC_TYPE_RESUME ? -1000 : 0;
+		icc_dispatch(icc_msg);
 	}
 }
 
 void icc_init() {
-	uint8_t processor_count = mp_processor_count();
 	extern void* gmalloc_pool;
 	uint8_t apic_id = mp_apic_id();
 	Shared* shared = (Shared*)VIRTUAL_TO_PHYSICAL(SHARED_ADDR);
 
 	if(apic_id == 0) {
-		int icc_max = processor_count * processor_count;
-		shared->icc_pool = fifo_create(icc_max, gmalloc_pool);
-
-		for(int i = 0; i < icc_max; i++) {
-			ICC_Message* icc_message = __malloc(sizeof(ICC_Message), shared->icc_pool->pool);
-			fifo_push(shared->icc_pool, icc_message);
-		}
-
 		shared->icc_queues = __malloc(MP_MAX_CORE_COUNT * sizeof(ICC), gmalloc_pool);
-
-		lock_init(&shared->icc_lock_alloc);
+		memset(shared->icc_queues, 0, MP_MAX_CORE_COUNT * sizeof(ICC));
 
 		uint8_t* core_map = mp_processor_map();
 		for(int i = 0; i < MP_MAX_CORE_COUNT; i++) {
-			if(core_map[i] != MP_CORE_INVALID) {
-				shared->icc_queues[i].icc_queue = fifo_create(processor_count, gmalloc_pool);
-				lock_init(&shared->icc_queues[i].icc_queue_lock);
+			if(core_map[i] == MP_CORE_INVALID)
+				continue;
+
+			ICC* icc = &shared->icc_queues[i];
+			for(int j = 0; j < ICC_POOL_SIZE; j++) {
+				ICC_Message* icc_message = __malloc(sizeof(ICC_Message), gmalloc_pool);
+				icc_message->next = icc->pool;
+				icc->pool = icc_message;
 			}
 		}
 	}
@@ -112,46 +152,55 @@ void icc_init() {
 }
 
 ICC_Message* icc_alloc(uint8_t type) {
-	Shared* shared = (Shared*)SHARED_ADDR;
+	ICC* icc = icc_queue(mp_apic_id());
+
+	// Messages freed by the other cores are taken back when the pool runs out
+	if(!icc->pool)
+		icc->pool = icc_take(&icc->freed);
 
-	lock_lock(&shared->icc_lock_alloc);
-	ICC_Message* icc_message = fifo_pop(shared->icc_pool);
-	lock_unlock(&shared->icc_lock_alloc);
+	// and the pool grows from the shared memory when all of them are in flight
+	ICC_Message* icc_message = icc->pool;
+	if(icc_message)
+		icc->pool = icc_message->next;
+	else if(!(icc_message = __malloc(sizeof(ICC_Message), gmalloc_pool)))
+		return NULL;
 
+	icc_message->next = NULL;
 	icc_message->id = icc_id++;
 	icc_message->type = type;
 	icc_message->apic_id = mp_apic_id();
 	icc_message->result = 0;
+	icc_message->time = 0;
 
 	return icc_message;
 }
 
 void icc_free(ICC_Message* msg) {
-	Shared* shared = (Shared*)SHARED_ADDR;
+	ICC* icc = icc_queue(msg->apic_id);
 
-	lock_lock(&shared->icc_lock_free);
-	fifo_push(shared->icc_pool, msg);
-	lock_unlock(&shared->icc_lock_free);
+	if(msg->apic_id == mp_apic_id()) {
+		msg->next = icc->pool;
+		icc->pool = msg;
+	} else {
+		icc_push(&icc->freed, msg);
+	}
 }
 
 uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
-	Shared* shared = (Shared*)SHARED_ADDR;
+	ICC* icc = icc_queue(apic_id);
 	uint32_t _icc_id = msg->id;
+	uint8_t type = msg->type;
 
-	lock_lock(&shared->icc_queues[apic_id].icc_queue_lock);
-	fifo_push(shared->icc_queues[apic_id].icc_queue, msg);
-	lock_unlock(&shared->icc_queues[apic_id].icc_queue_lock);
+	if(!msg->time)
+		msg->time = timer_us();
 
-	apic_write64(APIC_REG_ICR, ((uint64_t)(apic_id) << 56) |
-			APIC_DSH_NONE | 
-			APIC_TM_EDGE | 
-			APIC_LV_DEASSERT | 
-			APIC_DM_PHYSICAL | 
-			APIC_DMODE_FIXED |
-			(msg->type == ICC_TYPE_PAUSE ? 49 : 48));
+	icc_push(&icc->inbox, msg);
 
-	// TODO: Remove wait
-	timer_mwait(100);
+	// Messages sent before the core handles the first one share its IPI
+	if(type != ICC_TYPE_PAUSE && __sync_lock_test_and_set(&icc->doorbell, 1))
+		return _icc_id;
+
+	icc_ipi(apic_id, APIC_DSH_NONE, type == ICC_TYPE_PAUSE ? 49 : 48);
 
 	return _icc_id;
 }
@@ -159,3 +208,13 @@ uint32_t icc_send(ICC_Message* msg, uint8_t apic_id) {
 void icc_register(uint8_t type, void(*event)(ICC_Message*)) {
 	icc_events[type] = event;
 }
+
+void icc_defer() {
+	ICC* icc = icc_queue(mp_apic_id());
+	if(!icc->received && !icc->inbox)
+		return;
+
+	// Delivered as soon as the VM enables interrupts
+	__sync_lock_test_and_set(&icc->doorbell, 1);
+	icc_ipi(0, APIC_DSH_SELF, 48);
+}
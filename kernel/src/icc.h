@@ -13,6 +13,7 @@ typedef enum {
 	ICC_TYPE_RESUMED,
 	ICC_TYPE_STOP,
 	ICC_TYPE_STOPPED,
+	ICC_TYPE_BUSY,
 } ICCType;
 
 #define ICC_STATUS_DONE		0
@@ -20,10 +21,12 @@ typedef enum {
 #define ICC_STATUS_RECEIVED	2
 
 typedef struct _ICC_Message {
+	struct _ICC_Message*	next;
 	uint32_t	id;
 	uint8_t		type;
-	uint8_t		apic_id;
+	uint8_t		apic_id;	///< Sender, the message goes back to its pool when freed
 	int		    result;
+	uint64_t	time;		///< Time the request was sent (us), replies carry it back
 	
 	union {
 		struct {
@@ -50,15 +53,34 @@ typedef struct _ICC_Message {
 		struct {
 			int return_code;
 		} stopped;
+
+		struct {
+			bool	(*func)(void*);
+			void*	context;
+		} busy;
 	} data;
 } ICC_Message;
 
 extern ICC_Message* icc_msg;	// Core's local message
 
 void icc_init();
+
+/**
+ * Allocate a message from the pool of the core, which grows from the shared
+ * memory when every message of it is in flight.
+ *
+ * @return NULL if the shared memory is exhausted
+ */
 ICC_Message* icc_alloc(uint8_t type);
 void icc_free(ICC_Message* msg);
 uint32_t icc_send(ICC_Message* msg, uint8_t apic_id);
 void icc_register(uint8_t type, void(*event)(ICC_Message*));
 
+/**
+ * Hand the messages not handled yet over to the interrupt handler, as the
+ * event loop does not run while the core runs a VM. Interrupts must be
+ * disabled until the VM runs.
+ */
+void icc_defer();
+
 #endif /* __ICC_H__ */
@@ -50,6 +50,10 @@
 #include "driver/bfs.h"
 #include "driver/console.h"
 
+static int nic_core_id() {
+	return mp_apic_id();
+}
+
 static void ap_timer_init() {
 	extern uint64_t TIMER_FREQUENCY_PER_SEC;
 	extern uint64_t __timer_ms;
@@ -150,7 +154,10 @@ static void context_switch() {
 
 	// Context switching
 	// TODO: Move exception handlers to task resources
+	apic_disable();
+	icc_defer();
 	task_switch(1);
+	apic_enable();
 
 	// Restore exception handlers
 	for(int i = 0; i < 32; i++) {
@@ -167,6 +174,12 @@ static void context_switch() {
 	}
 
 	ICC_Message* msg3 = icc_alloc(is_paused ? ICC_TYPE_PAUSED : ICC_TYPE_STOPPED);
+	if(!msg3) {
+		printf("Cannot allocate ICC message\n");
+		errno = 0;
+		return;
+	}
+
 	msg3->result = errno;
 	if(!is_paused) {
 		msg3->data.stopped.return_code = apic_user_return_code();
@@ -186,9 +199,11 @@ static void icc_start(ICC_Message* msg) {
 
 	if(errno != 0) {
 		ICC_Message* msg2 = icc_alloc(ICC_TYPE_STARTED);
-
-		msg2->result = errno;	// errno from loader_load
-		icc_send(msg2, msg->apic_id);
+		if(msg2) {
+			msg2->result = errno;	// errno from loader_load
+			msg2->time = msg->time;
+			icc_send(msg2, msg->apic_id);
+		}
 		icc_free(msg);
 		printf("Execution FAILED: %x\n", errno);
 		return;
@@ -203,6 +218,13 @@ static void icc_start(ICC_Message* msg) {
 
 	printf("Starting VM...\n");
 	ICC_Message* msg2 = icc_alloc(ICC_TYPE_STARTED);
+	if(!msg2) {
+		// Manager does not know the VM is running on the core
+		printf("Cannot allocate ICC message\n");
+		task_destroy(id);
+		icc_free(msg);
+		return;
+	}
 
 	msg2->data.started.stdin = (void*)TRANSLATE_TO_PHYSICAL((uint64_t)*(char**)task_addr(id, SYM_STDIN));
 	msg2->data.started.stdin_head = (void*)TRANSLATE_TO_PHYSICAL((uint64_t)task_addr(id, SYM_STDIN_HEAD));
@@ -219,6 +241,7 @@ static void icc_start(ICC_Message* msg) {
 	msg2->data.started.stderr_size = *(int*)task_addr(id, SYM_STDERR_SIZE);
 
 	msg2->data.started.global_heap_idx = TRANSLATE_TO_PHYSICAL((uint64_t)*(uint64_t*)task_addr(id, SYM_GMALLOC_POOL)) >> 21;
+	msg2->time = msg->time;
 
 	icc_send(msg2, msg->apic_id);
 
@@ -230,8 +253,10 @@ static void icc_start(ICC_Message* msg) {
 static void icc_resume(ICC_Message* msg) {
 	if(msg->result < 0) {
 		ICC_Message* msg2 = icc_alloc(ICC_TYPE_RESUMED);
-		msg2->result = msg->result;
-		icc_send(msg2, msg->apic_id);
+		if(msg2) {
+			msg2->result = msg->result;
+			icc_send(msg2, msg->apic_id);
+		}
 
 		icc_free(msg);
 		return;
@@ -239,6 +264,11 @@ static void icc_resume(ICC_Message* msg) {
 
 	printf("Resuming VM...\n");
 	ICC_Message* msg2 = icc_alloc(ICC_TYPE_RESUMED);
+	if(!msg2) {
+		printf("Cannot allocate ICC message\n");
+		icc_free(msg);
+		return;
+	}
 
 	icc_send(msg2, msg->apic_id);
 	icc_free(msg);
@@ -253,8 +283,10 @@ static void icc_pause(uint64_t vector, uint64_t error_code) {
 static void icc_stop(ICC_Message* msg) {
 	if(msg->result < 0) { // Not yet core is started.
 		ICC_Message* msg2 = icc_alloc(ICC_TYPE_STOPPED);
-		msg2->result = msg->result;
-		icc_send(msg2, msg->apic_id);
+		if(msg2) {
+			msg2->result = msg->result;
+			icc_send(msg2, msg->apic_id);
+		}
 
 		icc_free(msg);
 		return;
@@ -264,6 +296,21 @@ static void icc_stop(ICC_Message* msg) {
 	task_destroy(1);
 }
 
+static uint64_t idle_event;
+
+// A busy event, e.g. a NIC queue poll, is handed over to the core
+static void icc_busy(ICC_Message* msg) {
+	event_busy_add(msg->data.busy.func, msg->data.busy.context);
+
+	// Sleeping on the idle event would stall the busy event
+	if(idle_event) {
+		event_idle_remove(idle_event);
+		idle_event = 0;
+	}
+
+	icc_free(msg);
+}
+
 static void fixup_page_table(uint8_t apic_id, uint64_t offset) {
 	uint64_t base = VIRTUAL_TO_PHYSICAL(PAGE_TABLE_START) + apic_id * 0x200000 + offset;
 	PageTable* l4u = (PageTable*)(base + PAGE_TABLE_SIZE * PAGE_L4U_INDEX);
@@ -318,6 +365,7 @@ void main() {
 		gmalloc_init();
 		timer_init();
 		vnic__init_timer(TIMER_FREQUENCY_PER_SEC);
+		nic__init_cache(nic_core_id);
 
 		gdt_init();
 		tss_init();
@@ -349,6 +397,7 @@ void main() {
 
 		printf("Initializing Multi-tasking...\n");
 		task_init();
+		string_init();
 
 		printf("Initializing events...\n");
 		if(!event_init()) {
@@ -423,17 +472,19 @@ void main() {
 		apic_enable();
 
 		task_init();
+		string_init();
 		event_init();
 		icc_init();
 		icc_register(ICC_TYPE_START, icc_start);
 		icc_register(ICC_TYPE_RESUME, icc_resume);
 		icc_register(ICC_TYPE_STOP, icc_stop);
+		icc_register(ICC_TYPE_BUSY, icc_busy);
 		apic_register(49, icc_pause);
 
 		if(cpu_has_feature(CPU_FEATURE_MONITOR_MWAIT) && cpu_has_feature(CPU_FEATURE_MWAIT_INTERRUPT))
-			event_idle_add(idle_monitor_event, NULL);
+			idle_event = event_idle_add(idle_monitor_event, NULL);
 		else
-			event_idle_add(idle_hlt_event, NULL);
+			idle_event = event_idle_add(idle_hlt_event, NULL);
 	}
 
 	mp_sync(); // Barrier #3
@@ -240,6 +240,7 @@ static VNIC* manager_create_vnic(char* name) {
 		VNIC_PADDING_TAIL, 32,
 		VNIC_SLOW_RX_QUEUE_SIZE, 1024,
 		VNIC_SLOW_TX_QUEUE_SIZE, 1024,
+		VNIC_QUEUE_SPSC, true,	// Manager only runs on the manager core
 		VNIC_NONE
 	};
 
@@ -295,6 +296,8 @@ bool manager_destroy_vnic(VNIC* vnic) {
 	if(!nicdev_unregister_vnic(nic_dev, vnic->id))
 		return false;
 
+	nic_region_remove(vnic->nic);
+	nic_cache_invalidate(vnic->nic);
 	bfree(vnic->nic);
 	gfree(vnic);
 
@@ -804,6 +807,22 @@ static int cmd_nic(int argc, char** argv, void(*callback)(char* result, int exit
 				(nicdev->mac >> 16) & 0xff,
 				(nicdev->mac >> 8) & 0xff,
 				(nicdev->mac >> 0) & 0xff);
+
+		// Counters of each queue pair. VLANs share the queues of their NIC device
+		NICDriver* driver = nicdev->driver;
+		if(nicdev->root || !driver || !driver->get_status)
+			continue;
+
+		NICStatus status;
+		memset(&status, 0, sizeof(NICStatus));
+		driver->get_status(nicdev, &status);
+		for(int j = 0; j < status.queue_count; j++) {
+			NICQueueStatus* queue = &status.queues[j];
+			printf("%12s", "");
+			printf("queue%d RX packets:%lu bytes:%lu TX packets:%lu bytes:%lu dropped:%lu\n", j,
+					queue->rx_packets, queue->rx_bytes,
+					queue->tx_packets, queue->tx_bytes, queue->tx_drops);
+		}
 	}
 
 	return 0;
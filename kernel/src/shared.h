@@ -7,11 +7,18 @@
 
 #include <stdint.h>
 #include "mp.h"
-struct _FIFO;
+struct _ICC_Message;
 
+/**
+ * Inter-core messages of a core. Any core pushes to inbox and freed without
+ * locking, only the core itself takes from them.
+ */
 typedef struct {
-	struct _FIFO*		icc_queue;
-	volatile uint8_t 	icc_queue_lock;
+	struct _ICC_Message* volatile	inbox;		///< Messages sent to the core, newest first
+	struct _ICC_Message*		received;	///< Messages taken from inbox, oldest first
+	volatile uint8_t		doorbell;	///< An IPI is sent and not handled yet
+	struct _ICC_Message*		pool;		///< Free messages of the core
+	struct _ICC_Message* volatile	freed;		///< Messages of the core freed by the others
 } ICC;
 
 /**
@@ -25,9 +32,6 @@ typedef struct {
 
 	volatile uint8_t    	sync;
 
-	struct _FIFO*		icc_pool;
-	volatile uint8_t	icc_lock_alloc;
-	volatile uint8_t	icc_lock_free;
 	ICC*			icc_queues;
 
 	uint64_t		magic;
@@ -8,19 +8,7 @@
 #ifndef __MODE_32_BIT__
 #include "apic.h"
 #include "asm.h"
-
-static bool is_sse_support() {
-	uint32_t eax = 0x1;
-	uint32_t edx = 0x0;
-	asm volatile("cpuid"
-		: "=d"(edx)
-		: "a"(eax), "b"(0), "c"(0), "d"(0));
-
-	if(edx & (1 << 25)) {//SSE support
-		return true;
-	} else
-		return false;
-}
+#include "cpu.h"
 
 static bool is_sse_allow() {
 	uint64_t val = read_cr0();
@@ -46,100 +34,58 @@ void* __memcpy_chk(void* dest, const void* src, size_t size, size_t bos) {
 	return __memcpy(dest, src, size);
 }
 
-static void* memset_check(void* s, int c, size_t n);
-static void*(*memset_func)(void*, int, size_t) = memset_check;
-static void* memset_check(void* s, int c, size_t n) {
+/*
+ * The generic functions are used until string_init() picks the vector ones
+ * for the CPU, once the FPU state is switched between the tasks. AVX2 is
+ * picked only when XCR0 enables the YMM registers, which the kernel does not
+ * do while the tasks save the FPU state with fxsave.
+ */
+static void*(*memset_func)(void*, int, size_t) = __memset;
+static void*(*memcpy_func)(void*, const void*, size_t) = __memcpy;
+static void*(*memmove_func)(void*, const void*, size_t) = __memmove;
+static int(*memcmp_func)(const void*, const void*, size_t) = __memcmp;
+
+void string_init() {
 #ifndef __MODE_32_BIT__
-	if(is_sse_support()) {
-		if(is_sse_allow()) {
-			memset_func = __memset_sse;
-		} else {
-			return __memset(s, c, n);
-		}
+	if(!cpu_has_feature(CPU_FEATURE_SSE_2) || !is_sse_allow())
+		return;
+
+	memmove_func = __memmove_sse;
+
+	if(cpu_has_feature(CPU_FEATURE_AVX_2)) {
+		memset_func = __memset_avx2;
+		memcpy_func = __memcpy_avx2;
+		memcmp_func = __memcmp_avx2;
+	} else if(cpu_has_feature(CPU_FEATURE_ERMS)) {
+		memset_func = __memset_erms;
+		memcpy_func = __memcpy_erms;
+		memcmp_func = __memcmp_sse;
 	} else {
-		memset_func = __memset;
+		memset_func = __memset_sse;
+		memcpy_func = __memcpy_sse;
+		memcmp_func = __memcmp_sse;
 	}
-#else
-	memset_func = __memset;
 #endif
-	return memset_func(s, c, n);
 }
 
 void *memset(void *s, int c, size_t n) {
 	return memset_func(s, c, n);
 }
 
-static void* memcpy_check(void* dest, const void* src, size_t n);
-static void*(*memcpy_func)(void*, const void*, size_t) = memcpy_check;
-static void* memcpy_check(void* dest, const void* src, size_t n) {
-#ifndef __MODE_32_BIT__
-	if(is_sse_support()) {
-		if(is_sse_allow()) {
-			memcpy_func = __memcpy_sse;
-		} else {
-			return __memcpy(dest, src, n);
-		}
-	} else {
-		memcpy_func = __memcpy;
-	}
-#else
-	memcpy_func = __memcpy;
-#endif
-	return memcpy_func(dest, src, n);
-}
-
 void *memcpy(void *dest, const void *src, size_t n) {
 	return memcpy_func(dest, src, n);
 }
 
-static void* memmove_check(void* dest, const void* src, size_t len);
-static void*(*memmove_func)(void*, const void*, size_t) = memmove_check;
-static void* memmove_check(void* dest, const void* src, size_t len) {
-#ifndef __MODE_32_BIT__
-	if(is_sse_support()) {
-		if(is_sse_allow()) {
-			memmove_func = __memmove_sse;
-		} else {
-			return __memmove(dest, src, len);
-		}
-	} else {
-		memmove_func = __memmove;
-	}
-#else
-	memmove_func = __memmove;
-#endif
-	return memmove_func(dest, src, len);
-}
-
 void *memmove(void *dest, const void *src, size_t len) {
 	return memmove_func(dest, src, len);
 }
 
-static int memcmp_check(const void* v1, const void* v2, size_t size);
-static int(*memcmp_func)(const void*, const void*, size_t) = memcmp_check;
-static int memcmp_check(const void* v1, const void* v2, size_t size) {
-#ifndef __MODE_32_BIT__
-	if(is_sse_support()) {
-		if(is_sse_allow()) {
-			memcmp_func = __memcmp_sse;
-		} else {
-			return __memcmp(v1, v2, size);
-		}
-	} else {
-		memcmp_func = __memcmp;
-	}
-#else
-	memcmp_func = __memcmp;
-#endif
-	return memcmp_func(v1, v2, size);
-}
-
 int memcmp(const void* v1, const void* v2, size_t size) {
 	return memcmp_func(v1, v2, size);
 }
 
 void bzero(void* dest, size_t size) {
-	__bzero(dest, size);
+	memset_func(dest, 0, size);
 }
 
 size_t strlen(const char* s) {
@@ -32,6 +32,7 @@ typedef struct {
 	int			status;		// VM_STATUS_XXX
 	int			error_code;
 	int			return_code;
+	uint64_t		latency;	// START to STARTED round trip (us)
 
 	VM*			vm;
 
@@ -145,6 +146,8 @@ static void icc_started(ICC_Message* msg) {
 	Core* core = &cores[msg->apic_id];
 	VM* vm = core->vm;
 
+	core->latency = timer_us() - msg->time;
+
 	if(msg->result == 0) {
 		core->error_code = 0;
 
@@ -202,20 +205,29 @@ static void icc_started(ICC_Message* msg) {
 		for(int i = 0; i < vm->core_size; i++) {
 			if(cores[vm->cores[i]].status == VM_STATUS_START) {
 				ICC_Message* msg2 = icc_alloc(ICC_TYPE_STOP);
-				icc_send(msg2, vm->cores[i]);
+				if(msg2)
+					icc_send(msg2, vm->cores[i]);
 			}
 		}
 	}
 
 	if(error_code == 0) {
+		uint64_t min = UINT64_MAX;
+		uint64_t max = 0;
 		printf("VM started on cores[");
 		for(int i = 0; i < vm->core_size; i++) {
+			uint64_t latency = cores[vm->cores[i]].latency;
+			if(latency < min)
+				min = latency;
+			if(latency > max)
+				max = latency;
+
 			printf("%d", mp_apic_id_to_processor_id(vm->cores[i]));
 			if(i + 1 < vm->core_size) {
 				printf(", ");
 			}
 		}
-		printf("]\n");
+		printf("] round trip %lu~%lu us\n", min, max);
 	} else {
 		printf("VM started with error(s) on cores[");
 		for(int i = 0; i < vm->core_size; i++) {
@@ -262,7 +274,8 @@ static void icc_paused(ICC_Message* msg) {
 static void icc_resumed(ICC_Message* msg) {
 	if(msg->result == -1000) {	// VM is not strated yet
 		ICC_Message* msg2 = icc_alloc(ICC_TYPE_RESUME);
-		icc_send(msg2, msg->apic_id);
+		if(msg2)
+			icc_send(msg2, msg->apic_id);
 		icc_free(msg);
 		return;
 	}
@@ -297,7 +310,8 @@ static void icc_resumed(ICC_Message* msg) {
 static void icc_stopped(ICC_Message* msg) {
 	if(msg->result == -1000) {	// VM is not strated yet
 		ICC_Message* msg2 = icc_alloc(ICC_TYPE_STOP);
-		icc_send(msg2, msg->apic_id);
+		if(msg2)
+			icc_send(msg2, msg->apic_id);
 		icc_free(msg);
 		// Resend stop icc
 		return;
@@ -385,7 +399,14 @@ static bool vm_delete(VM* vm, int core) {
 			#endif
 			for(int i = 0; i < vm->nic_count; i++) {
 				if(vm->nics[i]) {
+					// The NIC device may still hold buffers of the pool
+					NICDevice* nic_dev = nicdev_get(vm->nics[i]->parent);
+					if(nic_dev)
+						nicdev_unregister_vnic(nic_dev, vm->nics[i]->id);
+
 					dispatcher_destroy_vnic(vm->nics[i]);
+					nic_region_remove(vm->nics[i]->nic);
+					nic_cache_invalidate(vm->nics[i]->nic);
 					bfree(vm->nics[i]->nic);
 					vnic_free_id(vm->nics[i]->id);
 					gfree(vm->nics[i]);
@@ -727,6 +748,10 @@ uint32_t vm_create(VMSpec* vm_spec) {
 				VNIC_TX_QUEUE_SIZE, nics[i].output_buffer_size ? : NIC_DEFAULT_BUFFER_SIZE,
 				VNIC_SLOW_RX_QUEUE_SIZE, nics[i].slow_input_buffer_size ? : NIC_DEFAULT_BUFFER_SIZE,
 				VNIC_SLOW_TX_QUEUE_SIZE, nics[i].slow_output_buffer_size ? : NIC_DEFAULT_BUFFER_SIZE,
+				// Single thread VM is the only consumer/producer of the VM side of queues
+				VNIC_QUEUE_SPSC, vm->core_size == 1,
+				VNIC_RX_SHAPER, (uint64_t)&nic_dev->rx_shaper,
+				VNIC_TX_SHAPER, (uint64_t)&nic_dev->tx_shaper,
 				VNIC_NONE
 			};
 
@@ -737,8 +762,9 @@ uint32_t vm_create(VMSpec* vm_spec) {
 			}
 
 			vnic->id = vnic_alloc_id();
-			vnic->nic_size = nics[i].pool_size ? : NIC_DEFAULT_POOL_SIZE;
-			vnic->nic = bmalloc(((nics[i].pool_size ? : NIC_DEFAULT_POOL_SIZE) + 0x200000 - 1) / 0x200000);
+			// pool_size may carry layout flags such as VNIC_POOL_CLASS
+			vnic->nic_size = (nics[i].pool_size ? : NIC_DEFAULT_POOL_SIZE) & ~VNIC_POOL_CLASS;
+			vnic->nic = bmalloc((vnic->nic_size + 0x200000 - 1) / 0x200000);
 			if(!vnic->nic) {
 				printf("Manager: Failed to allocate NIC in VNIC\n");
 				goto fail;
@@ -776,6 +802,10 @@ uint32_t vm_create(VMSpec* vm_spec) {
 			if(!map_put(vms, (void*)(uint64_t)vmid, vm)) {
 				goto fail;
 			}
+
+			// NICs of a VM are all mapped to it, so they can share received packets
+			for(int i = 0; i < vm->nic_count; i++)
+				vm->nics[i]->group = vmid;
 			break;
 		}
 	}
@@ -945,6 +975,11 @@ void vm_status_set(uint32_t vmid, int status, VM_STATUS_CALLBACK callback, void*
 		} else {
 			cores[vm->cores[i]].error_code = 0;
 			ICC_Message* msg = icc_alloc(icc_type);
+			if(!msg) {
+				printf("Cannot allocate ICC message for core[%d]\n", mp_apic_id_to_processor_id(vm->cores[i]));
+				continue;
+			}
+
 			if(status == VM_STATUS_START) {
 				msg->data.start.vm = vm;
 			}
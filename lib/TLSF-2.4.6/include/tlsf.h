@@ -30,6 +30,8 @@ extern void destroy_memory_pool(void *);
 extern size_t add_new_area(void *, size_t, void *);
 extern void *malloc_ex(size_t, void *);
 extern void free_ex(void *, void *);
+extern size_t malloc_batch_ex(size_t, void **, size_t, void *);
+extern void free_batch_ex(void **, size_t, void *);
 extern void *realloc_ex(void *, size_t, void *);
 extern void *calloc_ex(size_t, size_t, void *);
 
@@ -812,6 +812,24 @@ void *malloc_ex(size_t size, void *mem_pool) {
     return ptr;
 }
 
+size_t malloc_batch_ex(size_t size, void **ptrs, size_t count, void *mem_pool) {
+    size_t i;
+
+    if(((tlsf_t*)mem_pool)->use_lock)
+        TLSF_ACQUIRE_LOCK(&((tlsf_t *)mem_pool)->lock);
+
+    for (i = 0; i < count; i++) {
+        ptrs[i] = _malloc_ex(size, mem_pool);
+        if (!ptrs[i])
+            break;
+    }
+
+    if(((tlsf_t*)mem_pool)->use_lock)
+        TLSF_RELEASE_LOCK(&((tlsf_t *)mem_pool)->lock);
+
+    return i;
+}
+
 /******************************************************************/
 static void _free_ex(void *ptr, void *mem_pool)
 {
@@ -861,6 +879,19 @@ void free_ex(void *ptr, void *mem_pool) {
         TLSF_RELEASE_LOCK(&((tlsf_t *)mem_pool)->lock);
 }
 
+void free_batch_ex(void **ptrs, size_t count, void *mem_pool) {
+    size_t i;
+
+    if(((tlsf_t*)mem_pool)->use_lock)
+        TLSF_ACQUIRE_LOCK(&((tlsf_t *)mem_pool)->lock);
+
+    for (i = 0; i < count; i++)
+        _free_ex(ptrs[i], mem_pool);
+
+    if(((tlsf_t*)mem_pool)->use_lock)
+        TLSF_RELEASE_LOCK(&((tlsf_t *)mem_pool)->lock);
+}
+
 /******************************************************************/
 static void *_realloc_ex(void *ptr, size_t new_size, void *mem_pool)
 {
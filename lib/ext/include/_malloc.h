@@ -7,6 +7,8 @@
 void __malloc_init(void* start, size_t size);
 void* __malloc(size_t size, void* mem_pool);
 void __free(void *ptr, void* mem_pool);
+size_t __malloc_batch(size_t size, void** ptrs, size_t count, void* mem_pool);
+void __free_batch(void** ptrs, size_t count, void* mem_pool);
 void* __realloc(void *ptr, size_t new_size, void* mem_pool);
 void* __calloc(size_t nelem, size_t elem_size, void* mem_pool);
 
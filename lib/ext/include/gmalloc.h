@@ -6,6 +6,11 @@
 /**
  * @file
  * Memory allocation from global memory area
+ *
+ * The global memory area is shared by the threads of a VM. Small chunks are
+ * cached per thread, so the threads allocate and free them at the same time
+ * without taking the lock of the area on every call. A chunk may be freed by
+ * any thread.
  */
  
 /**
@@ -44,4 +49,10 @@ void *gcalloc(size_t nmemb, size_t size);
  */
 void *grealloc(void *ptr, size_t size);
 
+/**
+ * Return the memory chunks cached by the calling thread to global area, e.g.
+ * before the thread stops allocating.
+ */
+void gmalloc_flush();
+
 #endif /* __GMALLOC_H__ */
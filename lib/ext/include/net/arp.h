@@ -27,31 +27,119 @@ typedef struct _ARP {
 	uint32_t tpa;			///< Target protocol address (endian32)
 } __attribute__ ((packed)) ARP;
 
-extern uint64_t ARP_TIMEOUT;		///< ARP timeout of ARP table
+#define ARP_TIMEOUT		((uint64_t)14400 * 1000000)	///< Lifetime of a learned entity (us), 4 hours
+#define ARP_RESOLVE_TIMEOUT	((uint64_t)3 * 1000000)		///< Lifetime of an unresolved entity and its packets (us)
+#define ARP_REQUEST_INTERVAL	((uint64_t)1000000)		///< Minimum interval of requests for an address (us)
+#define ARP_GC_INTERVAL		((uint64_t)1000000)		///< Aging timer period (us)
+#define ARP_GC_BUDGET		4096				///< Slots aged per timer event
+#define ARP_TABLE_SIZE		64				///< Initial slots of a table, a power of two
+#define ARP_PENDING_COUNT	64				///< Packets held per table while resolving
 
-typedef struct _ARPEntity {
-	uint64_t	mac;
-	uint32_t	addr;
-	uint64_t	timeout;
+#define ARP_STATE_EMPTY		0	///< Slot was never used
+#define ARP_STATE_DELETED	1	///< Slot was used, lookups go on probing
+#define ARP_STATE_RESOLVING	2	///< Request is sent, no reply yet
+#define ARP_STATE_DYNAMIC	3	///< Learned from the network, ages out
+#define ARP_STATE_STATIC	4	///< Set by the user, never ages out
 
-	bool		dynamic;
+typedef struct _ARPEntity {
+	uint64_t	mac;		///< MAC address, 0xffffffffffff while resolving
+	uint64_t	timeout;	///< Expiry time (us), time to request again while resolving
+	uint32_t	addr;		///< IPv4 address
+	uint8_t		state;		///< ARP_STATE_*
 } ARPEntity;
 
-#define ARP_ENTITY_MAX_COUNT	16
+typedef struct _ARPPending {
+	Packet*		packet;		///< Packet waiting for the MAC address, NULL if the slot is free
+	uint32_t	addr;		///< IPv4 address to resolve
+	uint64_t	timeout;	///< The packet is dropped after this time (us)
+} ARPPending;
+
+/**
+ * ARP table of a NIC. The header lives in the NIC config area and is shared
+ * by the threads using the NIC, the entities are in the global memory. Slots
+ * are found by open addressing with linear probing on the IPv4 address.
+ */
 typedef struct ARPTable {
-	uint64_t	timeout;
-	uint16_t	entity_count;
-	ARPEntity 	entity[ARP_ENTITY_MAX_COUNT];
+	volatile uint8_t	lock;
+	uint32_t	capacity;	///< Number of slots, a power of two
+	uint32_t	count;		///< Slots in use
+	uint32_t	deleted;	///< Slots deleted
+	ARPEntity*	entities;	///< Slots
+	uint32_t	gc_index;	///< Next slot to age
+	uint64_t	gc_event;	///< Aging timer
+	int		gc_thread;	///< Thread of the aging timer
+	uint16_t	pending_count;	///< Packets held
+	ARPPending	pending[ARP_PENDING_COUNT];
 } ARPTable;
 
 /**
- * Get ARP Table
+ * Get ARP Table. It is created with an aging timer of the calling thread on
+ * the first call.
  *
  * @param NIC
- * @return ARP Table
+ * @return ARP Table, NULL if there is no memory
  */
 ARPTable* arp_get_table(NIC* nic);
 
+/**
+ * Destroy ARP table of the NIC, dropping the packets it holds. It may be
+ * called from any thread, the aging timer ends on its own thread.
+ *
+ * @param nic NIC
+ * @return true if there was a table
+ */
+bool arp_table_destroy(NIC* nic);
+
+/**
+ * Add or update an entity. A dynamic entity does not replace a static one.
+ *
+ * @param table ARP table
+ * @param mac MAC address
+ * @param addr IPv4 address
+ * @param dynamic true if learned from the network
+ * @return true if the entity is set
+ */
+bool arp_table_update(ARPTable* table, uint64_t mac, uint32_t addr, bool dynamic);
+
+/**
+ * Find an entity by IPv4 address.
+ *
+ * @param table ARP table
+ * @param addr IPv4 address
+ * @param entity copy of the entity
+ * @return true if there is the entity
+ */
+bool arp_table_get_by_addr(ARPTable* table, uint32_t addr, ARPEntity* entity);
+
+/**
+ * Find an entity by MAC address. It scans the whole table.
+ *
+ * @param table ARP table
+ * @param mac MAC address
+ * @param entity copy of the entity
+ * @return true if there is the entity
+ */
+bool arp_table_get_by_mac(ARPTable* table, uint64_t mac, ARPEntity* entity);
+
+/**
+ * Remove an entity.
+ *
+ * @param table ARP table
+ * @param addr IPv4 address
+ * @return true if there was the entity
+ */
+bool arp_table_remove(ARPTable* table, uint32_t addr);
+
+/**
+ * Remove expired entities and drop expired packets. The aging timer calls it
+ * with ARP_GC_BUDGET.
+ *
+ * @param table ARP table
+ * @param current current time (us)
+ * @param budget number of slots to check
+ */
+void arp_table_age(ARPTable* table, uint64_t current, uint32_t budget);
+
 #define ARP_PROCESS()
 /**
  * Process ARP packet.
@@ -91,7 +179,8 @@ bool arp_announce(NIC* nic, uint32_t ip);
  * Get MAC address associated with IP address from local ARP table.
  * It will return MAC address if there is an entity in ARP table,
  * it will return 0xffffffffffff if there is no entity in ARP table.
- * If there is no entity, ARP request is will be sent.
+ * If there is no entity, ARP request is will be sent, at most once per
+ * ARP_REQUEST_INTERVAL.
  *
  * @param nic NIC reference which manages ARP table
  * @param destination IP address
@@ -100,6 +189,19 @@ bool arp_announce(NIC* nic, uint32_t ip);
  */
 uint64_t arp_get_mac(NIC* nic, uint32_t destination, uint32_t source);
 
+/**
+ * Transmit an Ethernet frame to an IP address of the LAN. The destination MAC
+ * address is filled from the ARP table. If it is not known, the packet is
+ * held until the ARP reply arrives or ARP_RESOLVE_TIMEOUT passes.
+ *
+ * @param nic NIC to transmit the packet
+ * @param packet Ethernet frame, everything but the destination MAC is set
+ * @param destination IP address of the next hop
+ * @param source IP address of interface
+ * @return true if the packet is transmitted or held, it is freed otherwise
+ */
+bool arp_send(NIC* nic, Packet* packet, uint32_t destination, uint32_t source);
+
 /**
  * Get IP address associated with MAC address from local ARP table.
  * 
@@ -5,7 +5,7 @@
 
 /**
  * @file
- * IPv4 checksum
+ * Internet checksum (RFC 1071) and its incremental update (RFC 1624)
  */
 
 /**
@@ -17,4 +17,41 @@
  */
 uint16_t checksum(void* data, uint32_t size);
 
+/**
+ * Add data to a ones' complement sum, to checksum data split over several
+ * buffers. Every buffer but the last one must be of even size.
+ *
+ * @param data data
+ * @param size data size
+ * @param sum sum of the previous buffers, 0 for the first one
+ * @return sum, to be passed to checksum_partial() or checksum_finish()
+ */
+uint32_t checksum_partial(void* data, uint32_t size, uint32_t sum);
+
+/**
+ * Get checksum of a sum made by checksum_partial().
+ *
+ * @param sum sum of the data
+ * @return checksum, same as checksum() of the data
+ */
+uint16_t checksum_finish(uint32_t sum);
+
+/**
+ * Update a checksum for a 16-bit field changed, without summing the data
+ * again. Values are taken in the byte order of the packet.
+ *
+ * @param checksum checksum field of the packet
+ * @param old previous value of the field
+ * @param new new value of the field
+ * @return checksum field for the new value
+ */
+uint16_t checksum_adjust16(uint16_t checksum, uint16_t old, uint16_t new);
+
+/**
+ * Update a checksum for a 32-bit field changed.
+ *
+ * @see checksum_adjust16
+ */
+uint16_t checksum_adjust32(uint16_t checksum, uint32_t old, uint32_t new);
+
 #endif /* __NET_CHECKSUM_H__ */
@@ -43,6 +43,26 @@ typedef struct _IP {
 	uint8_t		body[0];	///< IP body payload
 } __attribute__ ((packed)) IP;
 
+/**
+ * Get the IPv4 header of the packet.
+ * The packet metadata is used if there is one, otherwise the packet is
+ * parsed as an untagged Ethernet frame.
+ *
+ * @param packet packet reference
+ *
+ * @return IPv4 header
+ */
+IP* ip_header(Packet* packet);
+
+/**
+ * Get the header after the IPv4 header (TCP, UDP, ...) of the packet.
+ *
+ * @param packet packet reference
+ *
+ * @return transport header
+ */
+void* ip_body(Packet* packet);
+
 /**
  * Set IP length, TTL, checksum, and Packet->end index
  *
@@ -2,10 +2,77 @@
 #define __NET_PORT_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <nic.h>
 
-uint8_t* port_map_get(NIC* nic, char* key_name);
-uint16_t port_alloc(uint8_t* port_table, uint16_t port);
-bool port_free(uint8_t* port_table, uint16_t port);
+/**
+ * @file
+ * L4 port allocator.
+ *
+ * Ports are kept in a bitmap of 64-bit words in the NIC config area, so every
+ * thread of the VM sees the same ports. The ephemeral range is split into a
+ * shard per thread and port_alloc() only searches the shard of the calling
+ * thread, so threads do not contend on the same words. Words with no free
+ * port are marked in a summary bitmap, which makes a search a few bit scans
+ * regardless of how many ports are used.
+ */
+
+#define PORT_EPHEMERAL_START	1024	///< First port allocated by port_alloc()
+#define PORT_EPHEMERAL_END	49152	///< Port after the last one allocated by port_alloc()
+#define PORT_WORD_COUNT		(65536 / 64)
+#define PORT_SHARD_COUNT	64	///< Threads beyond this count share the shards
+
+/*
+ * The config area only aligns entries to 4 bytes, so a shard may straddle two
+ * cache lines. Cursors are still a line apart and never share one.
+ */
+typedef struct _PortShard {
+	uint16_t	cursor;		///< Word the next search starts from
+	uint8_t		padding[62];	///< Owned by a thread, keeps cursors off the same line
+} PortShard;
+
+typedef struct _PortMap {
+	uint64_t	ports[PORT_WORD_COUNT];		///< Set bit means the port is used
+	uint64_t	full[PORT_WORD_COUNT / 64];	///< Set bit means the word of ports may be full
+	PortShard	shards[PORT_SHARD_COUNT];
+} PortMap;
+
+/**
+ * Get the port map of the name in the NIC config area.
+ *
+ * @param nic NIC
+ * @param key_name config key name
+ * @return port map or NULL if the config area is full
+ */
+PortMap* port_map_get(NIC* nic, char* key_name);
+
+/**
+ * Allocate a port. Any thread may allocate any port by number.
+ *
+ * @param port_map port map
+ * @param port port number to allocate, or 0 for an ephemeral port of the calling thread
+ * @return port number or 0 if the port is used or no port is left
+ */
+uint16_t port_alloc(PortMap* port_map, uint16_t port);
+
+/**
+ * Free a port. Any thread may free any port.
+ *
+ * @param port_map port map
+ * @param port port number to free
+ * @return true if the port was used
+ */
+bool port_free(PortMap* port_map, uint16_t port);
+
+/**
+ * Free ports, updating ports in the same word at once. Sorted ports free
+ * faster.
+ *
+ * @param port_map port map
+ * @param ports port numbers to free
+ * @param count number of ports
+ * @return number of ports which were used
+ */
+uint32_t port_free_batch(PortMap* port_map, uint16_t* ports, uint32_t count);
 
 #endif /*__NET_PORT_H__*/
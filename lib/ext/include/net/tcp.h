@@ -51,21 +51,30 @@ typedef struct _TCP_Pseudo {
  * Allocate TCP port number which associated with NI.
  *
  * @param nic NIC reference
- * @param port
- * @return true if port alloc success
+ * @param port port number to allocate, or 0 for an ephemeral port of the calling thread
+ * @return port number or 0 if port alloc fails
  */
-bool tcp_port_alloc(NIC* nic, uint16_t port);
+uint16_t tcp_port_alloc(NIC* nic, uint16_t port);
 
 /**
  * Free TCP port number.
  *
  * @param nic NIC reference
- * @param addr
  * @param port port number to free
- * @raeturn true if port free success
+ * @return true if port free success
  */
 bool tcp_port_free(NIC* nic, uint16_t port);
 
+/**
+ * Free TCP port numbers at once, e.g. of the sessions expired together.
+ *
+ * @param nic NIC reference
+ * @param ports port numbers to free
+ * @param count number of ports
+ * @return number of ports freed
+ */
+uint32_t tcp_port_free_batch(NIC* nic, uint16_t* ports, uint32_t count);
+
 /**
  * Set TCP checksum, and do IP packing.
  *
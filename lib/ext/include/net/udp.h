@@ -27,10 +27,10 @@ typedef struct _UDP {
  * Allocate UDP port number which associated with NI.
  *
  * @param nic NIC reference
- * @param port
- * @return port number
+ * @param port port number to allocate, or 0 for an ephemeral port of the calling thread
+ * @return port number or 0 if port alloc fails
  */
-bool udp_port_alloc(NIC* nic, uint16_t port);
+uint16_t udp_port_alloc(NIC* nic, uint16_t port);
 
 /**
  * Free UDP port number.
@@ -41,6 +41,16 @@ bool udp_port_alloc(NIC* nic, uint16_t port);
  */
 bool udp_port_free(NIC* nic, uint16_t port);
 
+/**
+ * Free UDP port numbers at once.
+ *
+ * @param nic NIC reference
+ * @param ports port numbers to free
+ * @param count number of ports
+ * @return number of ports freed
+ */
+uint32_t udp_port_free_batch(NIC* nic, uint16_t* ports, uint32_t count);
+
 /**
  * Set UDP length, checksum, and do IP packing.
  *
@@ -1,32 +1,96 @@
 #ifndef __UTIL_CACHE_H__
 #define __UTIL_CACHE_H__
 
-#include <util/list.h>
 #include <util/map.h>
 
+/**
+ * @file
+ * LRU cache. The entries are linked from the least recently used one, and
+ * the map refers to the entries, so hits, sets and evictions take constant
+ * time whatever the capacity.
+ */
+
+/**
+ * Cache entry (internal use only)
+ */
+typedef struct _CacheEntry {
+	struct _CacheEntry*	prev;	///< More recently used entry
+	struct _CacheEntry*	next;	///< Less recently used entry
+	void*			key;	///< Key
+	void*			data;	///< Value
+	size_t			size;	///< Bytes counted for the data
+} CacheEntry;
+
 typedef struct {
-	Map*	map;
-	List*	list;
-	size_t 	capacity;
-	void	(*uncache)(void*);
-	void*	pool;
+	Map*		map;		///< Key to CacheEntry (internal use only)
+	CacheEntry*	head;		///< Least recently used entry (internal use only)
+	CacheEntry*	tail;		///< Most recently used entry (internal use only)
+	size_t		size;		///< Number of entries
+	size_t		bytes;		///< Bytes of the entries
+	size_t 		capacity;	///< Maximum number of entries
+	size_t		bytes_capacity;	///< Maximum bytes of the entries, 0 if unlimited
+	void		(*uncache)(void*);
+	void*		pool;
 } Cache;
 
+/**
+ * Create a cache limited by the number of entries.
+ *
+ * @param capacity maximum number of entries
+ * @param uncache called with the data which is evicted or removed, may be NULL
+ * @param pool memory pool to use, if NULL local memory area will be used
+ * @return cache or NULL
+ */
 Cache* cache_create(size_t capacity, void(*uncache)(void*), void* pool);
+
+/**
+ * Create a cache limited by the number of entries and by their bytes.
+ *
+ * @param capacity maximum number of entries
+ * @param bytes maximum bytes of the entries set by cache_set_sized(), 0 if unlimited
+ * @param uncache called with the data which is evicted or removed, may be NULL
+ * @param pool memory pool to use, if NULL local memory area will be used
+ * @return cache or NULL
+ */
+Cache* cache_create_sized(size_t capacity, size_t bytes, void(*uncache)(void*), void* pool);
+
 void cache_destroy(Cache* cache);
+
+/**
+ * Get the data of the key and make it the most recently used.
+ *
+ * @return data or NULL if the key is not cached
+ */
 void* cache_get(Cache* cache, void* key);
+
+/**
+ * Cache the data, evicting the least recently used entries to make room.
+ *
+ * @return true if the data is cached, false if the key is cached already
+ */
 bool cache_set(Cache* cache, void* key, void* data);
+
+/**
+ * Cache the data counted as size bytes.
+ *
+ * @return true if the data is cached, false if the key is cached already or
+ *	the size is over the bytes capacity
+ */
+bool cache_set_sized(Cache* cache, void* key, void* data, size_t size);
+
 void* cache_remove(Cache* cache, void* key);
 void cache_clear(Cache* cache);
 
 typedef struct _CacheIterator {
 	Cache* cache;
-	ListNode* node;
+	CacheEntry* node;
 } CacheIterator;
 
+/**
+ * Iterate the data from the least recently used one.
+ */
 void cache_iterator_init(CacheIterator* iter, Cache* cache);
 bool cache_iterator_has_next(CacheIterator* iter);
 void* cache_iterator_next(CacheIterator* iter);
 
 #endif /* __UTIL_CACHE_H__ */
-
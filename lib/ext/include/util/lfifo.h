@@ -0,0 +1,152 @@
+#ifndef __UTIL_LFIFO_H__
+#define __UTIL_LFIFO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file
+ * Bounded lock-free First In First Out data structure.
+ *
+ * Unlike FIFO, it may be pushed and popped by many cores at the same time
+ * without a lock. The producers and the consumers each reserve a range of
+ * slots by moving a head index, fill or drain it, and then publish it by
+ * moving a tail index in the order of the reservations. A single producer or
+ * consumer skips the compare and swap and the wait. A producer or consumer
+ * which is preempted while it holds a reservation delays the others of its
+ * kind until it runs again, which never happens on the cores of PacketNgin.
+ */
+
+#define LFIFO_SP	0x1	///< Single producer
+#define LFIFO_SC	0x2	///< Single consumer
+
+#define LFIFO_SPSC	(LFIFO_SP | LFIFO_SC)	///< One core pushes, one core pops
+#define LFIFO_MPSC	LFIFO_SC		///< Any core pushes, one core pops
+#define LFIFO_MPMC	0			///< Any core pushes and pops
+
+/**
+ * Head and tail of the producers or the consumers (internal use only)
+ */
+typedef struct _LFIFOIndex {
+	volatile uint32_t	head;	///< Next slot to reserve
+	volatile uint32_t	tail;	///< Slots before it are published
+} __attribute__((__aligned__(64))) LFIFOIndex;
+
+/**
+ * Lock-free FIFO data structure
+ */
+typedef struct _LFIFO {
+	uint32_t	size;		///< Number of slots, power of two (internal use only)
+	uint32_t	mask;		///< size - 1 (internal use only)
+	uint32_t	flags;		///< LFIFO_SP, LFIFO_SC (internal use only)
+	void*		pool;		///< Memory pool (internal use only)
+
+	LFIFOIndex	producer;	///< Indices of the pushes (internal use only)
+	LFIFOIndex	consumer;	///< Indices of the pops (internal use only)
+
+	void*		array[0] __attribute__((__aligned__(64)));	///< Slots (internal use only)
+} LFIFO;
+
+/**
+ * Bytes of a lock-free FIFO of the size, for lfifo_init().
+ */
+#define LFIFO_MEMSIZE(size)	(sizeof(LFIFO) + (size) * sizeof(void*))
+
+/**
+ * Create a lock-free FIFO.
+ *
+ * @param size number of elements, power of two
+ * @param flags LFIFO_SPSC, LFIFO_MPSC or LFIFO_MPMC
+ * @param pool memory pool, if NULL local memory area will be used
+ * @return lock-free FIFO or NULL if the size is not a power of two or memory is full
+ */
+LFIFO* lfifo_create(size_t size, uint32_t flags, void* pool);
+
+/**
+ * Destroy the lock-free FIFO which is created using lfifo_create function.
+ *
+ * @param fifo lock-free FIFO
+ */
+void lfifo_destroy(LFIFO* fifo);
+
+/**
+ * Initialize the lock-free FIFO in memory which is not allocated by
+ * lfifo_create function, e.g. shared between the cores.
+ *
+ * @param fifo memory of LFIFO_MEMSIZE(size) bytes aligned to 64 bytes
+ * @param size number of elements, power of two
+ * @param flags LFIFO_SPSC, LFIFO_MPSC or LFIFO_MPMC
+ * @return false if the size is not a power of two
+ */
+bool lfifo_init(LFIFO* fifo, size_t size, uint32_t flags);
+
+/**
+ * Push elements, as many as there is space for.
+ *
+ * @param fifo lock-free FIFO
+ * @param array elements to push
+ * @param count number of elements
+ * @return number of elements pushed
+ */
+size_t lfifo_push_bulk(LFIFO* fifo, void** array, size_t count);
+
+/**
+ * Pop elements, as many as there are.
+ *
+ * @param fifo lock-free FIFO
+ * @param array array to pop the elements to
+ * @param count maximum number of elements
+ * @return number of elements popped
+ */
+size_t lfifo_pop_bulk(LFIFO* fifo, void** array, size_t count);
+
+/**
+ * Push an element.
+ *
+ * @param fifo lock-free FIFO
+ * @param data an element to push
+ * @return true if the element is pushed
+ */
+static inline bool lfifo_push(LFIFO* fifo, void* data) {
+	return lfifo_push_bulk(fifo, &data, 1) == 1;
+}
+
+/**
+ * Pop an element.
+ *
+ * @param fifo lock-free FIFO
+ * @return popped element or NULL if there is no element
+ */
+static inline void* lfifo_pop(LFIFO* fifo) {
+	void* data;
+
+	return lfifo_pop_bulk(fifo, &data, 1) ? data : NULL;
+}
+
+/**
+ * Get the number of elements. It may be out of date when it returns if the
+ * other cores push or pop.
+ *
+ * @param fifo lock-free FIFO
+ * @return number of elements
+ */
+size_t lfifo_size(LFIFO* fifo);
+
+/**
+ * Get the capacity, which is the size given.
+ *
+ * @param fifo lock-free FIFO
+ * @return capacity
+ */
+size_t lfifo_capacity(LFIFO* fifo);
+
+/**
+ * Check lock-free FIFO is empty or not.
+ *
+ * @param fifo lock-free FIFO
+ * @return true if there is no element
+ */
+bool lfifo_empty(LFIFO* fifo);
+
+#endif /* __UTIL_LFIFO_H__ */
@@ -17,11 +17,21 @@ typedef struct _MapEntry {
 	void*	data;			///< Value
 } MapEntry;
 
+/**
+ * Hash map slot (internal use only)
+ */
+typedef struct _MapSlot {
+	uint32_t	hash;		///< Mixed hash of the key
+	uint32_t	index;		///< Index of the entry plus one, 0 if the slot is empty
+} MapSlot;
+
 /**
  * Hash Map data structure
  */
 typedef struct _Map {
-	List**		table;		///< Map table (internal use only)
+	MapSlot*	table;		///< Map table (internal use only)
+	MapEntry*	entries;	///< Entries packed in an array (internal use only)
+	size_t		entries_capacity; ///< Capacity of entries (internal use only)
 	size_t		threshold;	///< Threshold to extend the table (internal use only)
 	size_t		capacity;	///< Current capacity (internal use only)
 	size_t		size;		///< Number of elements (internal use only)
@@ -134,9 +144,8 @@ size_t map_size(Map* map);
  */
 typedef struct _MapIterator {
 	Map*		map;		///< HashMap (internal use only)
-	size_t		index;		///< Current index of table (internal use only)
-	size_t		list_index;	///< Current index of list (internal use only)
-	MapEntry	entry;		///< Temporary MapEntry
+	size_t		index;		///< Index of the next entry (internal use only)
+	MapEntry	entry;		///< Copy of the removed MapEntry
 } MapIterator;
 
 /**
@@ -156,7 +165,8 @@ void map_iterator_init(MapIterator* iter, Map* map);
 bool map_iterator_has_next(MapIterator* iter);
 
 /**
- * Get next element from iterator.
+ * Get next element from iterator. The element is in the HashMap, so its data
+ * can be updated in place until the HashMap is changed.
  *
  * @param iter iterator
  * @return next element (MapEntry)
@@ -165,6 +175,7 @@ MapEntry* map_iterator_next(MapIterator* iter);
 
 /**
  * Remove the element from the HashMap which is recetly iterated using map_iterator_next function.
+ * The other elements are still iterated once.
  *
  * @param iter iterator
  * @return removed element (MapEntry)
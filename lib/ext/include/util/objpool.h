@@ -0,0 +1,121 @@
+#ifndef __UTIL_OBJPOOL_H__
+#define __UTIL_OBJPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file
+ * Pool of fixed-size objects.
+ *
+ * Objects are cut from slabs of a fixed number of objects, one at a time as
+ * they are first needed, and put objects are kept in a free list, so getting
+ * and putting an object is constant time however many objects are live. A new
+ * slab is allocated when every object is in use. Slabs are freed only when
+ * the pool is destroyed.
+ *
+ * A pool created with OBJECT_POOL_CACHED may be used by every thread of the
+ * VM when it is created in the global memory area. Each thread then gets and
+ * puts objects in its own cache, and moves them to and from the pool in
+ * batches under the lock of the pool.
+ */
+
+#define OBJECT_POOL_CACHED	0x1	///< Cache objects per thread, any thread may get and put
+#define OBJECT_POOL_CACHE_COUNT	64	///< Threads beyond this count use the lock on every call
+#define OBJECT_POOL_BATCH	32	///< Objects moved between a cache and the pool at once
+
+/**
+ * Objects cached by a thread (internal use only)
+ */
+typedef struct _ObjectPoolCache {
+	void*		list;	///< Cached objects
+	uint32_t	count;	///< Number of cached objects
+	uint64_t	gets;	///< Objects got by the thread
+	uint64_t	puts;	///< Objects put by the thread
+} __attribute__((__aligned__(64))) ObjectPoolCache;
+
+/**
+ * Object pool data structure
+ */
+typedef struct _ObjectPool {
+	size_t		size;		///< Object size (internal use only)
+	size_t		count;		///< Objects per slab (internal use only)
+	uint32_t	flags;		///< OBJECT_POOL_CACHED (internal use only)
+	void*		pool;		///< Memory pool (internal use only)
+
+	volatile uint8_t	lock;	///< Lock of the slabs and the free list (internal use only)
+	void*		slabs;		///< Allocated slabs (internal use only)
+	uint8_t*	next;		///< Next object of the newest slab not cut yet (internal use only)
+	uint8_t*	end;		///< End of the newest slab (internal use only)
+	void*		free;		///< Objects put back to the pool (internal use only)
+	size_t		slab_count;	///< Number of slabs (internal use only)
+	uint64_t	gets;		///< Objects got without a cache (internal use only)
+	uint64_t	puts;		///< Objects put without a cache (internal use only)
+
+	ObjectPoolCache*	caches;	///< Caches of the threads, NULL if not cached (internal use only)
+} ObjectPool;
+
+/**
+ * Usage counters of an object pool
+ */
+typedef struct _ObjectPoolStats {
+	size_t		total;		///< Objects in the slabs
+	size_t		used;		///< Objects got and not put yet
+	size_t		slabs;		///< Number of slabs
+	uint64_t	gets;		///< Objects got
+	uint64_t	puts;		///< Objects put
+} ObjectPoolStats;
+
+/**
+ * Create an object pool. The first slab is allocated at once.
+ *
+ * @param size object size
+ * @param count number of objects per slab
+ * @param flags OBJECT_POOL_CACHED or 0
+ * @param pool memory pool, if NULL local memory area will be used
+ * @return object pool or NULL if memory is full
+ */
+ObjectPool* object_pool_create(size_t size, size_t count, uint32_t flags, void* pool);
+
+/**
+ * Destroy the object pool and every slab of it, including the objects which
+ * are not put back.
+ *
+ * @param object_pool object pool
+ */
+void object_pool_destroy(ObjectPool* object_pool);
+
+/**
+ * Get an object. Its content is not initialized.
+ *
+ * @param object_pool object pool
+ * @return object or NULL if memory is full
+ */
+void* object_pool_get(ObjectPool* object_pool);
+
+/**
+ * Put an object back to the object pool it was got from.
+ *
+ * @param object_pool object pool
+ * @param object object
+ */
+void object_pool_put(ObjectPool* object_pool, void* object);
+
+/**
+ * Return the objects cached by the calling thread to the object pool.
+ *
+ * @param object_pool object pool
+ */
+void object_pool_flush(ObjectPool* object_pool);
+
+/**
+ * Get the usage counters. They may be out of date when it returns if the
+ * other threads get or put objects.
+ *
+ * @param object_pool object pool
+ * @param stats usage counters to fill
+ */
+void object_pool_stats(ObjectPool* object_pool, ObjectPoolStats* stats);
+
+#endif /* __UTIL_OBJPOOL_H__ */
@@ -7,7 +7,7 @@ project 'ext'
 
     filter { 'configurations:linux' }
         defines     { 'LINUX' }
-        removefiles { 'src/malloc.c' }
+        removefiles { 'src/malloc.c', 'src/string.c' }
     filter {}
 
     postbuildcommands { '{COPY} -L include/* ../include' }
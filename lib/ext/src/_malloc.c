@@ -23,6 +23,20 @@ void __free(void *ptr, void* mem_pool) {
 		free_ex(ptr, mem_pool);
 }
 
+size_t __malloc_batch(size_t size, void** ptrs, size_t count, void* mem_pool) {
+	if(!mem_pool)
+		return malloc_batch_ex(size, ptrs, count, __malloc_pool);
+	else
+		return malloc_batch_ex(size, ptrs, count, mem_pool);
+}
+
+void __free_batch(void** ptrs, size_t count, void* mem_pool) {
+	if(!mem_pool)
+		free_batch_ex(ptrs, count, __malloc_pool);
+	else
+		free_batch_ex(ptrs, count, mem_pool);
+}
+
 void* __realloc(void *ptr, size_t new_size, void* mem_pool) {
 	if(!mem_pool)
 		return realloc_ex(ptr, new_size, __malloc_pool);
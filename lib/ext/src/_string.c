@@ -4,8 +4,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 
-#include <xmmintrin.h>
-#include <smmintrin.h>
+#include <immintrin.h>
 
 void *__memset(void *s, int c, size_t n) {
 	uint64_t c8;
@@ -28,191 +27,385 @@ void *__memset(void *s, int c, size_t n) {
 	return s;
 }
 
-void *__memset_sse(void *dst, int value, size_t len) {
-	uint8_t* a = dst;
+/*
+ * Vector primitives. Copies and fills of up to a block are done with a few
+ * moves overlapping in the middle instead of byte loops, so short packets
+ * take no branch per byte and the alignment of the buffers does not matter.
+ * Longer ones align the stores and move a block per iteration, and the last
+ * block is moved ending at the end, overlapping the previous one.
+ */
 
-	int aligned_a = 0;
-	int i = 0;
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u64;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u32;
+typedef uint16_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u16;
+
+#define ERMS_THRESHOLD	1024	// rep movsb and stosb start faster than vector loops from here
+
+// Copies up to 16 bytes
+static inline void copy16(uint8_t* d, const uint8_t* s, size_t len) {
+	if(len >= 8) {
+		uint64_t head = *(unaligned_u64*)s;
+		uint64_t tail = *(unaligned_u64*)(s + len - 8);
+		*(unaligned_u64*)d = head;
+		*(unaligned_u64*)(d + len - 8) = tail;
+	} else if(len >= 4) {
+		uint32_t head = *(unaligned_u32*)s;
+		uint32_t tail = *(unaligned_u32*)(s + len - 4);
+		*(unaligned_u32*)d = head;
+		*(unaligned_u32*)(d + len - 4) = tail;
+	} else if(len) {
+		uint8_t head = s[0];
+		uint8_t middle = s[len / 2];
+		uint8_t tail = s[len - 1];
+		d[0] = head;
+		d[len / 2] = middle;
+		d[len - 1] = tail;
+	}
+}
 
-	aligned_a = ((uintptr_t)a & (sizeof(__m128i)-1));
+// Copies up to 64 bytes
+static inline void copy64(uint8_t* d, const uint8_t* s, size_t len) {
+	if(len > 32) {
+		__m128i r1 = _mm_loadu_si128((__m128i*)s);
+		__m128i r2 = _mm_loadu_si128((__m128i*)(s + 16));
+		__m128i r3 = _mm_loadu_si128((__m128i*)(s + len - 32));
+		__m128i r4 = _mm_loadu_si128((__m128i*)(s + len - 16));
+		_mm_storeu_si128((__m128i*)d, r1);
+		_mm_storeu_si128((__m128i*)(d + 16), r2);
+		_mm_storeu_si128((__m128i*)(d + len - 32), r3);
+		_mm_storeu_si128((__m128i*)(d + len - 16), r4);
+	} else if(len > 16) {
+		__m128i r1 = _mm_loadu_si128((__m128i*)s);
+		__m128i r2 = _mm_loadu_si128((__m128i*)(s + len - 16));
+		_mm_storeu_si128((__m128i*)d, r1);
+		_mm_storeu_si128((__m128i*)(d + len - 16), r2);
+	} else {
+		copy16(d, s, len);
+	}
+}
 
-	/* aligned */
-	if(aligned_a) {
-		while(len && ((uintptr_t) &a[i] & (sizeof(__m128i)-1))) {
-			a[i] = (uint8_t)value;
+static inline void copy_block_sse(uint8_t* d, const uint8_t* s) {
+	__m128i r1 = _mm_loadu_si128((__m128i*)s);
+	__m128i r2 = _mm_loadu_si128((__m128i*)(s + 16));
+	__m128i r3 = _mm_loadu_si128((__m128i*)(s + 32));
+	__m128i r4 = _mm_loadu_si128((__m128i*)(s + 48));
+	_mm_storeu_si128((__m128i*)d, r1);
+	_mm_storeu_si128((__m128i*)(d + 16), r2);
+	_mm_storeu_si128((__m128i*)(d + 32), r3);
+	_mm_storeu_si128((__m128i*)(d + 48), r4);
+}
 
-			i++;
-			len--;
-		}
+void* __memcpy_sse(void *dst, const void *src, size_t len) {
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	if(len <= 64) {
+		copy64(d, s, len);
+		return dst;
 	}
 
-	if(len >= 16) {
-		uint32_t buf_32 = value;
-		buf_32 |= (buf_32 << 8);
-		buf_32 |= (buf_32 << 16);
+	// Copies of up to 256 bytes, most packets, skip aligning
+	if(len > 256) {
+		size_t skip = 16 - ((uintptr_t)d & 15);
+		_mm_storeu_si128((__m128i*)d, _mm_loadu_si128((__m128i*)s));
+		d += skip;
+		s += skip;
+		len -= skip;
+	}
 
-		if(len >= 16) {
-			__m128i r1 = _mm_set_epi32(buf_32, buf_32, buf_32, buf_32);
-
-			while(len >= 128) {
-				_mm_store_si128((__m128i*)&a[i], r1);
-				_mm_store_si128((__m128i*)&a[i + 16], r1);
-				_mm_store_si128((__m128i*)&a[i + 32], r1);
-				_mm_store_si128((__m128i*)&a[i + 48], r1);
-				_mm_store_si128((__m128i*)&a[i + 64], r1);
-				_mm_store_si128((__m128i*)&a[i + 80], r1);
-				_mm_store_si128((__m128i*)&a[i + 96], r1);
-				_mm_store_si128((__m128i*)&a[i + 112], r1);
-
-				i += 128;
-				len -= 128;
-			}
+	while(len > 64) {
+		copy_block_sse(d, s);
+		d += 64;
+		s += 64;
+		len -= 64;
+	}
 
-			if(len >= 64) {
-				_mm_store_si128((__m128i*)&a[i], r1);
-				_mm_store_si128((__m128i*)&a[i + 16], r1);
-				_mm_store_si128((__m128i*)&a[i + 32], r1);
-				_mm_store_si128((__m128i*)&a[i + 48], r1);
+	copy_block_sse(d + len - 64, s + len - 64);
 
-				i += 64;
-				len -= 64;
-			}
-
-			if(len >= 32) {
-				_mm_store_si128((__m128i*)&a[i], r1);
-				_mm_store_si128((__m128i*)&a[i + 16], r1);
+	return dst;
+}
 
-				i += 32;
-				len -= 32;
-			}
+static inline __attribute__((target("avx2"))) void copy_block_avx2(uint8_t* d, const uint8_t* s) {
+	__m256i r1 = _mm256_loadu_si256((__m256i*)s);
+	__m256i r2 = _mm256_loadu_si256((__m256i*)(s + 32));
+	__m256i r3 = _mm256_loadu_si256((__m256i*)(s + 64));
+	__m256i r4 = _mm256_loadu_si256((__m256i*)(s + 96));
+	_mm256_storeu_si256((__m256i*)d, r1);
+	_mm256_storeu_si256((__m256i*)(d + 32), r2);
+	_mm256_storeu_si256((__m256i*)(d + 64), r3);
+	_mm256_storeu_si256((__m256i*)(d + 96), r4);
+}
 
-			if(len >= 16) {
-				_mm_store_si128((__m128i*)&a[i], r1);
+void* __attribute__((target("avx2"))) __memcpy_avx2(void *dst, const void *src, size_t len) {
+	uint8_t* d = dst;
+	const uint8_t* s = src;
 
-				i += 16;
-				len -= 16;
-			}
+	if(len <= 32) {
+		if(len > 16) {
+			__m128i r1 = _mm_loadu_si128((__m128i*)s);
+			__m128i r2 = _mm_loadu_si128((__m128i*)(s + len - 16));
+			_mm_storeu_si128((__m128i*)d, r1);
+			_mm_storeu_si128((__m128i*)(d + len - 16), r2);
+		} else {
+			copy16(d, s, len);
 		}
 
-		while(len >= 4) {
-			*(uint32_t*)(&a[i]) = buf_32;
+		return dst;
+	}
 
-			i += 4;
-			len -= 4;
+	if(len <= 128) {
+		__m256i r1 = _mm256_loadu_si256((__m256i*)s);
+		__m256i r2 = _mm256_loadu_si256((__m256i*)(s + len - 32));
+		if(len > 64) {
+			__m256i r3 = _mm256_loadu_si256((__m256i*)(s + 32));
+			__m256i r4 = _mm256_loadu_si256((__m256i*)(s + len - 64));
+			_mm256_storeu_si256((__m256i*)(d + 32), r3);
+			_mm256_storeu_si256((__m256i*)(d + len - 64), r4);
 		}
+		_mm256_storeu_si256((__m256i*)d, r1);
+		_mm256_storeu_si256((__m256i*)(d + len - 32), r2);
+
+		return dst;
 	}
 
-	while(len) {
-		a[i] = (uint8_t)value;
+	if(len > 256) {
+		size_t skip = 32 - ((uintptr_t)d & 31);
+		_mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((__m256i*)s));
+		d += skip;
+		s += skip;
+		len -= skip;
+	}
 
-		i++;
-		len--;
+	while(len > 128) {
+		copy_block_avx2(d, s);
+		d += 128;
+		s += 128;
+		len -= 128;
 	}
 
+	copy_block_avx2(d + len - 128, s + len - 128);
+
 	return dst;
 }
 
-void* __memcpy_sse(void *dst, const void *src, size_t len) {
-	uint8_t* a = (uint8_t*)dst;
-	uint8_t* b = (uint8_t*)src;
+void* __memcpy_erms(void *dst, const void *src, size_t len) {
+	if(len < ERMS_THRESHOLD)
+		return __memcpy_sse(dst, src, len);
 
-	int aligned_a = 0, aligned_b = 0;
-	int i = 0;
+	void* d = dst;
+	asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(len) : : "memory");
 
-	aligned_a = ((uintptr_t)a & (sizeof(__m128i)-1));
-	aligned_b = ((uintptr_t)b & (sizeof(__m128i)-1));
+	return dst;
+}
 
-	/* Not aligned */
-	if(aligned_a != aligned_b) {
-		while(len) {
-			a[i] = b[i];
+// Fills up to 16 bytes
+static inline void fill16(uint8_t* d, uint64_t value, size_t len) {
+	if(len >= 8) {
+		*(unaligned_u64*)d = value;
+		*(unaligned_u64*)(d + len - 8) = value;
+	} else if(len >= 4) {
+		*(unaligned_u32*)d = value;
+		*(unaligned_u32*)(d + len - 4) = value;
+	} else if(len) {
+		d[0] = value;
+		d[len / 2] = value;
+		d[len - 1] = value;
+	}
+}
 
-			i++;
-			len--;
+void *__memset_sse(void *dst, int value, size_t len) {
+	uint8_t* d = dst;
+	uint64_t value8 = 0x0101010101010101UL * (uint8_t)value;
+
+	if(len <= 16) {
+		fill16(d, value8, len);
+		return dst;
+	}
+
+	__m128i r = _mm_set1_epi8((char)value);
+	if(len <= 64) {
+		_mm_storeu_si128((__m128i*)d, r);
+		_mm_storeu_si128((__m128i*)(d + len - 16), r);
+		if(len > 32) {
+			_mm_storeu_si128((__m128i*)(d + 16), r);
+			_mm_storeu_si128((__m128i*)(d + len - 32), r);
 		}
 
 		return dst;
 	}
 
-	/* aligned */
-	if(aligned_a) {
-		while(len && ((uintptr_t) &a[i] & (sizeof(__m128i)-1))) {
-			a[i] = b[i];
+	uint8_t* end = d + len;
+	_mm_storeu_si128((__m128i*)d, r);
+	d = (uint8_t*)(((uintptr_t)d + 16) & ~(uintptr_t)15);
 
-			i++;
-			len--;
-		}
+	while(d + 64 < end) {
+		_mm_store_si128((__m128i*)d, r);
+		_mm_store_si128((__m128i*)(d + 16), r);
+		_mm_store_si128((__m128i*)(d + 32), r);
+		_mm_store_si128((__m128i*)(d + 48), r);
+		d += 64;
 	}
 
-	while(len >= 128) {
-		__m128i r1 = _mm_loadu_si128((__m128i*)&(b[i])); //16byte
-		__m128i r2 = _mm_loadu_si128((__m128i*)&(b[i + 16])); //16byte
-		__m128i r3 = _mm_loadu_si128((__m128i*)&(b[i + 32])); //16byte
-		__m128i r4 = _mm_loadu_si128((__m128i*)&(b[i + 48])); //16byte
-		__m128i r5 = _mm_loadu_si128((__m128i*)&(b[i + 64])); //16byte
-		__m128i r6 = _mm_loadu_si128((__m128i*)&(b[i + 80])); //16byte
-		__m128i r7 = _mm_loadu_si128((__m128i*)&(b[i + 96])); //16byte
-		__m128i r8 = _mm_loadu_si128((__m128i*)&(b[i + 112])); //16byte
-		_mm_store_si128((__m128i*)&a[i], r1);
-		_mm_store_si128((__m128i*)&a[i + 16], r2);
-		_mm_store_si128((__m128i*)&a[i + 32], r3);
-		_mm_store_si128((__m128i*)&a[i + 48], r4);
-		_mm_store_si128((__m128i*)&a[i + 64], r5);
-		_mm_store_si128((__m128i*)&a[i + 80], r6);
-		_mm_store_si128((__m128i*)&a[i + 96], r7);
-		_mm_store_si128((__m128i*)&a[i + 112], r8);
-
-		i += 128;
-		len -= 128;
+	_mm_storeu_si128((__m128i*)(end - 64), r);
+	_mm_storeu_si128((__m128i*)(end - 48), r);
+	_mm_storeu_si128((__m128i*)(end - 32), r);
+	_mm_storeu_si128((__m128i*)(end - 16), r);
+
+	return dst;
+}
+
+void* __attribute__((target("avx2"))) __memset_avx2(void *dst, int value, size_t len) {
+	uint8_t* d = dst;
+	uint64_t value8 = 0x0101010101010101UL * (uint8_t)value;
+
+	if(len <= 16) {
+		fill16(d, value8, len);
+		return dst;
 	}
 
-	if(len >= 64) {
-		__m128i r1 = _mm_loadu_si128((__m128i*)&(b[i])); //16byte
-		__m128i r2 = _mm_loadu_si128((__m128i*)&(b[i + 16])); //16byte
-		__m128i r3 = _mm_loadu_si128((__m128i*)&(b[i + 32])); //16byte
-		__m128i r4 = _mm_loadu_si128((__m128i*)&(b[i + 48])); //16byte
-		_mm_store_si128((__m128i*)&a[i], r1);
-		_mm_store_si128((__m128i*)&a[i + 16], r2);
-		_mm_store_si128((__m128i*)&a[i + 32], r3);
-		_mm_store_si128((__m128i*)&a[i + 48], r4);
+	if(len <= 32) {
+		__m128i r = _mm_set1_epi8((char)value);
+		_mm_storeu_si128((__m128i*)d, r);
+		_mm_storeu_si128((__m128i*)(d + len - 16), r);
 
-		i += 64;
-		len -= 64;
+		return dst;
 	}
 
-	if(len >= 32) {
-		__m128i r1 = _mm_loadu_si128((__m128i*)&(b[i])); //16byte
-		__m128i r2 = _mm_loadu_si128((__m128i*)&(b[i + 16])); //16byte
-		_mm_store_si128((__m128i*)&a[i], r1);
-		_mm_store_si128((__m128i*)&a[i + 16], r2);
+	__m256i r = _mm256_set1_epi8((char)value);
+	if(len <= 128) {
+		_mm256_storeu_si256((__m256i*)d, r);
+		_mm256_storeu_si256((__m256i*)(d + len - 32), r);
+		if(len > 64) {
+			_mm256_storeu_si256((__m256i*)(d + 32), r);
+			_mm256_storeu_si256((__m256i*)(d + len - 64), r);
+		}
 
-		i += 32;
-		len -= 32;
+		return dst;
 	}
 
-	if(len >= 16) {
-		__m128i r1 = _mm_loadu_si128((__m128i*)&(b[i])); //16byte
-		_mm_store_si128((__m128i*)&a[i], r1);
+	uint8_t* end = d + len;
+	_mm256_storeu_si256((__m256i*)d, r);
+	d = (uint8_t*)(((uintptr_t)d + 32) & ~(uintptr_t)31);
 
-		i += 16;
-		len -= 16;
+	while(d + 128 < end) {
+		_mm256_store_si256((__m256i*)d, r);
+		_mm256_store_si256((__m256i*)(d + 32), r);
+		_mm256_store_si256((__m256i*)(d + 64), r);
+		_mm256_store_si256((__m256i*)(d + 96), r);
+		d += 128;
 	}
 
-	while(len >= 4) {
-		*(uint32_t*)(&a[i]) = *(uint32_t*)(&b[i]);
+	_mm256_storeu_si256((__m256i*)(end - 128), r);
+	_mm256_storeu_si256((__m256i*)(end - 96), r);
+	_mm256_storeu_si256((__m256i*)(end - 64), r);
+	_mm256_storeu_si256((__m256i*)(end - 32), r);
+
+	return dst;
+}
+
+void* __memset_erms(void *dst, int value, size_t len) {
+	if(len < ERMS_THRESHOLD)
+		return __memset_sse(dst, value, len);
+
+	void* d = dst;
+	asm volatile("rep stosb" : "+D"(d), "+c"(len) : "a"(value) : "memory");
 
-		i += 4;
-		len -= 4;
+	return dst;
+}
+
+// Compares up to 16 bytes
+static inline int compare16(const uint8_t* a, const uint8_t* b, size_t len) {
+	if(len >= 8) {
+		uint64_t x = *(unaligned_u64*)a;
+		uint64_t y = *(unaligned_u64*)b;
+		if(x == y) {
+			a += len - 8;
+			b += len - 8;
+			x = *(unaligned_u64*)a;
+			y = *(unaligned_u64*)b;
+			if(x == y)
+				return 0;
+		}
+
+		int i = __builtin_ctzl(x ^ y) / 8;
+
+		return a[i] - b[i];
+	}
+
+	for(size_t i = 0; i < len; i++) {
+		if(a[i] != b[i])
+			return a[i] - b[i];
 	}
 
-	while(len) {
-		a[i] = b[i];
+	return 0;
+}
 
-		i++;
-		len--;
+int __memcmp_sse(const void *v1, const void *v2, size_t len) {
+	const uint8_t* a = v1;
+	const uint8_t* b = v2;
+
+	if(len <= 16)
+		return compare16(a, b, len);
+
+	// The last 16 bytes are compared ending at the end, overlapping the previous ones
+	size_t i = 0;
+	while(true) {
+		if(i + 16 > len)
+			i = len - 16;
+
+		__m128i x = _mm_loadu_si128((__m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((__m128i*)(b + i));
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if(mask != 0xffff) {
+			i += __builtin_ctz(~mask);
+			return a[i] - b[i];
+		}
+
+		i += 16;
+		if(i >= len)
+			return 0;
 	}
+}
 
-	return dst;
+int __attribute__((target("avx2"))) __memcmp_avx2(const void *v1, const void *v2, size_t len) {
+	const uint8_t* a = v1;
+	const uint8_t* b = v2;
+
+	if(len <= 16)
+		return compare16(a, b, len);
+
+	if(len <= 32) {
+		for(size_t i = 0; ; i = len - 16) {
+			__m128i x = _mm_loadu_si128((__m128i*)(a + i));
+			__m128i y = _mm_loadu_si128((__m128i*)(b + i));
+			uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+			if(mask != 0xffff) {
+				i += __builtin_ctz(~mask);
+				return a[i] - b[i];
+			}
+
+			if(i == len - 16)
+				return 0;
+		}
+	}
+
+	size_t i = 0;
+	while(true) {
+		if(i + 32 > len)
+			i = len - 32;
+
+		__m256i x = _mm256_loadu_si256((__m256i*)(a + i));
+		__m256i y = _mm256_loadu_si256((__m256i*)(b + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+		if(mask != 0xffffffff) {
+			i += __builtin_ctz(~mask);
+			return a[i] - b[i];
+		}
+
+		i += 32;
+		if(i >= len)
+			return 0;
+	}
 }
 
 void * __attribute__ (( noinline )) __memcpy ( void *dest, const void *src,
@@ -460,95 +653,6 @@ void* __memmove_chk(void* dest, const void* src, size_t size, size_t bos) {
 	return __memmove(dest, src, size);
 }
 
-int __memcmp_sse(const void *dst, const void *src, size_t len) {
-	uint8_t* a = (uint8_t*)dst;
-	uint8_t* b = (uint8_t*)src;
-
-	if(!len)
-		return 0;
-
-	int aligned_a = 0, aligned_b = 0;
-	int i = 0;
-
-	aligned_a = ((uintptr_t)a & (sizeof(__m128i)-1));
-	aligned_b = ((uintptr_t)b & (sizeof(__m128i)-1));
-
-	while(len) {
-		if (a[i] != b[i])
-			return b[i] - a[i];
-
-		i++;
-		len--;
-	}
-
-	return 0;
-	/* Not aligned */
-	if(aligned_a != aligned_b) {
-		while(len) {
-			if (a[i] != b[i])
-				return b[i] - a[i];
-
-			i++;
-			len--;
-		}
-
-		return 0;
-	}
-
-	/* aligned */
-	if(aligned_a) {
-		while(len && (((uintptr_t) &a[i]) & (sizeof(__m128i)-1))) {
-			if(a[i] != b[i]) {
-				return b[i] - a[i];
-			}
-
-			i++;
-			len--;
-		}
-	}
-
-	while(len >= 16) {
-		__m128i x = _mm_loadu_si128((__m128i*)&(a[i])); //16byte
-		__m128i y = _mm_loadu_si128((__m128i*)&(b[i])); //16byte
-
-		__m128i cmp = _mm_cmpeq_epi8(x, y);
-
-		uint16_t result = (uint16_t)_mm_movemask_epi8(cmp);
-		if(result != 0xffffU) {
-			result = ~result;
-
-			while(!(result & 0x1)) {
-				result = result >> 1;
-				i++;
-			}
-
-			return b[i] - a[i];
-		}
-
-		i += 16;
-		len -= 16;
-	}
-
-	while(len >= 4) {
-		if(*(uint32_t*)(&a[i]) != *(uint32_t*)(&b[i])) {
-			break;
-		}
-
-		i += 4;
-		len -= 4;
-	}
-
-	while(len) {
-		if(a[i] != b[i])
-			return b[i] - a[i];
-
-		i++;
-		len--;
-	}
-
-	return 0;
-}
-
 int __memcmp(const void* v1, const void* v2, size_t size) {
 	const uint64_t* d = v1;
 	const uint64_t* s = v2;
@@ -569,7 +673,7 @@ int __memcmp(const void* v1, const void* v2, size_t size) {
 	//count = size % 8;
 	while(size) {
 		if(*d2 != *s2)
-			return *s2 - *d2;
+			return *d2 - *s2;
 
 		s2++;
 		d2++;
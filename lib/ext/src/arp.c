@@ -1,123 +1,265 @@
 #include <timer.h>
 #include <string.h>
+#include <lock.h>
+#include <thread.h>
+#include <gmalloc.h>
+#include <util/event.h>
 #include <net/interface.h>
 #include <net/ether.h>
 #include <net/arp.h>
 #include <nic.h>
 
 #define ARP_TABLE		"net.arp.arptable"
-#define ARP_TIMEOUT		(uint64_t)14400 * 1000000	// 4 hours  (us)
 
-#define GC_INTERVAL		(uint64_t)10 * 1000000	// 10 secs
-
-//TODO When load application in kernel, do set arp_table.
-void arp_table_reflash(ARPTable* table, uint64_t current) {
-	if(current < table->timeout)
-		return;
-
-	for(int i = 0; i < table->entity_count; i++) {
-recheck:
-		if(table->entity[i].timeout > current)
-			continue;
+static inline uint32_t arp_hash(uint32_t addr) {
+	return ((uint64_t)addr * 0x9e3779b97f4a7c15UL) >> 32;
+}
 
-		if(i == table->entity_count - 1) {
-			table->entity_count--;
-			break;
-		} else {
-			table->entity[i] = table->entity[--table->entity_count];
-			goto recheck;
+// Slot of the address, or the slot to insert it at if there is none
+static ARPEntity* arp_slot(ARPTable* table, uint32_t addr) {
+	uint32_t mask = table->capacity - 1;
+	ARPEntity* deleted = NULL;
+
+	for(uint32_t i = arp_hash(addr) & mask; ; i = (i + 1) & mask) {
+		ARPEntity* entity = &table->entities[i];
+		if(entity->state == ARP_STATE_EMPTY)
+			return deleted ? : entity;
+
+		if(entity->state == ARP_STATE_DELETED) {
+			if(!deleted)
+				deleted = entity;
+		} else if(entity->addr == addr) {
+			return entity;
 		}
 	}
-
-	table->timeout = current + GC_INTERVAL;
 }
 
-ARPTable* arp_get_table(NIC* nic) {
-	//TODO Add cache
-	static NIC* _nic = NULL;
-	static ARPTable* table = NULL;
+static void arp_slot_delete(ARPTable* table, ARPEntity* entity) {
+	entity->state = ARP_STATE_DELETED;
+	table->count--;
+	table->deleted++;
+}
 
-	uint64_t current = timer_us();
-	if(_nic == nic) {
-		arp_table_reflash(table, current);
-		return table;
-	}
+// Rehashes when the used and deleted slots exceed 3/4, growing if half are in use
+static bool arp_table_reserve(ARPTable* table) {
+	if((table->count + table->deleted + 1) * 4 <= table->capacity * 3)
+		return true;
 
-	int32_t table_key = nic_config_key(nic, ARP_TABLE);
-	if(table_key <= 0) {
-		table_key = nic_config_alloc(nic, ARP_TABLE, sizeof(ARPTable));
-		if(table_key <= 0)
-			return NULL;
+	uint32_t capacity = table->capacity;
+	if((table->count + 1) * 2 > capacity)
+		capacity *= 2;
 
-		table = nic_config_get(nic, table_key);
-		memset(table, 0, sizeof(ARPTable));
+	ARPEntity* entities = gcalloc(capacity, sizeof(ARPEntity));
+	if(!entities)
+		return false;
 
-		_nic = nic;
+	ARPEntity* old = table->entities;
+	uint32_t old_capacity = table->capacity;
+	table->entities = entities;
+	table->capacity = capacity;
+	table->deleted = 0;
+	table->gc_index = 0;
 
-		return table;
+	for(uint32_t i = 0; i < old_capacity; i++) {
+		if(old[i].state > ARP_STATE_DELETED)
+			*arp_slot(table, old[i].addr) = old[i];
 	}
 
-	table = nic_config_get(nic, table_key);
-	arp_table_reflash(table, current);
+	gfree(old);
 
-	_nic = nic;
+	return true;
+}
 
-	return table;
+static void arp_pending_drop(ARPTable* table, ARPPending* pending) {
+	nic_free(pending->packet);
+	pending->packet = NULL;
+	table->pending_count--;
 }
 
-// TODO
-bool arp_table_destroy(NIC* nic) {
+static bool arp_gc(void* context) {
+	ARPTable* table = context;
+
+	// The table is destroyed, or created again with the timer of another thread
+	lock_lock(&table->lock);
+	bool stale = !table->entities || table->gc_thread != thread_id();
+	if(stale && table->gc_thread == thread_id())
+		table->gc_event = 0;
+	lock_unlock(&table->lock);
+
+	if(stale)
+		return false;
+
+	arp_table_age(table, timer_us(), ARP_GC_BUDGET);
+
 	return true;
 }
 
-bool arp_table_update(ARPTable* table, uint64_t mac, uint32_t addr, bool dynamic) {
-	uint64_t current = timer_us();
-	for(int i = 0; i < table->entity_count; i++) {
-		if(table->entity[i].addr == addr) {
-			if(!dynamic) {
-				table->entity[i].mac = mac;
-				table->entity[i].timeout = current + ARP_TIMEOUT;
-			} else if(table->entity[table->entity_count].dynamic == dynamic) {
-				table->entity[i].mac = mac;
-				table->entity[i].timeout = current + ARP_TIMEOUT;
-			} else
-				return false;
+ARPTable* arp_get_table(NIC* nic) {
+	ARPTable* table = nic_config_lookup(nic, ARP_TABLE, sizeof(ARPTable));
+	if(!table || table->entities)
+		return table;
 
-			return true;
+	lock_lock(&table->lock);
+	if(!table->entities) {
+		table->entities = gcalloc(ARP_TABLE_SIZE, sizeof(ARPEntity));
+		if(!table->entities) {
+			lock_unlock(&table->lock);
+			return NULL;
 		}
+
+		// The timer of a table destroyed on another thread is still here
+		if(table->gc_event && table->gc_thread == thread_id())
+			event_timer_remove(table->gc_event);
+
+		table->capacity = ARP_TABLE_SIZE;
+		table->gc_thread = thread_id();
+		table->gc_event = event_timer_add(arp_gc, table, ARP_GC_INTERVAL, ARP_GC_INTERVAL);
 	}
+	lock_unlock(&table->lock);
 
-	if(table->entity_count >= ARP_ENTITY_MAX_COUNT)
+	return table;
+}
+
+bool arp_table_destroy(NIC* nic) {
+	ARPTable* table = arp_get_table(nic);
+	if(!table)
 		return false;
 
-	table->entity[table->entity_count].mac = mac;
-	table->entity[table->entity_count].addr = addr;
-	table->entity[table->entity_count].dynamic = dynamic;
-	table->entity[table->entity_count++].timeout = current + ARP_TIMEOUT;
+	// Timers are per thread, the timer of another thread ends on its next expiry
+	lock_lock(&table->lock);
+	if(table->gc_event && table->gc_thread == thread_id()) {
+		event_timer_remove(table->gc_event);
+		table->gc_event = 0;
+	}
+
+	for(int i = 0; i < ARP_PENDING_COUNT && table->pending_count; i++) {
+		if(table->pending[i].packet)
+			arp_pending_drop(table, &table->pending[i]);
+	}
+
+	gfree(table->entities);
+	table->entities = NULL;
+	table->capacity = table->count = table->deleted = 0;
+	lock_unlock(&table->lock);
 
 	return true;
 }
 
-ARPEntity* arp_table_get_by_addr(ARPTable* table, uint32_t addr) {
-	for(int i = 0; i < table->entity_count; i++) {
-		if(table->entity[i].addr == addr)
-			return &table->entity[i];
+// Called with the lock held
+static ARPEntity* arp_table_set(ARPTable* table, uint64_t mac, uint32_t addr, uint8_t state, uint64_t timeout) {
+	ARPEntity* entity = arp_slot(table, addr);
+	if(entity->state <= ARP_STATE_DELETED) {
+		if(!arp_table_reserve(table))
+			return NULL;
+
+		// Slots may have moved
+		entity = arp_slot(table, addr);
+		if(entity->state == ARP_STATE_DELETED)
+			table->deleted--;
+		table->count++;
+	} else if(entity->state == ARP_STATE_STATIC && state != ARP_STATE_STATIC) {
+		return NULL;
 	}
 
-	return NULL;
+	entity->mac = mac;
+	entity->addr = addr;
+	entity->state = state;
+	entity->timeout = timeout;
+
+	return entity;
 }
 
-ARPEntity* arp_table_get_by_mac(ARPTable* table, uint64_t mac) {
-	for(int i = 0; i < table->entity_count; i++) {
-		if(table->entity[i].mac == mac)
-			return &table->entity[i];
+bool arp_table_update(ARPTable* table, uint64_t mac, uint32_t addr, bool dynamic) {
+	lock_lock(&table->lock);
+	ARPEntity* entity = arp_table_set(table, mac, addr, dynamic ? ARP_STATE_DYNAMIC : ARP_STATE_STATIC,
+			timer_us() + ARP_TIMEOUT);
+	lock_unlock(&table->lock);
+
+	return entity != NULL;
+}
+
+// Entities are copied out, the slots move when the table is rehashed
+bool arp_table_get_by_addr(ARPTable* table, uint32_t addr, ARPEntity* entity) {
+	lock_lock(&table->lock);
+	ARPEntity* slot = arp_slot(table, addr);
+	bool found = slot->state > ARP_STATE_RESOLVING;
+	if(found)
+		*entity = *slot;
+	lock_unlock(&table->lock);
+
+	return found;
+}
+
+bool arp_table_get_by_mac(ARPTable* table, uint64_t mac, ARPEntity* entity) {
+	bool found = false;
+
+	lock_lock(&table->lock);
+	for(uint32_t i = 0; i < table->capacity; i++) {
+		if(table->entities[i].state > ARP_STATE_RESOLVING && table->entities[i].mac == mac) {
+			*entity = table->entities[i];
+			found = true;
+			break;
+		}
 	}
+	lock_unlock(&table->lock);
 
-	return NULL;
+	return found;
 }
 
 bool arp_table_remove(ARPTable* table, uint32_t addr) {
-	return true;
+	lock_lock(&table->lock);
+	ARPEntity* entity = arp_slot(table, addr);
+	bool found = entity->state > ARP_STATE_DELETED;
+	if(found)
+		arp_slot_delete(table, entity);
+	lock_unlock(&table->lock);
+
+	return found;
+}
+
+void arp_table_age(ARPTable* table, uint64_t current, uint32_t budget) {
+	lock_lock(&table->lock);
+
+	if(budget > table->capacity)
+		budget = table->capacity;
+
+	for(uint32_t i = 0; i < budget; i++) {
+		ARPEntity* entity = &table->entities[table->gc_index];
+		table->gc_index = (table->gc_index + 1) & (table->capacity - 1);
+
+		if((entity->state == ARP_STATE_DYNAMIC || entity->state == ARP_STATE_RESOLVING) &&
+				entity->timeout <= current)
+			arp_slot_delete(table, entity);
+	}
+
+	for(int i = 0; i < ARP_PENDING_COUNT && table->pending_count; i++) {
+		if(table->pending[i].packet && table->pending[i].timeout <= current)
+			arp_pending_drop(table, &table->pending[i]);
+	}
+
+	lock_unlock(&table->lock);
+}
+
+// Looks up the MAC address, marks the address resolving and tells if a request is due when it is not known
+static uint64_t arp_lookup(ARPTable* table, uint32_t addr, bool* request) {
+	uint64_t current = timer_us();
+	ARPEntity* entity = arp_slot(table, addr);
+	*request = false;
+
+	if(entity->state > ARP_STATE_RESOLVING)
+		return entity->mac;
+
+	if(entity->state == ARP_STATE_RESOLVING) {
+		if(entity->timeout <= current) {
+			entity->timeout = current + ARP_REQUEST_INTERVAL;
+			*request = true;
+		}
+	} else {
+		*request = true;
+		arp_table_set(table, 0xffffffffffff, addr, ARP_STATE_RESOLVING, current + ARP_REQUEST_INTERVAL);
+	}
+
+	return 0xffffffffffff;
 }
 
 uint64_t arp_get_mac(NIC* nic, uint32_t destination, uint32_t source) {
@@ -127,22 +269,99 @@ uint64_t arp_get_mac(NIC* nic, uint32_t destination, uint32_t source) {
 		return 0xffffffffffff;
 	}
 
-	ARPEntity* entity = arp_table_get_by_mac(table, destination);
-	if(!entity) {
+	bool request;
+	lock_lock(&table->lock);
+	uint64_t mac = arp_lookup(table, destination, &request);
+	lock_unlock(&table->lock);
+
+	if(request)
 		arp_request0(nic, destination, source);
-		return 0xffffffffffff;
+
+	return mac;
+}
+
+bool arp_send(NIC* nic, Packet* packet, uint32_t destination, uint32_t source) {
+	ARPTable* table = arp_get_table(nic);
+	if(!table) {
+		nic_free(packet);
+		return false;
+	}
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+
+	bool request;
+	lock_lock(&table->lock);
+	uint64_t mac = arp_lookup(table, destination, &request);
+	if(mac != 0xffffffffffff) {
+		lock_unlock(&table->lock);
+
+		ether->dmac = endian48(mac);
+		return nic_tx(nic, packet);
+	}
+
+	ARPPending* pending = NULL;
+	if(table->pending_count < ARP_PENDING_COUNT) {
+		for(int i = 0; i < ARP_PENDING_COUNT; i++) {
+			if(!table->pending[i].packet) {
+				pending = &table->pending[i];
+				break;
+			}
+		}
+
+		pending->packet = packet;
+		pending->addr = destination;
+		pending->timeout = timer_us() + ARP_RESOLVE_TIMEOUT;
+		table->pending_count++;
+	}
+	lock_unlock(&table->lock);
+
+	if(request)
+		arp_request0(nic, destination, source);
+
+	if(!pending) {
+		nic_free(packet);
+		return false;
 	}
 
-	return entity->mac;
+	return true;
+}
+
+// Transmits the packets waiting for the address
+static void arp_flush(NIC* nic, ARPTable* table, uint32_t addr, uint64_t mac) {
+	if(!table->pending_count)
+		return;
+
+	Packet* packets[ARP_PENDING_COUNT];
+	int count = 0;
+
+	lock_lock(&table->lock);
+	for(int i = 0; i < ARP_PENDING_COUNT && table->pending_count; i++) {
+		ARPPending* pending = &table->pending[i];
+		if(pending->packet && pending->addr == addr) {
+			packets[count++] = pending->packet;
+			pending->packet = NULL;
+			table->pending_count--;
+		}
+	}
+	lock_unlock(&table->lock);
+
+	for(int i = 0; i < count; i++) {
+		Ether* ether = (Ether*)(packets[i]->buffer + packets[i]->start);
+		ether->dmac = endian48(mac);
+		nic_tx(nic, packets[i]);
+	}
 }
 
 uint32_t arp_get_ip(NIC* nic, uint64_t mac) {
 	ARPTable* table = arp_get_table(nic);
-	ARPEntity* entity = arp_table_get_by_mac(table, mac);
-	if(!entity)
+	if(!table)
+		return 0;
+
+	ARPEntity entity;
+	if(!arp_table_get_by_mac(table, mac, &entity))
 		return 0;
 
-	return entity->addr;
+	return entity.addr;
 }
 
 bool arp_process(NIC* nic, Packet* packet) {
@@ -158,10 +377,12 @@ bool arp_process(NIC* nic, Packet* packet) {
 		return false;
 
 	ARPTable* table = arp_get_table(nic);
+	uint64_t smac = endian48(arp->sha);
+	uint32_t sip = endian32(arp->spa);
 	switch(endian16(arp->operation)) {
 		case 1:	// Request
-			if(table)
-				arp_table_update(table, ether->smac, arp->spa, true);
+			if(table && arp_table_update(table, smac, sip, true))
+				arp_flush(nic, table, sip, smac);
 
 			ether->dmac = ether->smac;
 			ether->smac = endian48(nic->mac);
@@ -174,11 +395,8 @@ bool arp_process(NIC* nic, Packet* packet) {
 			nic_tx(nic, packet);
 			return true;
 		case 2: // Reply
-			;
-			uint64_t smac = endian48(arp->sha);
-			uint32_t sip = endian32(arp->spa);
-			if(table)
-				arp_table_update(table, smac, sip, true);
+			if(table && arp_table_update(table, smac, sip, true))
+				arp_flush(nic, table, sip, smac);
 			nic_free(packet);
 			return true;
 	}
@@ -1,98 +1,163 @@
 #include <_malloc.h>
 #include <util/cache.h>
 
-Cache* cache_create(size_t capacity, void(*uncache)(void*), void* pool) {
+Cache* cache_create_sized(size_t capacity, size_t bytes, void(*uncache)(void*), void* pool) {
 	if(capacity == 0)
 		return NULL;
 
 	Cache* cache = __malloc(sizeof(Cache), pool);
 	if(!cache)
 		return NULL;
-	
+
 	cache->map = map_create(capacity, NULL, NULL, pool);
 	if(!cache->map) {
 		__free(cache, pool);
 		return NULL;
 	}
-	
-	cache->list = list_create(pool);
-	if(!cache->list) {
-		map_destroy(cache->map);
-		__free(cache, pool);
-		return NULL;
-	}
 
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->size = 0;
+	cache->bytes = 0;
 	cache->capacity = capacity;
+	cache->bytes_capacity = bytes;
 	cache->uncache = uncache;
 	cache->pool = pool;
 
 	return cache;
 }
 
+Cache* cache_create(size_t capacity, void(*uncache)(void*), void* pool) {
+	return cache_create_sized(capacity, 0, uncache, pool);
+}
+
 void cache_destroy(Cache* cache) {
 	cache_clear(cache);
 
-	list_destroy(cache->list);
 	map_destroy(cache->map);
 
 	__free(cache, cache->pool);
 }
 
+static void cache_unlink(Cache* cache, CacheEntry* entry) {
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->tail = entry->next;
+
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->head = entry->prev;
+}
+
+// Links the entry as the most recently used
+static void cache_link(Cache* cache, CacheEntry* entry) {
+	entry->prev = NULL;
+	entry->next = cache->tail;
+	if(cache->tail)
+		cache->tail->prev = entry;
+	else
+		cache->head = entry;
+
+	cache->tail = entry;
+}
+
+// Unlinks the entry and uncaches its data, the entry is to be reused or freed
+static void* cache_evict(Cache* cache, CacheEntry* entry) {
+	void* data = entry->data;
+
+	map_remove(cache->map, entry->key);
+	cache_unlink(cache, entry);
+	cache->size--;
+	cache->bytes -= entry->size;
+
+	if(cache->uncache)
+		cache->uncache(data);
+
+	return data;
+}
+
 void* cache_get(Cache* cache, void* key) {
-	void* data = map_get(cache->map, key);
-	if(!data) 
+	CacheEntry* entry = map_get(cache->map, key);
+	if(!entry)
 		return NULL;
-	
+
 	// Update cache ordering
-	list_remove_data(cache->list, key);
-	list_add(cache->list, key);
-	
-	return data;
+	if(entry != cache->tail) {
+		cache_unlink(cache, entry);
+		cache_link(cache, entry);
+	}
+
+	return entry->data;
 }
 
-bool cache_set(Cache* cache, void* key, void* data) {
+bool cache_set_sized(Cache* cache, void* key, void* data, size_t size) {
+	if(cache->bytes_capacity && size > cache->bytes_capacity)
+		return false;
+
 	// Check existed data having the key
 	if(map_contains(cache->map, key))
 		return false;
-	
-	if(list_size(cache->list) >= cache->capacity) {
-		// Delete LRU data  
-		void* lru_key = list_remove_first(cache->list);
-		void* lru_data = map_remove(cache->map, lru_key);
-		if(cache->uncache)
-			cache->uncache(lru_data);
+
+	// Delete LRU data, reusing the last entry
+	CacheEntry* entry = NULL;
+	while(cache->head && (cache->size >= cache->capacity ||
+			(cache->bytes_capacity && cache->bytes + size > cache->bytes_capacity))) {
+		if(entry)
+			__free(entry, cache->pool);
+
+		entry = cache->head;
+		cache_evict(cache, entry);
+	}
+
+	if(!entry) {
+		entry = __malloc(sizeof(CacheEntry), cache->pool);
+		if(!entry)
+			return false;
+	}
+
+	entry->key = key;
+	entry->data = data;
+	entry->size = size;
+	if(!map_put(cache->map, key, entry)) {
+		__free(entry, cache->pool);
+		return false;
 	}
-	
-	list_add(cache->list, key);
-	map_put(cache->map, key, data);
+
+	cache_link(cache, entry);
+	cache->size++;
+	cache->bytes += size;
 
 	return true;
 }
 
+bool cache_set(Cache* cache, void* key, void* data) {
+	return cache_set_sized(cache, key, data, 0);
+}
+
 void* cache_remove(Cache* cache, void* key) {
-	void* data = map_remove(cache->map, key);
-	if(!data) 
+	CacheEntry* entry = map_get(cache->map, key);
+	if(!entry)
 		return NULL;
 
-	list_remove_data(cache->list, key);
-	if(cache->uncache)
-		cache->uncache(data);
-	
+	void* data = cache_evict(cache, entry);
+	__free(entry, cache->pool);
+
 	return data;
 }
 
 void cache_clear(Cache* cache) {
-	while(list_size(cache->list) > 0) {
-		void* key = list_remove_first(cache->list);
-		void* data = map_remove(cache->map, key);
-		if(cache->uncache)
-			cache->uncache(data);
+	while(cache->head) {
+		CacheEntry* entry = cache->head;
+		cache_evict(cache, entry);
+		__free(entry, cache->pool);
 	}
 }
 
 void cache_iterator_init(CacheIterator* iter, Cache* cache) {
 	iter->cache = cache;
-	iter->node = cache->list->head;
+	iter->node = cache->head;
 }
 
 bool cache_iterator_has_next(CacheIterator* iter) {
@@ -101,10 +166,10 @@ bool cache_iterator_has_next(CacheIterator* iter) {
 
 void* cache_iterator_next(CacheIterator* iter) {
 	if(iter->node) {
-		void* key = iter->node->data;
-		iter->node = iter->node->next;
-	
-		return map_get(iter->cache->map, key);
+		void* data = iter->node->data;
+		iter->node = iter->node->prev;
+
+		return data;
 	} else {
 		return NULL;
 	}
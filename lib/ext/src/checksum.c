@@ -1,23 +1,172 @@
+#include <stdbool.h>
 #include <byteswap.h>
+#include <immintrin.h>
 #include <net/checksum.h>
 
-uint16_t checksum(void* data, uint32_t size) {
-	uint32_t sum = 0;
-	uint16_t* p = data;
-	
-	while(size > 1) {
-		sum += *p++;
-		if(sum >> 16)
-			sum = (sum & 0xffff) + (sum >> 16);
-		
-		size -= 2;
+#define SIMD_MIN	64	// Smaller data is summed by sum_scalar
+
+/*
+ * Data is summed as little endian words of 64 bits with end around carry. The
+ * ones' complement sum does not depend on the word size, so it is folded to 16
+ * bits at the end and swapped to network byte order by checksum_finish().
+ */
+
+static inline uint64_t add64(uint64_t sum, uint64_t value) {
+	sum += value;
+	return sum + (sum < value);
+}
+
+static inline uint32_t fold(uint64_t sum) {
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint32_t)sum;
+}
+
+static uint64_t sum_scalar(const uint8_t* p, uint32_t size) {
+	uint64_t sum = 0;
+	uint64_t value;
+
+	while(size >= 8) {
+		__builtin_memcpy(&value, p, 8);
+		sum = add64(sum, value);
+		p += 8;
+		size -= 8;
+	}
+
+	// Odd byte is padded with zero
+	value = 0;
+	if(size & 4) {
+		uint32_t v;
+		__builtin_memcpy(&v, p, 4);
+		value = v;
+		p += 4;
+	}
+	if(size & 2) {
+		uint16_t v;
+		__builtin_memcpy(&v, p, 2);
+		value += (uint64_t)v << 32;
+		p += 2;
+	}
+	if(size & 1)
+		value += (uint64_t)*p << 48;
+
+	return add64(sum, value);
+}
+
+// 32-bit words are added to 64-bit lanes, which never overflow
+static uint64_t sum_sse2(const uint8_t* p, uint32_t size) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum0 = _mm_setzero_si128();
+	__m128i sum1 = _mm_setzero_si128();
+
+	while(size >= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i*)p);
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(a, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(a, zero));
+		sum0 = _mm_add_epi64(sum0, _mm_unpacklo_epi32(b, zero));
+		sum1 = _mm_add_epi64(sum1, _mm_unpackhi_epi32(b, zero));
+		p += 32;
+		size -= 32;
 	}
-	
-	if(size)
-		sum += *(uint8_t*)p;
-	
-	while(sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
-	
-	return bswap_16((uint16_t)~sum);
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(sum0, sum1));
+
+	uint64_t sum = add64(lanes[0], lanes[1]);
+
+	return add64(sum, sum_scalar(p, size));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t* p, uint32_t size) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sum0 = _mm256_setzero_si256();
+	__m256i sum1 = _mm256_setzero_si256();
+
+	while(size >= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)p);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+		sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(a, zero));
+		sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(a, zero));
+		sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(b, zero));
+		sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(b, zero));
+		p += 64;
+		size -= 64;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(sum0, sum1));
+
+	uint64_t sum = add64(add64(lanes[0], lanes[1]), add64(lanes[2], lanes[3]));
+
+	return add64(sum, sum_sse2(p, size));
+}
+
+// AVX2 needs the CPU support and the OS to save the YMM registers (XCR0)
+static bool avx2_enabled() {
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile("cpuid"
+		: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+		: "a"(0));
+	if(eax < 7)
+		return false;
+
+	asm volatile("cpuid"
+		: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+		: "a"(1));
+	if(!(ecx & (1 << 27)))	// OSXSAVE
+		return false;
+
+	uint32_t xcr0, xcr0_high;
+	asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+	if((xcr0 & 0x6) != 0x6)	// XMM and YMM state
+		return false;
+
+	asm volatile("cpuid"
+		: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+		: "a"(7), "c"(0));
+
+	return !!(ebx & (1 << 5));
+}
+
+static uint64_t sum_detect(const uint8_t* p, uint32_t size);
+static uint64_t (*sum_simd)(const uint8_t* p, uint32_t size) = sum_detect;
+
+// Chooses the implementation on the first call
+static uint64_t sum_detect(const uint8_t* p, uint32_t size) {
+	sum_simd = avx2_enabled() ? sum_avx2 : sum_sse2;
+
+	return sum_simd(p, size);
+}
+
+uint32_t checksum_partial(void* data, uint32_t size, uint32_t sum) {
+	uint64_t s = size < SIMD_MIN ? sum_scalar(data, size) : sum_simd(data, size);
+
+	return fold(add64(s, sum));
+}
+
+uint16_t checksum_finish(uint32_t sum) {
+	return bswap_16((uint16_t)~fold(sum));
+}
+
+uint16_t checksum(void* data, uint32_t size) {
+	return checksum_finish(checksum_partial(data, size, 0));
+}
+
+// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+uint16_t checksum_adjust16(uint16_t checksum, uint16_t old, uint16_t new) {
+	uint32_t sum = (uint16_t)~checksum + (uint16_t)~old + new;
+
+	return (uint16_t)~fold(sum);
+}
+
+uint16_t checksum_adjust32(uint16_t checksum, uint32_t old, uint32_t new) {
+	uint32_t sum = (uint16_t)~checksum + (uint16_t)~(old >> 16) + (uint16_t)~old +
+		(new >> 16) + (new & 0xffff);
+
+	return (uint16_t)~fold(sum);
 }
@@ -9,13 +9,48 @@ typedef struct {
 	void*		context;
 } Node;
 
-typedef struct {
+/*
+ * Timers are kept in a hierarchical timing wheel of microsecond ticks. Level l
+ * has TIMER_SLOTS slots of 2^(TIMER_BITS * l) ticks each. A timer sits in the
+ * lowest level whose range covers its expiry and moves down a level (cascade)
+ * when the wheel reaches the start of its slot, so adding, removing and
+ * firing a timer do not depend on the number of timers.
+ */
+#define TIMER_BITS		8
+#define TIMER_SLOTS		(1 << TIMER_BITS)
+#define TIMER_MASK		(TIMER_SLOTS - 1)
+#define TIMER_LEVELS		5	// 2^40 us (12.7 days), later timers wait in the last level
+#define TIMER_LEVEL_PENDING	TIMER_LEVELS	// Expired, to be called in this event loop
+#define TIMER_POOL_SIZE		1024	// Timer nodes allocated at once
+
+typedef enum {
+	TIMER_FREE,
+	TIMER_ARMED,		// In a slot or pending
+	TIMER_RUNNING,		// Callback is being called
+	TIMER_CANCELLED,	// Removed while its callback is being called
+} TimerState;
+
+typedef struct _TimerNode {
+	struct _TimerNode*	next;
+	struct _TimerNode*	prev;
 	EventFunc	func;
 	void*		context;
-	clock_t		delay;
+	uint64_t	expire;		// us
 	clock_t		period;
+	uint8_t		state;
+	uint8_t		level;
+	uint8_t		index;
 } TimerNode;
 
+typedef struct {
+	uint64_t	time;		// Next tick to be processed
+	uint64_t	next;		// No timer is called or cascaded before this tick
+	uint64_t	count;		// Number of armed timers
+	TimerNode*	slots[TIMER_LEVELS + 1][TIMER_SLOTS];	// Circular lists, the last level is pending
+	uint64_t	bitmaps[TIMER_LEVELS][TIMER_SLOTS / 64];	// Non-empty slots
+	TimerNode*	free;		// Node pool
+} TimerWheel;
+
 typedef struct {
 	uint64_t		event_id;
 	TriggerEventFunc	func;
@@ -30,11 +65,208 @@ typedef struct {
 } Trigger;
 
 static List* busy_events;
-static List* timer_events;
+static TimerWheel timer_wheel = { .next = UINT64_MAX };
 static Map* trigger_events;
 static List* triggers;
 static List* idle_events;
 
+static bool timer_pool_grow(TimerWheel* wheel) {
+	TimerNode* nodes = malloc(sizeof(TimerNode) * TIMER_POOL_SIZE);
+	if(!nodes)
+		return false;
+
+	// Nodes are never given back to malloc, a stale ID still points to a node
+	for(int i = 0; i < TIMER_POOL_SIZE; i++) {
+		nodes[i].state = TIMER_FREE;
+		nodes[i].next = i + 1 < TIMER_POOL_SIZE ? &nodes[i + 1] : wheel->free;
+	}
+	wheel->free = nodes;
+
+	return true;
+}
+
+static TimerNode* timer_alloc(TimerWheel* wheel) {
+	if(!wheel->free && !timer_pool_grow(wheel))
+		return NULL;
+
+	TimerNode* node = wheel->free;
+	wheel->free = node->next;
+
+	return node;
+}
+
+static void timer_free(TimerWheel* wheel, TimerNode* node) {
+	node->state = TIMER_FREE;
+	node->next = wheel->free;
+	wheel->free = node;
+}
+
+static void timer_link(TimerWheel* wheel, TimerNode* node, uint8_t level, uint8_t index) {
+	TimerNode** head = &wheel->slots[level][index];
+	node->level = level;
+	node->index = index;
+
+	if(!*head) {
+		node->next = node->prev = node;
+		*head = node;
+	} else {
+		node->prev = (*head)->prev;
+		node->next = *head;
+		(*head)->prev->next = node;
+		(*head)->prev = node;
+	}
+
+	if(level < TIMER_LEVELS)
+		wheel->bitmaps[level][index / 64] |= 1UL << (index % 64);
+}
+
+static void timer_unlink(TimerWheel* wheel, TimerNode* node) {
+	TimerNode** head = &wheel->slots[node->level][node->index];
+
+	if(node->next == node) {
+		*head = NULL;
+		if(node->level < TIMER_LEVELS)
+			wheel->bitmaps[node->level][node->index / 64] &= ~(1UL << (node->index % 64));
+	} else {
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		if(*head == node)
+			*head = node->next;
+	}
+}
+
+static void timer_insert(TimerWheel* wheel, TimerNode* node) {
+	if(node->expire < wheel->time)
+		node->expire = wheel->time;
+
+	uint64_t delta = node->expire - wheel->time;
+	uint64_t expire = node->expire;
+	int level = 0;
+	while(level < TIMER_LEVELS - 1 && delta >> (TIMER_BITS * (level + 1)))
+		level++;
+
+	// Too far for the wheel: wait a whole last level rotation and be cascaded again
+	if(delta >> (TIMER_BITS * TIMER_LEVELS))
+		expire = wheel->time + ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1);
+
+	int shift = TIMER_BITS * level;
+	timer_link(wheel, node, level, (expire >> shift) & TIMER_MASK);
+
+	// The slot is called or cascaded when the lower bits of the time are zero
+	uint64_t tick = expire >> shift << shift;
+	if(tick < wheel->next)
+		wheel->next = tick;
+}
+
+/* First slot of a level bitmap at or after index, -1 if there is none */
+static int timer_bitmap_next(uint64_t* bitmap, int index) {
+	for(int i = index / 64; i < TIMER_SLOTS / 64; i++) {
+		uint64_t bits = bitmap[i];
+		if(i == index / 64)
+			bits &= ~0UL << (index % 64);
+
+		if(bits)
+			return i * 64 + __builtin_ctzl(bits);
+	}
+
+	return -1;
+}
+
+/* Tick of the next slot to be called or cascaded */
+static uint64_t timer_next(TimerWheel* wheel) {
+	uint64_t time = wheel->time;
+
+	// The current slot of an upper level is cascaded at the start of it
+	for(int level = 1; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_BITS * level;
+		if(time & ((1UL << shift) - 1))
+			break;
+
+		int index = (time >> shift) & TIMER_MASK;
+		if(wheel->bitmaps[level][index / 64] & 1UL << (index % 64))
+			return time;
+	}
+
+	for(int level = 0; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_BITS * level;
+		int index = (time >> shift) & TIMER_MASK;
+		uint64_t base = time >> (shift + TIMER_BITS) << (shift + TIMER_BITS);
+
+		// Otherwise it is a whole rotation ahead
+		if(level)
+			index++;
+
+		int next = index < TIMER_SLOTS ? timer_bitmap_next(wheel->bitmaps[level], index) : -1;
+		if(next >= 0)
+			return base | (uint64_t)next << shift;
+
+		// Slots behind the current one come after this level wraps around
+		if(timer_bitmap_next(wheel->bitmaps[level], 0) >= 0)
+			return base + (1UL << (shift + TIMER_BITS));
+	}
+
+	return UINT64_MAX;
+}
+
+/* Call the timers expired by the time, returns the number of timers called */
+static int timer_run(TimerWheel* wheel, uint64_t time) {
+	int count = 0;
+
+	while(wheel->next <= time) {
+		uint64_t tick = wheel->next;
+		wheel->time = tick;
+
+		// Move the timers of the upper level slots starting now down
+		for(int level = 1; level < TIMER_LEVELS; level++) {
+			int shift = TIMER_BITS * level;
+			if(tick & ((1UL << shift) - 1))
+				break;
+
+			TimerNode** head = &wheel->slots[level][(tick >> shift) & TIMER_MASK];
+			while(*head) {
+				TimerNode* node = *head;
+				timer_unlink(wheel, node);
+				timer_insert(wheel, node);
+			}
+		}
+
+		TimerNode** head = &wheel->slots[0][tick & TIMER_MASK];
+		while(*head) {
+			TimerNode* node = *head;
+			timer_unlink(wheel, node);
+			timer_link(wheel, node, TIMER_LEVEL_PENDING, 0);
+		}
+
+		// Timers added by callbacks expire from the next tick
+		wheel->time = tick + 1;
+		wheel->next = UINT64_MAX;
+
+		TimerNode** pending = &wheel->slots[TIMER_LEVEL_PENDING][0];
+		while(*pending) {
+			TimerNode* node = *pending;
+			timer_unlink(wheel, node);
+			node->state = TIMER_RUNNING;
+
+			if(node->func(node->context) && node->state == TIMER_RUNNING) {
+				node->state = TIMER_ARMED;
+				node->expire += node->period;
+				timer_insert(wheel, node);
+			} else {
+				wheel->count--;
+				timer_free(wheel, node);
+			}
+
+			count++;
+		}
+
+		uint64_t next = timer_next(wheel);
+		if(next < wheel->next)
+			wheel->next = next;
+	}
+
+	return count;
+}
+
 bool event_init() {
 #ifndef LINUX
 	extern uint64_t __timer_ms;
@@ -46,8 +278,7 @@ bool event_init() {
 	if(!busy_events)
 		return false;
 
-	timer_events = list_create(NULL);
-	if(!timer_events)
+	if(!timer_pool_grow(&timer_wheel))
 		return false;
 
 	trigger_events = map_create(8, map_uint64_hash, map_uint64_equals, NULL);
@@ -91,12 +322,6 @@ done:
 		last(event_id, event, last_context);
 }
 
-static bool get_first_bigger(void* time, void* node) {
-	return (clock_t)time < ((TimerNode*)node)->delay;
-}
-
-static uint64_t next_timer = UINT64_MAX;
-
 int event_loop() {
 	int count = 0;
 	
@@ -124,38 +349,8 @@ int event_loop() {
 		return count;
 	
 	// Timer events
-	uint64_t time = timer_us();
-	while(next_timer <= time) {
-		TimerNode* node = list_remove_first(timer_events);
-		if(node->func(node->context)) {
-			node->delay += node->period;
-			int index = list_index_of(timer_events, (void*)(uintptr_t)node->delay, get_first_bigger);
-			if(index == -1) {
-				if(!list_add(timer_events, node)) {
-					free(node);
-
-					printf("Timer event lost unexpectedly cause of memory lack!!!\n");
-					while(1) __asm__ __volatile__  ("hlt");
-				}
-			} else {
-				if(!list_add_at(timer_events, index, node)) {
-					free(node);
-
-					printf("Timer event lost unexpectedly cause of memory lack!!!\n");
-					while(1) __asm__ __volatile__  ("hlt");
-				}
-			}
-		} else {
-			free(node);
-		}
-		
-		if(list_size(timer_events) > 0)
-			next_timer = ((TimerNode*)list_get_first(timer_events))->delay;
-		else
-			next_timer = INT64_MAX;
-		
-		count++;
-	}
+	if(timer_wheel.next != UINT64_MAX)
+		count += timer_run(&timer_wheel, timer_us());
 
 	if(count > 0)
 		return count;
@@ -201,74 +396,72 @@ bool event_busy_remove(uint64_t id) {
 }
 
 uint64_t event_timer_add(EventFunc func, void* context, clock_t delay, clock_t period) {
-	TimerNode* node = malloc(sizeof(TimerNode));
+	TimerWheel* wheel = &timer_wheel;
+	TimerNode* node = timer_alloc(wheel);
 	if(!node)
 		return 0;
 	node->func = func;
 	node->context = context;
 	uint64_t time = timer_us();
 
-	node->delay = time + delay;
-	node->period = period;
-	
-	int index = list_index_of(timer_events, (void*)(uintptr_t)node->delay, get_first_bigger);
-	if(index == -1) {
-		if(!list_add(timer_events, node)) {
-			free(node);
-			return 0;
-		}
-	} else {
-		if(!list_add_at(timer_events, index, node)) {
-			free(node);
-			return 0;
-		}
+	// An empty wheel starts from now instead of cascading through the idle time
+	if(!wheel->count && wheel->time < time) {
+		wheel->time = time;
+		wheel->next = UINT64_MAX;
 	}
-	
-	next_timer = ((TimerNode*)list_get_first(timer_events))->delay;
-	
+
+	node->expire = time + delay;
+	node->period = period;
+	node->state = TIMER_ARMED;
+	timer_insert(wheel, node);
+	wheel->count++;
+
 	return (uintptr_t)node;
 }
 
 bool event_timer_update(uint64_t id, clock_t period) {
-	if(list_remove_data(timer_events, (void*)id)) {
-		TimerNode* node = (TimerNode*)id;
-		uint64_t time = timer_us();
-		node->period = period;
-		node->delay = time + node->period;
-		
-		int index = list_index_of(timer_events, (void*)(uint64_t)node->delay, get_first_bigger);
-		if(index == -1) {
-			if(!list_add(timer_events, node)) {
-				free(node);
-				return false;
-			}
-		} else {
-			if(!list_add_at(timer_events, index, node)) {
-				free(node);
-				return false;
-			}
-		}
-
-		next_timer = ((TimerNode*)list_get_first(timer_events))->delay;
-		
-		return true;
-	} else {
+	TimerNode* node = (TimerNode*)(uintptr_t)id;
+	if(!node)
 		return false;
+
+	uint64_t time = timer_us();
+	node->period = period;
+	switch(node->state) {
+		case TIMER_ARMED:
+			timer_unlink(&timer_wheel, node);
+			node->expire = time + period;
+			timer_insert(&timer_wheel, node);
+			return true;
+
+		case TIMER_RUNNING:
+			// Rearmed by the period when the callback returns true
+			node->expire = time;
+			return true;
+
+		default:
+			return false;
 	}
 }
 
 bool event_timer_remove(uint64_t id) {
-	if(list_remove_data(timer_events, (void*)(uintptr_t)id)) {
-		free((void*)(uintptr_t)id);
-		
-		if(list_size(timer_events) > 0)
-			next_timer = ((TimerNode*)list_get_first(timer_events))->delay;
-		else
-			next_timer = INT64_MAX;
-		
-		return true;
-	} else {
+	TimerNode* node = (TimerNode*)(uintptr_t)id;
+	if(!node)
 		return false;
+
+	switch(node->state) {
+		case TIMER_ARMED:
+			timer_unlink(&timer_wheel, node);
+			timer_wheel.count--;
+			timer_free(&timer_wheel, node);
+			return true;
+
+		case TIMER_RUNNING:
+			// Freed when the callback returns
+			node->state = TIMER_CANCELLED;
+			return true;
+
+		default:
+			return false;
 	}
 }
 
@@ -1,23 +1,194 @@
 #include <stdint.h>
+#include <string.h>
 #include <thread.h>
 #include <_malloc.h>
 #include <gmalloc.h>
 
+/*
+ * Blocks of up to GMALLOC_SMALL_MAX bytes with the header are rounded up to a
+ * power of two size class and cached per thread. A thread refills an empty
+ * class with a batch of blocks from the global pool and returns a batch when
+ * it holds two. A batch is allocated and freed under one hold of the lock of
+ * the pool, so the lock is taken once per batch instead of once per block.
+ * Larger blocks go to the global pool directly. Every block starts with a
+ * header of its class and usable size, which keeps the data aligned to 16
+ * bytes, and a cached block links the next one in the header.
+ */
+
+#define GMALLOC_HEADER_SIZE	16
+#define GMALLOC_MIN_SHIFT	5		// 32 bytes class
+#define GMALLOC_CLASS_COUNT	7		// 32 to 2048 bytes classes
+#define GMALLOC_SMALL_MAX	(1 << (GMALLOC_MIN_SHIFT + GMALLOC_CLASS_COUNT - 1))
+#define GMALLOC_BATCH_BYTES	8192		// Bytes of a batch of a big class
+#define GMALLOC_BATCH_MAX	32		// Blocks of a batch of a small class
+#define GMALLOC_LARGE		0xffffffff	// Class of a block from the global pool
+
+typedef struct _GmallocHeader {
+	union {
+		struct _GmallocHeader*	next;	///< Next cached block
+		uint64_t		size;	///< Usable bytes
+	};
+	uint32_t	class;			///< Size class or GMALLOC_LARGE
+	uint32_t	padding;
+} GmallocHeader;
+
+typedef struct _GmallocCache {
+	GmallocHeader*	list;	///< Cached blocks
+	uint32_t	count;	///< Number of cached blocks
+} GmallocCache;
+
+#ifdef LINUX
+#define THREAD_LOCAL	__thread
+#else
+#define THREAD_LOCAL	// Every thread of a VM has its own data segment
+#endif
+
 /* These functions could be replaced with kernel implemtation with strong symbols */
 void* __gmalloc_pool;
 
+static THREAD_LOCAL GmallocCache gmalloc_caches[GMALLOC_CLASS_COUNT];
+
+static inline uint32_t gmalloc_class(size_t size) {
+	size += GMALLOC_HEADER_SIZE - 1;
+	if(size < (1 << GMALLOC_MIN_SHIFT))
+		return 0;
+
+	return 64 - __builtin_clzl(size) - GMALLOC_MIN_SHIFT;
+}
+
+static inline uint32_t gmalloc_batch(uint32_t class) {
+	uint32_t batch = GMALLOC_BATCH_BYTES >> (GMALLOC_MIN_SHIFT + class);
+
+	return batch < GMALLOC_BATCH_MAX ? batch : GMALLOC_BATCH_MAX;
+}
+
+static GmallocHeader* gmalloc_refill(GmallocCache* cache, uint32_t class) {
+	void* blocks[GMALLOC_BATCH_MAX];
+	size_t count = __malloc_batch(1 << (GMALLOC_MIN_SHIFT + class), blocks,
+			gmalloc_batch(class), __gmalloc_pool);
+
+	for(size_t i = 0; i < count; i++) {
+		GmallocHeader* header = blocks[i];
+		header->next = cache->list;
+		cache->list = header;
+	}
+	cache->count += count;
+
+	return cache->list;
+}
+
+static void gmalloc_drain(GmallocCache* cache, uint32_t count) {
+	void* blocks[GMALLOC_BATCH_MAX];
+
+	while(count && cache->list) {
+		size_t i = 0;
+		while(i < GMALLOC_BATCH_MAX && count && cache->list) {
+			blocks[i++] = cache->list;
+			cache->list = cache->list->next;
+			cache->count--;
+			count--;
+		}
+
+		__free_batch(blocks, i, __gmalloc_pool);
+	}
+}
+
 void* __attribute__((weak)) gmalloc(size_t size) {
-	return __malloc(size, __gmalloc_pool);
+	GmallocHeader* header;
+
+	if(size > GMALLOC_SMALL_MAX - GMALLOC_HEADER_SIZE) {
+		header = __malloc(GMALLOC_HEADER_SIZE + size, __gmalloc_pool);
+		if(!header)
+			return NULL;
+
+		header->class = GMALLOC_LARGE;
+		header->size = size;
+
+		return (void*)header + GMALLOC_HEADER_SIZE;
+	}
+
+	uint32_t class = gmalloc_class(size);
+	GmallocCache* cache = &gmalloc_caches[class];
+	header = cache->list;
+	if(!header && !(header = gmalloc_refill(cache, class)))
+		return NULL;
+
+	cache->list = header->next;
+	cache->count--;
+
+	header->class = class;
+	header->size = (1 << (GMALLOC_MIN_SHIFT + class)) - GMALLOC_HEADER_SIZE;
+
+	return (void*)header + GMALLOC_HEADER_SIZE;
 }
 
 void __attribute__((weak)) gfree(void *ptr) {
-	__free(ptr, __gmalloc_pool);
+	if(!ptr)
+		return;
+
+	GmallocHeader* header = ptr - GMALLOC_HEADER_SIZE;
+	if(header->class == GMALLOC_LARGE) {
+		__free(header, __gmalloc_pool);
+		return;
+	}
+
+	// Blocks of the other threads are cached too, the pool is global
+	uint32_t class = header->class;
+	GmallocCache* cache = &gmalloc_caches[class];
+	header->next = cache->list;
+	cache->list = header;
+
+	uint32_t batch = gmalloc_batch(class);
+	if(++cache->count >= batch * 2)
+		gmalloc_drain(cache, batch);
 }
 
 void* __attribute__((weak)) gcalloc(size_t nmemb, size_t size) {
-	return __calloc(nmemb, size, __gmalloc_pool);
+	if(size && nmemb > (size_t)-1 / size)
+		return NULL;
+
+	void* ptr = gmalloc(nmemb * size);
+	if(ptr)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
 }
 
 void* __attribute__((weak)) grealloc(void *ptr, size_t size) {
-	return __realloc(ptr, size, __gmalloc_pool);
+	if(!ptr)
+		return gmalloc(size);
+
+	if(!size) {
+		gfree(ptr);
+		return NULL;
+	}
+
+	GmallocHeader* header = ptr - GMALLOC_HEADER_SIZE;
+	if(size <= header->size)
+		return ptr;
+
+	// The global pool may grow a large block in place
+	if(header->class == GMALLOC_LARGE && size > GMALLOC_SMALL_MAX - GMALLOC_HEADER_SIZE) {
+		header = __realloc(header, GMALLOC_HEADER_SIZE + size, __gmalloc_pool);
+		if(!header)
+			return NULL;
+
+		header->size = size;
+
+		return (void*)header + GMALLOC_HEADER_SIZE;
+	}
+
+	void* ptr2 = gmalloc(size);
+	if(!ptr2)
+		return NULL;
+
+	memcpy(ptr2, ptr, header->size);
+	gfree(ptr);
+
+	return ptr2;
+}
+
+void __attribute__((weak)) gmalloc_flush() {
+	for(uint32_t class = 0; class < GMALLOC_CLASS_COUNT; class++)
+		gmalloc_drain(&gmalloc_caches[class], (uint32_t)-1);
 }
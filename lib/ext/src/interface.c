@@ -5,22 +5,7 @@
 #define NIC_ADDR_IPv4	"net.addr.ipv4"
 
 IPv4InterfaceTable* interface_table_get(NIC* nic) {
-	int32_t interface_key = nic_config_key(nic, NIC_ADDR_IPv4);
-	IPv4InterfaceTable* table = NULL;
-
-	if(interface_key < 0) {
-		interface_key = nic_config_alloc(nic, NIC_ADDR_IPv4, sizeof(IPv4InterfaceTable));
-		if(interface_key < 0)
-			return NULL;
-
-		interface_key = nic_config_key(nic, NIC_ADDR_IPv4);
-
-		table = nic_config_get(nic, interface_key);
-		memset(table, 0, sizeof(IPv4InterfaceTable));
-	} else
-		table = nic_config_get(nic, interface_key);
-
-	return table;
+	return nic_config_lookup(nic, NIC_ADDR_IPv4, sizeof(IPv4InterfaceTable));
 }
 
 IPv4Interface* interface_alloc(NIC* nic, uint32_t address, uint32_t netmask, uint32_t gateway, bool is_default) {
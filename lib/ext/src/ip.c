@@ -2,9 +2,26 @@
 #include <net/ip.h>
 #include <net/checksum.h>
 
-void ip_pack(Packet* packet, uint16_t ip_body_len) {
+IP* ip_header(Packet* packet) {
+	PacketMeta* meta = packet_meta(packet);
+	if(meta && meta->l3_proto == ETHER_TYPE_IPv4)
+		return (IP*)(packet->buffer + meta->l3);
+
 	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
+	return (IP*)ether->payload;
+}
+
+void* ip_body(Packet* packet) {
+	PacketMeta* meta = packet_meta(packet);
+	if(meta && meta->l3_proto == ETHER_TYPE_IPv4 && meta->l4)
+		return packet->buffer + meta->l4;
+
+	IP* ip = ip_header(packet);
+	return (uint8_t*)ip + ip->ihl * 4;
+}
+
+void ip_pack(Packet* packet, uint16_t ip_body_len) {
+	IP* ip = ip_header(packet);
 	
 	ip->length = endian16(ip->ihl * 4 + ip_body_len);
 	ip->ttl = IPDEFTTL;
@@ -12,5 +29,9 @@ void ip_pack(Packet* packet, uint16_t ip_body_len) {
 	
 	ip->checksum = endian16(checksum(ip, ip->ihl * 4));
 	
-	packet->end = packet->start + ETHER_LEN + ip->ihl * 4 + ip_body_len;
+	packet->end = ((uint8_t*)ip - packet->buffer) + ip->ihl * 4 + ip_body_len;
+
+	PacketMeta* meta = packet_meta(packet);
+	if(meta)
+		meta->flags = (meta->flags & ~PACKET_META_IP_CSUM_NEEDED) | PACKET_META_IP_CSUM_GOOD;
 }
@@ -0,0 +1,126 @@
+#include <_malloc.h>
+#include <util/lfifo.h>
+
+/*
+ * Indices run freely and wrap around at 2^32, so head - tail is the number of
+ * reserved slots even after they wrap, and a FIFO of size slots holds size
+ * elements. The elements are written before the tail is stored with release
+ * ordering and read after it is loaded with acquire ordering.
+ */
+
+LFIFO* lfifo_create(size_t size, uint32_t flags, void* pool) {
+	if(!size || size & (size - 1) || size > 0x80000000)
+		return NULL;
+
+	// Aligned by hand, pools do not align to cache lines
+	void* ptr = __malloc(LFIFO_MEMSIZE(size) + 64 + sizeof(void*), pool);
+	if(!ptr)
+		return NULL;
+
+	LFIFO* fifo = (LFIFO*)(((uintptr_t)ptr + sizeof(void*) + 63) & ~(uintptr_t)63);
+	((void**)fifo)[-1] = ptr;
+
+	lfifo_init(fifo, size, flags);
+	fifo->pool = pool;
+
+	return fifo;
+}
+
+void lfifo_destroy(LFIFO* fifo) {
+	__free(((void**)fifo)[-1], fifo->pool);
+}
+
+bool lfifo_init(LFIFO* fifo, size_t size, uint32_t flags) {
+	if(!size || size & (size - 1) || size > 0x80000000)
+		return false;
+
+	fifo->size = size;
+	fifo->mask = size - 1;
+	fifo->flags = flags;
+	fifo->pool = NULL;
+	fifo->producer.head = fifo->producer.tail = 0;
+	fifo->consumer.head = fifo->consumer.tail = 0;
+
+	return true;
+}
+
+/*
+ * Reserves up to count slots from the head of the index. The other index
+ * bounds them: the consumer tail for pushes, the producer tail plus the size
+ * for pops.
+ */
+static inline uint32_t lfifo_reserve(LFIFOIndex* index, volatile uint32_t* bound, uint32_t offset,
+		bool single, uint32_t count, uint32_t* head) {
+	uint32_t next;
+	do {
+		*head = index->head;
+		uint32_t available = __atomic_load_n(bound, __ATOMIC_ACQUIRE) + offset - *head;
+		if(count > available)
+			count = available;
+
+		if(!count)
+			return 0;
+
+		next = *head + count;
+		if(single) {
+			index->head = next;
+			break;
+		}
+	} while(!__sync_bool_compare_and_swap(&index->head, *head, next));
+
+	return count;
+}
+
+// Publishes the slots after the earlier reservations are published
+static inline void lfifo_publish(LFIFOIndex* index, bool single, uint32_t head, uint32_t count) {
+	if(!single) {
+		while(index->tail != head)
+			asm volatile("pause");
+	}
+
+	__atomic_store_n(&index->tail, head + count, __ATOMIC_RELEASE);
+}
+
+size_t lfifo_push_bulk(LFIFO* fifo, void** array, size_t count) {
+	uint32_t head;
+	bool single = fifo->flags & LFIFO_SP;
+
+	count = lfifo_reserve(&fifo->producer, &fifo->consumer.tail, fifo->size, single,
+			count > fifo->size ? fifo->size : count, &head);
+
+	for(uint32_t i = 0; i < count; i++)
+		fifo->array[(head + i) & fifo->mask] = array[i];
+
+	if(count)
+		lfifo_publish(&fifo->producer, single, head, count);
+
+	return count;
+}
+
+size_t lfifo_pop_bulk(LFIFO* fifo, void** array, size_t count) {
+	uint32_t head;
+	bool single = fifo->flags & LFIFO_SC;
+
+	count = lfifo_reserve(&fifo->consumer, &fifo->producer.tail, 0, single,
+			count > fifo->size ? fifo->size : count, &head);
+
+	for(uint32_t i = 0; i < count; i++)
+		array[i] = fifo->array[(head + i) & fifo->mask];
+
+	if(count)
+		lfifo_publish(&fifo->consumer, single, head, count);
+
+	return count;
+}
+
+size_t lfifo_size(LFIFO* fifo) {
+	return (uint32_t)(fifo->producer.tail - fifo->consumer.tail);
+}
+
+size_t lfifo_capacity(LFIFO* fifo) {
+	return fifo->size;
+}
+
+bool lfifo_empty(LFIFO* fifo) {
+	return fifo->producer.tail == fifo->consumer.tail;
+}
@@ -2,9 +2,134 @@
 #include <_malloc.h>
 #include <util/map.h>
 
-// TODO: Change accessing list using index to using iterator.
-
 #define THRESHOLD(cap)	(((cap) >> 1) + ((cap) >> 2))	// 75%
+#define ENTRIES_MIN	8
+
+/*
+ * Entries are packed in an array, so iterating is a walk over the array and
+ * putting an element allocates nothing but when the array doubles. Removing an
+ * element moves the last entry into its place.
+ *
+ * The table is open addressed with linear probing and refers to the entries
+ * by index. Slots are placed Robin Hood style: an entry which is farther from
+ * its home slot takes the place of a nearer one, which keeps the probes short
+ * and lets a lookup stop at the first slot nearer to its home than the key
+ * would be. Removing a slot shifts the following ones back, so there are no
+ * tombstones.
+ */
+
+static inline uint32_t map_mix(Map* map, void* key) {
+	return (map->hash(key) * 0x9e3779b97f4a7c15UL) >> 32;
+}
+
+static inline size_t map_distance(Map* map, size_t pos, uint32_t hash) {
+	return (pos - hash) & (map->capacity - 1);
+}
+
+static MapSlot* map_find(Map* map, void* key, uint32_t hash) {
+	size_t mask = map->capacity - 1;
+	size_t pos = hash & mask;
+	for(size_t distance = 0; ; distance++, pos = (pos + 1) & mask) {
+		MapSlot* slot = &map->table[pos];
+		if(!slot->index || map_distance(map, pos, slot->hash) < distance)
+			return NULL;
+
+		if(slot->hash == hash && map->equals(map->entries[slot->index - 1].key, key))
+			return slot;
+	}
+}
+
+// Slot which refers to the entry
+static MapSlot* map_slot(Map* map, size_t index) {
+	size_t mask = map->capacity - 1;
+	size_t pos = map_mix(map, map->entries[index].key) & mask;
+	while(map->table[pos].index != index + 1)
+		pos = (pos + 1) & mask;
+
+	return &map->table[pos];
+}
+
+static void map_insert(Map* map, MapSlot slot) {
+	size_t mask = map->capacity - 1;
+	size_t pos = slot.hash & mask;
+	for(size_t distance = 0; ; distance++, pos = (pos + 1) & mask) {
+		MapSlot* current = &map->table[pos];
+		if(!current->index) {
+			*current = slot;
+			return;
+		}
+
+		size_t current_distance = map_distance(map, pos, current->hash);
+		if(current_distance < distance) {
+			MapSlot tmp = *current;
+			*current = slot;
+			slot = tmp;
+			distance = current_distance;
+		}
+	}
+}
+
+static void map_delete(Map* map, MapSlot* slot) {
+	size_t mask = map->capacity - 1;
+	size_t pos = slot - map->table;
+	size_t index = slot->index - 1;
+
+	while(true) {
+		size_t next = (pos + 1) & mask;
+		MapSlot* current = &map->table[next];
+		if(!current->index || map_distance(map, next, current->hash) == 0)
+			break;
+
+		map->table[pos] = *current;
+		pos = next;
+	}
+	map->table[pos].index = 0;
+
+	size_t last = --map->size;
+	if(index != last) {
+		map_slot(map, last)->index = index + 1;
+		map->entries[index] = map->entries[last];
+	}
+}
+
+static bool map_table_resize(Map* map, size_t capacity) {
+	MapSlot* table = __malloc(sizeof(MapSlot) * capacity, map->pool);
+	if(!table)
+		return false;
+
+	memset(table, 0x0, sizeof(MapSlot) * capacity);
+
+	MapSlot* old = map->table;
+	size_t old_capacity = map->capacity;
+	map->table = table;
+	map->capacity = capacity;
+	map->threshold = THRESHOLD(capacity);
+
+	for(size_t i = 0; i < old_capacity; i++) {
+		if(old[i].index)
+			map_insert(map, old[i]);
+	}
+
+	__free(old, map->pool);
+
+	return true;
+}
+
+static bool map_entries_resize(Map* map, size_t capacity) {
+	MapEntry* entries = __malloc(sizeof(MapEntry) * capacity, map->pool);
+	if(!entries)
+		return false;
+
+	if(map->entries) {
+		memcpy(entries, map->entries, sizeof(MapEntry) * map->size);
+		__free(map->entries, map->pool);
+	}
+
+	map->entries = entries;
+	map->entries_capacity = capacity;
+
+	return true;
+}
 
 Map* map_create(size_t initial_capacity, uint64_t(*hash)(void*), bool(*equals)(void*,void*), void* pool) {
 	if(!equals)
@@ -21,13 +146,15 @@ Map* map_create(size_t initial_capacity, uint64_t(*hash)(void*), bool(*equals)(v
 	if(!map)
 		return NULL;
 
-	map->table = __malloc(sizeof(List*) * capacity, pool);
+	map->table = __malloc(sizeof(MapSlot) * capacity, pool);
 	if(!map->table) {
 		__free(map, pool);
 		return NULL;
 	}
 
-	memset(map->table, 0x0, sizeof(List*) * capacity);
+	memset(map->table, 0x0, sizeof(MapSlot) * capacity);
+	map->entries = NULL;
+	map->entries_capacity = 0;
 	map->capacity = capacity;
 	map->threshold = THRESHOLD(capacity);
 	map->size = 0;
@@ -38,27 +165,11 @@ Map* map_create(size_t initial_capacity, uint64_t(*hash)(void*), bool(*equals)(v
 	return map;
 }
 
-static void destroy(Map* map) {
-	for(size_t i = 0; i < map->capacity; i++) {
-		List* list = map->table[i];
-		if(!list)
-			continue;
-		
-		ListIterator iter;
-		list_iterator_init(&iter, list);
-		while(list_iterator_has_next(&iter)) {
-			MapEntry* entry = list_iterator_next(&iter);
-			__free(entry, map->pool);
-		}
-		
-		list_destroy(list);
-	}
-	
-	__free(map->table, map->pool);
-}
-
 void map_destroy(Map* map) {
-	destroy(map);
+	if(map->entries)
+		__free(map->entries, map->pool);
+
+	__free(map->table, map->pool);
 	__free(map, map->pool);
 }
 
@@ -67,171 +178,64 @@ bool map_is_empty(Map* map) {
 }
 
 bool map_put(Map* map, void* key, void* data) {
-	if(map->size + 1 > map->threshold) {
-		// Create new map
-		Map map2;
-		size_t capacity = map->capacity * 2;
-		map2.table = __malloc(sizeof(List*) * capacity, map->pool);
-		if(!map2.table)
-			return false;
-		memset(map2.table, 0x0, sizeof(List*) * capacity);
-		map2.capacity = capacity;
-		map2.threshold = THRESHOLD(capacity);
-		map2.size = 0;
-		map2.hash = map->hash;
-		map2.equals = map->equals;
-		map2.pool = map->pool;
-		
-		// Copy
-		MapIterator iter;
-		map_iterator_init(&iter, map);
-		while(map_iterator_has_next(&iter)) {
-			MapEntry* entry = map_iterator_next(&iter);
-			if(!map_put(&map2, entry->key, entry->data)) {
-				destroy(&map2);
-				return false;
-			}
-		}
-		
-		// Destory
-		destroy(map);
-		
-		// Paste
-		memcpy(map, &map2, sizeof(Map));
-	}
-	
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
-		map->table[index] = list_create(map->pool);
-		if(!map->table[index])
-			return false;
-	} else {
-		size_t size = list_size(map->table[index]);
-		for(size_t i = 0; i < size; i++) {
-			MapEntry* entry = list_get(map->table[index], i);
-			if(map->equals(entry->key, key))
-				return false;
-		}
-	}
-	
-	MapEntry* entry = __malloc(sizeof(MapEntry), map->pool);
-	if(!entry) {
-		if(list_is_empty(map->table[index])) {
-			list_destroy(map->table[index]);
-			map->table[index] = NULL;
-		}
+	uint32_t hash = map_mix(map, key);
+	if(map_find(map, key, hash))
 		return false;
-	}
-	
+
+	if(map->size + 1 > map->threshold && !map_table_resize(map, map->capacity * 2))
+		return false;
+
+	if(map->size == map->entries_capacity &&
+			!map_entries_resize(map, map->entries_capacity ? map->entries_capacity * 2 : ENTRIES_MIN))
+		return false;
+
+	MapEntry* entry = &map->entries[map->size];
 	entry->key = key;
 	entry->data = data;
-	
-	if(!list_add(map->table[index], entry)) {
-		__free(entry, map->pool);
-		if(list_is_empty(map->table[index])) {
-			list_destroy(map->table[index]);
-			map->table[index] = NULL;
-		}
+	map_insert(map, (MapSlot){ .hash = hash, .index = ++map->size });
 
-		return false;
-	}
-	map->size++;
-	
 	return true;
 }
 
 bool map_update(Map* map, void* key, void* data) {
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
+	MapSlot* slot = map_find(map, key, map_mix(map, key));
+	if(!slot)
 		return false;
-	}
-	
-	size_t size = list_size(map->table[index]);
-	for(size_t i = 0; i < size; i++) {
-		MapEntry* entry = list_get(map->table[index], i);
-		if(map->equals(entry->key, key)) {
-			entry->data = data;
-			return true;
-		}
-	}
-	
-	return false;
+
+	map->entries[slot->index - 1].data = data;
+
+	return true;
 }
 
 void* map_get(Map* map, void* key) {
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
+	MapSlot* slot = map_find(map, key, map_mix(map, key));
+	if(!slot)
 		return NULL;
-	}
-	
-	size_t size = list_size(map->table[index]);
-	for(size_t i = 0; i < size; i++) {
-		MapEntry* entry = list_get(map->table[index], i);
-		if(map->equals(entry->key, key))
-			return entry->data;
-	}
-	
-	return NULL;
+
+	return map->entries[slot->index - 1].data;
 }
 
 void* map_get_key(Map* map, void* key) {
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
+	MapSlot* slot = map_find(map, key, map_mix(map, key));
+	if(!slot)
 		return NULL;
-	}
-	
-	size_t size = list_size(map->table[index]);
-	for(size_t i = 0; i < size; i++) {
-		MapEntry* entry = list_get(map->table[index], i);
-		if(map->equals(entry->key, key))
-			return entry->key;
-	}
-	
-	return NULL;
+
+	return map->entries[slot->index - 1].key;
 }
 
 bool map_contains(Map* map, void* key) {
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
-		return false;
-	}
-	
-	size_t size = list_size(map->table[index]);
-	for(size_t i = 0; i < size; i++) {
-		MapEntry* entry = list_get(map->table[index], i);
-		if(map->equals(entry->key, key))
-			return true;
-	}
-	
-	return false;
+	return map_find(map, key, map_mix(map, key)) != NULL;
 }
 
 void* map_remove(Map* map, void* key) {
-	size_t index = map->hash(key) % map->capacity;
-	if(!map->table[index]) {
+	MapSlot* slot = map_find(map, key, map_mix(map, key));
+	if(!slot)
 		return NULL;
-	}
-	
-	size_t size = list_size(map->table[index]);
-	for(size_t i = 0; i < size; i++) {
-		MapEntry* entry = list_get(map->table[index], i);
-		if(map->equals(entry->key, key)) {
-			void* data = entry->data;
-			list_remove(map->table[index], i);
-			__free(entry, map->pool);
-			
-			if(list_is_empty(map->table[index])) {
-				list_destroy(map->table[index]);
-				map->table[index] = NULL;
-			}
-			
-			map->size--;
-			
-			return data;
-		}
-	}
-	
-	return NULL;
+
+	void* data = map->entries[slot->index - 1].data;
+	map_delete(map, slot);
+
+	return data;
 }
 
 size_t map_capacity(Map* map) {
@@ -244,49 +248,23 @@ size_t map_size(Map* map) {
 
 void map_iterator_init(MapIterator* iter, Map* map) {
 	iter->map = map;
-	for(iter->index = 0; iter->index < map->capacity && !map->table[iter->index]; iter->index++);
-	iter->list_index = 0;
+	iter->index = 0;
 }
 
 bool map_iterator_has_next(MapIterator* iter) {
-	if(iter->index >= iter->map->capacity)
-		return false;
-	
-	if(iter->map->table[iter->index] && iter->list_index < list_size(iter->map->table[iter->index]))
-		return true;
-	
-	for(iter->index++; iter->index < iter->map->capacity && !iter->map->table[iter->index]; iter->index++);
-	
-	if(iter->index < iter->map->capacity) {
-		iter->list_index = 0;
-		return true;
-	} else {
-		return false;
-	}
+	return iter->index < iter->map->size;
 }
 
 MapEntry* map_iterator_next(MapIterator* iter) {
-	MapEntry* entry = list_get(iter->map->table[iter->index], iter->list_index++);
-	iter->entry.key = entry->key;
-	iter->entry.data = entry->data;
-	
-	return &iter->entry;
+	return &iter->map->entries[iter->index++];
 }
 
 MapEntry* map_iterator_remove(MapIterator* iter) {
-	iter->list_index--;
-	MapEntry* entry = list_remove(iter->map->table[iter->index], iter->list_index);
-	iter->entry.key = entry->key;
-	iter->entry.data = entry->data;
-	__free(entry, iter->map->pool);
-	
-	if(list_is_empty(iter->map->table[iter->index])) {
-		list_destroy(iter->map->table[iter->index]);
-		iter->map->table[iter->index] = NULL;
-	}
-	
-	iter->map->size--;
-	
+	// The last entry is moved to the removed one, which is iterated next
+	iter->index--;
+	iter->entry = iter->map->entries[iter->index];
+	map_delete(iter->map, map_slot(iter->map, iter->index));
+
 	return &iter->entry;
 }
 
@@ -0,0 +1,235 @@
+#include <_malloc.h>
+#include <lock.h>
+#include <thread.h>
+#include <util/objpool.h>
+
+/*
+ * A slab starts with a header linking the other slabs, and a free object
+ * links the next one in its first word. The lock is taken only by a cached
+ * pool, the others are used by one thread like the other data structures.
+ */
+
+#define SLAB_HEADER_SIZE	16
+
+// Called with the lock held
+static bool object_pool_grow(ObjectPool* object_pool) {
+	void** slab = __malloc(SLAB_HEADER_SIZE + object_pool->size * object_pool->count, object_pool->pool);
+	if(!slab)
+		return false;
+
+	*slab = object_pool->slabs;
+	object_pool->slabs = slab;
+	object_pool->slab_count++;
+
+	object_pool->next = (uint8_t*)slab + SLAB_HEADER_SIZE;
+	object_pool->end = object_pool->next + object_pool->size * object_pool->count;
+
+	return true;
+}
+
+// Called with the lock held
+static inline void* object_pool_take(ObjectPool* object_pool) {
+	void* object = object_pool->free;
+	if(object) {
+		object_pool->free = *(void**)object;
+		return object;
+	}
+
+	if(object_pool->next == object_pool->end && !object_pool_grow(object_pool))
+		return NULL;
+
+	object = object_pool->next;
+	object_pool->next += object_pool->size;
+
+	return object;
+}
+
+static inline ObjectPoolCache* object_pool_cache(ObjectPool* object_pool) {
+	if(!object_pool->caches)
+		return NULL;
+
+	int id = thread_id();
+
+	return id < OBJECT_POOL_CACHE_COUNT ? &object_pool->caches[id] : NULL;
+}
+
+// Moves the first count objects of the cache to the free list of the pool
+static void object_pool_drain(ObjectPool* object_pool, ObjectPoolCache* cache, uint32_t count) {
+	if(!count)
+		return;
+
+	void* first = cache->list;
+	void* last = first;
+	for(uint32_t i = 1; i < count; i++)
+		last = *(void**)last;
+
+	cache->list = *(void**)last;
+	cache->count -= count;
+
+	lock_lock(&object_pool->lock);
+	*(void**)last = object_pool->free;
+	object_pool->free = first;
+	lock_unlock(&object_pool->lock);
+}
+
+ObjectPool* object_pool_create(size_t size, size_t count, uint32_t flags, void* pool) {
+	if(!size || !count)
+		return NULL;
+
+	ObjectPool* object_pool = __malloc(sizeof(ObjectPool), pool);
+	if(!object_pool)
+		return NULL;
+
+	object_pool->size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	object_pool->count = count;
+	object_pool->flags = flags;
+	object_pool->pool = pool;
+
+	lock_init(&object_pool->lock);
+	object_pool->slabs = NULL;
+	object_pool->next = NULL;
+	object_pool->end = NULL;
+	object_pool->free = NULL;
+	object_pool->slab_count = 0;
+	object_pool->gets = 0;
+	object_pool->puts = 0;
+	object_pool->caches = NULL;
+
+	if(flags & OBJECT_POOL_CACHED) {
+		// Aligned by hand, pools do not align to cache lines
+		size_t caches_size = sizeof(ObjectPoolCache) * OBJECT_POOL_CACHE_COUNT;
+		void* ptr = __malloc(caches_size + 64 + sizeof(void*), pool);
+		if(!ptr)
+			goto failed;
+
+		object_pool->caches = (ObjectPoolCache*)(((uintptr_t)ptr + sizeof(void*) + 63) & ~(uintptr_t)63);
+		((void**)object_pool->caches)[-1] = ptr;
+
+		for(int i = 0; i < OBJECT_POOL_CACHE_COUNT; i++) {
+			object_pool->caches[i].list = NULL;
+			object_pool->caches[i].count = 0;
+			object_pool->caches[i].gets = 0;
+			object_pool->caches[i].puts = 0;
+		}
+	}
+
+	if(!object_pool_grow(object_pool))
+		goto failed;
+
+	return object_pool;
+
+failed:
+	if(object_pool->caches)
+		__free(((void**)object_pool->caches)[-1], pool);
+
+	__free(object_pool, pool);
+
+	return NULL;
+}
+
+void object_pool_destroy(ObjectPool* object_pool) {
+	void* slab = object_pool->slabs;
+	while(slab) {
+		void* next = *(void**)slab;
+		__free(slab, object_pool->pool);
+		slab = next;
+	}
+
+	if(object_pool->caches)
+		__free(((void**)object_pool->caches)[-1], object_pool->pool);
+
+	__free(object_pool, object_pool->pool);
+}
+
+void* object_pool_get(ObjectPool* object_pool) {
+	ObjectPoolCache* cache = object_pool_cache(object_pool);
+	void* object;
+
+	if(!cache) {
+		bool locked = object_pool->flags & OBJECT_POOL_CACHED;
+		if(locked)
+			lock_lock(&object_pool->lock);
+
+		object = object_pool_take(object_pool);
+		if(object)
+			object_pool->gets++;
+
+		if(locked)
+			lock_unlock(&object_pool->lock);
+
+		return object;
+	}
+
+	object = cache->list;
+	if(!object) {
+		lock_lock(&object_pool->lock);
+		for(int i = 0; i < OBJECT_POOL_BATCH; i++) {
+			void* taken = object_pool_take(object_pool);
+			if(!taken)
+				break;
+
+			*(void**)taken = cache->list;
+			cache->list = taken;
+			cache->count++;
+		}
+		lock_unlock(&object_pool->lock);
+
+		object = cache->list;
+		if(!object)
+			return NULL;
+	}
+
+	cache->list = *(void**)object;
+	cache->count--;
+	cache->gets++;
+
+	return object;
+}
+
+void object_pool_put(ObjectPool* object_pool, void* object) {
+	ObjectPoolCache* cache = object_pool_cache(object_pool);
+
+	if(!cache) {
+		bool locked = object_pool->flags & OBJECT_POOL_CACHED;
+		if(locked)
+			lock_lock(&object_pool->lock);
+
+		*(void**)object = object_pool->free;
+		object_pool->free = object;
+		object_pool->puts++;
+
+		if(locked)
+			lock_unlock(&object_pool->lock);
+
+		return;
+	}
+
+	*(void**)object = cache->list;
+	cache->list = object;
+	cache->puts++;
+
+	if(++cache->count >= OBJECT_POOL_BATCH * 2)
+		object_pool_drain(object_pool, cache, OBJECT_POOL_BATCH);
+}
+
+void object_pool_flush(ObjectPool* object_pool) {
+	ObjectPoolCache* cache = object_pool_cache(object_pool);
+	if(cache)
+		object_pool_drain(object_pool, cache, cache->count);
+}
+
+void object_pool_stats(ObjectPool* object_pool, ObjectPoolStats* stats) {
+	stats->total = object_pool->slab_count * object_pool->count;
+	stats->slabs = object_pool->slab_count;
+	stats->gets = object_pool->gets;
+	stats->puts = object_pool->puts;
+
+	if(object_pool->caches) {
+		for(int i = 0; i < OBJECT_POOL_CACHE_COUNT; i++) {
+			stats->gets += object_pool->caches[i].gets;
+			stats->puts += object_pool->caches[i].puts;
+		}
+	}
+
+	stats->used = stats->gets - stats->puts;
+}
@@ -1,56 +1,144 @@
-#include <string.h>
 #include <net/port.h>
+#include <thread.h>
 #include <nic.h>
 
-#define PORT_MAP_SIZE		(65536 / 8)
+#define WORD_START		(PORT_EPHEMERAL_START / 64)
+#define WORD_END		(PORT_EPHEMERAL_END / 64)
 
-uint8_t* port_map_get(NIC* nic, char* key_name) {
-	int32_t port_map_key = nic_config_key(nic, key_name);
-	uint8_t* port_map = NULL;
-
-	if(port_map_key <= 0) {
-		port_map_key = nic_config_alloc(nic, key_name, PORT_MAP_SIZE);
-		if(port_map_key <= 0)
-			return false;
+PortMap* port_map_get(NIC* nic, char* key_name) {
+	return nic_config_lookup(nic, key_name, sizeof(PortMap));
+}
 
-		port_map = nic_config_get(nic, port_map_key);
-		memset(port_map, 0, PORT_MAP_SIZE);
-	} else
-		port_map = nic_config_get(nic, port_map_key);
+/*
+ * A set bit of full is only a hint that the word has no free port. It is set
+ * after the last port of the word is taken and cleared after a port of the
+ * word is freed. Setting it checks the word again, so a port freed meanwhile
+ * never stays hidden.
+ */
+static void port_mark_full(PortMap* port_map, uint32_t word) {
+	uint64_t bit = 1UL << (word % 64);
 
-	return port_map;
+	__sync_fetch_and_or(&port_map->full[word / 64], bit);
+	if(~port_map->ports[word])
+		__sync_fetch_and_and(&port_map->full[word / 64], ~bit);
 }
 
-bool port_free(uint8_t* port_map, uint16_t port) {
-	int index = port / 8;
-	uint8_t idx = 1 << (port % 8);
+// Takes the lowest free port of the word
+static uint16_t port_take(PortMap* port_map, uint32_t word) {
+	while(true) {
+		uint64_t ports = port_map->ports[word];
+		if(!~ports) {
+			port_mark_full(port_map, word);
+			return 0;
+		}
 
-	port_map[index] |= idx;
-	port_map[index] ^= idx;
+		uint64_t bit = ~ports & (ports + 1);
+		if(__sync_bool_compare_and_swap(&port_map->ports[word], ports, ports | bit)) {
+			if(!~(ports | bit))
+				port_mark_full(port_map, word);
 
-	return true;
+			return word * 64 + __builtin_ctzl(bit);
+		}
+	}
 }
 
-static bool port_alloc0(uint8_t* port_map, uint16_t port) {
-	int index = port / 8;
-	uint8_t idx = 1 << (port % 8);
+// Searches the words [from, to) which are not marked full
+static uint16_t port_search(PortMap* port_map, uint32_t from, uint32_t to, uint32_t* found) {
+	uint32_t word = from;
+	while(word < to) {
+		uint64_t candidates = ~port_map->full[word / 64] & (~0UL << (word % 64));
+		if(!candidates) {
+			word = (word / 64 + 1) * 64;
+			continue;
+		}
 
-	if(port_map[index] & idx)
-		return false;
+		word = word / 64 * 64 + __builtin_ctzl(candidates);
+		if(word >= to)
+			break;
 
-	port_map[index] |= idx;
+		uint16_t port = port_take(port_map, word);
+		if(port) {
+			*found = word;
+			return port;
+		}
 
-	return true;
+		word++;
+	}
+
+	return 0;
 }
 
-uint16_t port_alloc(uint8_t* port_map, uint16_t port) {
+static uint16_t port_alloc_ephemeral(PortMap* port_map) {
+	int count = thread_count();
+	if(count < 1)
+		count = 1;
+	else if(count > PORT_SHARD_COUNT)
+		count = PORT_SHARD_COUNT;
+
+	int index = thread_id() % count;
+	uint32_t words = WORD_END - WORD_START;
+	uint32_t start = WORD_START + words * index / count;
+	uint32_t end = WORD_START + words * (index + 1) / count;
+
+	PortShard* shard = &port_map->shards[index];
+	uint32_t cursor = shard->cursor;
+	if(cursor < start || cursor >= end)
+		cursor = start;
+
+	uint32_t found;
+	uint16_t port = port_search(port_map, cursor, end, &found);
+	if(!port)
+		port = port_search(port_map, start, cursor, &found);
+
 	if(port)
-		return port_alloc0(port_map, port);
+		shard->cursor = found;
+
+	return port;
+}
+
+uint16_t port_alloc(PortMap* port_map, uint16_t port) {
+	if(!port)
+		return port_alloc_ephemeral(port_map);
 
-	for(int i = 1024; i < 49152; i++) {
-		if(port_alloc0(port_map, i))
-			return i;
+	uint32_t word = port / 64;
+	uint64_t bit = 1UL << (port % 64);
+	uint64_t ports = __sync_fetch_and_or(&port_map->ports[word], bit);
+	if(ports & bit)
+		return 0;
+
+	if(!~(ports | bit))
+		port_mark_full(port_map, word);
+
+	return port;
+}
+
+// Frees the ports of the bits in the word and returns how many were used
+static uint32_t port_release(PortMap* port_map, uint32_t word, uint64_t bits) {
+	uint64_t ports = __sync_fetch_and_and(&port_map->ports[word], ~bits);
+
+	uint64_t bit = 1UL << (word % 64);
+	if(port_map->full[word / 64] & bit)
+		__sync_fetch_and_and(&port_map->full[word / 64], ~bit);
+
+	return __builtin_popcountl(ports & bits);
+}
+
+bool port_free(PortMap* port_map, uint16_t port) {
+	return port_release(port_map, port / 64, 1UL << (port % 64)) == 1;
+}
+
+uint32_t port_free_batch(PortMap* port_map, uint16_t* ports, uint32_t count) {
+	uint32_t freed = 0;
+
+	uint32_t i = 0;
+	while(i < count) {
+		uint32_t word = ports[i] / 64;
+		uint64_t bits = 0;
+		for(; i < count && ports[i] / 64 == word; i++)
+			bits |= 1UL << (ports[i] % 64);
+
+		freed += port_release(port_map, word, bits);
 	}
 
-	return 0;
+	return freed;
 }
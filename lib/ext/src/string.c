@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <_string.h>
+
+/*
+ * memcpy, memset, memmove and memcmp of the VMs, replacing the generic ones
+ * of libc. The vector functions for the CPU are picked on the first call of
+ * any of them, from CPUID as cpu_has_feature() of the kernel does. A thread
+ * racing the first call picks the same ones.
+ */
+
+static void string_select();
+
+static void* memset_select(void* s, int c, size_t n);
+static void* memcpy_select(void* dest, const void* src, size_t n);
+static void* memmove_select(void* dest, const void* src, size_t len);
+static int memcmp_select(const void* v1, const void* v2, size_t size);
+
+static void*(*memset_func)(void*, int, size_t) = memset_select;
+static void*(*memcpy_func)(void*, const void*, size_t) = memcpy_select;
+static void*(*memmove_func)(void*, const void*, size_t) = memmove_select;
+static int(*memcmp_func)(const void*, const void*, size_t) = memcmp_select;
+
+static void string_select() {
+	uint32_t a, b, c, d;
+
+	asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x00), "c"(0));
+	uint32_t max_leaf = a;
+
+	asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x01), "c"(0));
+	bool sse2 = d & 0x4000000;
+	bool osxsave = c & 0x8000000;
+
+	// Leaf 7 reads as the highest leaf on the CPUs which do not have it
+	bool avx2 = false;
+	bool erms = false;
+	if(max_leaf >= 0x07) {
+		asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x07), "c"(0));
+		avx2 = b & 0x20;
+		erms = b & 0x200;
+	}
+
+	// AVX2 needs XCR0 to enable the SSE and AVX states
+	if(osxsave) {
+		uint32_t xcr0, xcr0_high;
+		asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+		avx2 = avx2 && (xcr0 & 0x6) == 0x6;
+	} else {
+		avx2 = false;
+	}
+
+	if(!sse2) {
+		memset_func = __memset;
+		memcpy_func = __memcpy;
+		memmove_func = __memmove;
+		memcmp_func = __memcmp;
+		return;
+	}
+
+	memmove_func = __memmove_sse;
+
+	if(avx2) {
+		memset_func = __memset_avx2;
+		memcpy_func = __memcpy_avx2;
+		memcmp_func = __memcmp_avx2;
+	} else if(erms) {
+		memset_func = __memset_erms;
+		memcpy_func = __memcpy_erms;
+		memcmp_func = __memcmp_sse;
+	} else {
+		memset_func = __memset_sse;
+		memcpy_func = __memcpy_sse;
+		memcmp_func = __memcmp_sse;
+	}
+}
+
+static void* memset_select(void* s, int c, size_t n) {
+	string_select();
+	return memset_func(s, c, n);
+}
+
+static void* memcpy_select(void* dest, const void* src, size_t n) {
+	string_select();
+	return memcpy_func(dest, src, n);
+}
+
+static void* memmove_select(void* dest, const void* src, size_t len) {
+	string_select();
+	return memmove_func(dest, src, len);
+}
+
+static int memcmp_select(const void* v1, const void* v2, size_t size) {
+	string_select();
+	return memcmp_func(v1, v2, size);
+}
+
+void* memset(void* s, int c, size_t n) {
+	return memset_func(s, c, n);
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+	return memcpy_func(dest, src, n);
+}
+
+void* memmove(void* dest, const void* src, size_t len) {
+	return memmove_func(dest, src, len);
+}
+
+int memcmp(const void* v1, const void* v2, size_t size) {
+	return memcmp_func(v1, v2, size);
+}
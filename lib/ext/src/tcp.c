@@ -6,20 +6,33 @@
 
 #define TCP_PORT_TABLE		"net.ip.tcp.porttable"
 
-bool tcp_port_alloc(NIC* nic, uint16_t port) {
-	uint8_t* port_map = port_map_get(nic, TCP_PORT_TABLE);
+uint16_t tcp_port_alloc(NIC* nic, uint16_t port) {
+	PortMap* port_map = port_map_get(nic, TCP_PORT_TABLE);
+	if(!port_map)
+		return 0;
+
 	return port_alloc(port_map, port);
 }
 
 bool tcp_port_free(NIC* nic, uint16_t port) {
-	uint8_t* port_map = port_map_get(nic, TCP_PORT_TABLE);
+	PortMap* port_map = port_map_get(nic, TCP_PORT_TABLE);
+	if(!port_map)
+		return false;
+
 	return port_free(port_map, port);
 }
 
+uint32_t tcp_port_free_batch(NIC* nic, uint16_t* ports, uint32_t count) {
+	PortMap* port_map = port_map_get(nic, TCP_PORT_TABLE);
+	if(!port_map)
+		return 0;
+
+	return port_free_batch(port_map, ports, count);
+}
+
 void tcp_pack(Packet* packet, uint16_t tcp_body_len) {
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	TCP* tcp = (TCP*)((uint8_t*)ip + ip->ihl * 4);
+	IP* ip = ip_header(packet);
+	TCP* tcp = ip_body(packet);
 	
 	uint16_t tcp_len = (tcp->offset * 4) + tcp_body_len;
 	
@@ -31,10 +44,12 @@ void tcp_pack(Packet* packet, uint16_t tcp_body_len) {
 	pseudo.length = endian16(tcp_len);
 	
 	tcp->checksum = 0;
-	uint32_t sum = (uint16_t)~checksum(&pseudo, sizeof(pseudo)) + (uint16_t)~checksum(tcp, tcp_len);
-	while(sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
-	tcp->checksum = endian16(~sum);
+	uint32_t sum = checksum_partial(&pseudo, sizeof(pseudo), 0);
+	tcp->checksum = endian16(checksum_finish(checksum_partial(tcp, tcp_len, sum)));
 	
+	PacketMeta* meta = packet_meta(packet);
+	if(meta)
+		meta->flags = (meta->flags & ~PACKET_META_L4_CSUM_NEEDED) | PACKET_META_L4_CSUM_GOOD;
+
 	ip_pack(packet, tcp_len);
 }
@@ -5,20 +5,32 @@
 
 #define UDP_PORT_TABLE		"net.ip.udp.porttable"
 
-bool udp_port_alloc(NIC* nic, uint16_t port) {
-	uint8_t* port_map = port_map_get(nic, UDP_PORT_TABLE);
+uint16_t udp_port_alloc(NIC* nic, uint16_t port) {
+	PortMap* port_map = port_map_get(nic, UDP_PORT_TABLE);
+	if(!port_map)
+		return 0;
+
 	return port_alloc(port_map, port);
 }
 
 bool udp_port_free(NIC* nic, uint16_t port) {
-	uint8_t* port_map = port_map_get(nic, UDP_PORT_TABLE);
+	PortMap* port_map = port_map_get(nic, UDP_PORT_TABLE);
+	if(!port_map)
+		return false;
+
 	return port_free(port_map, port);
 }
 
+uint32_t udp_port_free_batch(NIC* nic, uint16_t* ports, uint32_t count) {
+	PortMap* port_map = port_map_get(nic, UDP_PORT_TABLE);
+	if(!port_map)
+		return 0;
+
+	return port_free_batch(port_map, ports, count);
+}
+
 void udp_pack(Packet* packet, uint16_t udp_body_len) {
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	UDP* udp = (UDP*)((uint8_t*)ip + ip->ihl * 4);
+	UDP* udp = ip_body(packet);
 	
 	uint16_t udp_len = UDP_LEN + udp_body_len;
 	udp->length = endian16(udp_len);
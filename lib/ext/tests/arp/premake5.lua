@@ -0,0 +1,9 @@
+project 'arp'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/arp.c', 'src/arp.c' }
+    includedirs { '../../include', '../../../vnic/include' }
+    defines     { 'LINUX' }
+    optimize    'On'
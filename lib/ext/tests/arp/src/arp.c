@@ -0,0 +1,397 @@
+/**
+ * ARP table test and benchmark
+ *
+ * The ARP module runs on a simulated clock with a fake NIC which keeps the
+ * transmitted frames. The tests check lookups while the table grows to 64k
+ * entities, static entities, aging by the timer, request rate limiting,
+ * packets held until the reply arrives or dropped when it does not, per NIC
+ * tables, and replying to a request. The cycles per insert and per lookup are
+ * measured for 1k to 64k entities and should stay flat.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/interface.h>
+#include <util/event.h>
+
+#define TEST_COUNT	65536
+#define MAC(i)		(0x020000000000L + (i))
+#define ADDR(i)		(0x0a000000 + (i) * 7)	// 10.0.0.0/8
+#define LOCAL_ADDR	0xc0a80001		// 192.168.0.1
+
+static uint64_t now = 1;
+static int thread;
+static int errors;
+
+#define check(cond, ...) do {				\
+	if(!(cond)) {					\
+		printf("FAIL %s:%d: ", __func__, __LINE__);	\
+		printf(__VA_ARGS__);			\
+		printf("\n");				\
+		errors++;				\
+	}						\
+} while(0)
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+// Simulated environment
+uint64_t timer_us() {
+	return now;
+}
+
+int thread_id() {
+	return thread;
+}
+
+void lock_lock(uint8_t volatile* lock) {
+}
+
+void lock_unlock(uint8_t volatile* lock) {
+}
+
+void* gcalloc(size_t nmemb, size_t size) {
+	return calloc(nmemb, size);
+}
+
+void gfree(void* ptr) {
+	free(ptr);
+}
+
+static EventFunc timer_func;
+static void* timer_context;
+static int timer_thread;
+
+uint64_t event_timer_add(EventFunc func, void* context, clock_t delay, clock_t period) {
+	timer_func = func;
+	timer_context = context;
+	timer_thread = thread;
+	return 1;
+}
+
+bool event_timer_remove(uint64_t id) {
+	if(thread != timer_thread)
+		return false;
+
+	timer_func = NULL;
+	return true;
+}
+
+typedef struct {
+	NIC	nic;
+	void*	config;
+	Packet*	tx[1024];
+	int	tx_count;
+} FakeNIC;
+
+static FakeNIC nics[2];
+static int allocated;
+
+static FakeNIC* fake(NIC* nic) {
+	return (FakeNIC*)nic;
+}
+
+void* nic_config_lookup(NIC* nic, char* name, uint16_t size) {
+	FakeNIC* f = fake(nic);
+	if(!f->config)
+		f->config = calloc(1, size);
+
+	return f->config;
+}
+
+Packet* nic_alloc(NIC* nic, uint16_t size) {
+	Packet* packet = calloc(1, sizeof(Packet) + 128 + size);
+	packet->start = 64;
+	packet->end = 64 + size;
+	packet->size = 128 + size;
+	allocated++;
+
+	return packet;
+}
+
+bool nic_free(Packet* packet) {
+	free(packet);
+	allocated--;
+
+	return true;
+}
+
+bool nic_tx(NIC* nic, Packet* packet) {
+	FakeNIC* f = fake(nic);
+	f->tx[f->tx_count++] = packet;
+
+	return true;
+}
+
+static void tx_clear(NIC* nic) {
+	FakeNIC* f = fake(nic);
+	for(int i = 0; i < f->tx_count; i++)
+		nic_free(f->tx[i]);
+	f->tx_count = 0;
+}
+
+static IPv4Interface interface = { .address = LOCAL_ADDR, .netmask = 0xffffff00 };
+
+IPv4Interface* interface_get(NIC* nic, uint32_t address) {
+	return address == LOCAL_ADDR ? &interface : NULL;
+}
+
+IPv4InterfaceTable* interface_table_get(NIC* nic) {
+	return NULL;
+}
+
+static Packet* arp_packet(NIC* nic, uint16_t operation, uint64_t sha, uint32_t spa, uint32_t tpa) {
+	Packet* packet = nic_alloc(nic, sizeof(Ether) + sizeof(ARP));
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(nic->mac);
+	ether->smac = endian48(sha);
+	ether->type = endian16(ETHER_TYPE_ARP);
+
+	ARP* arp = (ARP*)ether->payload;
+	arp->htype = endian16(1);
+	arp->ptype = endian16(0x0800);
+	arp->hlen = 6;
+	arp->plen = 4;
+	arp->operation = endian16(operation);
+	arp->sha = endian48(sha);
+	arp->spa = endian32(spa);
+	arp->tha = endian48(nic->mac);
+	arp->tpa = endian32(tpa);
+
+	return packet;
+}
+
+static Packet* ip_packet(NIC* nic) {
+	Packet* packet = nic_alloc(nic, sizeof(Ether) + 20);
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->smac = endian48(nic->mac);
+	ether->type = endian16(ETHER_TYPE_IPv4);
+
+	return packet;
+}
+
+// The timer runs on its own thread
+static void run_timer(uint64_t until) {
+	int current = thread;
+	thread = timer_thread;
+	while(now < until) {
+		now += ARP_GC_INTERVAL;
+		if(timer_func && !timer_func(timer_context))
+			timer_func = NULL;
+	}
+	thread = current;
+}
+
+static void test_grow() {
+	ARPTable* table = arp_get_table(&nics[0].nic);
+	check(table != NULL, "no table");
+
+	for(int i = 0; i < TEST_COUNT; i++) {
+		check(arp_table_update(table, MAC(i), ADDR(i), true), "update %d", i);
+		if(i % 4096 == 0) {
+			for(int j = 0; j <= i; j += 97) {
+				ARPEntity entity;
+				check(arp_table_get_by_addr(table, ADDR(j), &entity) && entity.mac == MAC(j),
+						"lookup %d after %d inserts", j, i);
+			}
+		}
+	}
+	check(table->count == TEST_COUNT, "count %u", table->count);
+
+	for(int i = 0; i < TEST_COUNT; i += 2)
+		check(arp_table_remove(table, ADDR(i)), "remove %d", i);
+
+	for(int i = 0; i < TEST_COUNT; i++) {
+		ARPEntity entity;
+		bool found = arp_table_get_by_addr(table, ADDR(i), &entity);
+		if(i % 2)
+			check(found && entity.mac == MAC(i), "lookup %d after removes", i);
+		else
+			check(!found, "removed %d found", i);
+	}
+
+	check(arp_get_ip(&nics[0].nic, MAC(1)) == ADDR(1), "get ip");
+	check(arp_get_mac(&nics[0].nic, ADDR(3), LOCAL_ADDR) == MAC(3), "get mac");
+	check(nics[0].tx_count == 0, "request sent for a known address");
+
+	// Removed slots are reused without growing
+	uint32_t capacity = table->capacity;
+	for(int round = 0; round < 4; round++) {
+		for(int i = 0; i < TEST_COUNT; i += 2)
+			arp_table_update(table, MAC(i), ADDR(i), true);
+		for(int i = 0; i < TEST_COUNT; i += 2)
+			arp_table_remove(table, ADDR(i));
+	}
+	check(table->capacity == capacity, "capacity %u grew from %u", table->capacity, capacity);
+
+	arp_table_destroy(&nics[0].nic);
+}
+
+static void test_static_and_aging() {
+	NIC* nic = &nics[0].nic;
+	ARPTable* table = arp_get_table(nic);
+
+	check(arp_table_update(table, MAC(1), ADDR(1), false), "static");
+	check(!arp_table_update(table, MAC(2), ADDR(1), true), "dynamic replaced static");
+	check(arp_table_update(table, MAC(3), ADDR(1), false), "static replaced by static");
+	check(arp_table_update(table, MAC(4), ADDR(4), true), "dynamic");
+	check(arp_table_update(table, MAC(5), ADDR(4), true), "dynamic replaced by dynamic");
+
+	for(int i = 100; i < 20000; i++)
+		arp_table_update(table, MAC(i), ADDR(i), true);
+
+	run_timer(now + ARP_TIMEOUT / 2);
+	check(table->count == 20000 - 100 + 2, "aged early: %u", table->count);
+
+	// Every slot is visited within capacity / ARP_GC_BUDGET periods
+	run_timer(now + ARP_TIMEOUT / 2 + (table->capacity / ARP_GC_BUDGET + 1) * ARP_GC_INTERVAL);
+	check(table->count == 1, "not aged: %u", table->count);
+	ARPEntity entity;
+	check(arp_table_get_by_addr(table, ADDR(1), &entity) && entity.mac == MAC(3) &&
+			entity.state == ARP_STATE_STATIC, "static aged");
+
+	arp_table_destroy(nic);
+}
+
+static void test_resolve() {
+	NIC* nic = &nics[0].nic;
+	arp_get_table(nic);
+
+	// Requests are rate limited
+	for(int i = 0; i < 10; i++)
+		check(arp_get_mac(nic, ADDR(9), LOCAL_ADDR) == 0xffffffffffff, "unknown address resolved");
+	check(nics[0].tx_count == 1, "%d requests sent", nics[0].tx_count);
+
+	Ether* ether = (Ether*)(nics[0].tx[0]->buffer + nics[0].tx[0]->start);
+	ARP* arp = (ARP*)ether->payload;
+	check(endian16(arp->operation) == 1 && endian32(arp->tpa) == ADDR(9) && endian32(arp->spa) == LOCAL_ADDR,
+			"bad request");
+	tx_clear(nic);
+
+	// Packets are held until the reply
+	for(int i = 0; i < 3; i++)
+		check(arp_send(nic, ip_packet(nic), ADDR(9), LOCAL_ADDR), "send %d", i);
+	check(nics[0].tx_count == 0, "sent before reply");
+
+	check(arp_process(nic, arp_packet(nic, 2, MAC(9), ADDR(9), LOCAL_ADDR)), "reply");
+	check(nics[0].tx_count == 3, "%d held packets sent", nics[0].tx_count);
+	for(int i = 0; i < nics[0].tx_count; i++) {
+		ether = (Ether*)(nics[0].tx[i]->buffer + nics[0].tx[i]->start);
+		check(endian48(ether->dmac) == MAC(9), "dmac %lx", (uint64_t)endian48(ether->dmac));
+	}
+	tx_clear(nic);
+
+	check(arp_send(nic, ip_packet(nic), ADDR(9), LOCAL_ADDR), "send resolved");
+	check(nics[0].tx_count == 1, "resolved packet held");
+	tx_clear(nic);
+
+	// Held packets are dropped without a reply
+	for(int i = 0; i < ARP_PENDING_COUNT + 10; i++)
+		arp_send(nic, ip_packet(nic), ADDR(10), LOCAL_ADDR);
+	check(nics[0].tx_count == 1, "%d requests sent", nics[0].tx_count);
+	tx_clear(nic);
+	check(allocated == ARP_PENDING_COUNT, "%d packets held", allocated);
+
+	run_timer(now + ARP_RESOLVE_TIMEOUT + ARP_GC_INTERVAL);
+	check(allocated == 0, "%d packets leaked", allocated);
+	tx_clear(nic);
+
+	arp_table_destroy(nic);
+}
+
+static void test_nics() {
+	NIC* nic0 = &nics[0].nic;
+	NIC* nic1 = &nics[1].nic;
+
+	check(arp_get_table(nic0) != arp_get_table(nic1), "tables are shared");
+	arp_table_update(arp_get_table(nic0), MAC(1), ADDR(1), true);
+	ARPEntity entity;
+	check(!arp_table_get_by_addr(arp_get_table(nic1), ADDR(1), &entity), "entity is shared");
+
+	// Request to the local address is answered and the sender is learned
+	check(arp_process(nic1, arp_packet(nic1, 1, MAC(2), ADDR(2), LOCAL_ADDR)), "request");
+	check(nics[1].tx_count == 1, "no reply");
+	ARP* arp = (ARP*)((Ether*)(nics[1].tx[0]->buffer + nics[1].tx[0]->start))->payload;
+	check(endian16(arp->operation) == 2 && endian48(arp->tha) == MAC(2) && endian32(arp->spa) == LOCAL_ADDR,
+			"bad reply");
+	check(arp_get_mac(nic1, ADDR(2), LOCAL_ADDR) == MAC(2), "sender not learned");
+	tx_clear(nic1);
+
+	Packet* packet = arp_packet(nic1, 1, MAC(3), ADDR(3), LOCAL_ADDR + 1);
+	check(!arp_process(nic1, packet), "request to other address processed");
+	nic_free(packet);
+
+	arp_table_destroy(nic0);
+	arp_table_destroy(nic1);
+}
+
+static void test_threads() {
+	NIC* nic = &nics[0].nic;
+
+	// Destroyed on another thread, the timer ends on its own thread
+	arp_get_table(nic);
+	thread = 1;
+	arp_table_destroy(nic);
+	check(timer_func != NULL, "timer removed on another thread");
+	run_timer(now + ARP_GC_INTERVAL);
+	check(timer_func == NULL, "timer of a destroyed table runs");
+
+	// Created again on another thread, the old timer gives way
+	thread = 0;
+	arp_get_table(nic);
+	thread = 1;
+	arp_table_destroy(nic);
+	ARPTable* table = arp_get_table(nic);
+	check(table->gc_thread == 1, "timer thread %d", table->gc_thread);
+	arp_table_destroy(nic);
+	thread = 0;
+}
+
+static void bench() {
+	NIC* nic = &nics[0].nic;
+
+	printf("entities insert(cycles) lookup(cycles)\n");
+	for(int count = 1024; count <= TEST_COUNT; count *= 4) {
+		ARPTable* table = arp_get_table(nic);
+
+		uint64_t t = rdtsc();
+		for(int i = 0; i < count; i++)
+			arp_table_update(table, MAC(i), ADDR(i), true);
+		double insert = (double)(rdtsc() - t) / count;
+
+		uint64_t mac = 0;
+		uint64_t lookups = 10000000;
+		t = rdtsc();
+		for(uint64_t i = 0; i < lookups; i++)
+			mac += arp_get_mac(nic, ADDR((i * 7919) % count), LOCAL_ADDR);
+		double lookup = (double)(rdtsc() - t) / lookups;
+
+		check(mac != 0 && nics[0].tx_count == 0, "lookup missed");
+		printf("%8d %14.1f %14.1f\n", count, insert, lookup);
+
+		arp_table_destroy(nic);
+	}
+}
+
+int main(int argc, char** argv) {
+	nics[0].nic.id = 1;
+	nics[0].nic.mac = 0x001122334455;
+	nics[1].nic.id = 2;
+	nics[1].nic.mac = 0x001122334466;
+
+	test_grow();
+	test_static_and_aging();
+	test_resolve();
+	test_nics();
+	test_threads();
+	bench();
+
+	printf("%s\n", errors ? "FAILED" : "PASSED");
+
+	return errors != 0;
+}
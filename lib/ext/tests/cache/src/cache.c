@@ -202,7 +202,7 @@ static void cache_iterator_init_func(void **state) {
 	cache_iterator_init(&iter, cache);
 	
 	assert_int_equal(iter.cache, cache);
-	assert_int_equal(iter.node, cache->list->head);
+	assert_int_equal(iter.node, cache->head);
 
 	cache_destroy(cache);
 	cache = NULL;
@@ -0,0 +1,9 @@
+project 'checksum'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/checksum.c', 'src/checksum.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
+    optimize    'On'
@@ -0,0 +1,147 @@
+/**
+ * Internet checksum benchmark
+ *
+ * checksum() is compared with the previous 16-bit scalar loop for sizes from
+ * an IP header (20B) to a jumbo frame (9KB), in cycles per byte. Results must
+ * match the scalar loop for every size and alignment, and updating a checksum
+ * with checksum_adjust16() and checksum_adjust32() must match summing the
+ * rewritten data again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <byteswap.h>
+#include <net/checksum.h>
+
+#define BUFFER_SIZE	(9216 + 64)
+#define TEST_BYTES	1000000000L	// Bytes summed per size
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+// Previous implementation
+static uint16_t checksum_scalar(void* data, uint32_t size) {
+	uint32_t sum = 0;
+	uint16_t* p = data;
+
+	while(size > 1) {
+		sum += *p++;
+		if(sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+
+		size -= 2;
+	}
+
+	if(size)
+		sum += *(uint8_t*)p;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return bswap_16((uint16_t)~sum);
+}
+
+static uint8_t buffer[BUFFER_SIZE] __attribute__((__aligned__(64)));
+
+static double measure(uint16_t (*func)(void*, uint32_t), uint32_t size) {
+	uint64_t count = TEST_BYTES / size;
+	uint16_t result = 0;
+
+	uint64_t t = rdtsc();
+	for(uint64_t i = 0; i < count; i++) {
+		result += func(buffer, size);
+		asm volatile("" : "+r"(result) :: "memory");
+	}
+
+	return (double)(rdtsc() - t) / (count * size);
+}
+
+static int check_sizes() {
+	int fail = 0;
+	for(uint32_t offset = 0; offset < 8; offset++) {
+		for(uint32_t size = 0; size <= 9216; size++) {
+			uint16_t expected = checksum_scalar(buffer + offset, size);
+			if(checksum(buffer + offset, size) != expected) {
+				printf("checksum mismatch: offset %u size %u\n", offset, size);
+				fail = 1;
+			}
+		}
+	}
+
+	// Data split over buffers of even size
+	for(uint32_t split = 0; split <= 1500; split += 2) {
+		uint32_t sum = checksum_partial(buffer, split, 0);
+		if(checksum_finish(checksum_partial(buffer + split, 1500 - split, sum)) != checksum_scalar(buffer, 1500)) {
+			printf("checksum_partial mismatch: split %u\n", split);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
+
+static int check_adjust() {
+	int fail = 0;
+	for(int i = 0; i < 1000000; i++) {
+		uint32_t offset = (rand() % 256) * 2;
+		uint16_t* p16 = (uint16_t*)(buffer + offset);
+		uint32_t* p32 = (uint32_t*)(buffer + offset);
+
+		// Checksum field as stored in the packet
+		uint16_t csum = bswap_16(checksum_scalar(buffer, 1024));
+		if(i % 2) {
+			uint16_t old = *p16;
+			*p16 = rand();
+			csum = checksum_adjust16(csum, old, *p16);
+		} else {
+			uint32_t old = *p32;
+			*p32 = rand();
+			csum = checksum_adjust32(csum, old, *p32);
+		}
+
+		// Checksum over data carrying a valid checksum is zero
+		uint16_t expected = bswap_16(checksum_scalar(buffer, 1024));
+		if(csum != expected && !(csum == 0xffff && expected == 0) && !(csum == 0 && expected == 0xffff)) {
+			printf("checksum_adjust mismatch: %04x expected %04x\n", csum, expected);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
+
+int main(int argc, char** argv) {
+	uint32_t sizes[] = { 20, 40, 64, 128, 256, 576, 1024, 1500, 4096, 9000 };
+	int fail = 0;
+
+	srand(1);
+	for(int i = 0; i < BUFFER_SIZE; i++)
+		buffer[i] = rand();
+
+	fail |= check_sizes();
+	fail |= check_adjust();
+
+	printf("size   scalar(cycles/B) checksum(cycles/B) speedup\n");
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double scalar = measure(checksum_scalar, sizes[i]);
+		double simd = measure(checksum, sizes[i]);
+		printf("%4u %18.3f %18.3f %7.2fx\n", sizes[i], scalar, simd, scalar / simd);
+	}
+
+	// Rewriting an address and a port of a TCP segment
+	uint16_t csum = bswap_16(checksum_scalar(buffer, 1500));
+	uint32_t address = 0x0100000a;
+	uint16_t port = 0x5000;
+	uint64_t t = rdtsc();
+	for(int i = 0; i < 100000000; i++) {
+		csum = checksum_adjust32(csum, address, address + i);
+		csum = checksum_adjust16(csum, port, port + i);
+		asm volatile("" : "+r"(csum));
+	}
+	printf("adjust: %.2f cycles per address and port\n", (double)(rdtsc() - t) / 100000000);
+
+	return fail;
+}
@@ -0,0 +1,8 @@
+project 'event'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/event.c', '../../src/list.c', '../../src/map.c', 'src/event.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
@@ -0,0 +1,143 @@
+/**
+ * Timer event benchmark
+ *
+ * Timers with random delays up to 10 seconds are added, half of them are
+ * removed and the rest are fired by running the event loop on a simulated
+ * clock, for 1k to 1M timers. The cycles per add, remove and fire should stay
+ * flat as the number of timers grows. Every timer must be called once, in the
+ * event loop right after it expires, and never once removed. A periodic timer
+ * must be called once per period.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/event.h>
+
+#define MAX_DELAY	10000000	// 10s
+#define STEP		100		// Event loop runs every 100us
+#define PERIOD		1000
+
+static uint64_t now;
+
+uint64_t timer_us() {
+	return now;
+}
+
+// Lists and maps of the event engine allocate from libc
+void* __malloc(size_t size, void* pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* pool) {
+	free(ptr);
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+typedef struct {
+	uint64_t	expire;
+	uint64_t	id;
+	int		called;
+} Timer;
+
+static Timer* timers;
+static uint64_t errors;
+static uint64_t periodic_count;
+
+static bool timer(void* context) {
+	Timer* timer = context;
+	if(now < timer->expire || now >= timer->expire + STEP || timer->id == 0)
+		errors++;
+
+	timer->called++;
+
+	return false;
+}
+
+static bool periodic(void* context) {
+	periodic_count++;
+
+	return true;
+}
+
+static int run(int count) {
+	errors = 0;
+	for(int i = 0; i < count; i++) {
+		timers[i].expire = now + 1 + rand() % MAX_DELAY;
+		timers[i].called = 0;
+	}
+
+	uint64_t t = rdtsc();
+	for(int i = 0; i < count; i++)
+		timers[i].id = event_timer_add(timer, &timers[i], timers[i].expire - now, 0);
+	uint64_t add = rdtsc() - t;
+
+	uint64_t removed = timers[0].id;
+	t = rdtsc();
+	for(int i = 0; i < count; i += 2) {
+		if(!event_timer_remove(timers[i].id))
+			errors++;
+		timers[i].id = 0;
+	}
+	uint64_t remove = rdtsc() - t;
+
+	// Removing a removed timer fails
+	if(event_timer_remove(removed))
+		errors++;
+
+	// Cost of running the event loop itself
+	uint64_t idle = now;
+	t = rdtsc();
+	for(idle += STEP; idle <= now + MAX_DELAY + STEP; idle += STEP)
+		event_loop();
+	uint64_t loop = rdtsc() - t;
+
+	uint64_t end = now + MAX_DELAY + STEP;
+	uint64_t periodic_id = event_timer_add(periodic, NULL, PERIOD, PERIOD);
+	uint64_t start = now;
+	periodic_count = 0;
+
+	t = rdtsc();
+	for(now += STEP; now <= end; now += STEP)
+		event_loop();
+	uint64_t fire = rdtsc() - t;
+
+	event_timer_remove(periodic_id);
+
+	int fired = 0;
+	for(int i = 0; i < count; i++) {
+		if(timers[i].called != (i % 2 ? 1 : 0))
+			errors++;
+		fired += timers[i].called;
+	}
+
+	uint64_t periods = (now - STEP - start) / PERIOD;
+	if(periodic_count != periods)
+		errors++;
+
+	printf("%8d %10.1f %10.1f %10.1f %8lu\n", count, (double)add / count, (double)remove / (count / 2),
+			(double)(fire - loop) / (fired + periodic_count), errors);
+
+	return errors != 0;
+}
+
+int main(int argc, char** argv) {
+	if(!event_init())
+		return 1;
+
+	timers = malloc(sizeof(Timer) * 1000000);
+	if(!timers)
+		return 1;
+
+	int fail = 0;
+	printf("  timers  add(cyc) remove(cyc) fire(cyc)   errors\n");
+	for(int count = 1000; count <= 1000000; count *= 10)
+		fail |= run(count);
+
+	return fail;
+}
@@ -0,0 +1,11 @@
+project 'gmalloc'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/gmalloc.c', '../../src/_malloc.c', '../../../TLSF-2.4.6/src/tlsf.c',
+                  '../../../vnic/src/lock.c', 'src/gmalloc.c' }
+    includedirs { '../../include', '../../../TLSF-2.4.6/include', '../../../vnic/include' }
+    defines     { 'LINUX', 'USE_MMAP=0', 'USE_SBRK=0', 'USE_PRINTF=0', 'TLSF_STATISTIC=1', 'TLSF_USE_LOCKS=1' }
+    links       { 'pthread' }
+    optimize    'On'
@@ -0,0 +1,212 @@
+/**
+ * Global memory allocation benchmark
+ *
+ * Threads allocate and free blocks of random sizes from the global pool at
+ * the same time, mostly small ones with some larger than the cached classes,
+ * through gmalloc() and through the locked pool directly. Every block is
+ * filled with its owner and checked when it is freed. Blocks are also freed
+ * by another thread than the one which allocated them. After the caches are
+ * flushed the pool must be as used as before. A thread preempted while it
+ * holds the lock of the pool stalls the others until it runs again, so runs
+ * with more threads than online CPUs only check a few operations and are not
+ * timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <tlsf.h>
+#include <_malloc.h>
+#include <gmalloc.h>
+
+#define POOL_SIZE	0x4000000	// 64MB
+#define LIVE_COUNT	512		// Live blocks per thread
+#define OP_COUNT	2000000		// Operations per thread
+#define CHECK_COUNT	20000		// Operations per thread with more threads than CPUs
+#define PASS_COUNT	10000		// Blocks freed by another thread
+#define MAX_THREADS	16
+
+extern void* __gmalloc_pool;
+
+static bool cached;
+static uint64_t op_count;
+static volatile int fail;
+
+static size_t block_size(uint64_t* seed) {
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+	uint32_t r = *seed >> 33;
+
+	switch(r % 50) {
+		case 0:
+			return 4096 + r / 50 % 12288;	// Larger than the classes
+		case 1 ... 4:
+			return 512 + r / 50 % 1536;
+		default:
+			return 16 + r / 50 % 496;
+	}
+}
+
+static void* alloc(size_t size) {
+	return cached ? gmalloc(size) : __malloc(size, __gmalloc_pool);
+}
+
+static void release(void* ptr) {
+	if(cached)
+		gfree(ptr);
+	else
+		__free(ptr, __gmalloc_pool);
+}
+
+static void fill(uint8_t* ptr, size_t size, uint8_t tag) {
+	ptr[0] = ptr[size / 2] = ptr[size - 1] = tag;
+}
+
+static bool check(uint8_t* ptr, size_t size, uint8_t tag) {
+	return ptr[0] == tag && ptr[size / 2] == tag && ptr[size - 1] == tag;
+}
+
+static void* worker(void* context) {
+	uint8_t id = (uintptr_t)context;
+	uint64_t seed = id;
+	uint8_t* ptrs[LIVE_COUNT] = { NULL };
+	size_t sizes[LIVE_COUNT];
+
+	for(uint64_t i = 0; i < op_count; i++) {
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		int j = (seed >> 33) % LIVE_COUNT;
+		if(ptrs[j]) {
+			if(!check(ptrs[j], sizes[j], id))
+				fail = 1;
+			release(ptrs[j]);
+		}
+
+		sizes[j] = block_size(&seed);
+		ptrs[j] = alloc(sizes[j]);
+		if(!ptrs[j]) {
+			fail = 1;
+			break;
+		}
+		fill(ptrs[j], sizes[j], id);
+	}
+
+	for(int j = 0; j < LIVE_COUNT; j++) {
+		if(ptrs[j])
+			release(ptrs[j]);
+	}
+
+	if(cached)
+		gmalloc_flush();
+
+	return NULL;
+}
+
+static double run(bool _cached, int threads, uint64_t count) {
+	cached = _cached;
+	op_count = count;
+
+	size_t used = get_used_size(__gmalloc_pool);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t ids[MAX_THREADS];
+	for(int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, (void*)(uintptr_t)(i + 1));
+	for(int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(get_used_size(__gmalloc_pool) != used) {
+		printf("%s, %d threads: %lu bytes leaked\n", cached ? "gmalloc" : "locked pool", threads,
+				get_used_size(__gmalloc_pool) - used);
+		fail = 1;
+	}
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return count * threads / seconds / 1e6;
+}
+
+static void* passes[PASS_COUNT];
+
+static void* pass_alloc(void* context) {
+	uint64_t seed = 0;
+	for(int i = 0; i < PASS_COUNT; i++)
+		passes[i] = gmalloc(block_size(&seed));
+
+	gmalloc_flush();
+
+	return NULL;
+}
+
+static void* pass_free(void* context) {
+	for(int i = 0; i < PASS_COUNT; i++)
+		gfree(passes[i]);
+
+	gmalloc_flush();
+
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	__gmalloc_pool = aligned_alloc(0x1000, POOL_SIZE);
+	init_memory_pool(POOL_SIZE, __gmalloc_pool, 1);
+
+	printf("threads  gmalloc(Mops/s)  locked pool(Mops/s)\n");
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for(int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		if(threads > cpus) {
+			run(true, threads, CHECK_COUNT);
+			run(false, threads, CHECK_COUNT);
+			printf("%7d  not timed, %ld CPUs\n", threads, cpus);
+			continue;
+		}
+
+		double ops = run(true, threads, OP_COUNT);
+		printf("%7d  %15.2f  %19.2f\n", threads, ops, run(false, threads, OP_COUNT));
+	}
+
+	// Blocks freed by another thread are cached there and returned by its flush
+	size_t used = get_used_size(__gmalloc_pool);
+	pthread_t id;
+	pthread_create(&id, NULL, pass_alloc, NULL);
+	pthread_join(id, NULL);
+	pthread_create(&id, NULL, pass_free, NULL);
+	pthread_join(id, NULL);
+	if(get_used_size(__gmalloc_pool) != used)
+		fail = 1;
+
+	// Growing keeps the data, shrinking keeps the block, calloc clears
+	uint8_t* ptr = gmalloc(10);
+	memset(ptr, 0xab, 10);
+	uint8_t* ptr2 = grealloc(ptr, 8);
+	if(ptr2 != ptr)
+		fail = 1;
+	ptr = grealloc(ptr2, 20000);
+	if(!ptr || ptr[0] != 0xab || ptr[9] != 0xab)
+		fail = 1;
+	ptr = grealloc(ptr, 40000);
+	if(!ptr || ptr[0] != 0xab || ptr[9] != 0xab)
+		fail = 1;
+	gfree(ptr);
+
+	uint8_t* zeros = gcalloc(100, 30);
+	for(int i = 0; i < 3000; i++) {
+		if(zeros[i])
+			fail = 1;
+	}
+	gfree(zeros);
+
+	if(gcalloc((size_t)-1 / 2, 4) || ((uintptr_t)gmalloc(1) & 15))
+		fail = 1;
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
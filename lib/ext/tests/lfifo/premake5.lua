@@ -0,0 +1,10 @@
+project 'lfifo'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/lfifo.c', '../../src/fifo.c', 'src/lfifo.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
+    links       { 'pthread' }
+    optimize    'On'
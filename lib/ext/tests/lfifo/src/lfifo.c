@@ -0,0 +1,215 @@
+/**
+ * Lock-free FIFO contention benchmark
+ *
+ * Producers push sequence numbers tagged with their id in bursts and
+ * consumers pop them, for SPSC, MPSC and MPMC FIFOs with 2 to 16 threads.
+ * Every element must be popped exactly once and the elements of a producer
+ * must reach a consumer in order. The FIFO of lib/ext behind a spin lock is
+ * shown for comparison. A thread preempted while it holds a reservation, or
+ * the lock, stalls the others until it runs again, so runs with more threads
+ * than online CPUs only check a few elements and are not timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <util/fifo.h>
+#include <util/lfifo.h>
+
+#define FIFO_SIZE	1024
+#define ELEMENT_COUNT	2000000		// Elements per run
+#define CHECK_COUNT	20000		// Elements per run with more threads than CPUs
+#define BURST		8
+#define MAX_THREADS	16
+
+void* __malloc(size_t size, void* mem_pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* mem_pool) {
+	free(ptr);
+}
+
+static LFIFO* lfifo;
+static FIFO* fifo;
+static volatile uint8_t fifo_lock;
+static bool locked;
+
+static int producer_count;
+static uint64_t element_count;
+static int consumer_count;
+static volatile int done;
+static volatile uint64_t popped_sum;
+static volatile int fail;
+
+static size_t push(void** array, size_t count) {
+	if(!locked)
+		return lfifo_push_bulk(lfifo, array, count);
+
+	while(__sync_lock_test_and_set(&fifo_lock, 1))
+		asm volatile("pause");
+
+	size_t i;
+	for(i = 0; i < count && fifo_push(fifo, array[i]); i++);
+	__sync_lock_release(&fifo_lock);
+
+	return i;
+}
+
+static size_t pop(void** array, size_t count) {
+	if(!locked)
+		return lfifo_pop_bulk(lfifo, array, count);
+
+	while(__sync_lock_test_and_set(&fifo_lock, 1))
+		asm volatile("pause");
+
+	size_t i;
+	for(i = 0; i < count && (array[i] = fifo_pop(fifo)); i++);
+	__sync_lock_release(&fifo_lock);
+
+	return i;
+}
+
+// Elements are id << 32 | sequence, sequences start from 1
+static void* producer(void* context) {
+	uint64_t id = (uintptr_t)context;
+	uint64_t count = element_count / producer_count;
+	uint64_t sequence = 1;
+
+	while(sequence <= count) {
+		void* array[BURST];
+		size_t n = 0;
+		for(; n < BURST && sequence + n <= count; n++)
+			array[n] = (void*)(id << 32 | (sequence + n));
+
+		size_t pushed = 0;
+		while(pushed < n) {
+			size_t m = push(array + pushed, n - pushed);
+			if(!m)
+				sched_yield();
+			pushed += m;
+		}
+		sequence += n;
+	}
+
+	__sync_fetch_and_add(&done, 1);
+
+	return NULL;
+}
+
+static void* consumer(void* context) {
+	uint64_t last[MAX_THREADS] = { 0 };
+	uint64_t sum = 0;
+
+	while(true) {
+		void* array[BURST];
+		size_t n = pop(array, BURST);
+		if(!n) {
+			if(done == producer_count && (locked ? fifo_empty(fifo) : lfifo_empty(lfifo)))
+				break;
+
+			sched_yield();
+			continue;
+		}
+
+		for(size_t i = 0; i < n; i++) {
+			uint64_t element = (uintptr_t)array[i];
+			uint64_t id = element >> 32;
+			uint64_t sequence = element & 0xffffffff;
+			if(id >= MAX_THREADS || sequence <= last[id])
+				fail = 1;
+
+			last[id] = sequence;
+			sum += element;
+		}
+	}
+
+	__sync_fetch_and_add(&popped_sum, sum);
+
+	return NULL;
+}
+
+static double run(const char* name, uint32_t flags, int producers, int consumers, bool lock, uint64_t elements) {
+	producer_count = producers;
+	element_count = elements;
+	consumer_count = consumers;
+	locked = lock;
+	done = 0;
+	popped_sum = 0;
+
+	if(lock)
+		fifo = fifo_create(FIFO_SIZE + 1, NULL);
+	else
+		lfifo = lfifo_create(FIFO_SIZE, flags, NULL);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t threads[MAX_THREADS];
+	for(int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, producer, (void*)(uintptr_t)i);
+	for(int i = 0; i < consumers; i++)
+		pthread_create(&threads[producers + i], NULL, consumer, NULL);
+	for(int i = 0; i < producers + consumers; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t count = elements / producers;
+	uint64_t expected = 0;
+	for(uint64_t i = 0; i < (uint64_t)producers; i++)
+		expected += (i << 32) * count + count * (count + 1) / 2;
+
+	if(popped_sum != expected) {
+		printf("%s: elements lost or duplicated\n", name);
+		fail = 1;
+	}
+
+	if(lock)
+		fifo_destroy(fifo);
+	else
+		lfifo_destroy(lfifo);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return count * producers / seconds / 1e6;
+}
+
+static void report(const char* name, uint32_t flags, int producers, int consumers) {
+	int threads = producers + consumers;
+	if(threads > sysconf(_SC_NPROCESSORS_ONLN) && threads > 2) {
+		run(name, flags, producers, consumers, false, CHECK_COUNT);
+		printf("%s  %7d  %9d %9d  not timed, %ld CPUs\n", name, threads, producers, consumers,
+				sysconf(_SC_NPROCESSORS_ONLN));
+		return;
+	}
+
+	double ops = run(name, flags, producers, consumers, false, ELEMENT_COUNT);
+	printf("%s  %7d  %9d %9d  %17.2f  %14.2f\n", name, threads, producers, consumers, ops,
+			run("locked", 0, producers, consumers, true, ELEMENT_COUNT));
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("fifo  threads  producers consumers  lock-free(Mops/s)  locked(Mops/s)\n");
+
+	report("spsc", LFIFO_SPSC, 1, 1);
+	for(int threads = 2; threads <= MAX_THREADS; threads *= 2)
+		report("mpsc", LFIFO_MPSC, threads - 1, 1);
+	for(int threads = 2; threads <= MAX_THREADS; threads *= 2)
+		report("mpmc", LFIFO_MPMC, threads / 2, threads / 2);
+
+	// Sizes must be powers of two
+	LFIFO* one = lfifo_create(1, LFIFO_MPMC, NULL);
+	if(lfifo_create(1000, LFIFO_MPMC, NULL) || !one || !lfifo_push(one, &one) || lfifo_push(one, &one) ||
+			lfifo_pop(one) != &one || lfifo_pop(one))
+		fail = 1;
+	lfifo_destroy(one);
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
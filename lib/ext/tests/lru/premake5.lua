@@ -0,0 +1,9 @@
+project 'lru'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/cache.c', '../../src/map.c', 'src/lru.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
+    optimize    'On'
@@ -0,0 +1,134 @@
+/**
+ * LRU cache benchmark
+ *
+ * cache_get() hits are measured in cycles for caches of 64 to 1M entries and
+ * must stay flat as the capacity grows; the previous cache moved the entry to
+ * the front of a list, walking it on every hit. Eviction order is checked
+ * against the recency of the keys, limited by the number of entries and by
+ * bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <util/cache.h>
+
+#define HIT_COUNT	10000000
+
+void* __malloc(size_t size, void* mem_pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* mem_pool) {
+	free(ptr);
+}
+
+void* __realloc(void* ptr, size_t new_size, void* mem_pool) {
+	return realloc(ptr, new_size);
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static int uncached;
+
+static void uncache(void* data) {
+	uncached++;
+}
+
+static int check_order() {
+	int fail = 0;
+	Cache* cache = cache_create(100, uncache, NULL);
+
+	for(uintptr_t i = 1; i <= 100; i++)
+		cache_set(cache, (void*)i, (void*)i);
+
+	// 1..50 are used again, so 51..100 are evicted first
+	for(uintptr_t i = 1; i <= 50; i++)
+		cache_get(cache, (void*)i);
+	for(uintptr_t i = 101; i <= 150; i++)
+		cache_set(cache, (void*)i, (void*)i);
+
+	for(uintptr_t i = 1; i <= 150; i++) {
+		bool cached = i <= 50 || i > 100;
+		if(!!cache_get(cache, (void*)i) != cached) {
+			printf("key %lu %s\n", i, cached ? "evicted" : "not evicted");
+			fail = 1;
+		}
+	}
+	if(uncached != 50 || cache->size != 100) {
+		printf("%d uncached, %lu cached\n", uncached, cache->size);
+		fail = 1;
+	}
+
+	// Iterated from the least recently used
+	CacheIterator iter;
+	cache_iterator_init(&iter, cache);
+	uintptr_t expected = 1;
+	while(cache_iterator_has_next(&iter)) {
+		uintptr_t data = (uintptr_t)cache_iterator_next(&iter);
+		if(data != expected) {
+			printf("iterated %lu expected %lu\n", data, expected);
+			fail = 1;
+			break;
+		}
+		expected = expected == 50 ? 101 : expected + 1;
+	}
+
+	cache_destroy(cache);
+	if(uncached != 150) {
+		printf("%d uncached after destroy\n", uncached);
+		fail = 1;
+	}
+
+	// 10 entries of 100 bytes fit in 1000 bytes
+	uncached = 0;
+	cache = cache_create_sized(1000, 1000, uncache, NULL);
+	for(uintptr_t i = 1; i <= 20; i++)
+		cache_set_sized(cache, (void*)i, (void*)i, 100);
+	cache_set_sized(cache, (void*)21, (void*)21, 500);
+
+	if(cache->size != 6 || cache->bytes != 1000 || uncached != 15 || !cache_get(cache, (void*)16) ||
+			cache_get(cache, (void*)15) || cache_set_sized(cache, (void*)22, (void*)22, 1001)) {
+		printf("%lu entries of %lu bytes cached, %d uncached\n", cache->size, cache->bytes, uncached);
+		fail = 1;
+	}
+	cache_destroy(cache);
+
+	return fail;
+}
+
+int main(int argc, char** argv) {
+	int fail = check_order();
+	double first = 0;
+
+	printf("entries  hit(cycles)\n");
+	for(uintptr_t capacity = 64; capacity <= 1048576; capacity *= 4) {
+		Cache* cache = cache_create(capacity, NULL, NULL);
+		for(uintptr_t i = 1; i <= capacity; i++)
+			cache_set(cache, (void*)i, (void*)i);
+
+		// The same few keys, so the hit does not miss the CPU cache
+		uintptr_t sum = 0;
+		uint64_t t = rdtsc();
+		for(uintptr_t i = 0; i < HIT_COUNT; i++)
+			sum += (uintptr_t)cache_get(cache, (void*)(i % 16 + 1));
+		double hit = (double)(rdtsc() - t) / HIT_COUNT;
+
+		if(sum != HIT_COUNT / 16 * 136)
+			fail = 1;
+
+		printf("%7lu %12.1f\n", capacity, hit);
+		if(!first)
+			first = hit;
+		else if(hit > first * 2)
+			fail = 1;
+
+		cache_destroy(cache);
+	}
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
@@ -0,0 +1,9 @@
+project 'map'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/map.c', 'src/map.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
+    optimize    'On'
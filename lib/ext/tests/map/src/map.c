@@ -0,0 +1,183 @@
+/**
+ * Hash map test and benchmark
+ *
+ * Random puts, updates and removes, also while iterating, are checked against
+ * an array of the expected values. Then put, get, remove and iterate are
+ * measured in cycles per element with 1M uint64 keys, sequential and random.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/map.h>
+
+#define KEY_COUNT	1000000
+#define CHECK_KEYS	4096
+#define CHECK_COUNT	10000000
+
+void* __malloc(size_t size, void* mem_pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* mem_pool) {
+	free(ptr);
+}
+
+void* __realloc(void* ptr, size_t new_size, void* mem_pool) {
+	return realloc(ptr, new_size);
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t random64() {
+	return (uint64_t)rand() << 33 ^ (uint64_t)rand() << 11 ^ rand();
+}
+
+static uintptr_t expected[CHECK_KEYS];	// Data of the key, 0 if not in the map
+
+static int check_map(Map* map) {
+	size_t size = 0;
+	for(uintptr_t i = 0; i < CHECK_KEYS; i++) {
+		if(expected[i])
+			size++;
+
+		if((uintptr_t)map_get(map, (void*)(i * 16)) != expected[i] || map_contains(map, (void*)(i * 16)) != !!expected[i]) {
+			printf("key %lu: %lu expected %lu\n", i * 16, (uintptr_t)map_get(map, (void*)(i * 16)), expected[i]);
+			return 1;
+		}
+	}
+
+	if(map_size(map) != size) {
+		printf("size %lu expected %lu\n", map_size(map), size);
+		return 1;
+	}
+
+	// Every element is iterated once
+	static uint8_t seen[CHECK_KEYS];
+	memset(seen, 0, sizeof(seen));
+	MapIterator iter;
+	map_iterator_init(&iter, map);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		uintptr_t i = (uintptr_t)entry->key / 16;
+		if(seen[i]++ || (uintptr_t)entry->data != expected[i]) {
+			printf("key %lu iterated twice or with %lu\n", i * 16, (uintptr_t)entry->data);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int check() {
+	int fail = 0;
+	Map* map = map_create(4, NULL, NULL, NULL);
+
+	// Pointer-like keys, all multiples of 16
+	for(int i = 0; i < CHECK_COUNT && !fail; i++) {
+		uintptr_t k = rand() % CHECK_KEYS;
+		void* key = (void*)(k * 16);
+		uintptr_t data = rand() | 1;
+		switch(rand() % 4) {
+			case 0:
+			case 1:
+				if(map_put(map, key, (void*)data) != !expected[k]) {
+					printf("put %lu\n", k * 16);
+					fail = 1;
+				}
+				if(!expected[k])
+					expected[k] = data;
+				break;
+			case 2:
+				if(map_update(map, key, (void*)data) != !!expected[k]) {
+					printf("update %lu\n", k * 16);
+					fail = 1;
+				}
+				if(expected[k])
+					expected[k] = data;
+				break;
+			case 3:
+				if((uintptr_t)map_remove(map, key) != expected[k]) {
+					printf("remove %lu\n", k * 16);
+					fail = 1;
+				}
+				expected[k] = 0;
+				break;
+		}
+
+		if(i % 100000 == 0)
+			fail |= check_map(map);
+	}
+
+	// Removing every third element while iterating
+	MapIterator iter;
+	map_iterator_init(&iter, map);
+	int n = 0;
+	while(map_iterator_has_next(&iter)) {
+		map_iterator_next(&iter);
+		if(n++ % 3 == 0)
+			expected[(uintptr_t)map_iterator_remove(&iter)->key / 16] = 0;
+	}
+	fail |= check_map(map);
+
+	map_destroy(map);
+
+	return fail;
+}
+
+static int bench(const char* name, uint64_t* keys) {
+	Map* map = map_create(16, NULL, NULL, NULL);
+	int fail = 0;
+
+	uint64_t t = rdtsc();
+	for(int i = 0; i < KEY_COUNT; i++)
+		fail |= !map_put(map, (void*)keys[i], (void*)keys[i]);
+	double put = (double)(rdtsc() - t) / KEY_COUNT;
+
+	t = rdtsc();
+	for(int i = 0; i < KEY_COUNT; i++)
+		fail |= map_get(map, (void*)keys[i]) != (void*)keys[i];
+	double get = (double)(rdtsc() - t) / KEY_COUNT;
+
+	uint64_t sum = 0;
+	t = rdtsc();
+	MapIterator iter;
+	map_iterator_init(&iter, map);
+	while(map_iterator_has_next(&iter))
+		sum += (uint64_t)map_iterator_next(&iter)->data;
+	double iterate = (double)(rdtsc() - t) / KEY_COUNT;
+
+	t = rdtsc();
+	for(int i = 0; i < KEY_COUNT; i++)
+		fail |= map_remove(map, (void*)keys[i]) != (void*)keys[i];
+	double remove = (double)(rdtsc() - t) / KEY_COUNT;
+
+	fail |= map_size(map) != 0;
+	printf("%-10s %8.1f %8.1f %8.1f %8.1f\n", name, put, get, remove, iterate);
+	asm volatile("" :: "r"(sum));
+
+	map_destroy(map);
+
+	return fail;
+}
+
+int main(int argc, char** argv) {
+	int fail = check();
+
+	static uint64_t keys[KEY_COUNT];
+	printf("keys       put      get      remove   iterate (cycles)\n");
+	for(int i = 0; i < KEY_COUNT; i++)
+		keys[i] = i + 1;
+	fail |= bench("sequential", keys);
+
+	for(int i = 0; i < KEY_COUNT; i++)
+		keys[i] = random64() | 1;
+	fail |= bench("random", keys);
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
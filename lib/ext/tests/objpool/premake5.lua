@@ -0,0 +1,10 @@
+project 'objpool'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/objpool.c', '../../../vnic/src/lock.c', 'src/objpool.c' }
+    includedirs { '../../include', '../../../vnic/include' }
+    defines     { 'LINUX' }
+    links       { 'pthread' }
+    optimize    'On'
@@ -0,0 +1,233 @@
+/**
+ * Object pool benchmark
+ *
+ * Bursts of objects are got and put while 1K to 1M objects are live, which
+ * must cost the same, and compared with malloc and free. Live objects are
+ * also put and got again at random. Every object is filled with its owner
+ * and checked when it is put. Threads then share a cached pool,
+ * also putting the objects of another thread, and every object must be back
+ * in the pool after the caches are flushed. Runs with more threads than
+ * online CPUs only check a few objects.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <util/objpool.h>
+
+#define OBJECT_SIZE	40		// Size of a session of the loadbalancer
+#define SLAB_COUNT	4096
+#define MAX_LIVE	(1 << 20)
+#define CHURN_COUNT	1000000
+#define TEST_COUNT	4000000
+#define BURST		64
+#define THREAD_COUNT	2000000		// Operations per thread
+#define CHECK_COUNT	20000		// Operations per thread with more threads than CPUs
+#define LIVE_COUNT	1024		// Live objects per thread
+#define MAX_THREADS	16
+
+static __thread int __thread_id;
+static int fail;
+
+void* __malloc(size_t size, void* mem_pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* mem_pool) {
+	free(ptr);
+}
+
+int thread_id() {
+	return __thread_id;
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t next(uint64_t* seed) {
+	*seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+	return *seed >> 33;
+}
+
+static void fill(uint64_t* object, uint64_t tag) {
+	for(int i = 0; i < OBJECT_SIZE / 8; i++)
+		object[i] = tag;
+}
+
+static bool check(uint64_t* object, uint64_t tag) {
+	for(int i = 0; i < OBJECT_SIZE / 8; i++) {
+		if(object[i] != tag)
+			return false;
+	}
+
+	return true;
+}
+
+static void* live[MAX_LIVE];
+
+static void* put(ObjectPool* pool, void* object) {
+	if(pool)
+		object_pool_put(pool, object);
+	else
+		free(object);
+
+	return NULL;
+}
+
+static void* get(ObjectPool* pool) {
+	return pool ? object_pool_get(pool) : malloc(OBJECT_SIZE);
+}
+
+// Cycles to get and put an object while count objects are live
+static uint64_t churn(ObjectPool* pool, size_t count) {
+	uint64_t seed = count;
+
+	for(size_t i = 0; i < count; i++) {
+		live[i] = get(pool);
+		fill(live[i], i);
+	}
+
+	// Random objects are put back and got again
+	for(int i = 0; i < CHURN_COUNT; i++) {
+		size_t j = next(&seed) % count;
+		if(!check(live[j], j))
+			fail = 1;
+
+		put(pool, live[j]);
+		live[j] = get(pool);
+		fill(live[j], j);
+	}
+
+	void* burst[BURST];
+	uint64_t start = rdtsc();
+	for(int i = 0; i < TEST_COUNT / BURST; i++) {
+		for(int j = 0; j < BURST; j++)
+			burst[j] = get(pool);
+		for(int j = 0; j < BURST; j++)
+			put(pool, burst[j]);
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	for(size_t i = 0; i < count; i++)
+		put(pool, live[i]);
+
+	return cycles / TEST_COUNT;
+}
+
+static ObjectPool* shared;
+static uint64_t op_count;
+static void* passes[MAX_THREADS][LIVE_COUNT];
+
+static void* worker(void* context) {
+	__thread_id = (uintptr_t)context;
+	uint64_t tag = __thread_id + 1;
+	uint64_t seed = tag;
+	void** objects = passes[__thread_id];
+
+	for(int i = 0; i < LIVE_COUNT; i++) {
+		objects[i] = object_pool_get(shared);
+		fill(objects[i], tag);
+	}
+
+	for(uint64_t i = 0; i < op_count; i++) {
+		int j = next(&seed) % LIVE_COUNT;
+		if(!check(objects[j], tag))
+			fail = 1;
+
+		object_pool_put(shared, objects[j]);
+		objects[j] = object_pool_get(shared);
+		fill(objects[j], tag);
+	}
+
+	return NULL;
+}
+
+// Puts the objects of the next thread
+static void* passer(void* context) {
+	__thread_id = (uintptr_t)context;
+	int threads = (uintptr_t)context >> 8;
+	__thread_id &= 0xff;
+
+	void** objects = passes[(__thread_id + 1) % threads];
+	for(int i = 0; i < LIVE_COUNT; i++)
+		object_pool_put(shared, objects[i]);
+
+	object_pool_flush(shared);
+
+	return NULL;
+}
+
+static void run(int threads, uint64_t count) {
+	op_count = count;
+	shared = object_pool_create(OBJECT_SIZE, SLAB_COUNT, OBJECT_POOL_CACHED, NULL);
+
+	pthread_t ids[MAX_THREADS];
+	uint64_t start = rdtsc();
+	for(int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, (void*)(uintptr_t)i);
+	for(int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+	uint64_t cycles = rdtsc() - start;
+
+	for(int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, passer, (void*)(uintptr_t)(threads << 8 | i));
+	for(int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+
+	// Every object is back, and the pool never grew beyond the live objects and the caches
+	ObjectPoolStats stats;
+	object_pool_stats(shared, &stats);
+	void* object;
+	size_t count2 = 0;
+	while(shared->free) {
+		object = shared->free;
+		shared->free = *(void**)object;
+		count2++;
+	}
+	size_t cut = (SLAB_COUNT - (shared->end - shared->next) / shared->size) + (stats.slabs - 1) * SLAB_COUNT;
+	if(stats.used || count2 != cut || stats.total > (size_t)threads * (LIVE_COUNT + OBJECT_POOL_BATCH * 2) + SLAB_COUNT) {
+		printf("%d threads: %lu used, %lu of %lu objects back\n", threads, stats.used, count2, cut);
+		fail = 1;
+	}
+
+	if(count == THREAD_COUNT)
+		printf("%7d  %17lu\n", threads, cycles / (count * threads));
+	else
+		printf("%7d  not timed, %ld CPUs\n", threads, sysconf(_SC_NPROCESSORS_ONLN));
+
+	object_pool_destroy(shared);
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	ObjectPool* pool = object_pool_create(OBJECT_SIZE, SLAB_COUNT, 0, NULL);
+
+	printf("live      object pool(cycles)  malloc(cycles)\n");
+	for(size_t count = 1024; count <= MAX_LIVE; count *= 4)
+		printf("%-8lu  %19lu  %14lu\n", count, churn(pool, count), churn(NULL, count));
+
+	ObjectPoolStats stats;
+	object_pool_stats(pool, &stats);
+	// The bursts beyond the live objects take one more slab
+	if(stats.used || stats.slabs != MAX_LIVE / SLAB_COUNT + 1 || stats.total != stats.slabs * SLAB_COUNT)
+		fail = 1;
+	object_pool_destroy(pool);
+
+	printf("threads  cached(cycles/op)\n");
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for(int threads = 1; threads <= MAX_THREADS; threads *= 2)
+		run(threads, threads > cpus ? CHECK_COUNT : THREAD_COUNT);
+
+	if(object_pool_create(0, SLAB_COUNT, 0, NULL) || object_pool_create(OBJECT_SIZE, 0, 0, NULL))
+		fail = 1;
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
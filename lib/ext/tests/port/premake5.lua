@@ -0,0 +1,10 @@
+project 'port'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/port.c', 'src/port.c' }
+    includedirs { '../../include', '../../../vnic/include' }
+    defines     { 'LINUX' }
+    links       { 'pthread' }
+    optimize    'On'
@@ -0,0 +1,193 @@
+/**
+ * Port allocator test and benchmark
+ *
+ * Threads allocate ephemeral ports from the same map until it runs out and
+ * every port must be handed out exactly once, from the shard of the thread.
+ * Ports freed one by one and in batches must be allocated again. The cycles
+ * per allocation are compared with the previous linear bitmap scan while the
+ * map fills up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <net/port.h>
+
+#define THREAD_COUNT	4
+#define EPHEMERAL_COUNT	(PORT_EPHEMERAL_END - PORT_EPHEMERAL_START)
+
+static __thread int __thread_id;
+static int __thread_count = 1;
+
+int thread_id() {
+	return __thread_id;
+}
+
+int thread_count() {
+	return __thread_count;
+}
+
+void* nic_config_lookup(NIC* nic, char* name, uint16_t size) {
+	return NULL;
+}
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+// Previous implementation
+static bool port_alloc0_linear(uint8_t* port_map, uint16_t port) {
+	int index = port / 8;
+	uint8_t idx = 1 << (port % 8);
+
+	if(port_map[index] & idx)
+		return false;
+
+	port_map[index] |= idx;
+
+	return true;
+}
+
+static uint16_t port_alloc_linear(uint8_t* port_map) {
+	for(int i = 1024; i < 49152; i++) {
+		if(port_alloc0_linear(port_map, i))
+			return i;
+	}
+
+	return 0;
+}
+
+static PortMap map;
+static uint8_t owners[65536];
+
+static void* allocator(void* context) {
+	__thread_id = (int)(uintptr_t)context;
+
+	uint16_t port;
+	while((port = port_alloc(&map, 0)))
+		owners[port] = __thread_id + 1;
+
+	return NULL;
+}
+
+static int check_threads() {
+	int fail = 0;
+	memset(&map, 0, sizeof(map));
+	memset(owners, 0, sizeof(owners));
+	__thread_count = THREAD_COUNT;
+
+	pthread_t threads[THREAD_COUNT];
+	for(int i = 0; i < THREAD_COUNT; i++)
+		pthread_create(&threads[i], NULL, allocator, (void*)(uintptr_t)i);
+	for(int i = 0; i < THREAD_COUNT; i++)
+		pthread_join(threads[i], NULL);
+
+	// Shards are contiguous and in the order of the threads
+	int owner = 1;
+	for(int port = 0; port < 65536; port++) {
+		bool ephemeral = port >= PORT_EPHEMERAL_START && port < PORT_EPHEMERAL_END;
+		if(ephemeral != !!owners[port] || (owners[port] && (owners[port] < owner || owners[port] > owner + 1))) {
+			printf("port %d allocated by thread %d\n", port, owners[port] - 1);
+			fail = 1;
+			break;
+		}
+		if(owners[port])
+			owner = owners[port];
+	}
+
+	__thread_count = 1;
+
+	return fail;
+}
+
+static int check_free() {
+	int fail = 0;
+	memset(&map, 0, sizeof(map));
+
+	if(port_alloc(&map, 80) != 80 || port_alloc(&map, 80) != 0) {
+		printf("port 80 allocated twice\n");
+		fail = 1;
+	}
+
+	for(int i = 0; i < EPHEMERAL_COUNT; i++)
+		port_alloc(&map, 0);
+
+	if(port_alloc(&map, 0) != 0) {
+		printf("port allocated from a full map\n");
+		fail = 1;
+	}
+
+	uint16_t ports[1000];
+	for(int i = 0; i < 1000; i++) {
+		ports[i] = PORT_EPHEMERAL_START + (i * 7919) % EPHEMERAL_COUNT;
+		if(!port_free(&map, ports[i])) {
+			printf("port %d was not used\n", ports[i]);
+			fail = 1;
+		}
+	}
+
+	for(int i = 0; i < 1000; i++) {
+		uint16_t port = port_alloc(&map, 0);
+		if(!port || port_free(&map, port) != true) {
+			printf("freed port not found\n");
+			fail = 1;
+		}
+		port_alloc(&map, port);
+	}
+
+	if(port_free_batch(&map, ports, 1000) != 1000 || port_free_batch(&map, ports, 1000) != 0) {
+		printf("batch free mismatch\n");
+		fail = 1;
+	}
+
+	for(int i = 0; i < 1000; i++) {
+		if(!port_alloc(&map, 0)) {
+			printf("port freed by batch not found\n");
+			fail = 1;
+			break;
+		}
+	}
+
+	return fail;
+}
+
+int main(int argc, char** argv) {
+	int fail = 0;
+
+	fail |= check_threads();
+	fail |= check_free();
+
+	// Cycles per allocation while the map fills up, freeing one port of two
+	printf("used    linear(cycles) port_alloc(cycles)\n");
+	static uint8_t linear[65536 / 8];
+	memset(linear, 0, sizeof(linear));
+	memset(&map, 0, sizeof(map));
+
+	for(int used = 0; used + 4096 <= EPHEMERAL_COUNT; used += 4096) {
+		uint64_t t = rdtsc();
+		for(int i = 0; i < 8192; i++) {
+			uint16_t port = port_alloc_linear(linear);
+			if(i % 2) {
+				int index = port / 8;
+				linear[index] &= ~(1 << (port % 8));
+			}
+		}
+		double old = (double)(rdtsc() - t) / 8192;
+
+		t = rdtsc();
+		for(int i = 0; i < 8192; i++) {
+			uint16_t port = port_alloc(&map, 0);
+			if(i % 2)
+				port_free(&map, port);
+		}
+		double new = (double)(rdtsc() - t) / 8192;
+
+		printf("%5d %16.1f %19.1f\n", used, old, new);
+	}
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
@@ -1,15 +1,45 @@
 include 'cache'
+include 'event'
+include 'checksum'
+include 'arp'
+include 'port'
+include 'map'
+include 'lru'
+include 'lfifo'
+include 'gmalloc'
+include 'objpool'
+include 'string'
 
 project 'test'
     kind        'Makefile'
     location    '.'
 
     buildcommands {
-        'make -C cache'
+        'make -C cache',
+        'make -C event',
+        'make -C checksum',
+        'make -C arp',
+        'make -C port',
+        'make -C map',
+        'make -C lru',
+        'make -C lfifo',
+        'make -C gmalloc',
+        'make -C objpool',
+        'make -C string'
     }
 
     cleancommands {
-        'make clean -C cache'
+        'make clean -C cache',
+        'make clean -C event',
+        'make clean -C checksum',
+        'make clean -C arp',
+        'make clean -C port',
+        'make clean -C map',
+        'make clean -C lru',
+        'make clean -C lfifo',
+        'make clean -C gmalloc',
+        'make clean -C objpool',
+        'make clean -C string'
     }
 
 
@@ -317,7 +317,7 @@ static void map_iterator_init_func(void **state) {
 
 	// Case 1: Iterating in condition of no data in map.
 	map_iterator_init(&iter, map);
-	assert_int_equal(iter.list_index, 0);	
+	assert_int_equal(iter.index, 0);	
 	
 	for(int i = 0; i < ENTRY_SIZE; i++) {
 		map_put(map, (void*)&key[i], (void*)&data[i]);
@@ -325,7 +325,7 @@ static void map_iterator_init_func(void **state) {
 		
 	// Case 2: Iterating in condition of being data in map.
 	map_iterator_init(&iter, map);
-	assert_int_equal(iter.list_index, 0);	
+	assert_int_equal(iter.index, 0);	
 		
 	map_destroy(map);
 
@@ -376,10 +376,10 @@ static void map_iterator_next_func(void **state) {
 	// To usd map_iterator_next, map_iterator_has_next must be called.
 	for(int i = 0; i < ENTRY_SIZE; i++) {
 		map_iterator_has_next(&iter);
-		size_t before_list_index = iter.list_index;
+		size_t before_index = iter.index;
 		assert_non_null(map_iterator_next(&iter));
 		
-		assert_int_equal(before_list_index + 1, iter.list_index);
+		assert_int_equal(before_index + 1, iter.index);
 	}
 	
 	map_destroy(map);
@@ -403,12 +403,12 @@ static void map_iterator_remove_func(void **state) {
 
 	for(int i = 0; i < ENTRY_SIZE; i++) {
 		map_iterator_has_next(&iter);
-		size_t before_list_index = iter.list_index;
+		size_t before_index = iter.index;
 		size_t before_map_size = map->size;
 		assert_non_null(map_iterator_next(&iter));
 		assert_non_null(map_iterator_remove(&iter));
 		
-		assert_int_equal(before_list_index, iter.list_index);
+		assert_int_equal(before_index, iter.index);
 		assert_int_equal(before_map_size - 1, map->size);
 	}
 	
@@ -0,0 +1,9 @@
+project 'string'
+    kind 'ConsoleApp'
+
+    location '.'
+
+    files       { '../../src/_string.c', 'src/string.c' }
+    includedirs { '../../include' }
+    defines     { 'LINUX' }
+    optimize    'On'
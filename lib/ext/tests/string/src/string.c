@@ -0,0 +1,213 @@
+/**
+ * Memory function benchmark
+ *
+ * The generic, SSE2, ERMS and AVX2 memcpy, memset and memcmp of _string.c
+ * are checked against bytewise results for every length up to 600 bytes and
+ * several larger ones, at every alignment of the buffers, without writing
+ * outside the range. Copies are then timed over the IMIX packet sizes, 64,
+ * 594 and 1518 bytes 7:4:1, from the IP header of packets to copies with
+ * another padding, so the buffers are not aligned alike, and at fixed sizes from 64 bytes to jumbo frames. The libc functions are shown
+ * for comparison. The functions the CPU does not support are skipped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <_string.h>
+
+#define BUFFER_SIZE	0x4000
+#define GUARD		64
+#define PACKET_COUNT	64		// Packets copied in turn, stay in the cache
+#define PACKET_SIZE	0x2400		// Room of a packet buffer
+#define PACKET_OFFSET	(14 + 2)	// IP header behind the Ethernet header and 2 bytes padding
+#define COPY_OFFSET	(14 + 32)	// IP header of a copy with another padding
+#define TEST_COUNT	1000000
+
+typedef struct {
+	const char*	name;
+	void*		(*memcpy)(void*, const void*, size_t);
+	void*		(*memset)(void*, int, size_t);
+	int		(*memcmp)(const void*, const void*, size_t);
+	bool		supported;
+} Variant;
+
+static int fail;
+
+static void* libc_memcpy(void* dest, const void* src, size_t n) {
+	return memcpy(dest, src, n);
+}
+
+static void* libc_memset(void* s, int c, size_t n) {
+	return memset(s, c, n);
+}
+
+static int libc_memcmp(const void* v1, const void* v2, size_t size) {
+	return memcmp(v1, v2, size);
+}
+
+static Variant variants[] = {
+	{ "generic", __memcpy, __memset, __memcmp, true },
+	{ "sse2", __memcpy_sse, __memset_sse, __memcmp_sse, true },
+	{ "erms", __memcpy_erms, __memset_erms, __memcmp_sse, false },
+	{ "avx2", __memcpy_avx2, __memset_avx2, __memcmp_avx2, false },
+	{ "libc", libc_memcpy, libc_memset, libc_memcmp, true },
+};
+
+#define VARIANT_COUNT	(sizeof(variants) / sizeof(variants[0]))
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static void detect() {
+	uint32_t a, b, c, d;
+	asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x07), "c"(0));
+	variants[2].supported = b & 0x200;
+
+	__builtin_cpu_init();
+	variants[3].supported = __builtin_cpu_supports("avx2");
+}
+
+static uint8_t src[BUFFER_SIZE + 64];
+static uint8_t dst[BUFFER_SIZE + 64 + GUARD * 2];
+
+static void check_memcpy(Variant* v, size_t len, int soff, int doff) {
+	memset(dst, 0xee, GUARD * 2 + doff + len);
+	uint8_t* d = dst + GUARD + doff;
+	if(v->memcpy(d, src + soff, len) != d)
+		fail = 1;
+
+	for(size_t i = 0; i < GUARD * 2 + doff + len; i++) {
+		uint8_t* p = dst + i;
+		bool inside = p >= d && p < d + len;
+		if(*p != (inside ? src[soff + (p - d)] : 0xee)) {
+			printf("%s memcpy: %lu bytes from +%d to +%d differ at %ld\n", v->name, len, soff, doff, p - d);
+			fail = 1;
+			return;
+		}
+	}
+}
+
+static void check_memset(Variant* v, size_t len, int doff) {
+	memset(dst, 0xee, GUARD * 2 + doff + len);
+	uint8_t* d = dst + GUARD + doff;
+	if(v->memset(d, 0x5a, len) != d)
+		fail = 1;
+
+	for(size_t i = 0; i < GUARD * 2 + doff + len; i++) {
+		uint8_t* p = dst + i;
+		bool inside = p >= d && p < d + len;
+		if(*p != (inside ? 0x5a : 0xee)) {
+			printf("%s memset: %lu bytes at +%d differ at %ld\n", v->name, len, doff, p - d);
+			fail = 1;
+			return;
+		}
+	}
+}
+
+static void check_memcmp(Variant* v, size_t len, int soff, int doff) {
+	uint8_t* d = dst + GUARD + doff;
+	memcpy(d, src + soff, len);
+	if(v->memcmp(d, src + soff, len)) {
+		printf("%s memcmp: %lu equal bytes differ\n", v->name, len);
+		fail = 1;
+	}
+
+	// Differences before the last one must not matter
+	size_t positions[] = { 0, len / 2, len - 1 };
+	for(int i = 2; i >= 0 && len; i--) {
+		size_t p = positions[i];
+		uint8_t saved = src[soff + p];
+		src[soff + p] = 0x80;
+		d[p] = 0x81;
+		int r1 = v->memcmp(d, src + soff, len);
+		d[p] = 0x7f;
+		int r2 = v->memcmp(d, src + soff, len);
+		src[soff + p] = d[p] = saved;
+		if(r1 <= 0 || r2 >= 0) {
+			printf("%s memcmp: %lu bytes at +%d, +%d differing at %lu: %d %d\n", v->name, len, doff, soff, p, r1, r2);
+			fail = 1;
+			return;
+		}
+	}
+}
+
+static void check(Variant* v) {
+	static const size_t larges[] = { 1024, 1514, 1518, 2047, 4096, 9018, BUFFER_SIZE };
+
+	for(size_t len = 0; len <= 600 + sizeof(larges) / sizeof(larges[0]); len++) {
+		size_t n = len <= 600 ? len : larges[len - 601];
+		for(int soff = 0; soff < 32; soff += n > 600 ? 7 : 1) {
+			for(int doff = 0; doff < 32; doff += n > 600 ? 5 : 3) {
+				check_memcpy(v, n, soff, doff);
+				check_memcmp(v, n, soff, doff);
+			}
+			check_memset(v, n, soff);
+		}
+	}
+}
+
+static uint8_t* packets;
+static uint8_t* copies;
+
+// Cycles per copy of the sizes in turn
+static uint64_t bench(Variant* v, const size_t* sizes, int count) {
+	uint64_t start = rdtsc();
+	for(int i = 0; i < TEST_COUNT; i++) {
+		int j = i % PACKET_COUNT;
+		v->memcpy(copies + j * PACKET_SIZE + COPY_OFFSET, packets + j * PACKET_SIZE + PACKET_OFFSET,
+				sizes[i % count]);
+	}
+
+	return (rdtsc() - start) / TEST_COUNT;
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	detect();
+
+	for(size_t i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+
+	for(size_t i = 0; i < VARIANT_COUNT; i++) {
+		if(variants[i].supported)
+			check(&variants[i]);
+	}
+
+	packets = aligned_alloc(64, PACKET_COUNT * PACKET_SIZE);
+	copies = aligned_alloc(64, PACKET_COUNT * PACKET_SIZE);
+	memset(packets, 0x11, PACKET_COUNT * PACKET_SIZE);
+	memset(copies, 0, PACKET_COUNT * PACKET_SIZE);
+
+	// IMIX 7:4:1, spread over the turn
+	static const size_t imix[] = { 64, 594, 64, 64, 594, 64, 1518, 64, 594, 64, 594, 64 };
+	static const size_t fixed[] = { 64, 128, 256, 594, 1518, 9018 };
+
+	printf("memcpy   IMIX");
+	for(size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+		printf("  %6lu", fixed[i]);
+	printf("  (cycles)\n");
+
+	for(size_t i = 0; i < VARIANT_COUNT; i++) {
+		Variant* v = &variants[i];
+		if(!v->supported) {
+			printf("%-7s  not supported\n", v->name);
+			continue;
+		}
+
+		printf("%-7s  %4lu", v->name, bench(v, imix, sizeof(imix) / sizeof(imix[0])));
+		for(size_t j = 0; j < sizeof(fixed) / sizeof(fixed[0]); j++)
+			printf("  %6lu", bench(v, &fixed[j], 1));
+		printf("\n");
+	}
+
+	free(packets);
+	free(copies);
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
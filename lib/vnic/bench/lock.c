@@ -0,0 +1,180 @@
+/**
+ * Lock contention benchmark
+ *
+ * Threads take the byte lock, the ticket lock, the MCS lock and the
+ * reader-writer lock around a short critical section and count in it, which
+ * must add up to the number of acquisitions. The reader-writer lock is also
+ * taken for reading 15 times out of 16, and the readers check that a writer
+ * never updates the data under them. The lock statistics show how often the
+ * callers waited and for how long. A thread preempted while it holds or waits
+ * for a fair lock stalls the others until it runs again, so runs with more
+ * threads than online CPUs only check a few acquisitions and are not timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <lock.h>
+
+#define ACQUIRE_COUNT	1000000		// Acquisitions per thread
+#define CHECK_COUNT	1000		// Acquisitions per thread with more threads than CPUs
+#define MAX_THREADS	16
+
+typedef enum {
+	TYPE_BYTE,
+	TYPE_TICKET,
+	TYPE_MCS,
+	TYPE_RWLOCK,
+	TYPE_RWLOCK_READ,
+} Type;
+
+static const char* names[] = { "byte", "ticket", "mcs", "rwlock", "rwlock 1/16" };
+
+static volatile uint8_t byte_lock;
+static TicketLock ticket_lock;
+static MCSLock mcs_lock;
+static RWLock rwlock;
+static LockStats stats;
+
+static Type type;
+static uint64_t count;
+static volatile uint64_t data[2] __attribute__((__aligned__(64)));
+static volatile uint64_t writes;
+static volatile int fail;
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static inline void write_data() {
+	data[0]++;
+	data[1]++;
+	writes++;
+}
+
+static void* worker(void* context) {
+	MCSNode node;
+	uint64_t seed = (uintptr_t)context;
+
+	for(uint64_t i = 0; i < count; i++) {
+		switch(type) {
+			case TYPE_BYTE:
+				lock_lock_stats(&byte_lock, &stats);
+				write_data();
+				lock_unlock(&byte_lock);
+				break;
+			case TYPE_TICKET:
+				ticket_lock_lock(&ticket_lock);
+				write_data();
+				ticket_lock_unlock(&ticket_lock);
+				break;
+			case TYPE_MCS:
+				mcs_lock_lock(&mcs_lock, &node);
+				write_data();
+				mcs_lock_unlock(&mcs_lock, &node);
+				break;
+			case TYPE_RWLOCK:
+				rwlock_write_lock(&rwlock);
+				write_data();
+				rwlock_write_unlock(&rwlock);
+				break;
+			case TYPE_RWLOCK_READ:
+				seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+				if(seed >> 60) {
+					rwlock_read_lock(&rwlock);
+					if(data[0] != data[1])
+						fail = 1;
+					rwlock_read_unlock(&rwlock);
+				} else {
+					rwlock_write_lock(&rwlock);
+					write_data();
+					rwlock_write_unlock(&rwlock);
+				}
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+static void run(Type _type, int threads, uint64_t _count, bool timed) {
+	type = _type;
+	count = _count;
+	data[0] = data[1] = writes = 0;
+	memset(&stats, 0, sizeof(LockStats));
+	lock_init(&byte_lock);
+	ticket_lock_init(&ticket_lock, &stats);
+	mcs_lock_init(&mcs_lock, &stats);
+	rwlock_init(&rwlock, &stats);
+
+	pthread_t ids[MAX_THREADS];
+	uint64_t start = rdtsc();
+	for(int i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, (void*)(uintptr_t)(i + 1));
+	for(int i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+	uint64_t cycles = rdtsc() - start;
+
+	uint64_t total = count * threads;
+	if(stats.acquires != total || data[0] != data[1] || (type != TYPE_RWLOCK_READ && writes != total)) {
+		printf("%s: %lu acquisitions, %lu writes of %lu\n", names[type], stats.acquires, writes, total);
+		fail = 1;
+	}
+
+	if(!timed) {
+		printf("%-12s %7d  not timed, %ld CPUs\n", names[type], threads, sysconf(_SC_NPROCESSORS_ONLN));
+		return;
+	}
+
+	printf("%-12s %7d %16lu %11.2f%% %12lu %15lu\n", names[type], threads, cycles / total,
+			stats.contended * 100.0 / stats.acquires,
+			stats.contended ? stats.spin_cycles / stats.contended : 0, stats.max_wait);
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("lock         threads  cycles/acquire   contended  cycles/wait  max wait cycles\n");
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for(Type t = TYPE_BYTE; t <= TYPE_RWLOCK_READ; t++) {
+		for(int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+			bool timed = threads <= cpus;
+			run(t, threads, timed ? ACQUIRE_COUNT : CHECK_COUNT, timed);
+		}
+	}
+
+	// Try locks must fail while the lock is held and succeed after it is released
+	MCSNode node1, node2;
+	ticket_lock_init(&ticket_lock, NULL);
+	mcs_lock_init(&mcs_lock, NULL);
+	rwlock_init(&rwlock, NULL);
+	lock_init(&byte_lock);
+
+	if(!lock_trylock(&byte_lock) || lock_trylock(&byte_lock))
+		fail = 1;
+	lock_unlock(&byte_lock);
+	if(!ticket_lock_trylock(&ticket_lock) || ticket_lock_trylock(&ticket_lock))
+		fail = 1;
+	ticket_lock_unlock(&ticket_lock);
+	if(!mcs_lock_trylock(&mcs_lock, &node1) || mcs_lock_trylock(&mcs_lock, &node2))
+		fail = 1;
+	mcs_lock_unlock(&mcs_lock, &node1);
+	if(!rwlock_read_trylock(&rwlock) || !rwlock_read_trylock(&rwlock) || rwlock_write_trylock(&rwlock))
+		fail = 1;
+	rwlock_read_unlock(&rwlock);
+	rwlock_read_unlock(&rwlock);
+	if(!rwlock_write_trylock(&rwlock) || rwlock_read_trylock(&rwlock))
+		fail = 1;
+	rwlock_write_unlock(&rwlock);
+	if(!lock_trylock(&byte_lock) || !ticket_lock_trylock(&ticket_lock) || !mcs_lock_trylock(&mcs_lock, &node1) ||
+			!rwlock_read_trylock(&rwlock))
+		fail = 1;
+
+	printf("%s\n", fail ? "FAILED" : "PASSED");
+
+	return fail;
+}
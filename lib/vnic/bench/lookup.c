@@ -0,0 +1,81 @@
+/**
+ * Packet to NIC lookup benchmark
+ *
+ * Packets are taken at several offsets of a 16MB NIC and looked up with the
+ * 2MB backward walk (nic_find_by_packet_slow) and the region table
+ * (nic_find_by_packet). The walk gets slower the further the packet is from
+ * the NIC header while the region table is constant.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vnic.h>
+
+#define POOL_SIZE	NIC_MAX_SIZE
+#define TEST_COUNT	10000000
+
+static uint8_t buffer[POOL_SIZE] __attribute__((__aligned__(0x200000)));
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static NIC* setup() {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_BUDGET, 32,
+		VNIC_POOL_SIZE, POOL_SIZE,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 1024,
+		VNIC_TX_QUEUE_SIZE, 1024,
+		VNIC_SLOW_RX_QUEUE_SIZE, 1024,
+		VNIC_SLOW_TX_QUEUE_SIZE, 1024,
+		VNIC_NONE
+	};
+
+	static VNIC vnic;
+	memset(&vnic, 0, sizeof(VNIC));
+	vnic.nic = (NIC*)buffer;
+	if(!vnic_init(&vnic, attrs)) {
+		printf("vnic_init failed\n");
+		exit(1);
+	}
+
+	return vnic.nic;
+}
+
+static double run(NIC* (*find)(Packet*), NIC* nic, Packet* packet) {
+	uint64_t start = rdtsc();
+	for(int i = 0; i < TEST_COUNT; i++) {
+		if(find(packet) != nic) {
+			printf("lookup failed at offset 0x%lx\n", (uintptr_t)packet - (uintptr_t)nic);
+			exit(1);
+		}
+
+		asm volatile("" ::: "memory");
+	}
+
+	return (double)(rdtsc() - start) / TEST_COUNT;
+}
+
+int main(int argc, char** argv) {
+	NIC* nic = setup();
+
+	printf("offset     walk(cycles) table(cycles)\n");
+	for(uintptr_t offset = NIC_HEADER_SIZE; offset < POOL_SIZE; offset += 0x200000) {
+		Packet* packet = (void*)nic + ROUNDUP(offset, NIC_CHUNK_SIZE) + 0x100000;
+		printf("%8luKB %12.1f %13.1f\n", ((uintptr_t)packet - (uintptr_t)nic) / 1024,
+				run(nic_find_by_packet_slow, nic, packet), run(nic_find_by_packet, nic, packet));
+	}
+
+	nic_region_remove(nic);
+
+	return 0;
+}
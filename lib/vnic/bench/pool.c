@@ -0,0 +1,117 @@
+/**
+ * NIC packet pool benchmark
+ *
+ * Keeps a window of live packets with a mix of 64B and 1500B payloads and
+ * replaces a random one on every step, which fragments the pool the same way
+ * real traffic does. Bitmap and size-class layouts are compared for several
+ * pool sizes, and the size-class layout also with a per-core packet cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vnic.h>
+
+#define MAX_POOL_SIZE	NIC_MAX_SIZE
+#define LIVE_COUNT	1024
+#define TEST_COUNT	1000000
+
+static uint8_t buffer[MAX_POOL_SIZE] __attribute__((__aligned__(0x200000)));
+static Packet* packets[LIVE_COUNT];
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static NIC* setup(uint64_t pool_size) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_BUDGET, 32,
+		VNIC_POOL_SIZE, pool_size,
+		VNIC_RX_BANDWIDTH, 1000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000L,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, 1024,
+		VNIC_TX_QUEUE_SIZE, 1024,
+		VNIC_SLOW_RX_QUEUE_SIZE, 1024,
+		VNIC_SLOW_TX_QUEUE_SIZE, 1024,
+		VNIC_NONE
+	};
+
+	static VNIC vnic;
+	memset(&vnic, 0, sizeof(VNIC));
+	vnic.nic = (NIC*)buffer;
+	if(!vnic_init(&vnic, attrs)) {
+		printf("vnic_init failed\n");
+		exit(1);
+	}
+
+	return vnic.nic;
+}
+
+static int core_id() {
+	return 0;
+}
+
+static uint16_t packet_size() {
+	return rand() % 4 ? 64 : 1500;
+}
+
+static void run(const char* name, uint64_t pool_size) {
+	NIC* nic = setup(pool_size);
+	srand(0);
+
+	for(int i = 0; i < LIVE_COUNT; i++)
+		packets[i] = nic_alloc(nic, packet_size());
+
+	uint64_t failed = 0;
+	uint64_t start = rdtsc();
+	for(int i = 0; i < TEST_COUNT; i++) {
+		int j = rand() % LIVE_COUNT;
+		if(packets[j])
+			nic_free(packets[j]);
+
+		packets[j] = nic_alloc(nic, packet_size());
+		if(!packets[j])
+			failed++;
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	printf("%-8s %4luMB %8.1f cycles/alloc+free, %lu failed, used %lu/%lu bytes\n", name,
+			(pool_size & ~(uint64_t)VNIC_POOL_CLASS) / 0x100000, (double)cycles / TEST_COUNT,
+			failed, nic_pool_used(nic), nic_pool_total(nic));
+
+	for(int i = 0; i < LIVE_COUNT; i++) {
+		if(packets[i])
+			nic_free(packets[i]);
+	}
+
+	NICCacheStats stats;
+	if(nic_cache_stats(nic, &stats)) {
+		printf("%-8s hit rate %.2f%%, %lu refills, %lu flushes\n", name,
+				100.0 * stats.hit / (stats.hit + stats.miss), stats.refill, stats.flush);
+		nic_cache_flush(nic);
+	}
+	nic_region_remove(nic);
+	nic_cache_invalidate(nic);
+
+	if(nic_pool_used(nic) != 0)
+		printf("%-8s pool is not empty after free: %lu\n", name, nic_pool_used(nic));
+}
+
+int main(int argc, char** argv) {
+	for(uint64_t size = 0x200000; size <= MAX_POOL_SIZE; size <<= 1) {
+		run("bitmap", size);
+		run("class", size | VNIC_POOL_CLASS);
+
+		nic__init_cache(core_id);
+		run("cached", size | VNIC_POOL_CLASS);
+		nic__init_cache(NULL);
+	}
+
+	return 0;
+}
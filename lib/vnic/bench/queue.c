@@ -0,0 +1,147 @@
+/**
+ * NICQueue throughput benchmark
+ *
+ * A VM thread produces packets to the tx queue and a kernel thread consumes
+ * them, as nic_tx()/vnic_tx() do. The per packet locked path is compared with
+ * the lock-free SPSC burst path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <vnic.h>
+
+#define POOL_SIZE	0x400000
+#define QUEUE_SIZE	1024
+#define PACKET_COUNT	512
+#ifndef TEST_COUNT
+#define TEST_COUNT	20000000UL
+#endif
+
+extern NIC* __nics[NIC_MAX_COUNT];
+extern int __nic_count;
+
+static uint8_t buffer[POOL_SIZE] __attribute__((__aligned__(0x200000)));
+static VNIC vnic;
+static Packet* packets[PACKET_COUNT];
+static uint32_t burst;
+
+static void setup(bool spsc) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334455,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_BUDGET, 32,
+		VNIC_POOL_SIZE, POOL_SIZE,
+		VNIC_RX_BANDWIDTH, 1000000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000000L,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_TX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_SLOW_RX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_SLOW_TX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_QUEUE_SPSC, spsc,
+		VNIC_NONE
+	};
+
+	memset(&vnic, 0, sizeof(VNIC));
+	vnic.nic = (NIC*)buffer;
+	vnic.nic_size = POOL_SIZE;
+	if(!vnic_init(&vnic, attrs)) {
+		printf("vnic_init failed\n");
+		exit(1);
+	}
+
+	__nics[0] = vnic.nic;
+	__nic_count = 1;
+
+	for(int i = 0; i < PACKET_COUNT; i++) {
+		packets[i] = nic_alloc(vnic.nic, 64);
+		packets[i]->end = packets[i]->start + 64;
+	}
+}
+
+static void teardown() {
+	for(int i = 0; i < PACKET_COUNT; i++)
+		nic_free(packets[i]);
+}
+
+static bool transmitter(Packet* packet, void* context) {
+	(*(uint64_t*)context)++;
+	return true;
+}
+
+static void* produce_locked(void* arg) {
+	for(uint64_t i = 0; i < TEST_COUNT; ) {
+		if(nic_try_tx(vnic.nic, packets[i % PACKET_COUNT]))
+			i++;
+	}
+
+	return NULL;
+}
+
+static void* consume_locked(void* arg) {
+	uint64_t count = 0;
+	while(count < TEST_COUNT)
+		vnic_tx(&vnic, transmitter, &count);
+
+	return NULL;
+}
+
+static void* produce_burst(void* arg) {
+	Packet* batch[NIC_BURST_SIZE * 2];
+	for(uint64_t i = 0; i < TEST_COUNT; ) {
+		uint32_t count = TEST_COUNT - i < burst ? TEST_COUNT - i : burst;
+		for(uint32_t j = 0; j < count; j++)
+			batch[j] = packets[(i + j) % PACKET_COUNT];
+
+		i += nic_tx_burst(vnic.nic, batch, count);
+	}
+
+	return NULL;
+}
+
+static void* consume_burst(void* arg) {
+	Packet* batch[NIC_BURST_SIZE * 2];
+	uint64_t count = 0;
+	while(count < TEST_COUNT)
+		count += vnic_tx_burst(&vnic, batch, burst);
+
+	return NULL;
+}
+
+static void run(const char* name, bool spsc, void* (*producer)(void*), void* (*consumer)(void*)) {
+	setup(spsc);
+
+	struct timespec start, end;
+	pthread_t threads[2];
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&threads[0], NULL, consumer, NULL);
+	pthread_create(&threads[1], NULL, producer, NULL);
+	pthread_join(threads[1], NULL);
+	pthread_join(threads[0], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-24s %8.2f Mpps\n", name, TEST_COUNT / elapsed / 1e6);
+
+	teardown();
+}
+
+int main(int argc, char** argv) {
+	printf("%lu packets through a %d entries tx queue\n", TEST_COUNT, QUEUE_SIZE);
+
+	run("locked, per packet", false, produce_locked, consume_locked);
+	run("spsc, per packet", true, produce_locked, consume_locked);
+
+	burst = NIC_BURST_SIZE;
+	run("spsc, burst 32", true, produce_burst, consume_burst);
+
+	burst = NIC_BURST_SIZE * 2;
+	run("spsc, burst 64", true, produce_burst, consume_burst);
+
+	return 0;
+}
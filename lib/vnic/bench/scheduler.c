@@ -0,0 +1,150 @@
+/**
+ * Egress scheduler fairness benchmark
+ *
+ * Backlogged VNICs sending packets of different sizes are served by
+ * scheduler_drr() and the bytes each one transmits are compared with its
+ * share of the weights of its priority. A transmitted packet is queued again,
+ * so the VNICs never run empty. Shares must be within 1% of the weights and a
+ * lower priority must not send while a higher one has packets. The packet
+ * round robin (scheduler_rr) is shown for comparison.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vnic.h>
+#include <scheduler.h>
+
+#define VNIC_COUNT	4
+#define POOL_SIZE	0x200000
+#define QUEUE_SIZE	256
+#define TEST_COUNT	1000000
+#define TOLERANCE	0.01
+
+extern NIC* __nics[NIC_MAX_COUNT];
+extern int __nic_count;
+
+static uint8_t buffer[VNIC_COUNT][POOL_SIZE] __attribute__((__aligned__(0x200000)));
+static VNIC vnics[VNIC_COUNT];
+static VNIC* list[VNIC_COUNT + 1];
+static uint64_t bytes[VNIC_COUNT];
+static uint16_t sizes[VNIC_COUNT];
+
+static void setup(int index, uint64_t weight, uint64_t priority, uint16_t size) {
+	uint64_t attrs[] = {
+		VNIC_MAC, 0x001122334400 + index,
+		VNIC_DEV, (uint64_t)"eth0",
+		VNIC_BUDGET, 32,
+		VNIC_POOL_SIZE, POOL_SIZE,
+		VNIC_RX_BANDWIDTH, 1000000000000L,
+		VNIC_TX_BANDWIDTH, 1000000000000L,
+		VNIC_PADDING_HEAD, 32,
+		VNIC_PADDING_TAIL, 32,
+		VNIC_RX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_TX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_SLOW_RX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_SLOW_TX_QUEUE_SIZE, QUEUE_SIZE,
+		VNIC_WEIGHT, weight,
+		VNIC_PRIORITY, priority,
+		VNIC_NONE
+	};
+
+	VNIC* vnic = &vnics[index];
+	memset(vnic, 0, sizeof(VNIC));
+	vnic->nic = (NIC*)buffer[index];
+	vnic->nic_size = POOL_SIZE;
+	if(!vnic_init(vnic, attrs)) {
+		printf("vnic_init failed\n");
+		exit(1);
+	}
+
+	__nics[index] = vnic->nic;
+	__nic_count = index + 1;
+	list[index] = vnic;
+	sizes[index] = size;
+
+	for(int i = 0; i < QUEUE_SIZE / 2; i++) {
+		Packet* packet = nic_alloc(vnic->nic, size);
+		packet->end = packet->start + size;
+		nic_tx(vnic->nic, packet);
+	}
+}
+
+static void teardown(int count) {
+	for(int i = 0; i < count; i++) {
+		Packet* packets[QUEUE_SIZE];
+		uint32_t dequeued = vnic_tx_burst(&vnics[i], packets, QUEUE_SIZE);
+		for(uint32_t j = 0; j < dequeued; j++)
+			nic_free(packets[j]);
+
+		nic_region_remove(vnics[i].nic);
+		list[i] = NULL;
+	}
+}
+
+// Counts the bytes of the VNIC and queues the packet again
+static bool transmitter(Packet* packet, void* context) {
+	int index = ((uint8_t*)packet - buffer[0]) / POOL_SIZE;
+	bytes[index] += packet->end - packet->start;
+
+	return nic_tx(vnics[index].nic, packet);
+}
+
+static int check(int count, SchedulerTx tx, const char* name) {
+	Scheduler scheduler;
+	memset(&scheduler, 0, sizeof(Scheduler));
+	scheduler.tx = tx;
+	memset(bytes, 0, sizeof(bytes));
+
+	for(int i = 0; i < TEST_COUNT / 64; i++)
+		scheduler_tx(&scheduler, list, transmitter, NULL, 64);
+
+	// Shares are taken among the VNICs of the highest backlogged priority
+	uint64_t total = 0;
+	uint64_t weights = 0;
+	for(int i = 0; i < count; i++) {
+		if(vnics[i].priority == 0) {
+			total += bytes[i];
+			weights += vnics[i].weight;
+		}
+	}
+
+	int fail = 0;
+	for(int i = 0; i < count; i++) {
+		double target = vnics[i].priority == 0 ? (double)vnics[i].weight / weights : 0;
+		double share = (double)bytes[i] / total;
+		printf("%-4s vnic%d weight %2d priority %d size %4d share %7.4f%% target %7.4f%%\n", name, i,
+				vnics[i].weight, vnics[i].priority, sizes[i], share * 100, target * 100);
+		double error = share > target ? share - target : target - share;
+		if(target ? error > target * TOLERANCE : share > 0)
+			fail = 1;
+	}
+
+	return tx == scheduler_drr ? fail : 0;
+}
+
+int main(int argc, char** argv) {
+	int fail = 0;
+	uint16_t packet_sizes[] = { 64, 1500, 512, 9000 };
+
+	// Equal weights, different packet sizes
+	for(int i = 0; i < VNIC_COUNT; i++)
+		setup(i, 1, 0, packet_sizes[i]);
+	fail |= check(VNIC_COUNT, scheduler_drr, "drr");
+	check(VNIC_COUNT, scheduler_rr, "rr");
+	teardown(VNIC_COUNT);
+
+	// Weights 1:2:3:4
+	for(int i = 0; i < VNIC_COUNT; i++)
+		setup(i, i + 1, 0, packet_sizes[i]);
+	fail |= check(VNIC_COUNT, scheduler_drr, "drr");
+	teardown(VNIC_COUNT);
+
+	// A lower priority VNIC gets nothing while the others are backlogged
+	for(int i = 0; i < VNIC_COUNT; i++)
+		setup(i, 1, i == VNIC_COUNT - 1, packet_sizes[i]);
+	fail |= check(VNIC_COUNT, scheduler_drr, "drr");
+	teardown(VNIC_COUNT);
+
+	return fail;
+}
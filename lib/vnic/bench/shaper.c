@@ -0,0 +1,138 @@
+/**
+ * Token bucket shaper benchmark
+ *
+ * A backlogged sender is shaped on a simulated clock and the rate achieved
+ * after the first burst is compared with the target, for several rates and
+ * packet sizes, through a parent shaper, and across a live rate change.
+ * Every run must stay within 1% of the target. The cost of letting a packet
+ * pass a shaper which has tokens is measured last.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shaper.h>
+
+#define FREQ		3000000000L	// Simulated clock (3GHz)
+#define STEP		(FREQ / 1000000)	// Clock advances 1us at a time
+#define TOLERANCE	0.01
+#define TEST_COUNT	100000000
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t now;
+
+// Sends size bytes packets through the shaper as fast as it allows for the duration (s)
+static uint64_t send(Shaper* shaper, uint64_t size, double duration) {
+	uint64_t bytes = 0;
+	uint64_t end = now + (uint64_t)(duration * FREQ);
+	for(; now < end; now += STEP) {
+		shaper_refill(shaper, now);
+		while(shaper_ready(shaper)) {
+			shaper_charge(shaper, size);
+			bytes += size;
+		}
+	}
+
+	return bytes;
+}
+
+static int check(const char* name, uint64_t rate, uint64_t size, uint64_t bytes, double duration) {
+	double achieved = bytes * 8 / duration;
+	double error = (achieved - rate) / rate;
+	printf("%-10s %12lu %6lu %15.0f %+8.4f%%\n", name, rate, size, achieved, error * 100);
+
+	return error < -TOLERANCE || error > TOLERANCE;
+}
+
+int main(int argc, char** argv) {
+	uint64_t rates[] = { 10000000L, 100000000L, 1000000000L, 10000000000L };
+	uint64_t sizes[] = { 64, 512, 1518, 9000 };
+	int fail = 0;
+
+	printf("test               rate(bps)   size   achieved(bps)    error\n");
+	for(size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		for(size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			Shaper shaper;
+			memset(&shaper, 0, sizeof(Shaper));
+			shaper_set(&shaper, FREQ, now, rates[i], rates[i] / 8 / 100, rates[i] * 2, rates[i] * 2 / 8 / 1000);
+
+			// The initial burst is not part of the rate
+			send(&shaper, sizes[j], 0.1);
+			fail |= check("rate", rates[i], sizes[j], send(&shaper, sizes[j], 1), 1);
+		}
+	}
+
+	// Two children of a slower parent share the parent's rate
+	for(size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+		Shaper parent, child1, child2;
+		memset(&parent, 0, sizeof(Shaper));
+		memset(&child1, 0, sizeof(Shaper));
+		memset(&child2, 0, sizeof(Shaper));
+		child1.parent = child2.parent = &parent;
+		shaper_set(&parent, FREQ, now, 1000000000L, 1000000000L / 8 / 100, 0, 0);
+		shaper_set(&child1, FREQ, now, 800000000L, 800000000L / 8 / 100, 0, 0);
+		shaper_set(&child2, FREQ, now, 800000000L, 800000000L / 8 / 100, 0, 0);
+
+		uint64_t bytes = 0;
+		uint64_t end = now + FREQ + FREQ / 10;
+		uint64_t start = now + FREQ / 10;
+		for(; now < end; now += STEP) {
+			shaper_refill(&child1, now);
+			shaper_refill(&child2, now);
+			for(int k = 0; shaper_ready(&child1) || shaper_ready(&child2); k++) {
+				Shaper* child = k % 2 ? &child1 : &child2;
+				if(!shaper_ready(child))
+					continue;
+
+				shaper_charge(child, sizes[j]);
+				if(now >= start)
+					bytes += sizes[j];
+			}
+		}
+
+		fail |= check("parent", 1000000000L, sizes[j], bytes, 1);
+	}
+
+	// The rate is changed while sending
+	for(size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+		Shaper shaper;
+		memset(&shaper, 0, sizeof(Shaper));
+		shaper_set(&shaper, FREQ, now, 1000000000L, 1000000000L / 8 / 100, 0, 0);
+		send(&shaper, sizes[j], 0.1);
+		fail |= check("before", 1000000000L, sizes[j], send(&shaper, sizes[j], 1), 1);
+
+		shaper_set(&shaper, FREQ, now, 100000000L, 100000000L / 8 / 100, 0, 0);
+		send(&shaper, sizes[j], 0.1);
+		fail |= check("after", 100000000L, sizes[j], send(&shaper, sizes[j], 1), 1);
+	}
+
+	// Passing packets while tokens are left does not read the clock
+	Shaper parent, shaper;
+	memset(&parent, 0, sizeof(Shaper));
+	memset(&shaper, 0, sizeof(Shaper));
+	shaper.parent = &parent;
+	shaper_set(&parent, FREQ, now, 100000000000L, SHAPER_MAX_BURST, 0, 0);
+	shaper_set(&shaper, FREQ, now, 100000000000L, SHAPER_MAX_BURST, 0, 0);
+
+	uint64_t passed = 0;
+	uint64_t t = rdtsc();
+	for(int i = 0; i < TEST_COUNT; i++) {
+		if(!shaper_ready(&shaper)) {
+			parent.ctokens = shaper.ctokens = (int64_t)SHAPER_MAX_BURST << SHAPER_SHIFT;
+			continue;
+		}
+
+		shaper_charge(&shaper, 64);
+		passed++;
+		asm volatile("" ::: "memory");
+	}
+
+	printf("pass: %.2f cycles per packet (%lu passed)\n", (double)(rdtsc() - t) / TEST_COUNT, passed);
+
+	return fail;
+}
@@ -1,13 +1,32 @@
 #ifndef __LOCK_H__
 #define __LOCK_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 /**
  * @file
  * Locking between threads.
+ *
+ * The byte lock is a test and test and set spin lock which fits in the
+ * shared structures. Under contention the ticket lock and the MCS lock grant
+ * the lock in the order of the requests, and the MCS lock spins on a node of
+ * the waiter instead of the shared lock. The reader-writer lock lets many
+ * readers in at once and blocks new readers while a writer waits.
+ */
+
+/**
+ * Contention statistics of a lock, in TSC cycles. It is updated only when it
+ * is given to the lock, and the wait is measured only when the lock is not
+ * available at once.
  */
+typedef struct _LockStats {
+	volatile uint64_t	acquires;	///< Number of acquisitions
+	volatile uint64_t	contended;	///< Number of acquisitions which waited
+	volatile uint64_t	spin_cycles;	///< Total cycles spent waiting
+	volatile uint64_t	max_wait;	///< Longest wait
+} LockStats;
 
 /**
  * Initialize the lock object.
@@ -23,6 +42,14 @@ void lock_init(uint8_t volatile* lock);
  */
 void lock_lock(uint8_t volatile* lock);
 
+/**
+ * Lock it and count the acquisition.
+ *
+ * @param lock lock object
+ * @param stats statistics to update
+ */
+void lock_lock_stats(uint8_t volatile* lock, LockStats* stats);
+
 /**
  * Try to lock it if available.
  *
@@ -39,4 +66,154 @@ bool lock_trylock(uint8_t volatile* lock);
  */
 void lock_unlock(uint8_t volatile* lock);
 
+/**
+ * Ticket lock, granted in the order of lock_ticket_lock calls.
+ */
+typedef struct _TicketLock {
+	volatile uint32_t	next;	///< Ticket of the next caller
+	volatile uint32_t	owner;	///< Ticket holding the lock
+	LockStats*		stats;	///< Statistics, NULL if not counted
+} TicketLock;
+
+/**
+ * Initialize the ticket lock.
+ *
+ * @param lock ticket lock
+ * @param stats statistics to update, NULL not to count
+ */
+void ticket_lock_init(TicketLock* lock, LockStats* stats);
+
+/**
+ * Lock it, waiting for the earlier callers.
+ *
+ * @param lock ticket lock
+ */
+void ticket_lock_lock(TicketLock* lock);
+
+/**
+ * Try to lock it if nobody holds or waits for it.
+ *
+ * @param lock ticket lock
+ * @return true when succeed to lock
+ */
+bool ticket_lock_trylock(TicketLock* lock);
+
+/**
+ * Unlock it, passing it to the next caller.
+ *
+ * @param lock ticket lock
+ */
+void ticket_lock_unlock(TicketLock* lock);
+
+/**
+ * Queue node of an MCS lock caller. It must stay valid from lock to unlock
+ * and be at the same address for every core taking the lock.
+ */
+typedef struct _MCSNode {
+	struct _MCSNode* volatile	next;	///< Next waiter
+	volatile uint32_t		locked;	///< Still waiting
+} __attribute__((__aligned__(64))) MCSNode;
+
+/**
+ * MCS queue lock, granted in the order of the requests.
+ */
+typedef struct _MCSLock {
+	MCSNode* volatile	tail;	///< Last node in the queue, NULL if not locked
+	LockStats*		stats;	///< Statistics, NULL if not counted
+} MCSLock;
+
+/**
+ * Initialize the MCS lock.
+ *
+ * @param lock MCS lock
+ * @param stats statistics to update, NULL not to count
+ */
+void mcs_lock_init(MCSLock* lock, LockStats* stats);
+
+/**
+ * Lock it, waiting for the earlier callers.
+ *
+ * @param lock MCS lock
+ * @param node queue node of the caller
+ */
+void mcs_lock_lock(MCSLock* lock, MCSNode* node);
+
+/**
+ * Try to lock it if nobody holds or waits for it.
+ *
+ * @param lock MCS lock
+ * @param node queue node of the caller
+ * @return true when succeed to lock
+ */
+bool mcs_lock_trylock(MCSLock* lock, MCSNode* node);
+
+/**
+ * Unlock it, passing it to the next caller.
+ *
+ * @param lock MCS lock
+ * @param node queue node given to lock
+ */
+void mcs_lock_unlock(MCSLock* lock, MCSNode* node);
+
+/**
+ * Reader-writer lock. A waiting writer keeps new readers out, so writers are
+ * not starved by the readers.
+ */
+typedef struct _RWLock {
+	volatile uint32_t	value;	///< Writer bit, writer waiting bit and number of readers
+	LockStats*		stats;	///< Statistics, NULL if not counted
+} RWLock;
+
+/**
+ * Initialize the reader-writer lock.
+ *
+ * @param lock reader-writer lock
+ * @param stats statistics to update, NULL not to count
+ */
+void rwlock_init(RWLock* lock, LockStats* stats);
+
+/**
+ * Lock it for reading, shared with the other readers.
+ *
+ * @param lock reader-writer lock
+ */
+void rwlock_read_lock(RWLock* lock);
+
+/**
+ * Try to lock it for reading.
+ *
+ * @param lock reader-writer lock
+ * @return true when succeed to lock
+ */
+bool rwlock_read_trylock(RWLock* lock);
+
+/**
+ * Unlock it from reading.
+ *
+ * @param lock reader-writer lock
+ */
+void rwlock_read_unlock(RWLock* lock);
+
+/**
+ * Lock it for writing, waiting for the readers to leave.
+ *
+ * @param lock reader-writer lock
+ */
+void rwlock_write_lock(RWLock* lock);
+
+/**
+ * Try to lock it for writing.
+ *
+ * @param lock reader-writer lock
+ * @return true when succeed to lock
+ */
+bool rwlock_write_trylock(RWLock* lock);
+
+/**
+ * Unlock it from writing.
+ *
+ * @param lock reader-writer lock
+ */
+void rwlock_write_unlock(RWLock* lock);
+
 #endif /* __LOCK_H__ */
@@ -18,8 +18,15 @@
 #define NIC_MAX_COUNT		64
 #define NIC_MAX_LINKS		8
 #define NIC_CHUNK_SIZE		64
+#define NIC_CACHE_LINE_SIZE	64
+#define NIC_BURST_SIZE		32			// Default number of packets moved by one burst call
 #define NIC_MAX_SIZE		(16 * 1024 * 1024)	// 16MB
 #define NIC_HEADER_SIZE		(64 * 1024)		// 64KB
+#define NIC_REGION_SIZE		0x200000		// NICs are 2MB aligned and sized
+#define NIC_REGION_COUNT	1024			// Region table slots, twice NIC_MAX_COUNT * NIC_MAX_SIZE / NIC_REGION_SIZE
+#define NIC_CONFIG_INDEX_SIZE	256			// Hash buckets of config keys in the NIC header
+#define NIC_CONFIG_INDEX_DELETED	0xffff		// Bucket of a removed key, probing goes on
+#define NIC_CONFIG_HANDLE_COUNT	64			// Resolved config keys cached per process
 
 #define NIC_MAGIC_HEADER	0x0A38E56586468C01LL	// PacketNgin vNIC 01(version)
 
@@ -30,24 +37,78 @@
 
 // Host API
 
+#define NIC_QUEUE_F_SPSC	0x01	///< Single producer/single consumer queue, rlock/wlock are not used
+
+/**
+ * Packet queue shared between kernel and VM.
+ *
+ * head is only written by the consumer and tail is only written by the producer.
+ * They are placed on their own cache lines so that both sides do not bounce
+ * a cache line on every push and pop.
+ */
 typedef struct _NICQueue {
 	uint32_t	base;			///< Base offset
-	uint32_t	head;			///< Queue head
-	uint32_t	tail;			///< Queue tail
 	uint32_t	size;			///< Maximum number of packets this queue can have
+	uint8_t		flags;			///< NIC_QUEUE_F_* flags
 	volatile uint8_t rlock;		///< Read lock
 	volatile uint8_t wlock;		///< Write lock
-} NICQueue;
+
+	volatile uint32_t head __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue head (consumer)
+	volatile uint32_t tail __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));	///< Queue tail (producer)
+} __attribute__((__aligned__(NIC_CACHE_LINE_SIZE))) NICQueue;
+
+/**
+ * Load the index written by the other side of the queue.
+ * Entries published before the index was stored are visible after this call.
+ * x86-64 does not reorder loads with other loads, so a compiler barrier is enough.
+ */
+static inline uint32_t queue_load_acquire(volatile uint32_t* index) {
+	uint32_t value = *index;
+	asm volatile("" ::: "memory");
+	return value;
+}
 
 /**
- * Bitmap Pool
+ * Publish the index to the other side of the queue.
+ * Every entry written before this call is visible before the index itself.
+ */
+static inline void queue_store_release(volatile uint32_t* index, uint32_t value) {
+	asm volatile("" ::: "memory");
+	*index = value;
+}
+
+#define NIC_POOL_TYPE_BITMAP	0	///< First fit search over a byte map of NIC_CHUNK_SIZE chunks
+#define NIC_POOL_TYPE_CLASS	1	///< Size-class free lists, O(1) allocation and free
+
+#define NIC_POOL_CLASS_COUNT	5
+#define NIC_POOL_CLASS_SIZES	{ 128, 256, 512, 2048, 9216 }	///< Buffer sizes including Packet header
+#define NIC_POOL_CLASS_USED	0x80	///< Byte map mark of an allocated size-class buffer
+#define NIC_POOL_CLASS_CACHED	0x40	///< Byte map mark of a size-class buffer held by a core cache
+
+#define NIC_CACHE_CORE_COUNT	16	///< Cores which can have a packet cache (core id below this)
+#define NIC_CACHE_SLOT_COUNT	16	///< NICs cached per core, direct mapped by NIC id
+#define NIC_CACHE_SIZE		32	///< Packets per size class in a core cache
+#define NIC_CACHE_BATCH		16	///< Packets moved by one refill or flush
+
+/**
+ * Packet Pool
+ *
+ * NIC_POOL_TYPE_BITMAP: bitmap has one byte per chunk which tells how many
+ * chunks are left until the end of the buffer.
+ *
+ * NIC_POOL_TYPE_CLASS: buffers are carved from the pool at index on demand
+ * and recycled through the free list of their size class. The first chunk of
+ * a buffer has its class (and NIC_POOL_CLASS_USED while allocated) in bitmap.
+ * Free lists are linked by offsets from the NIC, so kernel and VM can share them.
  */
 typedef struct _NICPool {
 	uint32_t	bitmap;		///< Bitmap
 	uint32_t	count;		///< Chunk count
 	uint32_t	pool;		///< Bitmap pool
-	uint32_t	index;
+	uint32_t	index;		///< Next chunk to search (bitmap) or to carve (class)
 	uint32_t	used;		///< Number of active chunks
+	uint8_t		type;		///< NIC_POOL_TYPE_*
+	uint32_t	free[NIC_POOL_CLASS_COUNT];	///< Free list heads of size classes (offset from NIC, 0 is empty)
 	volatile uint8_t lock;	///< Write lock
 } NICPool;
 
@@ -87,17 +148,20 @@ typedef struct _NIC {
 	uint16_t	padding_head;
 	uint16_t	padding_tail;
 
-	NICQueue	rx;
-	NICQueue	tx;
+	NICQueue	rx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
+	NICQueue	tx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
 
-	NICQueue	srx;
-	NICQueue	stx;
+	NICQueue	srx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
+	NICQueue	stx __attribute__((__aligned__(NIC_CACHE_LINE_SIZE)));
 
 	NICPool		pool;
 
 	uint32_t	config;
-	uint8_t		config_head[0];
-	uint8_t		config_tail[0] __attribute__((__aligned__(NIC_HEADER_SIZE)));
+	volatile uint8_t config_lock;		///< Lock to add or remove config keys
+	volatile uint32_t config_gen __attribute__((__aligned__(sizeof(uint32_t))));	///< Incremented whenever a config key is removed
+	uint16_t	config_index[NIC_CONFIG_INDEX_SIZE];	///< Hash index of config keys (key + 1, 0 is empty)
+	uint32_t	config_head[0] __attribute__((__aligned__(sizeof(uint32_t))));
+	uint32_t	config_tail[0] __attribute__((__aligned__(NIC_HEADER_SIZE)));
 
 	// rx queue (8 bytes aligned)
 	// tx queue (8 bytes aligned)
@@ -107,7 +171,45 @@ typedef struct _NIC {
 	// pool (NIC_CHUNK_SIZE(64) bytges aligned)
 } __attribute__((packed)) NIC;
 
+/**
+ * Find the NIC which owns the packet in constant time using the region table.
+ * NICs which are not registered are searched by nic_find_by_packet_slow().
+ *
+ * @param packet packet
+ *
+ * @return NIC or NULL
+ */
 NIC* nic_find_by_packet(Packet* packet);
+
+/**
+ * Find the NIC by walking back 2MB at a time until NIC_MAGIC_HEADER is found.
+ *
+ * @param packet packet
+ *
+ * @return NIC or NULL
+ */
+NIC* nic_find_by_packet_slow(Packet* packet);
+
+/**
+ * Register the 2MB frames of a NIC in the region table.
+ * The kernel registers VNICs with their trusted size and pool layout. NICs in
+ * __nics are registered with their own layout when their first packet is
+ * looked up or cached.
+ *
+ * @param nic NIC (2MB aligned)
+ * @param layout pool layout which the packet caches validate offsets against
+ * @param size NIC memory size
+ *
+ * @return false if the NIC is not aligned or the table is full
+ */
+bool nic_region_add(NIC* nic, NICPool* layout, size_t size);
+
+/**
+ * Remove the NIC from the region table. Must be called before the NIC memory is released.
+ *
+ * @param nic NIC
+ */
+void nic_region_remove(NIC* nic);
 int nic_count();
 NIC* nic_get(int index);
 NIC* nic_get_by_id(uint32_t id);
@@ -115,8 +217,124 @@ NIC* nic_get_by_id(uint32_t id);
 Packet* nic_alloc(NIC* nic, uint16_t size);
 bool nic_free(Packet* packet);
 
+/**
+ * Allocate a buffer from a NIC_POOL_TYPE_CLASS pool.
+ *
+ * @param nic NIC which owns the pool
+ * @param layout trusted copy of the pool offsets (the VNIC's copy in kernel)
+ * @param size buffer size including Packet header and paddings
+ *
+ * @return newly allocated packet or NULL
+ */
+Packet* nic_pool_class_alloc(NIC* nic, NICPool* layout, uint32_t size);
+
+/**
+ * Return a buffer to a NIC_POOL_TYPE_CLASS pool.
+ *
+ * @param nic NIC which owns the packet
+ * @param layout trusted copy of the pool offsets (the VNIC's copy in kernel)
+ * @param packet packet allocated by nic_pool_class_alloc
+ *
+ * @return true if the packet is freed
+ */
+bool nic_pool_class_free(NIC* nic, NICPool* layout, Packet* packet);
+
+/**
+ * Add a read-only reference to a size-class buffer so that it can be queued
+ * to several NICs at once. Every reference is released by nic_free().
+ *
+ * @param nic NIC which owns the packet
+ * @param layout trusted copy of the pool offsets (the VNIC's copy in kernel)
+ * @param packet packet allocated by nic_pool_class_alloc
+ *
+ * @return false if the pool does not support sharing or too many references
+ */
+bool nic_pool_class_ref(NIC* nic, NICPool* layout, Packet* packet);
+
+/**
+ * Add a read-only reference to the packet. Only NIC_POOL_TYPE_CLASS pools support it.
+ *
+ * @param packet packet
+ *
+ * @return true if the reference is added
+ */
+bool nic_ref(Packet* packet);
+
+/**
+ * Check whether the packet is shared with other readers.
+ * A shared packet must not be modified, use nic_cow() first.
+ *
+ * @param packet packet
+ *
+ * @return true if the packet has more than one reference
+ */
+bool nic_shared(Packet* packet);
+
+/**
+ * Copy on write. Returns the packet itself if it is not shared. Otherwise the
+ * packet data is copied to a new packet of the NIC and the shared one is released.
+ *
+ * @param nic NIC to allocate the copy from
+ * @param packet packet
+ *
+ * @return writable packet, or NULL if the copy cannot be allocated (packet is still held)
+ */
+Packet* nic_cow(NIC* nic, Packet* packet);
+
+/**
+ * Per-core packet cache counters.
+ * Hit rate is hit / (hit + miss).
+ */
+typedef struct _NICCacheStats {
+	uint64_t	hit;		///< Allocations served from the core cache
+	uint64_t	miss;		///< Allocations which found the core cache empty
+	uint64_t	refill;		///< Bulk moves from the pool to the core cache
+	uint64_t	flush;		///< Bulk moves from the core cache to the pool
+} NICCacheStats;
+
+/**
+ * Enable per-core packet caches in front of NIC_POOL_TYPE_CLASS pools.
+ * Packets are allocated and freed without taking the pool lock while the
+ * cache of the calling core has room, and move in NIC_CACHE_BATCH bulks
+ * otherwise. Cached packets are counted as used in the pool.
+ *
+ * The SDK uses thread_id() when no function is registered.
+ *
+ * @param core_id returns the id of the calling core, or -1 to bypass the cache
+ */
+void nic__init_cache(int (*core_id)());
+
+/**
+ * Return every packet the calling core caches for the NIC to its pool.
+ *
+ * @param nic NIC
+ */
+void nic_cache_flush(NIC* nic);
+
+/**
+ * Forget the NIC on every core without touching its memory. Each core drops
+ * its packets of the NIC when it uses its cache next, so no core writes the
+ * cache of another. Must be called after nic_region_remove() and before the
+ * NIC memory is released.
+ *
+ * @param nic NIC
+ */
+void nic_cache_invalidate(NIC* nic);
+
+/**
+ * Sum the cache counters of every core for the NIC.
+ *
+ * @param nic NIC
+ * @param stats counters to fill
+ *
+ * @return false if no core has cached the NIC
+ */
+bool nic_cache_stats(NIC* nic, NICCacheStats* stats);
+
 bool queue_push(NIC* nic, NICQueue* queue, Packet* packet);
 void* queue_pop(NIC* nic, NICQueue* queue);
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count);
 uint32_t queue_size(NICQueue* queue);
 bool queue_available(NICQueue* queue);
 bool queue_empty(NICQueue* queue);
@@ -125,6 +343,17 @@ bool nic_has_rx(NIC* nic);
 Packet* nic_rx(NIC* nic);
 uint32_t nic_rx_size(NIC* nic);
 
+/**
+ * Receive up to count packets with a single queue index update.
+ *
+ * @param nic NIC
+ * @param packets array to store received packets
+ * @param count maximum number of packets to receive (NIC_BURST_SIZE is a good default)
+ *
+ * @return number of packets stored in packets
+ */
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count);
+
 bool nic_has_srx(NIC* nic);
 Packet* nic_srx(NIC* nic);
 uint32_t nic_srx_size(NIC* nic);
@@ -132,6 +361,18 @@ uint32_t nic_srx_size(NIC* nic);
 bool nic_tx(NIC* nic, Packet* packet);
 bool nic_try_tx(NIC* nic, Packet* packet);
 bool nic_tx_dup(NIC* nic, Packet* packet);
+
+/**
+ * Transmit up to count packets with a single queue index update.
+ * Packets which are not queued are still owned by the caller.
+ *
+ * @param nic NIC
+ * @param packets packets to transmit
+ * @param count number of packets
+ *
+ * @return number of packets queued from the beginning of packets
+ */
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count);
 bool nic_has_tx(NIC* nic);
 uint32_t nic_tx_size(NIC* nic);
 
@@ -145,9 +386,40 @@ size_t nic_pool_used(NIC* nic);
 size_t nic_pool_free(NIC* nic);
 size_t nic_pool_total(NIC* nic);
 
+/**
+ * Allocate a config entry. Keys are added under config_lock and published to
+ * config_index after the entry is written, so the other side of the NIC can
+ * look keys up without locking.
+ *
+ * @param nic NIC
+ * @param name key name (shorter than 255 bytes)
+ * @param size data size
+ *
+ * @return key, -1 if the name is too long or already exists, -2 if there is no space
+ */
 int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size);
 void nic_config_free(NIC* nic, uint16_t key);
+
+/**
+ * Find the key of the name through config_index.
+ * Resolved keys are cached per process until a key of the NIC is removed.
+ *
+ * @return -1 key length is too long
+ * @return -2 key of the name not found
+ * @return otherwise key of the name
+ */
 int32_t nic_config_key(NIC* nic, char* name);
+
+/**
+ * Get the data of the name, allocating size bytes of zeroed data if the name does not exist.
+ *
+ * @param nic NIC
+ * @param name key name
+ * @param size data size
+ *
+ * @return data or NULL if the entry cannot be allocated
+ */
+void* nic_config_lookup(NIC* nic, char* name, uint16_t size);
 void* nic_config_get(NIC* nic, uint16_t key);
 uint16_t nic_config_size(NIC* nic, uint16_t key);
 uint32_t nic_config_available(NIC* nic);
@@ -32,4 +32,79 @@ typedef struct _Packet {
 	uint8_t		buffer[0];  ///< data buffer
 } Packet;
 
+#define PACKET_META_MAGIC		0x4d50	///< PacketMeta is valid
+
+#define PACKET_META_VLAN		0x0001	///< Frame has VLAN tags
+#define PACKET_META_FRAGMENT		0x0002	///< IP fragment, no transport header
+#define PACKET_META_IP_CSUM_GOOD	0x0010	///< IP checksum was verified
+#define PACKET_META_L4_CSUM_GOOD	0x0020	///< Transport checksum was verified
+#define PACKET_META_IP_CSUM_NEEDED	0x0100	///< IP checksum has to be calculated before transmit
+#define PACKET_META_L4_CSUM_NEEDED	0x0200	///< Transport checksum has to be calculated before transmit
+
+/**
+ * Packet metadata.
+ *
+ * Filled once when the frame is received, so the headers do not have to be
+ * parsed again. The block is placed at the beginning of the head padding
+ * (Packet.buffer) and is valid only while Packet.start is beyond it and the
+ * magic is set. Moving start into the block (pushing headers) invalidates it.
+ * Offsets are from Packet.buffer, 0 if the header is not present.
+ */
+typedef struct _PacketMeta {
+	uint16_t	magic;		///< PACKET_META_MAGIC
+	uint16_t	flags;		///< PACKET_META_* flags
+	uint32_t	hash;		///< Flow hash of IP addresses and ports, 0 if not IP
+	uint16_t	l2;		///< Offset of Ethernet header
+	uint16_t	l3;		///< Offset of network header
+	uint16_t	l4;		///< Offset of transport header
+	uint16_t	payload;	///< Offset of transport payload
+	uint16_t	l3_proto;	///< Ether type of network header (host order)
+	uint8_t		l4_proto;	///< IP protocol of transport header
+	uint8_t		reserved[13];
+} PacketMeta;
+
+/**
+ * Get the metadata of the packet.
+ *
+ * @param packet packet
+ *
+ * @return metadata, NULL if the packet has none
+ */
+static inline PacketMeta* packet_meta(Packet* packet) {
+	PacketMeta* meta = (PacketMeta*)packet->buffer;
+	if(packet->start < sizeof(PacketMeta) || meta->magic != PACKET_META_MAGIC)
+		return NULL;
+
+	return meta;
+}
+
+/**
+ * Invalidate the metadata of the packet, allocators call it on every buffer.
+ *
+ * @param packet packet (its buffer is at least sizeof(PacketMeta) bytes)
+ */
+static inline void packet_meta_clear(Packet* packet) {
+	((PacketMeta*)packet->buffer)->magic = 0;
+}
+
+/**
+ * Parse the headers of a frame.
+ *
+ * @param meta metadata to fill, offsets are from data
+ * @param data frame
+ * @param size frame length
+ *
+ * @return true if at least the Ethernet header is present
+ */
+bool packet_meta_parse(PacketMeta* meta, uint8_t* data, uint16_t size);
+
+/**
+ * Attach metadata parsed from a frame to the packet that the frame was copied
+ * to at Packet.start.
+ *
+ * @param packet packet, Packet.start must be sizeof(PacketMeta) or more
+ * @param meta metadata returned by packet_meta_parse()
+ */
+void packet_meta_set(Packet* packet, PacketMeta* meta);
+
 #endif /*__PACKET_H__*/
@@ -0,0 +1,64 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "vnic.h"
+
+/**
+ * @file
+ * Egress scheduling of the VNICs sharing a NIC device.
+ */
+
+#define SCHEDULER_PRIORITY_COUNT	4	///< Strict priority classes, 0 is served first
+#define SCHEDULER_QUANTUM		1518	///< Bytes a VNIC of weight 1 may send per round
+
+typedef struct _Scheduler Scheduler;
+
+/**
+ * Transmit queued packets of the VNICs.
+ *
+ * @param scheduler scheduler state
+ * @param vnics VNICs, terminated by NULL or MAX_VNIC_COUNT long
+ * @param transmitter driver function that transmits a packet
+ * @param transmitter_context driver function context
+ * @param budget maximum number of packets to transmit
+ *
+ * @return number of packets transmitted
+ */
+typedef uint32_t (*SchedulerTx)(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget);
+
+/**
+ * Egress scheduler. A zeroed scheduler uses scheduler_drr().
+ */
+struct _Scheduler {
+	SchedulerTx	tx;					///< Scheduling algorithm, NULL for scheduler_drr
+	uint16_t	cursor[SCHEDULER_PRIORITY_COUNT];	///< VNIC to serve next in each priority
+};
+
+/**
+ * Deficit round robin with strict priorities.
+ * VNICs of a priority are served only when every VNIC of the higher
+ * priorities is empty. Within a priority each VNIC sends SCHEDULER_QUANTUM *
+ * weight bytes per round, so the bytes are shared by weight whatever the
+ * packet sizes are. A VNIC which goes empty loses its remaining deficit.
+ */
+uint32_t scheduler_drr(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget);
+
+/**
+ * Round robin of VNIC budget packets per VNIC, ignoring weights and priorities.
+ */
+uint32_t scheduler_rr(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget);
+
+/**
+ * Transmit with the algorithm of the scheduler.
+ *
+ * @see SchedulerTx
+ */
+static inline uint32_t scheduler_tx(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget) {
+	return (scheduler->tx ? : scheduler_drr)(scheduler, vnics, transmitter, transmitter_context, budget);
+}
+
+#endif /* __SCHEDULER_H__ */
@@ -0,0 +1,112 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#ifndef MODULE
+#include <stdbool.h>
+#include <stdint.h>
+#else
+#include <linux/types.h>
+#endif
+
+/**
+ * @file
+ * Token bucket traffic shaping.
+ */
+
+#define SHAPER_SHIFT		32			// Fraction bits of tokens
+#define SHAPER_MIN_BURST	4096			// Minimum burst size (bytes), a few frames
+#define SHAPER_MAX_BURST	((int64_t)1 << 30)	// Maximum burst size (bytes)
+
+/**
+ * Two rate token bucket.
+ *
+ * Tokens are bytes with SHAPER_SHIFT fraction bits. A packet passes while the
+ * committed and the peak buckets of the shaper and of all its parents have
+ * tokens, then its size is charged to all of them, so a bucket may owe one
+ * packet. Buckets are refilled only when one runs out, a shaper which is not
+ * limiting never reads the clock.
+ *
+ * A parent is shared by the VNICs on all cores, so its buckets are charged
+ * atomically and refilled by one core at a time under its lock. The shaper of
+ * a VNIC is only used under the queue lock of the VNIC.
+ *
+ * A zeroed shaper is an unlimited root.
+ */
+typedef struct _Shaper {
+	struct _Shaper*	parent;		///< Parent shaper (e.g. of the NICDevice), NULL for the root
+	uint64_t	cir;		///< Committed rate (bps), 0 is unlimited
+	uint64_t	pir;		///< Peak rate (bps), 0 is unlimited
+	int64_t		cbs;		///< Committed burst size (bytes)
+	int64_t		pbs;		///< Peak burst size (bytes)
+	uint64_t	cscale;		///< Committed tokens per clock tick
+	uint64_t	pscale;		///< Peak tokens per clock tick
+	int64_t		ctokens;	///< Committed tokens
+	int64_t		ptokens;	///< Peak tokens
+	uint64_t	last;		///< Clock of the last refill
+	volatile uint8_t lock;		///< Held while the buckets are refilled or the rates change
+} Shaper;
+
+/**
+ * Set the rates of a shaper.
+ * Tokens earned with the old rates are kept up to the new burst sizes, so the
+ * rates can be changed while packets are flowing. A zero frequency disables
+ * shaping.
+ *
+ * @param shaper shaper
+ * @param freq clock frequency per second
+ * @param now current clock
+ * @param cir committed rate (bps), 0 is unlimited
+ * @param cbs committed burst size (bytes)
+ * @param pir peak rate (bps), 0 is unlimited
+ * @param pbs peak burst size (bytes)
+ */
+void shaper_set(Shaper* shaper, uint64_t freq, uint64_t now, uint64_t cir, uint64_t cbs, uint64_t pir, uint64_t pbs);
+
+/**
+ * Refill the buckets of the shaper and its parents.
+ *
+ * @param shaper shaper
+ * @param now current clock
+ */
+void shaper_refill(Shaper* shaper, uint64_t now);
+
+/**
+ * Check if the shaper and its parents have tokens left, without refilling.
+ *
+ * @param shaper shaper
+ *
+ * @return true if a packet may pass
+ */
+static inline bool shaper_ready(Shaper* shaper) {
+	for(; shaper; shaper = shaper->parent) {
+		if(shaper->cir && shaper->ctokens <= 0)
+			return false;
+		if(shaper->pir && shaper->ptokens <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Charge passed bytes to the shaper and its parents.
+ *
+ * @param shaper shaper
+ * @param bytes passed bytes
+ */
+static inline void shaper_charge(Shaper* shaper, uint64_t bytes) {
+	int64_t tokens = (int64_t)bytes << SHAPER_SHIFT;
+	if(shaper->cir)
+		shaper->ctokens -= tokens;
+	if(shaper->pir)
+		shaper->ptokens -= tokens;
+
+	for(shaper = shaper->parent; shaper; shaper = shaper->parent) {
+		if(shaper->cir)
+			__sync_fetch_and_sub(&shaper->ctokens, tokens);
+		if(shaper->pir)
+			__sync_fetch_and_sub(&shaper->ptokens, tokens);
+	}
+}
+
+#endif /* __SHAPER_H__ */
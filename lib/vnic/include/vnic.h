@@ -2,8 +2,11 @@
 #define __VNIC_H__
 
 #include "nic.h"
+#include "shaper.h"
 
-#define MAX_VNIC_COUNT		8
+#define MAX_VNIC_COUNT		256
+
+#define VNIC_POOL_CLASS		0x1	///< VNIC_POOL_SIZE flag to use size-class pool layout (NIC_POOL_TYPE_CLASS)
 
 /**
  * @file Virtual NIC
@@ -21,7 +24,7 @@ typedef enum {
 	VNIC__MAND_STRT,
 	VNIC_DEV,			///< Device of Network Interface
 	VNIC_MAC,			///< MAC address
-	VNIC_POOL_SIZE,			///< NI's total memory size
+	VNIC_POOL_SIZE,			///< NI's total memory size (OR VNIC_POOL_CLASS to use size-class free lists)
 	VNIC_RX_BANDWIDTH,		///< Input bandwidth in bps
 	VNIC_TX_BANDWIDTH,		///< Output bandwidth in bps
 	VNIC_PADDING_HEAD,		///< Minimum padding head of packet payload buffer
@@ -39,6 +42,17 @@ typedef enum {
 	VNIC_RX_ACCEPT,			///< List of accept MAC addresses to receive
 	VNIC_TX_ACCEPT_ALL,		///< To accept all packets to send
 	VNIC_TX_ACCEPT,			///< List of accept MAC addresses to send
+
+	VNIC_QUEUE_SPSC,		///< Use lock-free single producer/single consumer queues (only one VM thread uses each queue)
+
+	VNIC_RX_BURST,			///< Input burst size in bytes (default 10ms of VNIC_RX_BANDWIDTH)
+	VNIC_TX_BURST,			///< Output burst size in bytes (default 1ms of VNIC_TX_BANDWIDTH)
+	VNIC_RX_PEAK,			///< Input peak rate in bps, 0 for none (burst is 1ms of it)
+	VNIC_TX_PEAK,			///< Output peak rate in bps, 0 for none (burst is 1ms of it)
+	VNIC_RX_SHAPER,			///< Parent Shaper* of input (e.g. of the NICDevice)
+	VNIC_TX_SHAPER,			///< Parent Shaper* of output (e.g. of the NICDevice)
+	VNIC_WEIGHT,			///< Share of output among VNICs of the same priority (default 1)
+	VNIC_PRIORITY,			///< Strict output priority, 0 is served first (default 0)
 } VNICAttributes;
 
 /**
@@ -75,12 +89,14 @@ typedef struct _VNIC {
 	uint16_t	vlan_proto; 		///< VLAN Protocol
 	uint16_t	vlan_tci;   		///< VLAN TCI
 	uint16_t	budget;			///< Polling limit
+	uint32_t	group;			///< VNICs of the same nonzero group are mapped to one VM and can share packets
 
 	// Buffers
 	NICQueue	rx;			///< Rx queue
 	NICQueue	tx;			///< Tx queue
 	NICQueue	srx;			///< Rx Queue for slowpath
 	NICQueue	stx;			///< Tx Queue for slowpath
+	volatile uint8_t	rx_lock;	///< Cores receiving to the VNIC take turns
 
 	// Statistics
 	uint64_t	input_bytes;		///< Total input bytes
@@ -95,15 +111,16 @@ typedef struct _VNIC {
 	uint16_t	padding_head;		///< Leading padding of packet buffer
 	uint16_t	padding_tail;		///< Trailing padding of packet buffer
 
+	// Scheduling
+	uint16_t	weight;			///< Output share among VNICs of the same priority
+	uint8_t		priority;		///< Strict output priority, 0 is served first
+	int32_t		deficit;		///< Bytes the VNIC may still send in this round (DRR)
+
 	// Constraint
 	uint64_t	rx_bandwidth;		///< Rx threshold
 	uint64_t	tx_bandwidth;		///< Tx threshold
-	uint64_t	rx_wait;		///< Amount of time to wait to adjust the rx bandwidth
-	uint64_t	rx_wait_grace;		///< Amount of time to wait to adjust the rx bandwidth gracefully
-	uint64_t	tx_wait;		///< Amount of time to wait to adjust the tx bandwidth
-	uint64_t	tx_wait_grace;		///< Amount of time to wait to adjust the tx bandwidth gracefully
-	uint64_t	rx_closed;		///< The next receivable frequency
-	uint64_t	tx_closed;		///< The next transmittable frequency
+	Shaper		rx_shaper;		///< Rx token buckets
+	Shaper		tx_shaper;		///< Tx token buckets
 } VNIC;
 
 /**
@@ -157,11 +174,16 @@ bool vnic_free(VNIC* vnic, Packet* packet);
 
 /**
  * Update the attributes of the VNIC
+ * Bandwidth (VNIC_RX/TX_BANDWIDTH, VNIC_RX/TX_BURST, VNIC_RX/TX_PEAK),
+ * scheduling (VNIC_WEIGHT, VNIC_PRIORITY) and padding can be updated while
+ * the VNIC is running, queued packets are kept.
+ * A rate updated without its burst size gets the default burst size.
  *
  * @param nic Virtual NIC
  * @param attrs attributes used to update the VNIC.
  *
- * @return VNIC_ERROR_NOERROR for success, error number for failure
+ * @return VNIC_ERROR_NOERROR for success, VNIC_ERROR_ATTRIBUTE_INVALID if an
+ * attribute cannot be updated (nothing is updated then)
  */
 VNICError vnic_update(VNIC* nic, uint64_t* attrs);
 
@@ -189,6 +211,22 @@ bool vnic_has_rx(VNIC* vnic);
  */
 VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2);
 
+/**
+ * Receive a packet data with the metadata parsed from it
+ * The data is placed after the metadata block if the head padding is large
+ * enough for it, otherwise it is received as vnic_rx() does.
+ *
+ * @param vnic Virtual NIC
+ * @param buf1 packet data
+ * @param size1 packet data length
+ * @param buf2 optional packet data
+ * @param size2 optional packet data length
+ * @param meta metadata of buf1 parsed by packet_meta_parse(), NULL for none
+ *
+ * @return VNIC_ERROR_NOERROR for success, error number for failure
+ */
+VNICError vnic_rx_meta(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, PacketMeta* meta);
+
 /**
  * Receive a Packet
  * This function is used to exchange data between VNICs
@@ -200,6 +238,32 @@ VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t
  */
 VNICError vnic_rx2(VNIC* vnic, Packet* packet);
 
+/**
+ * Receive a Packet owned by another VNIC without copying it.
+ * A read-only reference is added to the packet, both VNICs must be mapped to
+ * the same VM (same group).
+ *
+ * @param vnic Virtual NIC to receive the packet
+ * @param owner Virtual NIC which owns the packet
+ * @param packet packet allocated from owner
+ *
+ * @return VNIC_ERROR_UNSUPPORTED if the owner's pool cannot share packets
+ */
+VNICError vnic_rx_ref(VNIC* vnic, VNIC* owner, Packet* packet);
+
+/**
+ * Receive Packets in a burst
+ * All packets are queued with a single queue index update.
+ * Packets which cannot be queued are freed and counted as dropped.
+ *
+ * @param vnic Virtual NIC
+ * @param packets packets allocated from a NIC pool
+ * @param count number of packets
+ *
+ * @return number of packets queued
+ */
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count);
+
 /**
  * Check if there is data available for transmission.
  *
@@ -221,6 +285,19 @@ bool vnic_has_tx(VNIC* vnic);
  */
 VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmitter_context);
 
+/**
+ * Dequeue packets to transmit in a burst
+ * All packets are dequeued with a single queue index update.
+ * The caller owns the returned packets and must transmit or free them.
+ *
+ * @param vnic Virtual NIC
+ * @param packets array to store dequeued packets
+ * @param count maximum number of packets to dequeue
+ *
+ * @return number of packets stored in packets
+ */
+uint32_t vnic_tx_burst(VNIC* vnic, Packet** packets, uint32_t count);
+
 // Slowpath Rx/Tx
 /**
  * Check if there is received slowpath data
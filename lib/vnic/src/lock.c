@@ -1,21 +1,31 @@
 #include <lock.h>
 
+/*
+ * The byte lock is defined the same way in lib/hal, which the kernel links
+ * first. The other locks are in spinlock.c so that using them does not pull
+ * a second definition of the byte lock in.
+ */
+
+static inline void cpu_relax() {
+	asm volatile("pause" ::: "memory");
+}
+
 void lock_init(uint8_t volatile* lock) {
 	*lock = 0;
 }
 
-bool cmpxchg(uint8_t volatile* s1, uint8_t s2, uint8_t d);
-
 void lock_lock(uint8_t volatile* lock) {
-	do {
-		while(!lock_trylock(lock));
-	} while(cmpxchg(lock, 0, 1));
+	// Spins on a shared copy of the cache line, and writes only when it looks free
+	while(__sync_lock_test_and_set(lock, 1)) {
+		while(*lock)
+			cpu_relax();
+	}
 }
 
 bool lock_trylock(uint8_t volatile* lock) {
-	return !(*lock);
+	return !*lock && !__sync_lock_test_and_set(lock, 1);
 }
 
 void lock_unlock(uint8_t volatile* lock) {
-	*lock = 0;
+	__sync_lock_release(lock);
 }
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include "lock.h"
@@ -6,18 +7,143 @@
 NIC* __nics[NIC_MAX_COUNT];
 int __nic_count;
 
-NIC* nic_find_by_packet(Packet* packet) {
-	NIC* nic = (void*)((uintptr_t)packet & ~(uintptr_t)(0x200000 - 1)); // 2MB alignment
-	for(int i = 0; i < NIC_MAX_SIZE / 0x200000  - 1 && (uintptr_t)nic > 0; i++) {
+static inline void queue_lock(NICQueue* queue, volatile uint8_t* lock) {
+	if(!(queue->flags & NIC_QUEUE_F_SPSC))
+		lock_lock(lock);
+}
+
+static inline void queue_unlock(NICQueue* queue, volatile uint8_t* lock) {
+	if(!(queue->flags & NIC_QUEUE_F_SPSC))
+		lock_unlock(lock);
+}
+
+/*
+ * Region table: 2MB frame number -> NIC which covers the frame.
+ * Open addressing with linear probing. Readers do not lock, writers hold
+ * region_lock and publish the NIC before the frame number.
+ */
+typedef struct {
+	volatile uintptr_t	frame;	///< 2MB frame number, 0 is empty
+	NIC* volatile		nic;	///< NULL if removed
+	NICPool* volatile	layout;	///< Pool layout the process trusts for the NIC
+	volatile uint32_t	serial;	///< Registration of the NIC, tells a NIC added again at the same address apart
+} NICRegion;
+
+static NICRegion regions[NIC_REGION_COUNT];
+static volatile uint8_t region_lock;
+static uint32_t region_serial;
+static NIC* ids[NIC_MAX_COUNT];	// NIC id % NIC_MAX_COUNT -> last NIC found with the id
+
+static inline uint32_t region_hash(uintptr_t frame) {
+	return (uint32_t)((frame * 0x9E3779B97F4A7C15ULL) >> 32) % NIC_REGION_COUNT;
+}
+
+static inline NICRegion* region_find(uintptr_t frame) {
+	for(uint32_t i = region_hash(frame), j = 0; j < NIC_REGION_COUNT; i = (i + 1) % NIC_REGION_COUNT, j++) {
+		uintptr_t f = regions[i].frame;
+		if(f == frame)
+			return &regions[i];
+		else if(f == 0)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static inline NIC* region_get(uintptr_t frame) {
+	NICRegion* region = region_find(frame);
+
+	return region ? region->nic : NULL;
+}
+
+bool nic_region_add(NIC* nic, NICPool* layout, size_t size) {
+	uintptr_t first = (uintptr_t)nic / NIC_REGION_SIZE;
+	uintptr_t last = ((uintptr_t)nic + size - 1) / NIC_REGION_SIZE;
+	if((uintptr_t)nic % NIC_REGION_SIZE != 0 || size == 0 || size > NIC_MAX_SIZE)
+		return false;
+
+	lock_lock(&region_lock);
+
+	// The NIC keeps its serial while it is registered
+	NICRegion* region = region_find(first);
+	uint32_t serial = region && region->nic == nic ? region->serial : ++region_serial;
+
+	for(uintptr_t frame = first; frame <= last; frame++) {
+		uint32_t i = region_hash(frame);
+		uint32_t j;
+		for(j = 0; j < NIC_REGION_COUNT; i = (i + 1) % NIC_REGION_COUNT, j++) {
+			// Reuse a removed slot only if the frame is not registered further on
+			if(regions[i].frame == frame || regions[i].frame == 0 ||
+					(regions[i].nic == NULL && region_get(frame) == NULL))
+				break;
+		}
+
+		if(j == NIC_REGION_COUNT) {
+			lock_unlock(&region_lock);
+			nic_region_remove(nic);
+			return false;
+		}
+
+		regions[i].nic = nic;
+		regions[i].layout = layout;
+		regions[i].serial = serial;
+		asm volatile("" ::: "memory");
+		regions[i].frame = frame;
+	}
+
+	lock_unlock(&region_lock);
+
+	return true;
+}
+
+void nic_region_remove(NIC* nic) {
+	lock_lock(&region_lock);
+
+	for(uint32_t i = 0; i < NIC_REGION_COUNT; i++) {
+		if(regions[i].frame != 0 && regions[i].nic == nic)
+			regions[i].nic = NULL;	// Leave the frame so that probing goes on
+	}
+
+	for(uint32_t i = 0; i < NIC_MAX_COUNT; i++) {
+		if(ids[i] == nic)
+			ids[i] = NULL;
+	}
+
+	lock_unlock(&region_lock);
+}
+
+NIC* nic_find_by_packet_slow(Packet* packet) {
+	NIC* nic = (void*)((uintptr_t)packet & ~(uintptr_t)(NIC_REGION_SIZE - 1)); // 2MB alignment
+	for(int i = 0; i < NIC_MAX_SIZE / NIC_REGION_SIZE && (uintptr_t)nic > 0; i++) {
 		if(nic->magic == NIC_MAGIC_HEADER)
 			return nic;
 
-		nic = (void*)nic - 0x200000;
+		nic = (void*)nic - NIC_REGION_SIZE;
 	}
 
 	return NULL;
 }
 
+NIC* nic_find_by_packet(Packet* packet) {
+	NIC* nic = region_get((uintptr_t)packet / NIC_REGION_SIZE);
+	if(nic)
+		return nic;
+
+	nic = nic_find_by_packet_slow(packet);
+	if(!nic)
+		return NULL;
+
+	// Only NICs given to this process are trusted to tell their own size
+	for(int i = 0; i < __nic_count; i++) {
+		if(__nics[i] == nic) {
+			nic_region_add(nic, &nic->pool, nic->pool.pool + (size_t)nic->pool.count * NIC_CHUNK_SIZE);
+			break;
+		}
+	}
+
+	return nic;
+}
+
 int nic_count() {
 	return __nic_count;
 }
@@ -27,17 +153,446 @@ NIC* nic_get(int index) {
 }
 
 NIC* nic_get_by_id(uint32_t id) {
-	NIC* nic = NULL;
+	NIC* nic = ids[id % NIC_MAX_COUNT];
+	if(nic && nic->id == id)
+		return nic;
+
+	nic = NULL;
 	for(int i = 0; i < __nic_count; i++) {
 		if(__nics[i] && __nics[i]->id == id) {
 			nic =  __nics[i];
+			ids[id % NIC_MAX_COUNT] = nic;
 			break;
 		}
 	}
 	return nic;
 }
 
+static const uint32_t pool_class_sizes[NIC_POOL_CLASS_COUNT] = NIC_POOL_CLASS_SIZES;
+
+// Free list offsets live in shared memory. Never follow one outside of the pool
+static inline bool pool_class_valid(NICPool* layout, uint32_t offset) {
+	return offset >= layout->pool && offset < layout->pool + layout->count * NIC_CHUNK_SIZE &&
+		(offset - layout->pool) % NIC_CHUNK_SIZE == 0;
+}
+
+// Take a buffer of the class from its free list or carve a new one. Caller holds the pool lock
+static uint32_t pool_class_pop(NIC* nic, NICPool* layout, int class) {
+	uint32_t offset = nic->pool.free[class];
+	if(offset != 0) {
+		if(!pool_class_valid(layout, offset)) {
+			// Corrupted free list: drop it rather than handing out foreign memory
+			nic->pool.free[class] = 0;
+			return 0;
+		}
+
+		nic->pool.free[class] = *(uint32_t*)((void*)nic + offset);
+	} else {
+		// Carve a new buffer from the untouched part of the pool. The cursor is
+		// shared, so it is read once and checked without overflowing
+		uint32_t index = nic->pool.index;
+		uint32_t count = pool_class_sizes[class] / NIC_CHUNK_SIZE;
+		if(index > layout->count || count > layout->count - index)
+			return 0;
+
+		offset = layout->pool + index * NIC_CHUNK_SIZE;
+		nic->pool.index = index + count;
+	}
+
+	nic->pool.used += pool_class_sizes[class] / NIC_CHUNK_SIZE;
+
+	return offset;
+}
+
+// Link a buffer to the free list of the class. Caller holds the pool lock
+static void pool_class_push(NIC* nic, int class, uint32_t offset) {
+	*(uint32_t*)((void*)nic + offset) = nic->pool.free[class];
+	nic->pool.free[class] = offset;
+	nic->pool.used -= pool_class_sizes[class] / NIC_CHUNK_SIZE;
+}
+
+static inline Packet* pool_class_packet(NIC* nic, uint32_t offset, int class) {
+	Packet* packet = (void*)nic + offset;
+	packet->time = 0;
+	packet->start = 0;
+	packet->end = 0;
+	packet->size = pool_class_sizes[class] - sizeof(Packet);
+	packet_meta_clear(packet);
+
+	return packet;
+}
+
+/*
+ * Per-core packet caches. They are private to the process (kernel or VM) and
+ * hold offsets which were validated against the pool layout the process
+ * trusts for the NIC, the one registered in the region table. The kernel
+ * registers the VNIC copy, so a VM cannot make the kernel cache a foreign
+ * buffer through shared memory, whichever layout a free comes through.
+ */
+typedef struct {
+	NIC*		nic;
+	NICPool*	layout;		///< Trusted layout of the NIC
+	uint32_t	serial;		///< Region serial of the NIC
+	uint32_t	gen;		///< cache_gen when the NIC was last checked
+	uint32_t	count[NIC_POOL_CLASS_COUNT];
+	uint32_t	offsets[NIC_POOL_CLASS_COUNT][NIC_CACHE_SIZE];
+	NICCacheStats	stats;
+} NICCache;
+
+static NICCache caches[NIC_CACHE_CORE_COUNT][NIC_CACHE_SLOT_COUNT];
+static volatile uint32_t cache_gen;	// Incremented whenever a NIC is invalidated
+static int (*cache_core_id)();
+extern int __thread_id __attribute__((weak));	// SDK thread ID (lib/ext)
+
+void nic__init_cache(int (*core_id)()) {
+	cache_core_id = core_id;
+}
+
+static void cache_flush_class(NICCache* cache, int class, uint32_t count) {
+	NIC* nic = cache->nic;
+	uint8_t* bitmap = (void*)nic + cache->layout->bitmap;
+	uint32_t* offsets = cache->offsets[class];
+
+	lock_lock(&nic->pool.lock);
+	for(uint32_t i = 0; i < count; i++) {
+		bitmap[(offsets[i] - cache->layout->pool) / NIC_CHUNK_SIZE] = class;
+		pool_class_push(nic, class, offsets[i]);
+	}
+	lock_unlock(&nic->pool.lock);
+
+	// Oldest packets are flushed, recently freed ones stay hot in the cache
+	cache->count[class] -= count;
+	memmove(offsets, offsets + count, cache->count[class] * sizeof(uint32_t));
+	cache->stats.flush++;
+}
+
+static void cache_flush(NICCache* cache) {
+	for(int class = 0; class < NIC_POOL_CLASS_COUNT; class++) {
+		if(cache->count[class] > 0)
+			cache_flush_class(cache, class, cache->count[class]);
+	}
+}
+
+static void cache_refill(NICCache* cache, int class) {
+	NIC* nic = cache->nic;
+	uint8_t* bitmap = (void*)nic + cache->layout->bitmap;
+	uint32_t* offsets = cache->offsets[class];
+	uint32_t count = cache->count[class];
+
+	lock_lock(&nic->pool.lock);
+	while(count < NIC_CACHE_BATCH) {
+		uint32_t offset = pool_class_pop(nic, cache->layout, class);
+		if(offset == 0)
+			break;
+
+		bitmap[(offset - cache->layout->pool) / NIC_CHUNK_SIZE] = NIC_POOL_CLASS_CACHED | class;
+		offsets[count++] = offset;
+	}
+	lock_unlock(&nic->pool.lock);
+
+	if(count > cache->count[class]) {
+		cache->count[class] = count;
+		cache->stats.refill++;
+	}
+}
+
+// Region of a registered NIC. The NICs of the process are registered on first use
+static NICRegion* cache_region(NIC* nic) {
+	NICRegion* region = region_find((uintptr_t)nic / NIC_REGION_SIZE);
+	if(region && region->nic == nic)
+		return region;
+
+	for(int i = 0; i < __nic_count; i++) {
+		if(__nics[i] == nic) {
+			if(!nic_region_add(nic, &nic->pool, nic->pool.pool + (size_t)nic->pool.count * NIC_CHUNK_SIZE))
+				return NULL;
+
+			return region_find((uintptr_t)nic / NIC_REGION_SIZE);
+		}
+	}
+
+	return NULL;
+}
+
+// The NIC of the slot is still the registration it was cached with
+static bool cache_alive(NICCache* cache) {
+	NICRegion* region = region_find((uintptr_t)cache->nic / NIC_REGION_SIZE);
+
+	return region && region->nic == cache->nic && region->serial == cache->serial;
+}
+
+static NICCache* cache_get(NIC* nic) {
+	int core;
+	if(cache_core_id)
+		core = cache_core_id();
+	else if(&__thread_id)
+		core = __thread_id;
+	else
+		return NULL;
+
+	if(core < 0 || core >= NIC_CACHE_CORE_COUNT)
+		return NULL;
+
+	NICCache* cache = &caches[core][nic->id % NIC_CACHE_SLOT_COUNT];
+
+	// A NIC was invalidated: the packets of a removed NIC are forgotten, its memory may be gone
+	uint32_t gen = cache_gen;
+	if(cache->nic && cache->gen != gen) {
+		if(!cache_alive(cache)) {
+			cache->nic = NULL;
+			memset(cache->count, 0, sizeof(cache->count));
+		}
+		cache->gen = gen;
+	}
+
+	if(cache->nic != nic) {
+		// Unregistered NICs have no trusted layout and are not cached
+		NICRegion* region = cache_region(nic);
+		if(!region)
+			return NULL;
+
+		// Slot is taken by another NIC which is still alive
+		if(cache->nic)
+			cache_flush(cache);
+
+		cache->nic = nic;
+		cache->layout = region->layout;
+		cache->serial = region->serial;
+		cache->gen = gen;
+		memset(&cache->stats, 0, sizeof(NICCacheStats));
+	}
+
+	return cache;
+}
+
+void nic_cache_flush(NIC* nic) {
+	NICCache* cache = cache_get(nic);
+	if(cache)
+		cache_flush(cache);
+}
+
+void nic_cache_invalidate(NIC* nic) {
+	// Each core checks its own slots when it uses them next
+	__sync_fetch_and_add(&cache_gen, 1);
+}
+
+bool nic_cache_stats(NIC* nic, NICCacheStats* stats) {
+	bool found = false;
+	memset(stats, 0, sizeof(NICCacheStats));
+
+	for(int i = 0; i < NIC_CACHE_CORE_COUNT; i++) {
+		NICCache* cache = &caches[i][nic->id % NIC_CACHE_SLOT_COUNT];
+		if(cache->nic != nic || !cache_alive(cache))
+			continue;
+
+		stats->hit += cache->stats.hit;
+		stats->miss += cache->stats.miss;
+		stats->refill += cache->stats.refill;
+		stats->flush += cache->stats.flush;
+		found = true;
+	}
+
+	return found;
+}
+
+Packet* nic_pool_class_alloc(NIC* nic, NICPool* layout, uint32_t size) {
+	int class = 0;
+	while(class < NIC_POOL_CLASS_COUNT && pool_class_sizes[class] < size)
+		class++;
+
+	if(class >= NIC_POOL_CLASS_COUNT)
+		return NULL;
+
+	// The cache knows the trusted layout of the NIC
+	NICCache* cache = cache_get(nic);
+	if(cache)
+		layout = cache->layout;
+
+	uint8_t* bitmap = (void*)nic + layout->bitmap;
+	uint32_t offset = 0;
+
+	if(cache) {
+		if(cache->count[class] > 0) {
+			cache->stats.hit++;
+		} else {
+			cache->stats.miss++;
+			cache_refill(cache, class);
+		}
+
+		if(cache->count[class] > 0) {
+			offset = cache->offsets[class][--cache->count[class]];
+			bitmap[(offset - layout->pool) / NIC_CHUNK_SIZE] = NIC_POOL_CLASS_USED | class;
+			bitmap[(offset - layout->pool) / NIC_CHUNK_SIZE + 1] = 0;
+
+			return pool_class_packet(nic, offset, class);
+		}
+	}
+
+	lock_lock(&nic->pool.lock);
+
+	// Pool is fully carved: borrow a buffer of a larger class
+	while(class < NIC_POOL_CLASS_COUNT && (offset = pool_class_pop(nic, layout, class)) == 0)
+		class++;
+
+	if(offset == 0) {
+		lock_unlock(&nic->pool.lock);
+		return NULL;
+	}
+
+	bitmap[(offset - layout->pool) / NIC_CHUNK_SIZE] = NIC_POOL_CLASS_USED | class;
+	bitmap[(offset - layout->pool) / NIC_CHUNK_SIZE + 1] = 0;
+
+	lock_unlock(&nic->pool.lock);
+
+	return pool_class_packet(nic, offset, class);
+}
+
+/*
+ * Extra references of a shared size-class buffer are counted in the byte map
+ * entry of its second chunk, which is not used otherwise (every class has at
+ * least two chunks). 0 means the packet has a single owner.
+ */
+static inline bool ref_get(volatile uint8_t* refs) {
+	uint8_t old = *refs;
+	while(old != 0xff) {
+		uint8_t prev;
+		asm volatile("lock cmpxchgb %2, %1" : "=a"(prev), "+m"(*refs) : "q"((uint8_t)(old + 1)), "0"(old) : "memory");
+		if(prev == old)
+			return true;
+
+		old = prev;
+	}
+
+	return false;
+}
+
+// Drop an extra reference. Returns false if the caller held the last one
+static inline bool ref_put(volatile uint8_t* refs) {
+	uint8_t old = *refs;
+	while(old != 0) {
+		uint8_t prev;
+		asm volatile("lock cmpxchgb %2, %1" : "=a"(prev), "+m"(*refs) : "q"((uint8_t)(old - 1)), "0"(old) : "memory");
+		if(prev == old)
+			return true;
+
+		old = prev;
+	}
+
+	return false;
+}
+
+static inline volatile uint8_t* pool_class_refs(NIC* nic, NICPool* layout, Packet* packet) {
+	uint32_t offset = (uintptr_t)packet - (uintptr_t)nic;
+	if(layout->type != NIC_POOL_TYPE_CLASS || !pool_class_valid(layout, offset))
+		return NULL;
+
+	uint8_t* bitmap = (void*)nic + layout->bitmap;
+	uint32_t idx = (offset - layout->pool) / NIC_CHUNK_SIZE;
+	if(!(bitmap[idx] & NIC_POOL_CLASS_USED))
+		return NULL;
+
+	return &bitmap[idx + 1];
+}
+
+bool nic_pool_class_ref(NIC* nic, NICPool* layout, Packet* packet) {
+	volatile uint8_t* refs = pool_class_refs(nic, layout, packet);
+
+	return refs && ref_get(refs);
+}
+
+bool nic_ref(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+
+	return nic && nic_pool_class_ref(nic, &nic->pool, packet);
+}
+
+bool nic_shared(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(!nic)
+		return false;
+
+	volatile uint8_t* refs = pool_class_refs(nic, &nic->pool, packet);
+
+	return refs && *refs != 0;
+}
+
+Packet* nic_cow(NIC* nic, Packet* packet) {
+	if(!nic_shared(packet))
+		return packet;
+
+	Packet* copy = nic_alloc(nic, packet->end - packet->start);
+	if(!copy)
+		return NULL;
+
+	copy->time = packet->time;
+	copy->vlan_proto = packet->vlan_proto;
+	copy->vlan_tci = packet->vlan_tci;
+	copy->start = nic->padding_head;
+	copy->end = copy->start + packet->end - packet->start;
+	memcpy(copy->buffer + copy->start, packet->buffer + packet->start, packet->end - packet->start);
+
+	nic_free(packet);
+
+	return copy;
+}
+
+bool nic_pool_class_free(NIC* nic, NICPool* layout, Packet* packet) {
+	// A free through the shared layout is checked against the trusted one
+	NICCache* cache = cache_get(nic);
+	if(cache)
+		layout = cache->layout;
+
+	uint32_t offset = (uintptr_t)packet - (uintptr_t)nic;
+	if(!pool_class_valid(layout, offset))
+		return false;
+
+	uint8_t* bitmap = (void*)nic + layout->bitmap;
+	uint32_t idx = (offset - layout->pool) / NIC_CHUNK_SIZE;
+
+	if(!(bitmap[idx] & NIC_POOL_CLASS_USED))
+		return false;	// Double free or not a buffer head
+
+	// Shared packet: the last reader frees the buffer
+	if(ref_put(&bitmap[idx + 1]))
+		return true;
+
+	if(cache) {
+		uint8_t class = bitmap[idx];
+		if(!(class & NIC_POOL_CLASS_USED) || (class & ~NIC_POOL_CLASS_USED) >= NIC_POOL_CLASS_COUNT)
+			return false;	// Double free or not a buffer head
+
+		class &= ~NIC_POOL_CLASS_USED;
+		if(cache->count[class] >= NIC_CACHE_SIZE)
+			cache_flush_class(cache, class, NIC_CACHE_BATCH);
+
+		bitmap[idx] = NIC_POOL_CLASS_CACHED | class;
+		cache->offsets[class][cache->count[class]++] = offset;
+
+		return true;
+	}
+
+	lock_lock(&nic->pool.lock);
+
+	uint8_t class = bitmap[idx];
+	if(!(class & NIC_POOL_CLASS_USED) || (class & ~NIC_POOL_CLASS_USED) >= NIC_POOL_CLASS_COUNT) {
+		// Double free or not a buffer head
+		lock_unlock(&nic->pool.lock);
+		return false;
+	}
+
+	class &= ~NIC_POOL_CLASS_USED;
+	bitmap[idx] = class;
+	pool_class_push(nic, class, offset);
+
+	lock_unlock(&nic->pool.lock);
+
+	return true;
+}
+
 Packet* nic_alloc(NIC* nic, uint16_t size) {
+	if(nic->pool.type == NIC_POOL_TYPE_CLASS)
+		return nic_pool_class_alloc(nic, &nic->pool, sizeof(Packet) + nic->padding_head + size + nic->padding_tail);
+
 	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
 	uint32_t count = nic->pool.count;
 	void* pool = (void*)nic + nic->pool.pool;
@@ -99,6 +654,7 @@ found:
 	packet->start = 0;
 	packet->end = 0;
 	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	packet_meta_clear(packet);
 
 	return packet;
 }
@@ -108,6 +664,9 @@ bool nic_free(Packet* packet) {
 	if(nic == NULL)
 		return false;
 
+	if(nic->pool.type == NIC_POOL_TYPE_CLASS)
+		return nic_pool_class_free(nic, &nic->pool, packet);
+
 	uint8_t* bitmap = (void*)nic + nic->pool.bitmap;
 	uint32_t count = nic->pool.count;
 	void* pool = (void*)nic + nic->pool.pool;
@@ -132,16 +691,40 @@ bool nic_free(Packet* packet) {
 	return true;
 }
 
+static inline uint64_t queue_entry(Packet* packet) {
+	NIC* nic = nic_find_by_packet(packet);
+	if(nic == NULL)
+		return 0;
+
+	return ((uint64_t)nic->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic);
+}
+
+static inline Packet* queue_entry_packet(NIC* nic, uint64_t entry) {
+	uint32_t id = (uint32_t)(entry >> 32);
+	uint32_t data = (uint32_t)entry;
+
+	if(nic->id == id) {
+		return (void*)nic + data;
+	} else {
+		nic = nic_get_by_id(id);
+		if(nic != NULL)
+			return (void*)nic + data;
+		else
+			return NULL;
+	}
+}
+
 bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
-	NIC* nic2 = nic_find_by_packet(packet);
-	if(nic2 == NULL)
+	uint64_t entry = queue_entry(packet);
+	if(entry == 0)
 		return false;
 
 	uint64_t* array = (void*)nic + queue->base;
-	uint32_t next = (queue->tail + 1) % queue->size;
-	if(queue->head != next) {
-		array[queue->tail] = ((uint64_t)nic2->id << 32) | (uint64_t)(uint32_t)((uintptr_t)packet - (uintptr_t)nic2);
-		queue->tail = next;
+	uint32_t tail = queue->tail;
+	uint32_t next = (tail + 1) % queue->size;
+	if(queue_load_acquire(&queue->head) != next) {
+		array[tail] = entry;
+		queue_store_release(&queue->tail, next);
 
 		return true;
 	} else {
@@ -151,36 +734,83 @@ bool queue_push(NIC* nic, NICQueue* queue, Packet* packet) {
 
 void* queue_pop(NIC* nic, NICQueue* queue) {
 	uint64_t* array = (void*)nic + queue->base;
+	uint32_t head = queue->head;
 
-	if(queue->head != queue->tail) {
-		uint64_t tmp = array[queue->head];
-		uint32_t id = (uint32_t)(tmp >> 32);
-		uint32_t data = (uint32_t)tmp;
-
-		array[queue->head] = 0;
-
-		queue->head = (queue->head + 1) % queue->size;
+	if(head != queue_load_acquire(&queue->tail)) {
+		uint64_t tmp = array[head];
+		array[head] = 0;
 
+		queue_store_release(&queue->head, (head + 1) % queue->size);
 
-		if(nic->id == id) {
-			return (void*)nic + data;
-		} else {
-			nic = nic_get_by_id(id);
-			if(nic != NULL)
-				return (void*)nic + data;
-			else
-				return NULL;
-		}
+		return queue_entry_packet(nic, tmp);
 	} else {
 		return NULL;
 	}
 }
 
+uint32_t queue_push_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	uint64_t* array = (void*)nic + queue->base;
+	uint32_t size = queue->size;
+	uint32_t tail = queue->tail;
+	uint32_t head = queue_load_acquire(&queue->head);
+
+	// One slot is always kept empty to tell a full queue from an empty one
+	uint32_t available = (head + size - tail - 1) % size;
+	if(count > available)
+		count = available;
+
+	uint32_t i;
+	for(i = 0; i < count; i++) {
+		uint64_t entry = queue_entry(packets[i]);
+		if(entry == 0)
+			break;
+
+		array[tail] = entry;
+		tail = tail + 1 == size ? 0 : tail + 1;
+	}
+
+	if(i)
+		queue_store_release(&queue->tail, tail);
+
+	return i;
+}
+
+uint32_t queue_pop_burst(NIC* nic, NICQueue* queue, Packet** packets, uint32_t count) {
+	uint64_t* array = (void*)nic + queue->base;
+	uint32_t size = queue->size;
+	uint32_t head = queue->head;
+	uint32_t tail = queue_load_acquire(&queue->tail);
+
+	uint32_t used = (tail + size - head) % size;
+	if(count > used)
+		count = used;
+
+	uint32_t popped = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		uint64_t tmp = array[head];
+		array[head] = 0;
+		head = head + 1 == size ? 0 : head + 1;
+
+		// Packets of unknown NICs are consumed but not returned
+		Packet* packet = queue_entry_packet(nic, tmp);
+		if(packet)
+			packets[popped++] = packet;
+	}
+
+	if(count)
+		queue_store_release(&queue->head, head);
+
+	return popped;
+}
+
 uint32_t queue_size(NICQueue* queue) {
-	if(queue->tail >= queue->head)
-		return queue->tail - queue->head;
+	uint32_t head = queue->head;
+	uint32_t tail = queue->tail;
+
+	if(tail >= head)
+		return tail - head;
 	else
-		return queue->size + queue->tail - queue->head;
+		return queue->size + tail - head;
 }
 
 bool queue_available(NICQueue* queue) {
@@ -196,13 +826,21 @@ bool nic_has_rx(NIC* nic) {
 }
 
 Packet* nic_rx(NIC* nic) {
-	lock_lock(&nic->rx.rlock);
+	queue_lock(&nic->rx, &nic->rx.rlock);
 	Packet* packet = queue_pop(nic, &nic->rx);
-	lock_unlock(&nic->rx.rlock);
+	queue_unlock(&nic->rx, &nic->rx.rlock);
 
 	return packet;
 }
 
+uint32_t nic_rx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	queue_lock(&nic->rx, &nic->rx.rlock);
+	uint32_t received = queue_pop_burst(nic, &nic->rx, packets, count);
+	queue_unlock(&nic->rx, &nic->rx.rlock);
+
+	return received;
+}
+
 uint32_t nic_rx_size(NIC* nic) {
 	return queue_size(&nic->rx);
 }
@@ -212,9 +850,9 @@ bool nic_has_srx(NIC* nic) {
 }
 
 Packet* nic_srx(NIC* nic) {
-	lock_lock(&nic->srx.rlock);
+	queue_lock(&nic->srx, &nic->srx.rlock);
 	Packet* packet = queue_pop(nic, &nic->srx);
-	lock_unlock(&nic->srx.rlock);
+	queue_unlock(&nic->srx, &nic->srx.rlock);
 
 	return packet;
 }
@@ -228,30 +866,30 @@ bool nic_has_tx(NIC* nic) {
 }
 
 bool nic_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
+	queue_lock(&nic->tx, &nic->tx.wlock);
 	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 
 		nic_free(packet);
 		return false;
 	} else {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 		return true;
 	}
 }
 
 bool nic_try_tx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
+	queue_lock(&nic->tx, &nic->tx.wlock);
 	bool result = queue_push(nic, &nic->tx, packet);
-	lock_unlock(&nic->tx.wlock);
+	queue_unlock(&nic->tx, &nic->tx.wlock);
 
 	return result;
 }
 
 bool nic_tx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->tx.wlock);
+	queue_lock(&nic->tx, &nic->tx.wlock);
 	if(!queue_available(&nic->tx)) {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 		return false;
 	}
 
@@ -259,7 +897,7 @@ bool nic_tx_dup(NIC* nic, Packet* packet) {
 
 	Packet* packet2 = nic_alloc(nic, len);
 	if(!packet2) {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 		return false;
 	}
 
@@ -268,16 +906,24 @@ bool nic_tx_dup(NIC* nic, Packet* packet) {
 	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
 
 	if(!queue_push(nic, &nic->tx, packet)) {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 
 		nic_free(packet);
 		return false;
 	} else {
-		lock_unlock(&nic->tx.wlock);
+		queue_unlock(&nic->tx, &nic->tx.wlock);
 		return true;
 	}
 }
 
+uint32_t nic_tx_burst(NIC* nic, Packet** packets, uint32_t count) {
+	queue_lock(&nic->tx, &nic->tx.wlock);
+	uint32_t sent = queue_push_burst(nic, &nic->tx, packets, count);
+	queue_unlock(&nic->tx, &nic->tx.wlock);
+
+	return sent;
+}
+
 bool nic_tx_available(NIC* nic) {
 	return queue_available(&nic->tx);
 }
@@ -287,30 +933,30 @@ uint32_t nic_tx_size(NIC* nic) {
 }
 
 bool nic_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
+	queue_lock(&nic->stx, &nic->stx.wlock);
 	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		nic_free(packet);
 
 		return false;
 	} else {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		return true;
 	}
 }
 
 bool nic_try_stx(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
+	queue_lock(&nic->stx, &nic->stx.wlock);
 	bool result = queue_push(nic, &nic->stx, packet);
-	lock_unlock(&nic->stx.wlock);
+	queue_unlock(&nic->stx, &nic->stx.wlock);
 
 	return result;
 }
 
 bool nic_stx_dup(NIC* nic, Packet* packet) {
-	lock_lock(&nic->stx.wlock);
+	queue_lock(&nic->stx, &nic->stx.wlock);
 	if(!queue_available(&nic->stx)) {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		return false;
 	}
 
@@ -318,7 +964,7 @@ bool nic_stx_dup(NIC* nic, Packet* packet) {
 
 	Packet* packet2 = nic_alloc(nic, len);
 	if(!packet2) {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		return false;
 	}
 
@@ -327,12 +973,12 @@ bool nic_stx_dup(NIC* nic, Packet* packet) {
 	memcpy(packet2->buffer + packet2->start, packet->buffer + packet->start, len);
 
 	if(!queue_push(nic, &nic->stx, packet)) {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		nic_free(packet);
 
 		return false;
 	} else {
-		lock_unlock(&nic->stx.wlock);
+		queue_unlock(&nic->stx, &nic->stx.wlock);
 		return true;
 	}
 }
@@ -368,106 +1014,247 @@ size_t nic_pool_total(NIC* nic) {
  * @return -3 no space to allocate
  * @return 0 ~ 2^16 - 1 key
  */
-int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size) {
-	int len = strlen(name) + 1;
-	if(len > 255)
-		return -1;
-	
-	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
-	
-	// Check name is already allocated
-	for(uint32_t* p = nic->config_head; p < nic->config_tail; ) {
-		uint16_t len2 = *p >> 16;
-		uint16_t count2 = *p & 0xffff;
-		
+// config_head is a zero-length marker, index the area through a plain pointer
+static inline uint32_t* config_area(NIC* nic) {
+	return (uint32_t*)((uint8_t*)nic + offsetof(NIC, config_head));
+}
+
+static inline uint32_t config_hash(const char* name) {
+	uint32_t hash = 2166136261U;	// FNV-1a
+	while(*name)
+		hash = (hash ^ (uint8_t)*name++) * 16777619U;
+
+	return hash;
+}
+
+// Config area is shared with the other side. Check the entry before trusting it
+static bool config_match(NIC* nic, uint32_t key, const char* name, int len) {
+	uint32_t total = nic->config_tail - config_area(nic);
+	if(key >= total)
+		return false;
+
+	uint32_t header = config_area(nic)[key];
+	uint16_t count = header & 0xffff;
+	if(header >> 16 != len || count == 0 || key + count > total)
+		return false;
+
+	return strncmp(name, (const char*)&config_area(nic)[key + 1], len - 1) == 0;
+}
+
+static int32_t config_index_get(NIC* nic, const char* name, int len) {
+	uint32_t hash = config_hash(name);
+
+	for(uint32_t i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		uint16_t bucket = nic->config_index[(hash + i) % NIC_CONFIG_INDEX_SIZE];
+		if(bucket == 0)
+			return -2;
+		else if(bucket != NIC_CONFIG_INDEX_DELETED && config_match(nic, bucket - 1, name, len))
+			return bucket - 1;
+	}
+
+	// Index is full of removed keys, scan the config area
+	for(uint32_t* p = config_area(nic); p < nic->config_tail; ) {
 		if(*p == 0) {
 			p++;
 		} else {
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return -1;
-			}
-			
-			p += count2;
+			if(config_match(nic, p - config_area(nic), name, len))
+				return p - config_area(nic);
+
+			p += *p & 0xffff;
 		}
 	}
-	
+
+	return -2;
+}
+
+// Caller holds config_lock
+static int32_t config_alloc(NIC* nic, char* name, int len, uint16_t size) {
+	uint32_t req = 1 + ((len + sizeof(uint32_t) - 1) / sizeof(uint32_t)) + (((uint32_t)size + sizeof(uint32_t) - 1) / sizeof(uint32_t)); // heder + round(name) + round(blocks)
+
+	// Check name is already allocated
+	if(config_index_get(nic, name, len) >= 0)
+		return -1;
+
 	// Check available space
-	for(uint32_t* p = nic->config_head; p < nic->config_tail; ) {
+	for(uint32_t* p = config_area(nic); p < nic->config_tail; ) {
 		if(*p == 0) {
 			bool found = true;
 			for(int i = 0; i < req; i++) {
-				if(p >= nic->config_tail) {
+				if(p + i >= nic->config_tail) {
 					return -2;
 				}
-				
+
 				if(p[i] != 0) {
-					p += i - 1;
+					p += i;
 					found = false;
 					break;
 				}
 			}
-			
+
 			if(found) {
-				*p = (uint32_t)len << 16 | req;
+				uint32_t key = p - config_area(nic);
+
 				memcpy(p + 1, name, len);
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
+				*p = (uint32_t)len << 16 | req;
+
+				// Entry must be complete before other side finds it in the index
+				asm volatile("" ::: "memory");
+
+				uint32_t hash = config_hash(name);
+				for(uint32_t i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+					uint16_t* bucket = &nic->config_index[(hash + i) % NIC_CONFIG_INDEX_SIZE];
+					if(*bucket == 0 || *bucket == NIC_CONFIG_INDEX_DELETED) {
+						*bucket = key + 1;
+						break;
+					}
+				}
+
+				return key;
 			}
-			
-			p++;
 		} else {
 			p += *p & 0xffff;
 		}
 	}
-	
+
 	return -2;
 }
 
+int32_t nic_config_alloc(NIC* nic, char* name, uint16_t size) {
+	int len = strlen(name) + 1;
+	if(len > 255)
+		return -1;
+
+	lock_lock(&nic->config_lock);
+	int32_t key = config_alloc(nic, name, len, size);
+	lock_unlock(&nic->config_lock);
+
+	return key;
+}
+
 void nic_config_free(NIC* nic, uint16_t key) {
-	uint16_t count = (uint16_t)nic->config_head[key] & 0xffff;
-	
-	for(int i = count - 1; i >= 0; i--) {
-		nic->config_head[key + i] = 0;
+	uint32_t total = nic->config_tail - config_area(nic);
+	if(key >= total)
+		return;
+
+	lock_lock(&nic->config_lock);
+
+	for(uint32_t i = 0; i < NIC_CONFIG_INDEX_SIZE; i++) {
+		if(nic->config_index[i] == key + 1)
+			nic->config_index[i] = NIC_CONFIG_INDEX_DELETED;
 	}
+	nic->config_gen++;
+
+	uint16_t count = config_area(nic)[key] & 0xffff;
+	for(int i = (key + count > total ? total - key : count) - 1; i >= 0; i--) {
+		config_area(nic)[key + i] = 0;
+	}
+
+	lock_unlock(&nic->config_lock);
 }
 
-/**
- *
- * @return -1 key length is too long
- * @return -2 key of the name not found
- * @return otherwise key of the name
+/*
+ * Per-process cache of resolved keys. Entries are keyed by the name pointer,
+ * protocol code always passes the same literal. seq is odd while an entry is
+ * being written so that readers on other threads never use a torn entry.
  */
+typedef struct {
+	volatile uint32_t	seq;
+	NIC*			nic;
+	const char*		name;
+	uint32_t		gen;
+	int32_t			key;
+} ConfigHandle;
+
+static ConfigHandle handles[NIC_CONFIG_HANDLE_COUNT];
+static volatile uint8_t handles_lock;
+
+static inline ConfigHandle* config_handle(NIC* nic, const char* name) {
+	return &handles[(((uintptr_t)nic >> 21) ^ ((uintptr_t)name >> 3)) % NIC_CONFIG_HANDLE_COUNT];
+}
+
+static int32_t config_handle_get(NIC* nic, const char* name) {
+	ConfigHandle* handle = config_handle(nic, name);
+	uint32_t seq = handle->seq;
+	asm volatile("" ::: "memory");
+	if(seq & 1 || handle->nic != nic || handle->name != name || handle->gen != nic->config_gen)
+		return -1;
+
+	int32_t key = handle->key;
+	asm volatile("" ::: "memory");
+
+	return handle->seq == seq ? key : -1;
+}
+
+static void config_handle_put(NIC* nic, const char* name, uint32_t gen, int32_t key) {
+	ConfigHandle* handle = config_handle(nic, name);
+
+	lock_lock(&handles_lock);
+	handle->seq++;
+	asm volatile("" ::: "memory");
+	handle->nic = nic;
+	handle->name = name;
+	handle->gen = gen;
+	handle->key = key;
+	asm volatile("" ::: "memory");
+	handle->seq++;
+	lock_unlock(&handles_lock);
+}
+
 int32_t nic_config_key(NIC* nic, char* name) {
+	int32_t key = config_handle_get(nic, name);
+	if(key >= 0)
+		return key;
+
 	int len = strlen(name) + 1;
 	if(len > 255)
 		return -1;
-	
-	for(uint32_t* p = nic->config_head; p < nic->config_tail; ) {
-		if(*p == 0) {
-			p++;
-		} else {
-			uint16_t len2 = *p >> 16;
-			uint16_t count2 = *p & 0xffff;
-			
-			if(len2 == len && strncmp(name, (const char*)(p + 1), len - 1) == 0) {
-				return ((uintptr_t)p - (uintptr_t)nic->config_head) / sizeof(uint32_t);
-			}
-			
-			p += count2;
+
+	uint32_t gen = nic->config_gen;
+	asm volatile("" ::: "memory");
+	key = config_index_get(nic, name, len);
+	if(key >= 0)
+		config_handle_put(nic, name, gen, key);
+
+	return key;
+}
+
+void* nic_config_lookup(NIC* nic, char* name, uint16_t size) {
+	int32_t key = nic_config_key(nic, name);
+	if(key >= 0)
+		return nic_config_get(nic, key);
+
+	int len = strlen(name) + 1;
+	if(len > 255)
+		return NULL;
+
+	lock_lock(&nic->config_lock);
+
+	// Somebody may have added it after the lookup
+	key = config_index_get(nic, name, len);
+	if(key < 0) {
+		key = config_alloc(nic, name, len, size);
+		if(key < 0) {
+			lock_unlock(&nic->config_lock);
+			return NULL;
 		}
+
+		memset(nic_config_get(nic, key), 0, size);
 	}
 
-	return -2;
+	lock_unlock(&nic->config_lock);
+
+	return nic_config_get(nic, key);
 }
 
 void* nic_config_get(NIC* nic, uint16_t key) {
-	uint32_t* header = &nic->config_head[key];
+	uint32_t* header = &config_area(nic)[key];
 	uint16_t len = *header >> 16;
 	
 	return header + 1 + (len + sizeof(uint32_t) - 1) / sizeof(uint32_t);
 }
 
 uint16_t nic_config_size(NIC* nic, uint16_t key) {
-	uint32_t* header = &nic->config_head[key];
+	uint32_t* header = &config_area(nic)[key];
 	uint16_t len = *header >> 16;
 	uint16_t count = *header & 0xffff;
 	
@@ -477,7 +1264,7 @@ uint16_t nic_config_size(NIC* nic, uint16_t key) {
 uint32_t nic_config_available(NIC* nic) {
 	uint32_t count = 0;
 	
-	for(uint32_t* p = nic->config_head; p < nic->config_tail; ) {
+	for(uint32_t* p = config_area(nic); p < nic->config_tail; ) {
 		if(*p == 0) {
 			p++;
 			count++;
@@ -490,7 +1277,7 @@ uint32_t nic_config_available(NIC* nic) {
 }
 
 uint32_t nic_config_total(NIC* nic) {
-	return (uint32_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head);
+	return (uint32_t)((uintptr_t)nic->config_tail - (uintptr_t)config_area(nic));
 }
 
 #if TEST
@@ -507,14 +1294,14 @@ static void print_queue(NICQueue* queue) {
 }
 
 static void print_config(VNIC* vnic) {	
-	for(uint32_t* p = vnic->config_head; p < vnic->config_tail; ) {
+	for(uint32_t* p = vconfig_area(nic); p < vnic->config_tail; ) {
 		if(*p == 0) {
 			p++;
 		} else {
 			uint16_t len2 = *p >> 16;
 			uint16_t count2 = *p & 0xffff;
 			
-			printf("[%3d] %3d %3d \"%s\" ", (int)(((uintptr_t)p - (uintptr_t)vnic->config_head) / sizeof(uint32_t)), len2, count2, (char*)(p + 1));
+			printf("[%3d] %3d %3d \"%s\" ", (int)(((uintptr_t)p - (uintptr_t)vconfig_area(nic)) / sizeof(uint32_t)), len2, count2, (char*)(p + 1));
 			uint32_t* base = p + 1 + (len2 + 3) / 4;
 			uint16_t count3 = count2 - 1 - (len2 + 3) / 4;
 			for(int i = 0; i < count3 && i < 12; i++) {
@@ -531,7 +1318,7 @@ static void print_config(VNIC* vnic) {
 }
 
 static void dump_config(NIC* nic) {
-	uint8_t* p = (void*)nic->config_head;
+	uint8_t* p = (void*)config_area(nic);
 	int i = 0;
 	while(p < nic->config_tail) {
 		printf("%02x", *p);
@@ -0,0 +1,119 @@
+#include <packet.h>
+
+#define ETHER_LEN		14
+#define ETHER_TYPE_IPv4		0x0800
+#define ETHER_TYPE_IPv6		0x86dd
+#define ETHER_TYPE_8021Q	0x8100
+#define ETHER_TYPE_8021AD	0x88a8
+
+#define IP_LEN			20
+#define IPv6_LEN		40
+#define IP_PROTOCOL_TCP		0x06
+#define IP_PROTOCOL_UDP		0x11
+#define IP_FRAGMENT		0x3fff	// More fragments flag and fragment offset
+
+#define TCP_LEN			20
+#define UDP_LEN			8
+
+static inline uint16_t read16(uint8_t* p) {
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t read32(uint8_t* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t flow_hash(uint32_t source, uint32_t destination, uint32_t ports, uint8_t protocol) {
+	uint64_t h = ((uint64_t)source << 32 | destination) * 0x9e3779b97f4a7c15UL;
+	h ^= ((uint64_t)ports << 8 | protocol) * 0xc2b2ae3d27d4eb4fUL;
+	h ^= h >> 29;
+
+	return (uint32_t)(h >> 32) ? : 1;
+}
+
+static uint32_t fold(uint8_t* address) {
+	return read32(address) ^ read32(address + 4) ^ read32(address + 8) ^ read32(address + 12);
+}
+
+// Transport header and ports of TCP and UDP
+static uint32_t parse_l4(PacketMeta* meta, uint8_t* data, uint16_t size) {
+	uint16_t offset = meta->l4;
+	if(meta->l4_proto == IP_PROTOCOL_TCP && offset + TCP_LEN <= size) {
+		meta->payload = offset + (data[offset + 12] >> 4) * 4;
+		return read32(data + offset);
+	} else if(meta->l4_proto == IP_PROTOCOL_UDP && offset + UDP_LEN <= size) {
+		meta->payload = offset + UDP_LEN;
+		return read32(data + offset);
+	}
+
+	return 0;
+}
+
+bool packet_meta_parse(PacketMeta* meta, uint8_t* data, uint16_t size) {
+	meta->magic = PACKET_META_MAGIC;
+	meta->flags = 0;
+	meta->hash = 0;
+	meta->l2 = 0;
+	meta->l3 = 0;
+	meta->l4 = 0;
+	meta->payload = 0;
+	meta->l3_proto = 0;
+	meta->l4_proto = 0;
+
+	if(size < ETHER_LEN)
+		return false;
+
+	uint16_t offset = ETHER_LEN - 2;
+	uint16_t type = read16(data + offset);
+	while((type == ETHER_TYPE_8021Q || type == ETHER_TYPE_8021AD) && offset + 6 <= size) {
+		meta->flags |= PACKET_META_VLAN;
+		offset += 4;
+		type = read16(data + offset);
+	}
+
+	offset += 2;
+	meta->l3_proto = type;
+	meta->l3 = offset;
+
+	if(type == ETHER_TYPE_IPv4) {
+		uint8_t* ip = data + offset;
+		if(offset + IP_LEN > size || (ip[0] & 0xf) * 4 < IP_LEN)
+			return true;
+
+		meta->l4_proto = ip[9];
+		if(read16(ip + 6) & IP_FRAGMENT) {
+			meta->flags |= PACKET_META_FRAGMENT;
+			meta->hash = flow_hash(read32(ip + 12), read32(ip + 16), 0, ip[9]);
+			return true;
+		}
+
+		meta->l4 = offset + (ip[0] & 0xf) * 4;
+		meta->hash = flow_hash(read32(ip + 12), read32(ip + 16), parse_l4(meta, data, size), ip[9]);
+	} else if(type == ETHER_TYPE_IPv6) {
+		uint8_t* ip = data + offset;
+		if(offset + IPv6_LEN > size)
+			return true;
+
+		// Extension headers are not followed
+		meta->l4_proto = ip[6];
+		meta->l4 = offset + IPv6_LEN;
+		meta->hash = flow_hash(fold(ip + 8), fold(ip + 24), parse_l4(meta, data, size), ip[6]);
+	}
+
+	return true;
+}
+
+void packet_meta_set(Packet* packet, PacketMeta* meta) {
+	PacketMeta* dst = (PacketMeta*)packet->buffer;
+	uint16_t start = packet->start;
+
+	dst->flags = meta->flags;
+	dst->hash = meta->hash;
+	dst->l2 = meta->l2 + start;
+	dst->l3 = meta->l3 ? meta->l3 + start : 0;
+	dst->l4 = meta->l4 ? meta->l4 + start : 0;
+	dst->payload = meta->payload ? meta->payload + start : 0;
+	dst->l3_proto = meta->l3_proto;
+	dst->l4_proto = meta->l4_proto;
+	dst->magic = PACKET_META_MAGIC;
+}
@@ -0,0 +1,112 @@
+#include <scheduler.h>
+
+typedef struct {
+	bool		(*transmitter)(Packet*, void*);
+	void*		context;
+	uint32_t	bytes;		///< Size of the last packet passed to the transmitter
+} Transmit;
+
+static bool transmit(Packet* packet, void* context) {
+	Transmit* transmit = context;
+	transmit->bytes = packet->end - packet->start;
+
+	return transmit->transmitter(packet, transmit->context);
+}
+
+static uint32_t vnic_count(VNIC** vnics) {
+	uint32_t count = 0;
+	while(count < MAX_VNIC_COUNT && vnics[count])
+		count++;
+
+	return count;
+}
+
+uint32_t scheduler_drr(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget) {
+	uint32_t count = vnic_count(vnics);
+	if(!count)
+		return 0;
+
+	Transmit context = {
+		.transmitter = transmitter,
+		.context = transmitter_context
+	};
+
+	uint32_t transmitted = 0;
+	for(int priority = 0; priority < SCHEDULER_PRIORITY_COUNT; priority++) {
+		// Rounds go on while a VNIC of the priority has packets
+		bool backlogged = true;
+		while(backlogged) {
+			backlogged = false;
+			for(uint32_t visited = 0; visited < count; visited++) {
+				uint32_t i = scheduler->cursor[priority] % count;
+				VNIC* vnic = vnics[i];
+				if(vnic->priority != priority) {
+					scheduler->cursor[priority] = i + 1;
+					continue;
+				}
+
+				// A positive deficit is left when the last call ran out of budget
+				if(vnic->deficit <= 0)
+					vnic->deficit += SCHEDULER_QUANTUM * vnic->weight;
+				if(vnic->deficit <= 0)
+					backlogged = true;
+
+				while(vnic->deficit > 0) {
+					if(transmitted >= budget)
+						return transmitted;
+
+					context.bytes = 0;
+					VNICError error = vnic_tx(vnic, transmit, &context);
+
+					// No packet was popped, the queue was emptied meanwhile
+					if(error == VNIC_ERROR_RESOURCE_NOT_AVAILABLE ||
+							(error == VNIC_ERROR_OPERATION_FAILED && !context.bytes)) {
+						vnic->deficit = 0;
+						break;
+					}
+
+					// Transmitter is full, the dropped packet is not charged
+					if(error == VNIC_ERROR_OPERATION_FAILED)
+						return transmitted;
+
+					vnic->deficit -= context.bytes;
+					transmitted++;
+					backlogged = true;
+				}
+
+				scheduler->cursor[priority] = i + 1;
+			}
+		}
+	}
+
+	return transmitted;
+}
+
+uint32_t scheduler_rr(Scheduler* scheduler, VNIC** vnics,
+		bool (*transmitter)(Packet*, void*), void* transmitter_context, uint32_t budget) {
+	uint32_t count = vnic_count(vnics);
+	uint32_t transmitted = 0;
+
+	for(uint32_t visited = 0; visited < count; visited++) {
+		uint32_t i = scheduler->cursor[0] % count;
+		VNIC* vnic = vnics[i];
+
+		for(uint16_t j = 0; j < vnic->budget; j++) {
+			if(transmitted >= budget)
+				return transmitted;
+
+			VNICError error = vnic_tx(vnic, transmitter, transmitter_context);
+			if(error == VNIC_ERROR_OPERATION_FAILED)
+				return transmitted;
+			else if(error == VNIC_ERROR_RESOURCE_NOT_AVAILABLE)
+				break;
+
+			transmitted++;
+		}
+
+		scheduler->cursor[0] = i + 1;
+	}
+
+	return transmitted;
+}
@@ -0,0 +1,101 @@
+#include <shaper.h>
+
+// Tokens per clock tick of a rate in bps, long division so that any clock frequency fits
+static uint64_t tick_scale(uint64_t rate, uint64_t freq) {
+	uint64_t q = rate / freq;
+	uint64_t r = rate % freq;
+	for(int i = 0; i < SHAPER_SHIFT; i++) {
+		q <<= 1;
+		r <<= 1;
+		if(r >= freq) {
+			r -= freq;
+			q |= 1;
+		}
+	}
+
+	q /= 8;
+	return q ? : 1;
+}
+
+static int64_t burst_size(uint64_t burst) {
+	if(burst < SHAPER_MIN_BURST)
+		return SHAPER_MIN_BURST;
+	if(burst > SHAPER_MAX_BURST)
+		return SHAPER_MAX_BURST;
+
+	return burst;
+}
+
+// Charges racing with the refill only take tokens away, so the bucket never overflows
+static void bucket_refill(int64_t* tokens, int64_t burst, uint64_t scale, uint64_t elapsed) {
+	int64_t full = burst << SHAPER_SHIFT;
+	int64_t current = *(volatile int64_t*)tokens;
+	if(current >= full)
+		return;
+
+	// Capped before multiplying, elapsed * scale cannot overflow
+	uint64_t need = full - current;
+	__sync_fetch_and_add(tokens, elapsed >= need / scale ? need : elapsed * scale);
+}
+
+// Caller holds the lock of the shaper
+static void buckets_refill(Shaper* shaper, uint64_t now) {
+	// Clock went backwards (read on another core)
+	if((int64_t)(now - shaper->last) <= 0)
+		return;
+
+	uint64_t elapsed = now - shaper->last;
+	shaper->last = now;
+
+	if(shaper->cir)
+		bucket_refill(&shaper->ctokens, shaper->cbs, shaper->cscale, elapsed);
+	if(shaper->pir)
+		bucket_refill(&shaper->ptokens, shaper->pbs, shaper->pscale, elapsed);
+}
+
+static void shaper_refill0(Shaper* shaper, uint64_t now) {
+	if(!shaper->cir && !shaper->pir)
+		return;
+
+	// Another core is refilling the buckets already
+	if(__sync_lock_test_and_set(&shaper->lock, 1))
+		return;
+
+	buckets_refill(shaper, now);
+	__sync_lock_release(&shaper->lock);
+}
+
+void shaper_refill(Shaper* shaper, uint64_t now) {
+	for(; shaper; shaper = shaper->parent)
+		shaper_refill0(shaper, now);
+}
+
+void shaper_set(Shaper* shaper, uint64_t freq, uint64_t now, uint64_t cir, uint64_t cbs, uint64_t pir, uint64_t pbs) {
+	while(__sync_lock_test_and_set(&shaper->lock, 1))
+		asm volatile("pause");
+
+	if(shaper->cir || shaper->pir)
+		buckets_refill(shaper, now);
+
+	if(!freq)
+		cir = pir = 0;
+
+	// A bucket which was not limiting starts full
+	bool cfull = !shaper->cir;
+	bool pfull = !shaper->pir;
+
+	shaper->cir = cir;
+	shaper->cbs = burst_size(cbs);
+	shaper->cscale = cir ? tick_scale(cir, freq) : 0;
+	if(cfull || shaper->ctokens > shaper->cbs << SHAPER_SHIFT)
+		shaper->ctokens = shaper->cbs << SHAPER_SHIFT;
+
+	shaper->pir = pir;
+	shaper->pbs = burst_size(pbs);
+	shaper->pscale = pir ? tick_scale(pir, freq) : 0;
+	if(pfull || shaper->ptokens > shaper->pbs << SHAPER_SHIFT)
+		shaper->ptokens = shaper->pbs << SHAPER_SHIFT;
+
+	shaper->last = now;
+	__sync_lock_release(&shaper->lock);
+}
@@ -0,0 +1,220 @@
+#include <lock.h>
+
+#define RWLOCK_WRITER	0x80000000	// A writer holds the lock
+#define RWLOCK_PENDING	0x40000000	// A writer waits, readers keep out
+#define RWLOCK_READERS	0x3fffffff	// Number of readers
+
+static inline void cpu_relax() {
+	asm volatile("pause" ::: "memory");
+}
+
+static inline uint64_t lock_tsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return (uint64_t)hi << 32 | lo;
+}
+
+// Waits are measured only after the first try fails, so a free lock costs no clock read
+static void lock_stats_add(LockStats* stats, uint64_t wait) {
+	__sync_fetch_and_add(&stats->acquires, 1);
+	if(!wait)
+		return;
+
+	__sync_fetch_and_add(&stats->contended, 1);
+	__sync_fetch_and_add(&stats->spin_cycles, wait);
+
+	uint64_t max;
+	while(wait > (max = stats->max_wait) && !__sync_bool_compare_and_swap(&stats->max_wait, max, wait));
+}
+
+void lock_lock_stats(uint8_t volatile* lock, LockStats* stats) {
+	if(lock_trylock(lock)) {
+		lock_stats_add(stats, 0);
+		return;
+	}
+
+	uint64_t start = lock_tsc();
+	lock_lock(lock);
+	lock_stats_add(stats, lock_tsc() - start + 1);
+}
+
+void ticket_lock_init(TicketLock* lock, LockStats* stats) {
+	lock->next = 0;
+	lock->owner = 0;
+	lock->stats = stats;
+}
+
+void ticket_lock_lock(TicketLock* lock) {
+	uint32_t ticket = __sync_fetch_and_add(&lock->next, 1);
+	uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	if(owner == ticket) {
+		if(lock->stats)
+			lock_stats_add(lock->stats, 0);
+		return;
+	}
+
+	uint64_t start = lock->stats ? lock_tsc() : 0;
+
+	// Backs off in proportion to the number of callers ahead
+	do {
+		for(uint32_t i = ticket - owner; i > 0; i--)
+			cpu_relax();
+	} while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket);
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, lock_tsc() - start + 1);
+}
+
+bool ticket_lock_trylock(TicketLock* lock) {
+	uint32_t owner = lock->owner;
+	if(lock->next != owner || !__sync_bool_compare_and_swap(&lock->next, owner, owner + 1))
+		return false;
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, 0);
+
+	return true;
+}
+
+void ticket_lock_unlock(TicketLock* lock) {
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+void mcs_lock_init(MCSLock* lock, LockStats* stats) {
+	lock->tail = NULL;
+	lock->stats = stats;
+}
+
+void mcs_lock_lock(MCSLock* lock, MCSNode* node) {
+	node->next = NULL;
+	node->locked = 1;
+
+	MCSNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if(!prev) {
+		if(lock->stats)
+			lock_stats_add(lock->stats, 0);
+		return;
+	}
+
+	uint64_t start = lock->stats ? lock_tsc() : 0;
+
+	// Each waiter spins on its own node until the previous one hands over
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, lock_tsc() - start + 1);
+}
+
+bool mcs_lock_trylock(MCSLock* lock, MCSNode* node) {
+	node->next = NULL;
+	node->locked = 0;
+
+	if(lock->tail || !__sync_bool_compare_and_swap(&lock->tail, NULL, node))
+		return false;
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, 0);
+
+	return true;
+}
+
+void mcs_lock_unlock(MCSLock* lock, MCSNode* node) {
+	MCSNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if(!next) {
+		if(__sync_bool_compare_and_swap(&lock->tail, node, NULL))
+			return;
+
+		// A caller swapped the tail but has not linked itself yet
+		while(!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+void rwlock_init(RWLock* lock, LockStats* stats) {
+	lock->value = 0;
+	lock->stats = stats;
+}
+
+static inline bool rwlock_read_acquire(RWLock* lock) {
+	uint32_t value = lock->value;
+
+	return !(value & (RWLOCK_WRITER | RWLOCK_PENDING)) &&
+		__sync_bool_compare_and_swap(&lock->value, value, value + 1);
+}
+
+void rwlock_read_lock(RWLock* lock) {
+	if(rwlock_read_acquire(lock)) {
+		if(lock->stats)
+			lock_stats_add(lock->stats, 0);
+		return;
+	}
+
+	uint64_t start = lock->stats ? lock_tsc() : 0;
+	while(!rwlock_read_acquire(lock))
+		cpu_relax();
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, lock_tsc() - start + 1);
+}
+
+bool rwlock_read_trylock(RWLock* lock) {
+	if(!rwlock_read_acquire(lock))
+		return false;
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, 0);
+
+	return true;
+}
+
+void rwlock_read_unlock(RWLock* lock) {
+	__sync_fetch_and_sub(&lock->value, 1);
+}
+
+// Taking the lock clears the waiting bit, the other waiting writers set it again
+static inline bool rwlock_write_acquire(RWLock* lock) {
+	uint32_t value = lock->value;
+	if(!(value & (RWLOCK_WRITER | RWLOCK_READERS)))
+		return __sync_bool_compare_and_swap(&lock->value, value, RWLOCK_WRITER);
+
+	if(!(value & RWLOCK_PENDING))
+		__sync_fetch_and_or(&lock->value, RWLOCK_PENDING);
+
+	return false;
+}
+
+void rwlock_write_lock(RWLock* lock) {
+	if(rwlock_write_acquire(lock)) {
+		if(lock->stats)
+			lock_stats_add(lock->stats, 0);
+		return;
+	}
+
+	uint64_t start = lock->stats ? lock_tsc() : 0;
+	while(!rwlock_write_acquire(lock))
+		cpu_relax();
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, lock_tsc() - start + 1);
+}
+
+bool rwlock_write_trylock(RWLock* lock) {
+	uint32_t value = lock->value;
+	if(value & (RWLOCK_WRITER | RWLOCK_READERS) ||
+			!__sync_bool_compare_and_swap(&lock->value, value, RWLOCK_WRITER))
+		return false;
+
+	if(lock->stats)
+		lock_stats_add(lock->stats, 0);
+
+	return true;
+}
+
+void rwlock_write_unlock(RWLock* lock) {
+	__sync_fetch_and_and(&lock->value, ~RWLOCK_WRITER);
+}
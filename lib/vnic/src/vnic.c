@@ -2,6 +2,7 @@
 #include <lock.h>
 #include <vnic.h>
 #include <nic.h>
+#include <scheduler.h>
 
 #define ID_BUFFER_SIZE (128 * MAX_VNIC_COUNT / 8)
 static uint8_t id_map[ID_BUFFER_SIZE];
@@ -46,6 +47,42 @@ void vnic_free_id(int id) {
 	id_map[bucket] ^= slot;
 }
 
+// The VNIC keeps its own copy of each queue, so flags are never read from VM memory
+static inline bool queue_trylock(NICQueue* queue, volatile uint8_t* lock) {
+	return (queue->flags & NIC_QUEUE_F_SPSC) || lock_trylock(lock);
+}
+
+static inline void queue_unlock(NICQueue* queue, volatile uint8_t* lock) {
+	if(!(queue->flags & NIC_QUEUE_F_SPSC))
+		lock_unlock(lock);
+}
+
+// Lets a packet pass the token buckets, the clock is read only when a bucket runs out
+static inline bool bandwidth_available(Shaper* shaper) {
+	if(shaper_ready(shaper))
+		return true;
+
+	shaper_refill(shaper, timer_frequency());
+	return shaper_ready(shaper);
+}
+
+// Missing burst sizes are the traffic of 1 / period second, the peak burst is 1ms of the peak rate
+static void bandwidth_set(Shaper* shaper, uint64_t rate, uint64_t burst, uint64_t peak, uint64_t period) {
+	if(burst == (uint64_t)-1)
+		burst = rate / 8 / period;
+	if(peak == (uint64_t)-1)
+		peak = 0;
+
+	shaper_set(shaper, TIMER_FREQUENCY_PER_SEC, timer_frequency(), rate, burst, peak, peak / 8 / 1000);
+}
+
+static void scheduling_set(VNIC* vnic, uint64_t weight, uint64_t priority) {
+	if(weight != (uint64_t)-1)
+		vnic->weight = weight ? (weight < 0xffff ? weight : 0xffff) : 1;
+	if(priority != (uint64_t)-1)
+		vnic->priority = priority < SCHEDULER_PRIORITY_COUNT ? priority : SCHEDULER_PRIORITY_COUNT - 1;
+}
+
 static uint64_t get_value(uint64_t* attrs, uint64_t key) {
 	int i = 0;
 	while(attrs[i * 2] != VNIC_NONE) {
@@ -82,10 +119,11 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 		return has_mandatory(attrs);
 	if((uintptr_t)base == 0 || (uintptr_t)base % 0x200000 != 0)
 		return VNIC_ERROR_INVALID_BASE;
-	if(get_value(attrs, VNIC_POOL_SIZE) % 0x200000 != 0)
+	if((get_value(attrs, VNIC_POOL_SIZE) & ~(uint64_t)VNIC_POOL_CLASS) % 0x200000 != 0)
 		return VNIC_ERROR_INVALID_POOLSIZE;
 
 	int index = sizeof(NIC);
+	uint8_t flags = get_value(attrs, VNIC_QUEUE_SPSC) == 1 ? NIC_QUEUE_F_SPSC : 0;
 
 	NIC* nic = base;
 	nic->magic = NIC_MAGIC_HEADER;
@@ -100,6 +138,7 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	nic->rx.head = 0;
 	nic->rx.tail = 0;
 	nic->rx.size = get_value(attrs, VNIC_RX_QUEUE_SIZE);
+	nic->rx.flags = flags;
 	nic->rx.rlock = 0;
 	nic->rx.wlock = 0;
 
@@ -109,6 +148,7 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	nic->tx.head = 0;
 	nic->tx.tail = 0;
 	nic->tx.size = get_value(attrs, VNIC_TX_QUEUE_SIZE);
+	nic->tx.flags = flags;
 	nic->tx.rlock = 0;
 	nic->tx.wlock = 0;
 
@@ -118,6 +158,7 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	nic->srx.head = 0;
 	nic->srx.tail = 0;
 	nic->srx.size = get_value(attrs, VNIC_SLOW_RX_QUEUE_SIZE);
+	nic->srx.flags = flags;
 	nic->srx.rlock = 0;
 	nic->srx.wlock = 0;
 
@@ -127,6 +168,7 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	nic->stx.head = 0;
 	nic->stx.tail = 0;
 	nic->stx.size = get_value(attrs, VNIC_SLOW_TX_QUEUE_SIZE);
+	nic->stx.flags = flags;
 	nic->stx.rlock = 0;
 	nic->stx.wlock = 0;
 	index += nic->stx.size * sizeof(uint64_t);
@@ -140,12 +182,19 @@ static VNICError nic_init(void* base, uint64_t* attrs) {
 	index = ROUNDUP(index, NIC_CHUNK_SIZE);
 
 	nic->pool.pool = index;
-	nic->pool.count = BITMAP_SIZE;
+	nic->pool.type = poolsize & VNIC_POOL_CLASS ? NIC_POOL_TYPE_CLASS : NIC_POOL_TYPE_BITMAP;
+	poolsize &= ~(uint64_t)VNIC_POOL_CLASS;
+	// Chunks after the bitmap only, the pool must not run past the end of the NIC
+	nic->pool.count = (poolsize - index) / NIC_CHUNK_SIZE;
 	nic->pool.index = 0;
 	nic->pool.used = 0;
+	memset(nic->pool.free, 0, sizeof(nic->pool.free));
 	nic->pool.lock = 0;
 
 	nic->config = 0;
+	nic->config_lock = 0;
+	nic->config_gen = 0;
+	memset(nic->config_index, 0, sizeof(nic->config_index));
 	memset(nic->config_head, 0, (size_t)((uintptr_t)nic->config_tail - (uintptr_t)nic->config_head));
 	memset(base + nic->pool.bitmap, 0, nic->pool.count);
 
@@ -159,11 +208,21 @@ bool vnic_init(VNIC* vnic, uint64_t* attrs) {
 	strncpy(vnic->parent, (char*)get_value(attrs, VNIC_DEV), MAX_NIC_NAME_LEN);
 	vnic->nic->id = vnic->id;
 	vnic->budget = get_value(attrs, VNIC_BUDGET) > 32 ? : 32;
+	vnic->group = 0;
+	vnic->weight = 1;
+	vnic->priority = 0;
+	vnic->deficit = 0;
+	vnic->rx_lock = 0;
+	scheduling_set(vnic, get_value(attrs, VNIC_WEIGHT), get_value(attrs, VNIC_PRIORITY));
 	vnic->magic = vnic->nic->magic;
 	vnic->mac = vnic->nic->mac;
 	vnic->pool.bitmap = vnic->nic->pool.bitmap;
 	vnic->pool.count = vnic->nic->pool.count;
 	vnic->pool.pool = vnic->nic->pool.pool;
+	vnic->pool.type = vnic->nic->pool.type;
+
+	if(!nic_region_add(vnic->nic, &vnic->pool, vnic->pool.pool + (size_t)vnic->pool.count * NIC_CHUNK_SIZE))
+		return false;
 
 	vnic->rx_bandwidth = vnic->nic->rx_bandwidth;
 	vnic->tx_bandwidth = vnic->nic->tx_bandwidth;
@@ -175,21 +234,69 @@ bool vnic_init(VNIC* vnic, uint64_t* attrs) {
 	vnic->srx = vnic->nic->srx;
 	vnic->stx = vnic->nic->stx;
 
-	vnic->rx_closed = vnic->tx_closed = timer_frequency();
-	vnic->rx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->rx_bandwidth;
-	vnic->rx_wait_grace = TIMER_FREQUENCY_PER_SEC / 100;
-	vnic->tx_wait = TIMER_FREQUENCY_PER_SEC * 8 / vnic->tx_bandwidth;
-	vnic->tx_wait_grace = TIMER_FREQUENCY_PER_SEC / 1000;
+	Shaper* rx_parent = (Shaper*)get_value(attrs, VNIC_RX_SHAPER);
+	Shaper* tx_parent = (Shaper*)get_value(attrs, VNIC_TX_SHAPER);
+	memset(&vnic->rx_shaper, 0, sizeof(Shaper));
+	memset(&vnic->tx_shaper, 0, sizeof(Shaper));
+	vnic->rx_shaper.parent = rx_parent != (Shaper*)-1 ? rx_parent : NULL;
+	vnic->tx_shaper.parent = tx_parent != (Shaper*)-1 ? tx_parent : NULL;
+	bandwidth_set(&vnic->rx_shaper, vnic->rx_bandwidth, get_value(attrs, VNIC_RX_BURST), get_value(attrs, VNIC_RX_PEAK), 100);
+	bandwidth_set(&vnic->tx_shaper, vnic->tx_bandwidth, get_value(attrs, VNIC_TX_BURST), get_value(attrs, VNIC_TX_PEAK), 1000);
 
 	return true;
 }
 
 VNICError vnic_update(VNIC* vnic, uint64_t* attrs) {
-	// TODO impl
-	return VNIC_ERROR_UNSUPPORTED;
+	for(int i = 0; attrs[i] != VNIC_NONE; i += 2) {
+		switch(attrs[i]) {
+			case VNIC_RX_BANDWIDTH:
+			case VNIC_TX_BANDWIDTH:
+			case VNIC_RX_BURST:
+			case VNIC_TX_BURST:
+			case VNIC_RX_PEAK:
+			case VNIC_TX_PEAK:
+			case VNIC_WEIGHT:
+			case VNIC_PRIORITY:
+			case VNIC_PADDING_HEAD:
+			case VNIC_PADDING_TAIL:
+				break;
+			default:
+				return VNIC_ERROR_ATTRIBUTE_INVALID;
+		}
+	}
+
+	scheduling_set(vnic, get_value(attrs, VNIC_WEIGHT), get_value(attrs, VNIC_PRIORITY));
+
+	uint64_t value;
+	if((value = get_value(attrs, VNIC_PADDING_HEAD)) != (uint64_t)-1)
+		vnic->padding_head = vnic->nic->padding_head = value;
+	if((value = get_value(attrs, VNIC_PADDING_TAIL)) != (uint64_t)-1)
+		vnic->padding_tail = vnic->nic->padding_tail = value;
+
+	// Token buckets are reconfigured in place, queued packets are not touched
+	uint64_t burst = get_value(attrs, VNIC_RX_BURST);
+	uint64_t peak = get_value(attrs, VNIC_RX_PEAK);
+	if((value = get_value(attrs, VNIC_RX_BANDWIDTH)) != (uint64_t)-1)
+		vnic->rx_bandwidth = vnic->nic->rx_bandwidth = value;
+	else if(burst == (uint64_t)-1)
+		burst = vnic->rx_shaper.cbs;
+	bandwidth_set(&vnic->rx_shaper, vnic->rx_bandwidth, burst, peak != (uint64_t)-1 ? peak : vnic->rx_shaper.pir, 100);
+
+	burst = get_value(attrs, VNIC_TX_BURST);
+	peak = get_value(attrs, VNIC_TX_PEAK);
+	if((value = get_value(attrs, VNIC_TX_BANDWIDTH)) != (uint64_t)-1)
+		vnic->tx_bandwidth = vnic->nic->tx_bandwidth = value;
+	else if(burst == (uint64_t)-1)
+		burst = vnic->tx_shaper.cbs;
+	bandwidth_set(&vnic->tx_shaper, vnic->tx_bandwidth, burst, peak != (uint64_t)-1 ? peak : vnic->tx_shaper.pir, 1000);
+
+	return VNIC_ERROR_NOERROR;
 }
 
 Packet* vnic_alloc(VNIC* vnic, size_t size) {
+	if(vnic->pool.type == NIC_POOL_TYPE_CLASS)
+		return nic_pool_class_alloc(vnic->nic, &vnic->pool, sizeof(Packet) + vnic->padding_head + size + vnic->padding_tail);
+
 	if(!lock_trylock(&vnic->nic->pool.lock))
 		return NULL;
 
@@ -254,6 +361,7 @@ found:
 	packet->start = 0;
 	packet->end = 0;
 	packet->size = (req * NIC_CHUNK_SIZE) - sizeof(Packet);
+	packet_meta_clear(packet);
 
 	return packet;
 }
@@ -263,9 +371,12 @@ bool vnic_free(VNIC* vnic, Packet* packet) {
 	if(!nic || vnic->nic->id != nic->id)
 		return false;
 
+	if(vnic->pool.type == NIC_POOL_TYPE_CLASS)
+		return nic_pool_class_free(vnic->nic, &vnic->pool, packet);
+
 	uint8_t* bitmap = (void*)vnic->nic + vnic->pool.bitmap;
 	uint32_t count = vnic->pool.count;
-	void* pool = (void*)vnic + vnic->pool.pool;
+	void* pool = (void*)vnic->nic + vnic->pool.pool;
 
 	uint32_t idx = ((uintptr_t)packet - (uintptr_t)pool) / NIC_CHUNK_SIZE;
 	if(idx >= count)
@@ -286,46 +397,52 @@ bool vnic_free(VNIC* vnic, Packet* packet) {
 }
 
 VNICError vnic_rx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
-	const uint64_t t = timer_frequency();
+	return vnic_rx_meta(vnic, buf1, size1, buf2, size2, NULL);
+}
+
+static VNICError rx_meta(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, PacketMeta* meta) {
 	const size_t size = size1 + size2;
-	if(vnic->rx_closed - vnic->rx_wait_grace > t) // TODO
-		return -1;
+	if(!bandwidth_available(&vnic->rx_shaper))
+		goto drop;
 
-	if(!lock_trylock(&vnic->nic->rx.wlock))
+	if(!queue_trylock(&vnic->rx, &vnic->nic->rx.wlock))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	vnic->rx.head = vnic->nic->rx.head;
+	vnic->rx.head = queue_load_acquire(&vnic->nic->rx.head);
 	if(queue_available(&vnic->rx)) {
 		Packet* packet = vnic_alloc(vnic, size);
 		if(!packet) {
-			lock_unlock(&vnic->nic->rx.wlock);
+			queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 			goto drop;
 		}
 
+		// The metadata block takes the head padding
+		if(meta && vnic->padding_head >= sizeof(PacketMeta))
+			packet->start = vnic->padding_head;
+
 		memcpy(packet->buffer + packet->start, buf1, size1);
 		if(size2)
 			memcpy(packet->buffer + packet->start + size1, buf2, size2);
 		packet->end = packet->start + size;
 
-		if(queue_push(vnic->nic, &vnic->rx, packet)) {
-			vnic->nic->rx.tail = vnic->rx.tail;
-			lock_unlock(&vnic->nic->rx.wlock);
+		if(packet->start)
+			packet_meta_set(packet, meta);
 
-			if(vnic->rx_closed > t)
-				vnic->rx_closed += vnic->rx_wait * size;
-			else
-				vnic->rx_closed = t + vnic->rx_wait * size;
+		if(queue_push(vnic->nic, &vnic->rx, packet)) {
+			queue_store_release(&vnic->nic->rx.tail, vnic->rx.tail);
+			queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 
+			shaper_charge(&vnic->rx_shaper, size);
 			vnic->input_packets += 1;
 			vnic->input_bytes += size;
 			return VNIC_ERROR_NOERROR;
 		} else {
-			lock_unlock(&vnic->nic->rx.wlock);
+			queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 			nic_free(packet);
 			goto drop;
 		}
 	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
+		queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 		goto drop;
 	}
 
@@ -335,30 +452,26 @@ drop:
 	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
-VNICError vnic_rx2(VNIC* vnic, Packet* packet) {
+static VNICError rx2(VNIC* vnic, Packet* packet) {
 	// For VNICs belonging to the same VM: exchanging is done by putting packets in the queue
 	// For VNICs not in the same VM: packets are replicated for exchange
-	uint64_t t = timer_frequency();
-	if(vnic->rx_closed - vnic->rx_wait_grace > t)
+	if(!bandwidth_available(&vnic->rx_shaper))
 		goto drop;
-	if(!lock_trylock(&vnic->nic->rx.wlock))
+	if(!queue_trylock(&vnic->rx, &vnic->nic->rx.wlock))
 		goto drop;
 
-	vnic->rx.head = vnic->nic->rx.head;
+	vnic->rx.head = queue_load_acquire(&vnic->nic->rx.head);
 	if(queue_push(vnic->nic, &vnic->rx, packet)) {
-		vnic->nic->rx.tail = vnic->rx.tail;
-		lock_unlock(&vnic->nic->rx.wlock);
+		queue_store_release(&vnic->nic->rx.tail, vnic->rx.tail);
+		queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 
-		if(vnic->rx_closed > t)
-			vnic->rx_closed += vnic->rx_wait * (packet->end - packet->start);
-		else
-			vnic->rx_closed = t + vnic->rx_wait * (packet->end - packet->start);
+		shaper_charge(&vnic->rx_shaper, packet->end - packet->start);
 
 		vnic->input_packets += 1;
 		vnic->input_bytes += packet->end - packet->start;
 		return VNIC_ERROR_NOERROR;
 	} else {
-		lock_unlock(&vnic->nic->rx.wlock);
+		queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
 		nic_free(packet);
 		goto drop;
 	}
@@ -369,21 +482,84 @@ drop:
 	return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 }
 
+static uint32_t rx_burst(VNIC* vnic, Packet** packets, uint32_t count) {
+	uint32_t queued = 0;
+	if(!bandwidth_available(&vnic->rx_shaper))
+		goto drop;
+	if(!queue_trylock(&vnic->rx, &vnic->nic->rx.wlock))
+		goto drop;
+
+	vnic->rx.head = queue_load_acquire(&vnic->nic->rx.head);
+	queued = queue_push_burst(vnic->nic, &vnic->rx, packets, count);
+	queue_store_release(&vnic->nic->rx.tail, vnic->rx.tail);
+	queue_unlock(&vnic->rx, &vnic->nic->rx.wlock);
+
+	uint64_t bytes = 0;
+	for(uint32_t i = 0; i < queued; i++)
+		bytes += packets[i]->end - packets[i]->start;
+
+	shaper_charge(&vnic->rx_shaper, bytes);
+	vnic->input_packets += queued;
+	vnic->input_bytes += bytes;
+
+drop:
+	for(uint32_t i = queued; i < count; i++) {
+		vnic->input_drop_packets += 1;
+		vnic->input_drop_bytes += packets[i]->end - packets[i]->start;
+		nic_free(packets[i]);
+	}
+
+	return queued;
+}
+
+// The NIC device queues may be polled by several cores, so the cores take turns at the VNIC
+VNICError vnic_rx_meta(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2, PacketMeta* meta) {
+	lock_lock(&vnic->rx_lock);
+	VNICError error = rx_meta(vnic, buf1, size1, buf2, size2, meta);
+	lock_unlock(&vnic->rx_lock);
+
+	return error;
+}
+
+VNICError vnic_rx2(VNIC* vnic, Packet* packet) {
+	lock_lock(&vnic->rx_lock);
+	VNICError error = rx2(vnic, packet);
+	lock_unlock(&vnic->rx_lock);
+
+	return error;
+}
+
+uint32_t vnic_rx_burst(VNIC* vnic, Packet** packets, uint32_t count) {
+	lock_lock(&vnic->rx_lock);
+	uint32_t queued = rx_burst(vnic, packets, count);
+	lock_unlock(&vnic->rx_lock);
+
+	return queued;
+}
+
+VNICError vnic_rx_ref(VNIC* vnic, VNIC* owner, Packet* packet) {
+	if(!nic_pool_class_ref(owner->nic, &owner->pool, packet))
+		return VNIC_ERROR_UNSUPPORTED;
+
+	// Drops the reference if the packet is not queued
+	return vnic_rx_burst(vnic, &packet, 1) == 1 ? VNIC_ERROR_NOERROR : VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
+}
+
 bool vnic_has_srx(VNIC* vnic) {
-	vnic->srx.head = vnic->nic->srx.head;
+	vnic->srx.head = queue_load_acquire(&vnic->nic->srx.head);
 	return queue_available(&vnic->srx);
 }
 
-bool vnic_srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
+static bool srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+	if(!queue_trylock(&vnic->srx, &vnic->nic->srx.wlock))
 		return false;
 
 	size_t size = size1 + size2;
-	vnic->srx.head = vnic->nic->srx.head;
+	vnic->srx.head = queue_load_acquire(&vnic->nic->srx.head);
 	if(queue_available(&vnic->srx)) {
 		Packet* packet = vnic_alloc(vnic, size);
 		if(packet == NULL) {
-			lock_unlock(&vnic->nic->srx.wlock);
+			queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 			return false;
 		}
 
@@ -393,37 +569,53 @@ bool vnic_srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t siz
 		packet->end = packet->start + size;
 
 		if(queue_push(vnic->nic, &vnic->srx, packet)) {
-			vnic->nic->srx.tail = vnic->srx.tail;
-			lock_unlock(&vnic->nic->srx.wlock);
+			queue_store_release(&vnic->nic->srx.tail, vnic->srx.tail);
+			queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 			return true;
 		} else {
-			lock_unlock(&vnic->nic->srx.wlock);
+			queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 			nic_free(packet);
 			return false;
 		}
 	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
+		queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 		return false;
 	}
 }
 
-bool vnic_srx2(VNIC* vnic, Packet* packet) {
-	if(!lock_trylock(&vnic->nic->srx.wlock))
+static bool srx2(VNIC* vnic, Packet* packet) {
+	if(!queue_trylock(&vnic->srx, &vnic->nic->srx.wlock))
 		return false;
-	vnic->srx.head = vnic->nic->srx.head;
+	vnic->srx.head = queue_load_acquire(&vnic->nic->srx.head);
 	if(queue_push(vnic->nic, &vnic->srx, packet)) {
-		vnic->nic->srx.tail = vnic->srx.tail;
-		lock_unlock(&vnic->nic->srx.wlock);
+		queue_store_release(&vnic->nic->srx.tail, vnic->srx.tail);
+		queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 		return true;
 	} else {
-		lock_unlock(&vnic->nic->srx.wlock);
+		queue_unlock(&vnic->srx, &vnic->nic->srx.wlock);
 		nic_free(packet);
 		return false;
 	}
 }
 
+bool vnic_srx(VNIC* vnic, uint8_t* buf1, size_t size1, uint8_t* buf2, size_t size2) {
+	lock_lock(&vnic->rx_lock);
+	bool result = srx(vnic, buf1, size1, buf2, size2);
+	lock_unlock(&vnic->rx_lock);
+
+	return result;
+}
+
+bool vnic_srx2(VNIC* vnic, Packet* packet) {
+	lock_lock(&vnic->rx_lock);
+	bool result = srx2(vnic, packet);
+	lock_unlock(&vnic->rx_lock);
+
+	return result;
+}
+
 bool vnic_has_tx(VNIC* vnic) {
-	vnic->tx.tail = vnic->nic->tx.tail;
+	vnic->tx.tail = queue_load_acquire(&vnic->nic->tx.tail);
 	return !queue_empty(&vnic->tx);
 }
 
@@ -431,25 +623,21 @@ VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmi
 	if(!vnic_has_tx(vnic))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	uint64_t t = timer_frequency();
-	if(vnic->tx_closed - vnic->tx_wait_grace > t)
+	if(!bandwidth_available(&vnic->tx_shaper))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
-	if(!lock_trylock(&vnic->nic->tx.rlock))
+	if(!queue_trylock(&vnic->tx, &vnic->nic->tx.rlock))
 		return VNIC_ERROR_RESOURCE_NOT_AVAILABLE;
 
 	bool transmitted	= false;
 
-	vnic->tx.tail		= vnic->nic->tx.tail;
+	vnic->tx.tail		= queue_load_acquire(&vnic->nic->tx.tail);
 	Packet* packet		= queue_pop(vnic->nic, &vnic->tx);
-	vnic->nic->tx.head	= vnic->tx.head;
+	queue_store_release(&vnic->nic->tx.head, vnic->tx.head);
 
 	if(packet) {
 		uint64_t packet_size = packet->end - packet->start;
-		if(vnic->tx_closed > t)
-			vnic->tx_closed += vnic->tx_wait * packet_size;
-		else
-			vnic->tx_closed = t + vnic->tx_wait * packet_size;
+		shaper_charge(&vnic->tx_shaper, packet_size);
 
 		transmitted = transmitter(packet, transmitter_context);
 		if(transmitted) {
@@ -461,22 +649,45 @@ VNICError vnic_tx(VNIC* vnic, bool (*transmitter)(Packet*, void*), void* transmi
 		}
 	}
 
-	lock_unlock(&vnic->nic->tx.rlock);
+	queue_unlock(&vnic->tx, &vnic->nic->tx.rlock);
 	return transmitted ? VNIC_ERROR_NOERROR : VNIC_ERROR_OPERATION_FAILED;
 }
 
+uint32_t vnic_tx_burst(VNIC* vnic, Packet** packets, uint32_t count) {
+	if(!bandwidth_available(&vnic->tx_shaper))
+		return 0;
+
+	if(!queue_trylock(&vnic->tx, &vnic->nic->tx.rlock))
+		return 0;
+
+	vnic->tx.tail = queue_load_acquire(&vnic->nic->tx.tail);
+	uint32_t dequeued = queue_pop_burst(vnic->nic, &vnic->tx, packets, count);
+	queue_store_release(&vnic->nic->tx.head, vnic->tx.head);
+	queue_unlock(&vnic->tx, &vnic->nic->tx.rlock);
+
+	uint64_t bytes = 0;
+	for(uint32_t i = 0; i < dequeued; i++)
+		bytes += packets[i]->end - packets[i]->start;
+
+	shaper_charge(&vnic->tx_shaper, bytes);
+	vnic->output_packets += dequeued;
+	vnic->output_bytes += bytes;
+
+	return dequeued;
+}
+
 bool vnic_has_stx(VNIC* vnic) {
-	vnic->stx.tail = vnic->nic->stx.tail;
+	vnic->stx.tail = queue_load_acquire(&vnic->nic->stx.tail);
 	return !queue_empty(&vnic->stx);
 }
 
 Packet* vnic_stx(VNIC* vnic) {
-	if(!lock_trylock(&vnic->nic->stx.rlock))
+	if(!queue_trylock(&vnic->stx, &vnic->nic->stx.rlock))
 		return NULL;
-	vnic->stx.tail = vnic->nic->stx.tail;
+	vnic->stx.tail = queue_load_acquire(&vnic->nic->stx.tail);
 	Packet* packet = queue_pop(vnic->nic, &vnic->stx);
-	vnic->nic->stx.head = vnic->stx.head;
-	lock_unlock(&vnic->nic->stx.rlock);
+	queue_store_release(&vnic->nic->stx.head, vnic->stx.head);
+	queue_unlock(&vnic->stx, &vnic->nic->stx.rlock);
 
 	return packet;
 }